@@ -611,21 +611,8 @@ int fundef_reference (ptr, src, file, line)
 	return 1;
 }
 
-struct option_cache *free_option_caches;
-
-#if defined (DEBUG_MEMORY_LEAKAGE) || \
-		defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
-void relinquish_free_option_caches ()
-{
-	struct option_cache *o, *n;
-
-	for (o = free_option_caches; o; o = n) {
-		n = (struct option_cache *)(o -> expression);
-		dfree (o, MDL);
-	}
-	free_option_caches = (struct option_cache *)0;
-}
-#endif
+struct slab_pool option_cache_pool =
+	SLAB_POOL ("option_cache", struct option_cache);
 
 int option_cache_allocate (cptr, file, line)
 	struct option_cache **cptr;
@@ -634,17 +621,9 @@ int option_cache_allocate (cptr, file, line)
 {
 	struct option_cache *rval;
 
-	if (free_option_caches) {
-		rval = free_option_caches;
-		free_option_caches =
-			(struct option_cache *)(rval -> expression);
-		dmalloc_reuse (rval, file, line, 0);
-	} else {
-		rval = dmalloc (sizeof (struct option_cache), file, line);
-		if (!rval)
-			return 0;
-	}
-	memset (rval, 0, sizeof *rval);
+	rval = slab_alloc (&option_cache_pool, file, line);
+	if (!rval)
+		return 0;
 	return option_cache_reference (cptr, rval, file, line);
 }
 
@@ -676,6 +655,195 @@ int option_cache_reference (ptr, src, file, line)
 	return 1;
 }
 
+/*
+ * Per-packet arenas.
+ *
+ * Most of the buffers and option states made while handling a packet
+ * are gone by the time the packet is.  While do_packet() or
+ * do_packet6() is working on a packet, buffer_allocate() and
+ * option_state_allocate() carve them out of an arena that belongs to the
+ * packet, and the whole arena is reset in one go once the packet and
+ * everything allocated from it have been released.  An object that
+ * outlives its packet keeps the arena around until it is released too,
+ * so nothing is ever freed out from under anybody; the places that are
+ * known to keep packet data for a long time (stashed agent options,
+ * bindings, spawned classes, IA keys) call data_string_promote() to
+ * copy it to the heap so that it doesn't tie up an arena.
+ *
+ * An allocation that doesn't fit in what's left of the arena, or that
+ * happens when no packet is being worked on, comes from dmalloc().
+ * With memory debugging compiled in, every allocation does.
+ */
+
+#if !defined (PACKET_ARENA_SIZE)
+# define PACKET_ARENA_SIZE	8192
+#endif
+
+/* How many released arenas to keep for the next packets. */
+#if !defined (PACKET_ARENA_FREE_MAX)
+# define PACKET_ARENA_FREE_MAX	16
+#endif
+
+struct packet_arena {
+	struct packet_arena *next;
+	int retired;			/* The packet has been released. */
+	unsigned live;			/* Objects not yet freed. */
+	size_t used;
+};
+
+/* Every object from arena_alloc() starts with one of these, naming the
+   arena it came from, or NULL if it came from dmalloc(). */
+union arena_header {
+	struct packet_arena *arena;
+	double align [2];
+};
+
+#define ARENA_HDR_SIZE	(sizeof (union arena_header))
+#define ARENA_ROUND(x)	(((x) + ARENA_HDR_SIZE - 1) & ~(ARENA_HDR_SIZE - 1))
+
+struct packet_arena *packet_arena;
+static struct packet_arena *free_arenas;
+static int free_arena_count;
+
+/* Get an empty arena for a packet. */
+struct packet_arena *packet_arena_new ()
+{
+#if defined (DEBUG_MEMORY_LEAKAGE) || defined (DEBUG_MALLOC_POOL) || \
+		defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+	return NULL;
+#else
+	struct packet_arena *arena;
+
+	if (free_arenas) {
+		arena = free_arenas;
+		free_arenas = arena -> next;
+		free_arena_count--;
+	} else {
+		arena = dmalloc (ARENA_ROUND (sizeof *arena) +
+				 PACKET_ARENA_SIZE, MDL);
+		if (!arena)
+			return NULL;
+	}
+	arena -> next = NULL;
+	arena -> retired = 0;
+	arena -> live = 0;
+	arena -> used = 0;
+	return arena;
+#endif
+}
+
+static void packet_arena_reset (struct packet_arena *arena)
+{
+	if (free_arena_count >= PACKET_ARENA_FREE_MAX) {
+		dfree (arena, MDL);
+		return;
+	}
+	arena -> next = free_arenas;
+	free_arenas = arena;
+	free_arena_count++;
+}
+
+/* The packet that owns this arena is gone.   Reset it now if nothing
+   allocated from it is left, otherwise when the last such thing goes. */
+void packet_arena_release (struct packet_arena **ptr)
+{
+	struct packet_arena *arena = *ptr;
+
+	*ptr = NULL;
+	if (packet_arena == arena)
+		packet_arena = NULL;
+	arena -> retired = 1;
+	if (!arena -> live)
+		packet_arena_reset (arena);
+}
+
+#if defined (DEBUG_MEMORY_LEAKAGE) || \
+		defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+void relinquish_packet_arenas ()
+{
+	struct packet_arena *arena, *next;
+
+	for (arena = free_arenas; arena; arena = next) {
+		next = arena -> next;
+		dfree (arena, MDL);
+	}
+	free_arenas = NULL;
+	free_arena_count = 0;
+}
+#endif
+
+/* Allocate size bytes of zeroed memory from the given arena, or from the
+   heap if arena is NULL or full. */
+void *arena_alloc (struct packet_arena *arena, size_t size,
+		   const char *file, int line)
+{
+	union arena_header *hdr;
+	size_t len;
+
+	len = ARENA_HDR_SIZE + size;
+	if (len < size)
+		return NULL;
+
+	if (arena && !arena -> retired &&
+	    ARENA_ROUND (len) <= PACKET_ARENA_SIZE - arena -> used) {
+		hdr = (union arena_header *)((char *)arena +
+					     ARENA_ROUND (sizeof *arena) +
+					     arena -> used);
+		arena -> used += ARENA_ROUND (len);
+		arena -> live++;
+		memset (hdr + 1, 0, size);
+	} else {
+		hdr = dmalloc (len, file, line);
+		if (!hdr)
+			return NULL;
+		arena = NULL;
+	}
+	hdr -> arena = arena;
+	return hdr + 1;
+}
+
+void arena_free (void *ptr, const char *file, int line)
+{
+	union arena_header *hdr = (union arena_header *)ptr - 1;
+	struct packet_arena *arena = hdr -> arena;
+
+	if (!arena) {
+		dfree (hdr, file, line);
+		return;
+	}
+	if (!--arena -> live && arena -> retired)
+		packet_arena_reset (arena);
+}
+
+/* Nonzero if the memory came out of a packet arena. */
+int arena_owned (const void *ptr)
+{
+	return ((const union arena_header *)ptr - 1) -> arena != NULL;
+}
+
+/* If a data string's buffer is in a packet arena, copy the data into
+   a buffer of its own on the heap, for data that's going to be kept
+   long after the packet is gone. */
+int data_string_promote (struct data_string *ds, const char *file, int line)
+{
+	struct buffer *bp;
+	unsigned len;
+
+	if (!ds -> buffer || !arena_owned (ds -> buffer))
+		return 1;
+
+	len = ds -> len + (ds -> terminated ? 1 : 0);
+	bp = arena_alloc (NULL, len + sizeof *bp, file, line);
+	if (!bp)
+		return 0;
+	memcpy (bp -> data, ds -> data, len);
+
+	buffer_dereference (&ds -> buffer, file, line);
+	buffer_reference (&ds -> buffer, bp, file, line);
+	ds -> data = bp -> data;
+	return 1;
+}
+
 int buffer_allocate (ptr, len, file, line)
 	struct buffer **ptr;
 	unsigned len;
@@ -686,7 +854,7 @@ int buffer_allocate (ptr, len, file, line)
 
 	/* XXXSK: should check for bad ptr values, otherwise we
 		  leak memory if they are wrong */
-	bp = dmalloc (len + sizeof *bp, file, line);
+	bp = arena_alloc (packet_arena, len + sizeof *bp, file, line);
 	if (!bp)
 		return 0;
 	/* XXXSK: both of these initializations are unnecessary */
@@ -749,7 +917,7 @@ int buffer_dereference (ptr, file, line)
 	(*ptr) -> refcnt--;
 	rc_register (file, line, ptr, *ptr, (*ptr) -> refcnt, 1, RC_MISC);
 	if (!(*ptr) -> refcnt) {
-		dfree ((*ptr), file, line);
+		arena_free ((*ptr), file, line);
 	} else if ((*ptr) -> refcnt < 0) {
 		log_error ("%s(%d): negative refcnt!", file, line);
 #if defined (DEBUG_RC_HISTORY)
@@ -868,7 +1036,7 @@ int option_state_allocate (ptr, file, line)
 	}
 
 	size = sizeof **ptr + (universe_count - 1) * sizeof (void *);
-	*ptr = dmalloc (size, file, line);
+	*ptr = arena_alloc (packet_arena, size, file, line);
 	if (*ptr) {
 		memset (*ptr, 0, size);
 		(*ptr) -> universe_count = universe_count;
@@ -951,7 +1119,7 @@ int option_state_dereference (ptr, file, line)
 			((*(universes [i] -> option_state_dereference))
 			 (universes [i], options, file, line));
 
-	dfree (options, file, line);
+	arena_free (options, file, line);
 	return 1;
 }
 
@@ -1125,6 +1293,10 @@ int packet_dereference (ptr, file, line)
 			omapi_object_dereference ((omapi_object_t **)
 						  &packet -> classes [i], MDL);
 	}
+	if (packet -> memo)
+		option_memo_forget (&packet -> memo);
+	if (packet -> arena)
+		packet_arena_release (&packet -> arena);
 	packet -> raw = (struct dhcp_packet *)free_packets;
 	free_packets = packet;
 	dmalloc_reuse (free_packets, __FILE__, __LINE__, 0);
@@ -45,6 +45,7 @@ int quiet_interface_discovery;
 u_int16_t local_port;
 u_int16_t remote_port;
 int dhcpv4_over_dhcpv6 = 0;
+int dhcpv4_reuseport = 0;
 int (*dhcp_interface_setup_hook) (struct interface_info *, struct iaddr *);
 int (*dhcp_interface_discovery_hook) (struct interface_info *);
 isc_result_t (*dhcp_interface_startup_hook) (struct interface_info *);
@@ -1061,9 +1062,6 @@ isc_result_t got_one (h)
 		log_error ("receive_packet failed on %s: %m", ip -> name);
 		return ISC_R_UNEXPECTED;
 	}
-	if (result == 0)
-		return ISC_R_UNEXPECTED;
-
 	/*
 	 * If we didn't at least get the fixed portion of the BOOTP
 	 * packet, drop the packet.
@@ -1072,9 +1070,16 @@ isc_result_t got_one (h)
 	 * a bug caused short packets to not work and nobody has
 	 * complained, it seems rational to tighten up that
 	 * restriction.
+	 *
+	 * If the receive code has more packets buffered (e.g., a
+	 * batch read on LPF), carry on with those rather than
+	 * leaving them behind until the next packet shows up.
 	 */
-	if (result < DHCP_FIXED_NON_UDP)
+	if (result < DHCP_FIXED_NON_UDP) {
+		if (ip -> rbuf_offset != ip -> rbuf_len)
+			goto again;
 		return ISC_R_UNEXPECTED;
+	}
 
 #if defined(IP_PKTINFO) && defined(IP_RECVPKTINFO) && defined(USE_V4_PKTINFO)
 	{
@@ -33,6 +33,155 @@
 struct timeout *timeouts;
 static struct timeout *free_timeouts;
 
+/*
+ * Pending timeouts are also kept in a hash table keyed on the function
+ * and "what" argument, so that add_timeout() and cancel_timeout() can
+ * find the entry to supersede or cancel without walking the whole
+ * timeouts list.  Many timers have a NULL "what", so the function has
+ * to be part of the key to keep them from all landing in one chain.
+ * add_timeout() still honours a NULL "where" as a wildcard, which no
+ * caller uses, by walking the list.  The timeouts list itself is doubly
+ * linked so entries found through the index can be unlinked in
+ * constant time.
+ */
+static struct timeout **timeout_index;
+static unsigned timeout_index_size;
+static unsigned timeout_index_count;
+
+#define TIMEOUT_INDEX_MIN 256
+
+static unsigned timeout_hash(void (*func)(void *), void *what,
+			     unsigned size)
+{
+	u_int32_t h;
+
+	h = (u_int32_t)((unsigned long)what >> 3);
+	h ^= (u_int32_t)((unsigned long)func >> 2) * 0x9e3779b1U;
+	h *= 2654435761U;
+	h ^= h >> 16;
+	return h & (size - 1);
+}
+
+static void timeout_index_grow(void)
+{
+	struct timeout **nindex, *q, *n;
+	unsigned nsize, i, h;
+
+	nsize = timeout_index_size ? timeout_index_size * 2
+				   : TIMEOUT_INDEX_MIN;
+	nindex = dmalloc(nsize * sizeof(*nindex), MDL);
+	if (nindex == NULL) {
+		/* The index is an optimization; keep using the old one. */
+		if (timeout_index != NULL)
+			return;
+		log_fatal("add_timeout: no memory for timeout index!");
+	}
+
+	for (i = 0; i < timeout_index_size; i++) {
+		for (q = timeout_index[i]; q != NULL; q = n) {
+			n = q->index_next;
+			h = timeout_hash(q->func, q->what, nsize);
+			q->index_next = nindex[h];
+			nindex[h] = q;
+		}
+	}
+
+	if (timeout_index != NULL)
+		dfree(timeout_index, MDL);
+	timeout_index = nindex;
+	timeout_index_size = nsize;
+}
+
+/* Find a pending timeout.  A NULL where matches any function. */
+static struct timeout *timeout_index_find(void (*where)(void *), void *what)
+{
+	struct timeout *q;
+
+	if (where == NULL) {
+		for (q = timeouts; q != NULL; q = q->next)
+			if (q->what == what)
+				return q;
+		return NULL;
+	}
+
+	if (timeout_index == NULL)
+		return NULL;
+
+	for (q = timeout_index[timeout_hash(where, what, timeout_index_size)];
+	     q != NULL; q = q->index_next) {
+		if (q->func == where && q->what == what)
+			return q;
+	}
+	return NULL;
+}
+
+/* Return 1 if t is a timeout that is currently pending. */
+static int timeout_is_pending(struct timeout *t)
+{
+	struct timeout *q;
+
+	if (timeout_index == NULL)
+		return 0;
+
+	for (q = timeout_index[timeout_hash(t->func, t->what,
+					    timeout_index_size)];
+	     q != NULL; q = q->index_next) {
+		if (q == t)
+			return 1;
+	}
+	return 0;
+}
+
+/* Put q on the timeouts list after prev (or at the head if prev is NULL)
+   and enter it in the index. */
+static void timeout_link(struct timeout *q, struct timeout *prev)
+{
+	unsigned h;
+
+	if (prev == NULL) {
+		q->next = timeouts;
+		timeouts = q;
+	} else {
+		q->next = prev->next;
+		prev->next = q;
+	}
+	q->prev = prev;
+	if (q->next != NULL)
+		q->next->prev = q;
+
+	if (timeout_index_count >= timeout_index_size)
+		timeout_index_grow();
+	h = timeout_hash(q->func, q->what, timeout_index_size);
+	q->index_next = timeout_index[h];
+	timeout_index[h] = q;
+	timeout_index_count++;
+}
+
+/* Take q off the timeouts list and out of the index. */
+static void timeout_unlink(struct timeout *q)
+{
+	struct timeout **qp;
+
+	if (q->prev != NULL)
+		q->prev->next = q->next;
+	else
+		timeouts = q->next;
+	if (q->next != NULL)
+		q->next->prev = q->prev;
+	q->next = q->prev = NULL;
+
+	for (qp = &timeout_index[timeout_hash(q->func, q->what,
+					      timeout_index_size)];
+	     *qp != NULL; qp = &(*qp)->index_next) {
+		if (*qp == q) {
+			*qp = q->index_next;
+			timeout_index_count--;
+			break;
+		}
+	}
+	q->index_next = NULL;
+}
+
 void set_time(TIME t)
 {
 	/* Do any outstanding timeouts. */
@@ -55,7 +204,7 @@ struct timeval *process_outstanding_timeouts (struct timeval *tvp)
 		    ((timeouts -> when . tv_sec == cur_tv . tv_sec) &&
 		     (timeouts -> when . tv_usec <= cur_tv . tv_usec))) {
 			t = timeouts;
-			timeouts = timeouts -> next;
+			timeout_unlink(t);
 			(*(t -> func)) (t -> what);
 			if (t -> unref)
 				(*t -> unref) (&t -> what, MDL);
@@ -140,26 +289,21 @@ isclib_timer_callback(isc_task_t  *taskp,
 		      isc_event_t *eventp)
 {
 	struct timeout *t = (struct timeout *)eventp->ev_arg;
-	struct timeout *q, *r;
+	struct timeout *q;
 
 	/* Get the current time... */
 	gettimeofday (&cur_tv, (struct timezone *)0);
 
 	/*
 	 * Find the timeout on the dhcp list and remove it.
-	 * As the list isn't ordered we search the entire list
+	 * The index tells us whether it is still pending without
+	 * having to search the entire list.
 	 */
 
-	r = NULL;
-	for (q = timeouts; q; q = q->next) {
-		if (q == t) {
-			if (r)
-				r->next = q->next;
-			else
-				timeouts = q->next;
-			break;
-		}
-		r = q;
+	q = NULL;
+	if (timeout_is_pending(t)) {
+		q = t;
+		timeout_unlink(q);
 	}
 
 	/*
@@ -210,18 +354,10 @@ void add_timeout (when, where, what, ref, unref)
 	isc_time_t expires;
 
 	/* See if this timeout supersedes an existing timeout. */
-	t = (struct timeout *)0;
-	for (q = timeouts; q; q = q->next) {
-		if ((where == NULL || q->func == where) &&
-		    q->what == what) {
-			if (t)
-				t->next = q->next;
-			else
-				timeouts = q->next;
-			usereset = 1;
-			break;
-		}
-		t = q;
+	q = timeout_index_find(where, what);
+	if (q) {
+		timeout_unlink(q);
+		usereset = 1;
 	}
 
 	/* If we didn't supersede a timeout, allocate a timeout
@@ -312,36 +448,28 @@ void add_timeout (when, where, what, ref, unref)
 		if (!timeouts || (timeouts->when.tv_sec > q-> when.tv_sec) ||
 		    ((timeouts->when.tv_sec == q->when.tv_sec) &&
 		     (timeouts->when.tv_usec > q->when.tv_usec))) {
-			q->next = timeouts;
-			timeouts = q;
+			timeout_link(q, NULL);
 			return;
 		}
 
-		/* Middle of list? */
+		/* Middle or end of list. */
 		for (t = timeouts; t->next; t = t->next) {
 			if ((t->next->when.tv_sec > q->when.tv_sec) ||
 			    ((t->next->when.tv_sec == q->when.tv_sec) &&
 			     (t->next->when.tv_usec > q->when.tv_usec))) {
-				q->next = t->next;
-				t->next = q;
-				return;
+				break;
 			}
 		}
-
-		/* End of list. */
-		t->next = q;
-		q->next = (struct timeout *)0;
+		timeout_link(q, t);
 		return;
 	}
 #endif
 	/*
 	 * Don't bother sorting the DHCP list, just add it to the front.
-	 * Eventually the list should be removed as we migrate the callers
-	 * to the native ISC timer functions, if it becomes a performance
-	 * problem before then we may need to order the list.
+	 * The isclib orders the actual timers; the list and its index are
+	 * only used to find timeouts to supersede or cancel.
 	 */
-	q->next  = timeouts;
-	timeouts = q;
+	timeout_link(q, NULL);
 
 	isc_interval_set(&interval, sec, usec * 1000);
 	status = isc_time_nowplusinterval(&expires, &interval);
@@ -378,19 +506,14 @@ void cancel_timeout (where, what)
 	void (*where) (void *);
 	void *what;
 {
-	struct timeout *t, *q;
+	struct timeout *q;
 
 	/* Look for this timeout on the list, and unlink it if we find it. */
-	t = (struct timeout *)0;
-	for (q = timeouts; q; q = q -> next) {
-		if (q->func == where && q->what == what) {
-			if (t)
-				t->next = q->next;
-			else
-				timeouts = q->next;
-			break;
-		}
-		t = q;
+	q = NULL;
+	if (where != NULL) {
+		q = timeout_index_find(where, what);
+		if (q)
+			timeout_unlink(q);
 	}
 
 	/*
@@ -426,6 +549,11 @@ void cancel_all_timeouts ()
 		t->next = free_timeouts;
 		free_timeouts = t;
 	}
+	timeouts = NULL;
+	if (timeout_index != NULL)
+		memset(timeout_index, 0,
+		       timeout_index_size * sizeof(*timeout_index));
+	timeout_index_count = 0;
 }
 
 void relinquish_timeouts ()
@@ -435,5 +563,11 @@ void relinquish_timeouts ()
 		n = t->next;
 		dfree(t, MDL);
 	}
+	free_timeouts = NULL;
+	if (timeout_index != NULL) {
+		dfree(timeout_index, MDL);
+		timeout_index = NULL;
+		timeout_index_size = 0;
+	}
 }
 #endif
@@ -336,6 +336,7 @@ int execute_statements (result, packet, lease, client_state,
 
 		      case set_statement:
 		      case define_statement:
+			binding_generation++;
 			status = 1;
 			if (!scope) {
 				log_error("set %s: no scope",
@@ -384,6 +385,12 @@ int execute_statements (result, packet, lease, client_state,
 						   in_options, out_options,
 						   scope, r->data.set.expr,
 						   MDL));
+					/* Bindings often outlive the packet. */
+					if (status &&
+					    binding->value->type == binding_data)
+						data_string_promote
+						    (&binding->value->value.data,
+						     MDL);
 				} else {
 				    if (!(binding_value_allocate
 					  (&binding->value, MDL))) {
@@ -410,6 +417,7 @@ int execute_statements (result, packet, lease, client_state,
 			break;
 
 		      case unset_statement:
+			binding_generation++;
 			if (!scope || !*scope)
 				break;
 			binding = find_binding (*scope, r->data.unset);
@@ -429,6 +437,7 @@ int execute_statements (result, packet, lease, client_state,
 			break;
 
 		      case let_statement:
+			binding_generation++;
 #if defined (DEBUG_EXPRESSIONS)
 			log_debug("exec: let %s", r->data.let.name);
 #endif
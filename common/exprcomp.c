@@ -0,0 +1,1052 @@
+/* exprcomp.c
+
+   Compiled evaluation of expression trees. */
+
+/*
+ * Copyright (c) 2017 by Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *   Internet Systems Consortium, Inc.
+ *   950 Charter Street
+ *   Redwood City, CA 94063
+ *   <info@isc.org>
+ *   https://www.isc.org/
+ *
+ */
+
+/*
+ * Class matching and option evaluation walk the same expression trees
+ * for every packet.  The first time evaluate_compiled_boolean() or
+ * evaluate_compiled_data() sees an expression, it lowers the tree into a
+ * flat array of instructions for a small stack machine and hangs the
+ * program off the root node, where it stays until the tree is freed.
+ *
+ * Subtrees made only of constants are evaluated once, when the program
+ * is built.  The values the program works on are slices on a value
+ * stack on the C stack: they point into option data, the expression's
+ * constants, or a scratch area that is also on the C stack, so a
+ * substring of an option costs nothing and a concatenation costs a copy
+ * but no allocation.  Only the result of a data expression is copied
+ * into a buffer, and only when it was built in the scratch area.  "and"
+ * and "or" are compiled to jumps, so they short circuit just as the tree
+ * walker does.
+ *
+ * Operators the machine doesn't implement are handed to the tree walker
+ * by a fallback instruction, so every tree can be compiled and a
+ * program returns exactly what evaluating the tree would.  With
+ * DEBUG_EXPRESSIONS nothing is compiled, so that every step is logged
+ * as before.
+ */
+
+#include "dhcpd.h"
+#include <ctype.h>
+
+/* Deepest a program's value stack may get; deeper trees aren't
+   compiled. */
+#if !defined (EXPR_STACK_DEPTH)
+# define EXPR_STACK_DEPTH	32
+#endif
+
+/* Intermediate values that don't fit in this many bytes go in
+   buffers. */
+#if !defined (EXPR_SCRATCH_SIZE)
+# define EXPR_SCRATCH_SIZE	512
+#endif
+
+enum expr_kind {
+	EXPR_KIND_NONE,
+	EXPR_KIND_BOOLEAN,
+	EXPR_KIND_NUMERIC,
+	EXPR_KIND_DATA
+};
+
+enum expr_opcode {
+	EOP_CONST_DATA,		/* Push the data string at p. */
+	EOP_CONST_NUM,		/* Push num (a number or a boolean). */
+	EOP_CONST_FAIL,		/* Push a value that failed to evaluate. */
+	EOP_OPTION,		/* Push option p from in_options, or from
+				   cfg_options if arg is set. */
+	EOP_EXISTS,		/* Push whether in_options has option p. */
+	EOP_HARDWARE,
+	EOP_KNOWN,
+	EOP_STATIC,
+	EOP_SUBSTRING,		/* data offset len -> data */
+	EOP_SUFFIX,		/* data len -> data */
+	EOP_CONCAT,		/* data data -> data */
+	EOP_LCASE,
+	EOP_UCASE,
+	EOP_EXTRACT,		/* data -> number from the first arg bytes */
+	EOP_ENCODE,		/* number -> arg bytes of data */
+	EOP_EQUAL,		/* x y -> boolean; see the EQUAL_ flags */
+	EOP_NOT,
+	EOP_AND,		/* If false, replace with a failure and jump
+				   to arg. */
+	EOP_AND_END,
+	EOP_OR,			/* If true, leave true and jump to arg. */
+	EOP_OR_END,
+	EOP_TREE_BOOLEAN,	/* Evaluate p with the tree walker. */
+	EOP_TREE_NUMERIC,
+	EOP_TREE_DATA
+};
+
+#define EQUAL_NOT	1	/* not-equal */
+#define EQUAL_DATA	2	/* compare data rather than num */
+#define EQUAL_KINDS	4	/* x and y are of different kinds */
+
+struct expr_insn {
+	enum expr_opcode op;
+	int arg;
+	unsigned long num;
+	void *p;
+};
+
+struct expr_program {
+	enum expr_kind kind;
+	int count;			/* Instructions. */
+	int nconsts;
+	struct data_string *consts;	/* Folded constant data. */
+	struct expr_insn insn [1];
+};
+
+/* What a root that isn't worth compiling points to. */
+static struct expr_program no_program;
+
+struct expr_value {
+	int status;		/* Zero if the value couldn't be evaluated. */
+	int scratch;		/* Set if data is in the scratch area. */
+	int terminated;
+	unsigned len;
+	const unsigned char *data;
+	struct buffer *buffer;	/* Holds a reference to data, if set. */
+	unsigned long num;	/* Value of a number or boolean. */
+};
+
+struct expr_scratch {
+	unsigned used;
+	unsigned char buf [EXPR_SCRATCH_SIZE];
+};
+
+struct expr_compiler {
+	struct expr_program *prog;
+	int depth, max_depth;
+};
+
+static int expr_emit (struct expr_compiler *, struct expression *,
+		      enum expr_kind);
+
+/* The kind of value evaluate_expression() would make of an expression,
+   or EXPR_KIND_NONE if it can only tell at runtime. */
+static enum expr_kind expr_kind_of (struct expression *expr)
+{
+	if (is_boolean_expression (expr))
+		return EXPR_KIND_BOOLEAN;
+	if (is_numeric_expression (expr))
+		return EXPR_KIND_NUMERIC;
+	if (is_data_expression (expr))
+		return EXPR_KIND_DATA;
+	return EXPR_KIND_NONE;
+}
+
+/* Nonzero if the expression always evaluates to the same thing.   Only
+   operators without side effects that get nothing from the packet,
+   lease or options qualify. */
+static int expr_is_constant (struct expression *expr)
+{
+	switch (expr -> op) {
+	      case expr_const_data:
+	      case expr_const_int:
+		return 1;
+
+	      case expr_substring:
+		return (expr_is_constant (expr -> data.substring.expr) &&
+			expr_is_constant (expr -> data.substring.offset) &&
+			expr_is_constant (expr -> data.substring.len));
+
+	      case expr_suffix:
+		return (expr_is_constant (expr -> data.suffix.expr) &&
+			expr_is_constant (expr -> data.suffix.len));
+
+	      case expr_equal:
+	      case expr_not_equal:
+	      case expr_concat:
+	      case expr_and:
+	      case expr_or:
+		return (expr_is_constant (expr -> data.equal [0]) &&
+			expr_is_constant (expr -> data.equal [1]));
+
+	      case expr_not:
+	      case expr_lcase:
+	      case expr_ucase:
+	      case expr_extract_int8:
+	      case expr_extract_int16:
+	      case expr_extract_int32:
+	      case expr_encode_int8:
+	      case expr_encode_int16:
+	      case expr_encode_int32:
+		/* These all use the same union member. */
+		return expr_is_constant (expr -> data.not);
+
+	      default:
+		return 0;
+	}
+}
+
+/* The same, for the rest of the server: nonzero if expr's value never
+   changes. */
+int expression_is_constant (struct expression *expr)
+{
+	return expr && expr_is_constant (expr);
+}
+
+/* An upper bound on the number of nodes expr_emit() will visit. */
+static int expr_node_count (struct expression *expr)
+{
+	switch (expr -> op) {
+	      case expr_substring:
+		return (1 + expr_node_count (expr -> data.substring.expr) +
+			expr_node_count (expr -> data.substring.offset) +
+			expr_node_count (expr -> data.substring.len));
+
+	      case expr_suffix:
+		return (1 + expr_node_count (expr -> data.suffix.expr) +
+			expr_node_count (expr -> data.suffix.len));
+
+	      case expr_equal:
+	      case expr_not_equal:
+	      case expr_concat:
+	      case expr_and:
+	      case expr_or:
+		return (1 + expr_node_count (expr -> data.equal [0]) +
+			expr_node_count (expr -> data.equal [1]));
+
+	      case expr_not:
+	      case expr_lcase:
+	      case expr_ucase:
+	      case expr_extract_int8:
+	      case expr_extract_int16:
+	      case expr_extract_int32:
+	      case expr_encode_int8:
+	      case expr_encode_int16:
+	      case expr_encode_int32:
+		return 1 + expr_node_count (expr -> data.not);
+
+	      default:
+		return 1;
+	}
+}
+
+static struct expr_insn *expr_insn (struct expr_compiler *c,
+				    enum expr_opcode op, int pops, int pushes)
+{
+	struct expr_insn *insn;
+
+	insn = &c -> prog -> insn [c -> prog -> count++];
+	memset (insn, 0, sizeof *insn);
+	insn -> op = op;
+	c -> depth += pushes - pops;
+	if (c -> depth > c -> max_depth)
+		c -> max_depth = c -> depth;
+	return insn;
+}
+
+/* Evaluate a constant subtree now and emit its value. */
+static int expr_fold (struct expr_compiler *c, struct expression *expr,
+		      enum expr_kind kind)
+{
+	struct expr_insn *insn;
+	struct data_string *ds;
+	unsigned long num = 0;
+	int b = 0;
+	int status;
+
+	switch (kind) {
+	      case EXPR_KIND_BOOLEAN:
+		status = evaluate_boolean_expression (&b, NULL, NULL, NULL,
+						      NULL, NULL, NULL, expr);
+		num = b;
+		break;
+
+	      case EXPR_KIND_NUMERIC:
+		status = evaluate_numeric_expression (&num, NULL, NULL, NULL,
+						      NULL, NULL, NULL, expr);
+		break;
+
+	      default:
+		ds = &c -> prog -> consts [c -> prog -> nconsts];
+		status = evaluate_data_expression (ds, NULL, NULL, NULL,
+						   NULL, NULL, NULL, expr, MDL);
+		if (!status)
+			break;
+		/* The program outlives the packet being processed. */
+		if (!data_string_promote (ds, MDL)) {
+			data_string_forget (ds, MDL);
+			return 0;
+		}
+		c -> prog -> nconsts++;
+		insn = expr_insn (c, EOP_CONST_DATA, 0, 1);
+		insn -> p = ds;
+		return 1;
+	}
+
+	insn = expr_insn (c, status ? EOP_CONST_NUM : EOP_CONST_FAIL, 0, 1);
+	insn -> num = num;
+	return 1;
+}
+
+/* Emit code that leaves the value of expr, evaluated as kind, on the
+   stack. */
+static int expr_emit (struct expr_compiler *c, struct expression *expr,
+		      enum expr_kind kind)
+{
+	struct expr_insn *insn;
+	enum expr_kind lkind, rkind;
+	enum expr_opcode op;
+	int jump;
+
+	if (expr_kind_of (expr) == kind && expr -> op != expr_const_data &&
+	    expr -> op != expr_const_int && expr_is_constant (expr))
+		return expr_fold (c, expr, kind);
+
+	switch (kind) {
+	      case EXPR_KIND_BOOLEAN:
+		switch (expr -> op) {
+		      case expr_equal:
+		      case expr_not_equal:
+			lkind = expr_kind_of (expr -> data.equal [0]);
+			rkind = expr_kind_of (expr -> data.equal [1]);
+			if (lkind == EXPR_KIND_NONE ||
+			    rkind == EXPR_KIND_NONE)
+				break;
+			if (!expr_emit (c, expr -> data.equal [0], lkind) ||
+			    !expr_emit (c, expr -> data.equal [1], rkind))
+				return 0;
+			insn = expr_insn (c, EOP_EQUAL, 2, 1);
+			insn -> arg = ((expr -> op == expr_not_equal
+					? EQUAL_NOT : 0) |
+				       (lkind == EXPR_KIND_DATA
+					? EQUAL_DATA : 0) |
+				       (lkind != rkind ? EQUAL_KINDS : 0));
+			return 1;
+
+		      case expr_and:
+		      case expr_or:
+			if (!expr_emit (c, expr -> data.and [0], kind))
+				return 0;
+			jump = c -> prog -> count;
+			if (expr -> op == expr_and)
+				/* On the jump, a failure takes the place of
+				   the left hand side. */
+				expr_insn (c, EOP_AND, 1, 0);
+			else
+				expr_insn (c, EOP_OR, 0, 0);
+			if (!expr_emit (c, expr -> data.and [1], kind))
+				return 0;
+			if (expr -> op == expr_and)
+				expr_insn (c, EOP_AND_END, 0, 0);
+			else
+				expr_insn (c, EOP_OR_END, 2, 1);
+			c -> prog -> insn [jump].arg = c -> prog -> count;
+			return 1;
+
+		      case expr_not:
+			if (!expr_emit (c, expr -> data.not, kind))
+				return 0;
+			expr_insn (c, EOP_NOT, 1, 1);
+			return 1;
+
+		      case expr_exists:
+			insn = expr_insn (c, EOP_EXISTS, 0, 1);
+			insn -> p = expr -> data.exists;
+			return 1;
+
+		      case expr_known:
+			expr_insn (c, EOP_KNOWN, 0, 1);
+			return 1;
+
+		      case expr_static:
+			expr_insn (c, EOP_STATIC, 0, 1);
+			return 1;
+
+		      default:
+			break;
+		}
+		insn = expr_insn (c, EOP_TREE_BOOLEAN, 0, 1);
+		insn -> p = expr;
+		return 1;
+
+	      case EXPR_KIND_NUMERIC:
+		switch (expr -> op) {
+		      case expr_const_int:
+			insn = expr_insn (c, EOP_CONST_NUM, 0, 1);
+			insn -> num = expr -> data.const_int;
+			return 1;
+
+		      case expr_extract_int8:
+		      case expr_extract_int16:
+		      case expr_extract_int32:
+			if (!expr_emit (c, expr -> data.extract_int,
+					EXPR_KIND_DATA))
+				return 0;
+			insn = expr_insn (c, EOP_EXTRACT, 1, 1);
+			insn -> arg = (expr -> op == expr_extract_int8 ? 1 :
+				       expr -> op == expr_extract_int16 ? 2 : 4);
+			return 1;
+
+		      default:
+			break;
+		}
+		insn = expr_insn (c, EOP_TREE_NUMERIC, 0, 1);
+		insn -> p = expr;
+		return 1;
+
+	      default:
+		switch (expr -> op) {
+		      case expr_const_data:
+			insn = expr_insn (c, EOP_CONST_DATA, 0, 1);
+			insn -> p = &expr -> data.const_data;
+			return 1;
+
+		      case expr_option:
+		      case expr_config_option:
+			insn = expr_insn (c, EOP_OPTION, 0, 1);
+			insn -> p = expr -> data.option;
+			insn -> arg = expr -> op == expr_config_option;
+			return 1;
+
+		      case expr_hardware:
+			expr_insn (c, EOP_HARDWARE, 0, 1);
+			return 1;
+
+		      case expr_substring:
+			if (!expr_emit (c, expr -> data.substring.expr,
+					EXPR_KIND_DATA) ||
+			    !expr_emit (c, expr -> data.substring.offset,
+					EXPR_KIND_NUMERIC) ||
+			    !expr_emit (c, expr -> data.substring.len,
+					EXPR_KIND_NUMERIC))
+				return 0;
+			expr_insn (c, EOP_SUBSTRING, 3, 1);
+			return 1;
+
+		      case expr_suffix:
+			if (!expr_emit (c, expr -> data.suffix.expr,
+					EXPR_KIND_DATA) ||
+			    !expr_emit (c, expr -> data.suffix.len,
+					EXPR_KIND_NUMERIC))
+				return 0;
+			expr_insn (c, EOP_SUFFIX, 2, 1);
+			return 1;
+
+		      case expr_concat:
+			if (!expr_emit (c, expr -> data.concat [0],
+					EXPR_KIND_DATA) ||
+			    !expr_emit (c, expr -> data.concat [1],
+					EXPR_KIND_DATA))
+				return 0;
+			expr_insn (c, EOP_CONCAT, 2, 1);
+			return 1;
+
+		      case expr_lcase:
+		      case expr_ucase:
+			if (!expr_emit (c, expr -> data.lcase, EXPR_KIND_DATA))
+				return 0;
+			op = expr -> op == expr_lcase ? EOP_LCASE : EOP_UCASE;
+			expr_insn (c, op, 1, 1);
+			return 1;
+
+		      case expr_encode_int8:
+		      case expr_encode_int16:
+		      case expr_encode_int32:
+			if (!expr_emit (c, expr -> data.encode_int,
+					EXPR_KIND_NUMERIC))
+				return 0;
+			insn = expr_insn (c, EOP_ENCODE, 1, 1);
+			insn -> arg = (expr -> op == expr_encode_int8 ? 1 :
+				       expr -> op == expr_encode_int16 ? 2 : 4);
+			return 1;
+
+		      default:
+			break;
+		}
+		insn = expr_insn (c, EOP_TREE_DATA, 0, 1);
+		insn -> p = expr;
+		return 1;
+	}
+}
+
+static void expr_program_free (struct expr_program **pp)
+{
+	struct expr_program *prog = *pp;
+	int i;
+
+	*pp = NULL;
+	if (!prog || prog == &no_program)
+		return;
+	for (i = 0; i < prog -> nconsts; i++)
+		data_string_forget (&prog -> consts [i], MDL);
+	dfree (prog, MDL);
+}
+
+/* Compile expr, returning NULL if running the tree walker directly
+   would be as quick. */
+static struct expr_program *expr_compile (struct expression *expr,
+					  enum expr_kind kind)
+{
+	struct expr_compiler c;
+	struct expr_program *prog;
+	int nodes;
+
+	/* Every node takes at most two instructions and one constant. */
+	nodes = expr_node_count (expr);
+	prog = dmalloc (sizeof *prog +
+			(2 * nodes - 1) * sizeof (struct expr_insn) +
+			nodes * sizeof (struct data_string), MDL);
+	if (!prog)
+		return NULL;
+	memset (prog, 0, sizeof *prog);
+	prog -> kind = kind;
+	prog -> consts = (struct data_string *)&prog -> insn [2 * nodes];
+
+	memset (&c, 0, sizeof c);
+	c.prog = prog;
+	if (!expr_emit (&c, expr, kind) || c.max_depth > EXPR_STACK_DEPTH ||
+	    (prog -> count == 1 && prog -> nconsts == 0)) {
+		expr_program_free (&prog);
+		return NULL;
+	}
+	return prog;
+}
+
+static struct expr_program *expression_program (struct expression *expr,
+						enum expr_kind kind)
+{
+#if defined (DEBUG_EXPRESSIONS)
+	return NULL;
+#else
+	if (!expr -> program) {
+		expr -> program = expr_compile (expr, kind);
+		if (!expr -> program)
+			expr -> program = &no_program;
+	}
+	if (expr -> program == &no_program || expr -> program -> kind != kind)
+		return NULL;
+	return expr -> program;
+#endif
+}
+
+/* Free the program compiled from an expression, if there is one. */
+void expression_program_forget (struct expression *expr)
+{
+	expr_program_free (&expr -> program);
+}
+
+static void value_forget (struct expr_value *v)
+{
+	if (v -> buffer)
+		buffer_dereference (&v -> buffer, MDL);
+	memset (v, 0, sizeof *v);
+}
+
+/* Take over the data string's reference to its buffer. */
+static void value_from_data_string (struct expr_value *v,
+				    struct data_string *ds)
+{
+	v -> status = 1;
+	v -> scratch = 0;
+	v -> data = ds -> data;
+	v -> len = ds -> len;
+	v -> terminated = ds -> terminated;
+	v -> buffer = NULL;
+	if (ds -> buffer) {
+		buffer_reference (&v -> buffer, ds -> buffer, MDL);
+		data_string_forget (ds, MDL);
+	}
+}
+
+/* Find room for len bytes of a new value, in the scratch area if it
+   fits. */
+static unsigned char *value_space (struct expr_value *v,
+				   struct expr_scratch *scratch, unsigned len)
+{
+	unsigned char *p;
+
+	v -> buffer = NULL;
+	if (len <= sizeof scratch -> buf - scratch -> used) {
+		p = &scratch -> buf [scratch -> used];
+		scratch -> used += len;
+		v -> scratch = 1;
+		return p;
+	}
+	v -> scratch = 0;
+	if (!buffer_allocate (&v -> buffer, len, MDL))
+		return NULL;
+	return v -> buffer -> data;
+}
+
+static int values_equal (struct expr_value *left, struct expr_value *right,
+		       struct expr_insn *insn)
+{
+	int equal;
+
+	if (left -> status && right -> status) {
+		if (insn -> arg & EQUAL_KINDS)
+			equal = 0;
+		else if (insn -> arg & EQUAL_DATA)
+			equal = (left -> len == right -> len &&
+				 !memcmp (left -> data, right -> data,
+					  left -> len));
+		else
+			equal = left -> num == right -> num;
+	} else
+		equal = !left -> status && !right -> status;
+
+	return (insn -> arg & EQUAL_NOT) ? !equal : equal;
+}
+
+/* Run a program.   Returns with the value it computed in result; the
+   value may point into the caller's scratch area. */
+static void expr_run (struct expr_value *result, struct expr_program *prog,
+		      struct expr_scratch *scratch,
+		      struct packet *packet, struct lease *lease,
+		      struct client_state *client_state,
+		      struct option_state *in_options,
+		      struct option_state *cfg_options,
+		      struct binding_scope **scope)
+{
+	struct expr_value stack [EXPR_STACK_DEPTH];
+	struct expr_value *sp = stack, *v;
+	struct expr_insn *insn;
+	struct option_state *options;
+	struct option_cache *oc;
+	struct option *option;
+	struct data_string ds;
+	unsigned char *p;
+	unsigned long offset, len;
+	unsigned i;
+	int pc, b;
+
+	scratch -> used = 0;
+	for (pc = 0; pc < prog -> count; pc++) {
+		insn = &prog -> insn [pc];
+		switch (insn -> op) {
+		      case EOP_CONST_DATA:
+			memset (sp, 0, sizeof *sp);
+			memset (&ds, 0, sizeof ds);
+			data_string_copy (&ds, insn -> p, MDL);
+			value_from_data_string (sp, &ds);
+			sp++;
+			break;
+
+		      case EOP_CONST_NUM:
+			memset (sp, 0, sizeof *sp);
+			sp -> status = 1;
+			sp -> num = insn -> num;
+			sp++;
+			break;
+
+		      case EOP_CONST_FAIL:
+			memset (sp, 0, sizeof *sp);
+			sp++;
+			break;
+
+		      case EOP_OPTION:
+		      case EOP_EXISTS:
+			memset (sp, 0, sizeof *sp);
+			option = insn -> p;
+			options = insn -> arg ? cfg_options : in_options;
+			oc = NULL;
+			if (options && option -> universe -> lookup_func)
+				oc = ((*option -> universe -> lookup_func)
+				      (option -> universe, options,
+				       option -> code));
+			memset (&ds, 0, sizeof ds);
+			if (oc &&
+			    evaluate_option_cache (&ds, packet, lease,
+						   client_state, in_options,
+						   cfg_options, scope, oc,
+						   MDL))
+				value_from_data_string (sp, &ds);
+			if (insn -> op == EOP_EXISTS) {
+				b = sp -> status;
+				value_forget (sp);
+				sp -> status = 1;
+				sp -> num = b;
+			}
+			sp++;
+			break;
+
+		      case EOP_HARDWARE:
+			memset (sp, 0, sizeof *sp);
+			if (client_state) {
+				sp -> status = 1;
+				sp -> data = (client_state -> interface ->
+					      hw_address.hbuf);
+				sp -> len = (client_state -> interface ->
+					     hw_address.hlen);
+			} else if (packet && packet -> raw) {
+				if (packet -> raw -> hlen >
+				    sizeof packet -> raw -> chaddr) {
+					log_error ("data: hardware: invalid "
+						   "hlen (%d)\n",
+						   packet -> raw -> hlen);
+				} else if ((p = value_space
+					    (sp, scratch,
+					     packet -> raw -> hlen + 1))) {
+					p [0] = packet -> raw -> htype;
+					memcpy (&p [1], packet -> raw -> chaddr,
+						packet -> raw -> hlen);
+					sp -> data = p;
+					sp -> len = packet -> raw -> hlen + 1;
+					sp -> status = 1;
+				}
+			} else if (lease) {
+				p = value_space (sp, scratch,
+						 lease -> hardware_addr.hlen);
+				if (p) {
+					memcpy (p, lease -> hardware_addr.hbuf,
+						lease -> hardware_addr.hlen);
+					sp -> data = p;
+					sp -> len = lease -> hardware_addr.hlen;
+					sp -> status = 1;
+				}
+			} else
+				log_error ("data: hardware: no raw packet or "
+					   "lease is available");
+			sp++;
+			break;
+
+		      case EOP_KNOWN:
+			memset (sp, 0, sizeof *sp);
+			if (packet) {
+				sp -> status = 1;
+				sp -> num = packet -> known;
+			}
+			sp++;
+			break;
+
+		      case EOP_STATIC:
+			memset (sp, 0, sizeof *sp);
+			sp -> status = 1;
+			sp -> num = lease && (lease -> flags & STATIC_LEASE);
+			sp++;
+			break;
+
+		      case EOP_SUBSTRING:
+			sp -= 2;
+			v = sp - 1;
+			if (v -> status && sp [0].status && sp [1].status) {
+				offset = sp [0].num;
+				len = sp [1].num;
+				if (v -> len > offset) {
+					v -> data += offset;
+					v -> len -= offset;
+					if (v -> len > len) {
+						v -> len = len;
+						v -> terminated = 0;
+					}
+				} else {
+					value_forget (v);
+					v -> status = 1;
+				}
+			} else
+				value_forget (v);
+			break;
+
+		      case EOP_SUFFIX:
+			sp--;
+			v = sp - 1;
+			if (v -> status && sp -> status) {
+				len = sp -> num;
+				if (v -> len > len) {
+					v -> data += v -> len - len;
+					v -> len = len;
+				}
+			} else
+				value_forget (v);
+			break;
+
+		      case EOP_CONCAT:
+			sp--;
+			v = sp - 1;
+			if (v -> status && sp -> status) {
+				ds.buffer = v -> buffer;
+				v -> buffer = NULL;
+				p = value_space (v, scratch, (v -> len +
+							      sp -> len +
+							      sp -> terminated));
+				if (p) {
+					memmove (p, v -> data, v -> len);
+					memcpy (p + v -> len, sp -> data,
+						sp -> len + sp -> terminated);
+					v -> data = p;
+					v -> len += sp -> len;
+					v -> terminated = 0;
+				} else {
+					log_error ("data: concat: no memory");
+					v -> status = 0;
+				}
+				if (ds.buffer)
+					buffer_dereference (&ds.buffer, MDL);
+				if (!v -> status)
+					value_forget (v);
+			} else
+				value_forget (v);
+			value_forget (sp);
+			break;
+
+		      case EOP_LCASE:
+		      case EOP_UCASE:
+			v = sp - 1;
+			if (!v -> status)
+				break;
+			if (!v -> scratch) {
+				ds.buffer = v -> buffer;
+				ds.data = v -> data;
+				v -> buffer = NULL;
+				p = value_space (v, scratch,
+						 v -> len + v -> terminated);
+				if (p) {
+					memcpy (p, ds.data,
+						v -> len + v -> terminated);
+					v -> data = p;
+				} else {
+					log_error ("data: %s: no buffer "
+						   "memory.",
+						   insn -> op == EOP_LCASE ?
+						   "lcase" : "ucase");
+					v -> status = 0;
+				}
+				if (ds.buffer)
+					buffer_dereference (&ds.buffer, MDL);
+				if (!v -> status) {
+					value_forget (v);
+					break;
+				}
+			}
+			p = (unsigned char *)v -> data;
+			for (i = 0; i < v -> len; i++)
+				p [i] = (insn -> op == EOP_LCASE
+					 ? tolower (p [i]) : toupper (p [i]));
+			break;
+
+		      case EOP_EXTRACT:
+			v = sp - 1;
+			/* The tree walker's extract-int8 reads a byte that
+			   isn't there from an empty string; here it fails,
+			   as the wider ones do. */
+			if (v -> status && v -> len >= insn -> arg) {
+				if (insn -> arg == 1)
+					len = v -> data [0];
+				else if (insn -> arg == 2)
+					len = getUShort (v -> data);
+				else
+					len = getULong (v -> data);
+				value_forget (v);
+				v -> status = 1;
+				v -> num = len;
+			} else
+				value_forget (v);
+			break;
+
+		      case EOP_ENCODE:
+			v = sp - 1;
+			if (!v -> status)
+				break;
+			len = v -> num;
+			p = value_space (v, scratch, insn -> arg);
+			if (!p) {
+				log_error ("data: encode_int%d: no memory",
+					   insn -> arg * 8);
+				value_forget (v);
+				break;
+			}
+			if (insn -> arg == 1)
+				p [0] = len;
+			else if (insn -> arg == 2)
+				putUShort (p, len);
+			else
+				putULong (p, len);
+			v -> data = p;
+			v -> len = insn -> arg;
+			v -> terminated = 0;
+			v -> num = 0;
+			break;
+
+		      case EOP_EQUAL:
+			sp--;
+			v = sp - 1;
+			b = values_equal (v, sp, insn);
+			value_forget (v);
+			value_forget (sp);
+			v -> status = 1;
+			v -> num = b;
+			break;
+
+		      case EOP_NOT:
+			v = sp - 1;
+			if (v -> status)
+				v -> num = !v -> num;
+			break;
+
+		      case EOP_AND:
+			v = sp - 1;
+			if (!v -> status || !v -> num) {
+				v -> status = 0;
+				pc = insn -> arg - 1;
+			} else
+				sp--;
+			break;
+
+		      case EOP_AND_END:
+			v = sp - 1;
+			v -> num = v -> status && v -> num;
+			break;
+
+		      case EOP_OR:
+			v = sp - 1;
+			if (v -> status && v -> num) {
+				v -> num = 1;
+				pc = insn -> arg - 1;
+			}
+			break;
+
+		      case EOP_OR_END:
+			sp--;
+			v = sp - 1;
+			v -> num = sp -> status && sp -> num;
+			v -> status = v -> status || sp -> status;
+			break;
+
+		      case EOP_TREE_BOOLEAN:
+			memset (sp, 0, sizeof *sp);
+			b = 0;
+			sp -> status = (evaluate_boolean_expression
+					(&b, packet, lease, client_state,
+					 in_options, cfg_options, scope,
+					 insn -> p));
+			sp -> num = sp -> status ? b : 0;
+			sp++;
+			break;
+
+		      case EOP_TREE_NUMERIC:
+			memset (sp, 0, sizeof *sp);
+			len = 0;
+			sp -> status = (evaluate_numeric_expression
+					(&len, packet, lease, client_state,
+					 in_options, cfg_options, scope,
+					 insn -> p));
+			sp -> num = sp -> status ? len : 0;
+			sp++;
+			break;
+
+		      case EOP_TREE_DATA:
+			memset (sp, 0, sizeof *sp);
+			memset (&ds, 0, sizeof ds);
+			if (evaluate_data_expression (&ds, packet, lease,
+						      client_state,
+						      in_options, cfg_options,
+						      scope, insn -> p, MDL))
+				value_from_data_string (sp, &ds);
+			sp++;
+			break;
+		}
+	}
+
+	*result = stack [0];
+}
+
+/* Like evaluate_boolean_expression(), but runs the compiled form of the
+   expression, compiling it first if this is the first time. */
+int evaluate_compiled_boolean (result, packet, lease, client_state,
+			       in_options, cfg_options, scope, expr)
+	int *result;
+	struct packet *packet;
+	struct lease *lease;
+	struct client_state *client_state;
+	struct option_state *in_options;
+	struct option_state *cfg_options;
+	struct binding_scope **scope;
+	struct expression *expr;
+{
+	struct expr_program *prog;
+	struct expr_scratch scratch;
+	struct expr_value value;
+
+	prog = expression_program (expr, EXPR_KIND_BOOLEAN);
+	if (!prog)
+		return evaluate_boolean_expression (result, packet, lease,
+						    client_state, in_options,
+						    cfg_options, scope, expr);
+
+	expr_run (&value, prog, &scratch, packet, lease, client_state,
+		  in_options, cfg_options, scope);
+	if (!value.status)
+		return 0;
+	*result = value.num;
+	return 1;
+}
+
+/* Like evaluate_data_expression(), but runs the compiled form of the
+   expression, compiling it first if this is the first time. */
+int evaluate_compiled_data (result, packet, lease, client_state,
+			    in_options, cfg_options, scope, expr, file, line)
+	struct data_string *result;
+	struct packet *packet;
+	struct lease *lease;
+	struct client_state *client_state;
+	struct option_state *in_options;
+	struct option_state *cfg_options;
+	struct binding_scope **scope;
+	struct expression *expr;
+	const char *file;
+	int line;
+{
+	struct expr_program *prog;
+	struct expr_scratch scratch;
+	struct expr_value value;
+
+	prog = expression_program (expr, EXPR_KIND_DATA);
+	if (!prog)
+		return evaluate_data_expression (result, packet, lease,
+						 client_state, in_options,
+						 cfg_options, scope, expr,
+						 file, line);
+
+	expr_run (&value, prog, &scratch, packet, lease, client_state,
+		  in_options, cfg_options, scope);
+	if (!value.status)
+		return 0;
+
+	if (value.scratch) {
+		if (!buffer_allocate (&result -> buffer,
+				      value.len + value.terminated,
+				      file, line)) {
+			log_error ("data: no memory for expression result.");
+			return 0;
+		}
+		memcpy (result -> buffer -> data, value.data,
+			value.len + value.terminated);
+		result -> data = result -> buffer -> data;
+	} else {
+		if (value.buffer) {
+			buffer_reference (&result -> buffer, value.buffer,
+					  file, line);
+			buffer_dereference (&value.buffer, MDL);
+		}
+		result -> data = value.data;
+	}
+	result -> len = value.len;
+	result -> terminated = value.terminated;
+	return 1;
+}
@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2017  Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A four-ary version of the binary heap in heap.c, which is taken from
+ * the BIND 9 code.  The interface is the same, so the server can use it
+ * in place of libisc's isc_heap.
+ */
+
+/*! \file
+ * Heap implementation of priority queues adapted from the following:
+ *
+ *	\li "Introduction to Algorithms," Cormen, Leiserson, and Rivest,
+ *	MIT Press / McGraw Hill, 1990, ISBN 0-262-03141-8, chapter 7.
+ *
+ *	\li "Algorithms," Second Edition, Sedgewick, Addison-Wesley, 1988,
+ *	ISBN 0-201-06673-4, chapter 11.
+ *
+ * The server's heaps hold leases ordered by when they expire.  With four
+ * children per node the heap is half as deep as a binary one, so moving
+ * an element up the heap, which is what inserting and renewing leases
+ * mostly do, takes half as many steps.  The array is placed so that the
+ * four children of a node share one cache line, which keeps the extra
+ * comparisons on the way down cheap.
+ */
+
+#include "dhcpd.h"
+#include "omapip/omapip.h"
+#include "heap4.h"
+
+/*@{*/
+/*%
+ * As in heap.c, heap subscripts are 1-based and the first element of
+ * the heap array is not used.  The children of i are HEAP_ARITY * i - 2
+ * to HEAP_ARITY * i + 1, and its parent is (i + 2) / HEAP_ARITY.
+ */
+#define HEAP_ARITY			4
+#define heap_parent(i)			(((i) + 2) / HEAP_ARITY)
+#define heap_child(i)			((i) * HEAP_ARITY - 2)
+/*@}*/
+
+#define SIZE_INCREMENT			1024
+
+/*% A group of siblings: the children of one node start on this boundary. */
+#define HEAP_ALIGN			(HEAP_ARITY * sizeof(void *))
+
+/*%
+ * When the heap is in a consistent state, the following invariant
+ * holds true: for every element i > 1, heap_parent(i) has a priority
+ * higher than or equal to that of i.
+ */
+#define HEAPCONDITION(i) ((i) == 1 || \
+			  ! heap->compare(heap->array[(i)], \
+					  heap->array[heap_parent(i)]))
+
+/*% DHCP heap structure. */
+struct dhcp_heap {
+	unsigned int			size;
+	unsigned int			size_increment;
+	unsigned int			last;
+	void				**array;
+	void				*block;	/* array is inside this */
+	dhcp_heapcompare_t		compare;
+	dhcp_heapindex_t		index;
+};
+
+isc_result_t
+dhcp_heap_create(dhcp_heapcompare_t compare,
+		 dhcp_heapindex_t index, unsigned int size_increment,
+		 dhcp_heap_t **heapp)
+{
+	dhcp_heap_t *heap;
+
+	REQUIRE(heapp != NULL && *heapp == NULL);
+	REQUIRE(compare != NULL);
+
+	heap = dmalloc(sizeof(*heap), MDL);
+	if (heap == NULL)
+		return (ISC_R_NOMEMORY);
+	heap->size = 0;
+	if (size_increment == 0)
+		heap->size_increment = SIZE_INCREMENT;
+	else
+		heap->size_increment = size_increment;
+	heap->last = 0;
+	heap->array = NULL;
+	heap->block = NULL;
+	heap->compare = compare;
+	heap->index = index;
+
+	*heapp = heap;
+
+	return (ISC_R_SUCCESS);
+}
+
+void
+dhcp_heap_destroy(dhcp_heap_t **heapp) {
+	dhcp_heap_t *heap;
+
+	REQUIRE(heapp != NULL);
+	heap = *heapp;
+
+	if (heap->block != NULL)
+		dfree(heap->block, MDL);
+	dfree(heap, MDL);
+
+	*heapp = NULL;
+}
+
+static isc_boolean_t
+resize(dhcp_heap_t *heap) {
+	void **new_array;
+	void *new_block;
+	size_t new_size;
+
+	/* Grow by at least half again, so that filling a large heap
+	   doesn't copy the array over and over. */
+	if (heap->size / 2 > heap->size_increment)
+		new_size = heap->size + heap->size / 2;
+	else
+		new_size = heap->size + heap->size_increment;
+	new_block = dmalloc(new_size * sizeof(void *) + HEAP_ALIGN, MDL);
+	if (new_block == NULL)
+		return (ISC_FALSE);
+
+	/* The children of the top start at 2, and every group of siblings
+	   HEAP_ARITY further on, so line element 2 up on a boundary. */
+	new_array = (void **)
+		(((size_t)new_block + 2 * sizeof(void *) + HEAP_ALIGN - 1) &
+		 ~(size_t)(HEAP_ALIGN - 1));
+	new_array -= 2;
+
+	if (heap->array != NULL) {
+		memcpy(new_array, heap->array, heap->size * sizeof(void *));
+		dfree(heap->block, MDL);
+	}
+	heap->size = new_size;
+	heap->array = new_array;
+	heap->block = new_block;
+
+	return (ISC_TRUE);
+}
+
+static void
+float_up(dhcp_heap_t *heap, unsigned int i, void *elt) {
+	unsigned int p;
+
+	for (p = heap_parent(i) ;
+	     i > 1 && heap->compare(elt, heap->array[p]) ;
+	     i = p, p = heap_parent(i)) {
+		heap->array[i] = heap->array[p];
+		if (heap->index != NULL)
+			(heap->index)(heap->array[i], i);
+	}
+	heap->array[i] = elt;
+	if (heap->index != NULL)
+		(heap->index)(heap->array[i], i);
+
+	INSIST(HEAPCONDITION(i));
+}
+
+static void
+sink_down(dhcp_heap_t *heap, unsigned int i, void *elt) {
+	unsigned int j, c, end, size;
+
+	size = heap->last;
+	for (;;) {
+		/* Find the highest priority of the (at most) four children. */
+		c = heap_child(i);
+		if (c > size)
+			break;
+		end = c + HEAP_ARITY;
+		if (end > size + 1)
+			end = size + 1;
+		for (j = c++; c < end; c++)
+			if (heap->compare(heap->array[c], heap->array[j]))
+				j = c;
+		if (heap->compare(elt, heap->array[j]))
+			break;
+		heap->array[i] = heap->array[j];
+		if (heap->index != NULL)
+			(heap->index)(heap->array[i], i);
+		i = j;
+	}
+	heap->array[i] = elt;
+	if (heap->index != NULL)
+		(heap->index)(heap->array[i], i);
+
+	INSIST(HEAPCONDITION(i));
+}
+
+isc_result_t
+dhcp_heap_insert(dhcp_heap_t *heap, void *elt) {
+	unsigned int i;
+
+	i = ++heap->last;
+	if (heap->last >= heap->size && !resize(heap))
+		return (ISC_R_NOMEMORY);
+
+	float_up(heap, i, elt);
+
+	return (ISC_R_SUCCESS);
+}
+
+void
+dhcp_heap_delete(dhcp_heap_t *heap, unsigned int index) {
+	void *elt;
+	isc_boolean_t less;
+
+	REQUIRE(index >= 1 && index <= heap->last);
+
+	if (index == heap->last) {
+		heap->last--;
+	} else {
+		elt = heap->array[heap->last--];
+		less = heap->compare(elt, heap->array[index]);
+		heap->array[index] = elt;
+		if (less)
+			float_up(heap, index, heap->array[index]);
+		else
+			sink_down(heap, index, heap->array[index]);
+	}
+}
+
+void
+dhcp_heap_increased(dhcp_heap_t *heap, unsigned int index) {
+	REQUIRE(index >= 1 && index <= heap->last);
+
+	float_up(heap, index, heap->array[index]);
+}
+
+void
+dhcp_heap_decreased(dhcp_heap_t *heap, unsigned int index) {
+	REQUIRE(index >= 1 && index <= heap->last);
+
+	sink_down(heap, index, heap->array[index]);
+}
+
+void *
+dhcp_heap_element(dhcp_heap_t *heap, unsigned int index) {
+	REQUIRE(index >= 1 && index <= heap->last);
+
+	return (heap->array[index]);
+}
+
+void
+dhcp_heap_foreach(dhcp_heap_t *heap, dhcp_heapaction_t action, void *uap) {
+	unsigned int i;
+
+	REQUIRE(action != NULL);
+
+	for (i = 1 ; i <= heap->last ; i++)
+		(action)(heap->array[i], uap);
+}
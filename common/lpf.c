@@ -172,6 +172,26 @@ void if_deregister_send (info)
 #endif /* USE_LPF_SEND */
 
 #ifdef USE_LPF_RECEIVE
+#if defined (LPF_RECV_BATCH) && defined (MSG_WAITFORONE)
+/* Frames read by a single recvmmsg() call.   The batch lives in the
+   interface's read buffer; rbuf_offset is the index of the next frame
+   to hand out and rbuf_len is the number of frames read, so got_one()
+   keeps calling receive_packet() until the batch is drained, just as
+   it does for BPF. */
+struct lpf_recv_batch {
+	struct mmsghdr msgs [LPF_RECV_BATCH];
+	struct iovec iov [LPF_RECV_BATCH];
+#ifdef PACKET_AUXDATA
+	unsigned char cmsgbuf [LPF_RECV_BATCH]
+			      [CMSG_SPACE(sizeof(struct tpacket_auxdata))];
+#endif
+	unsigned char frames [LPF_RECV_BATCH][1536];
+};
+
+/* Cleared if the kernel turns out not to support recvmmsg(). */
+static int lpf_recv_batching = 1;
+#endif
+
 /* Defined in bpf.c.   We can't extern these in dhcpd.h without pulling
    in bpf includes... */
 extern struct sock_filter dhcp_bpf_filter [];
@@ -212,6 +232,18 @@ void if_register_receive (info)
 #endif
 		lpf_gen_filter_setup (info);
 
+#if defined (LPF_RECV_BATCH) && defined (MSG_WAITFORONE)
+	if (lpf_recv_batching && !info -> rbuf) {
+		info -> rbuf_max = sizeof (struct lpf_recv_batch);
+		info -> rbuf = dmalloc (info -> rbuf_max, MDL);
+		if (!info -> rbuf)
+			log_fatal ("Can't allocate receive batch for %s",
+				   info -> name);
+	}
+	info -> rbuf_offset = 0;
+	info -> rbuf_len = 0;
+#endif
+
 	if (!quiet_interface_discovery)
 		log_info ("Listening on LPF/%s/%s%s%s",
 			  info -> name,
@@ -230,6 +262,9 @@ void if_deregister_receive (info)
 	   are closed */
 	close (info -> rfdesc);
 	info -> rfdesc = -1;
+	/* Drop anything left over from the last batch. */
+	info -> rbuf_offset = 0;
+	info -> rbuf_len = 0;
 	if (!quiet_interface_discovery)
 		log_info ("Disabling input on LPF/%s/%s%s%s",
 			  info -> name,
@@ -345,6 +380,13 @@ ssize_t send_packet (interface, packet, raw, len, from, to, hto)
 				to -> sin_addr.s_addr, to -> sin_port,
 				(unsigned char *)raw, len);
 	memcpy (buf + ibufp, raw, len);
+
+	/* If we're in the middle of a batch, the frame goes out when the
+	   batch is flushed. */
+	if (queue_batched_send (interface -> wfdesc, buf + fudge,
+				ibufp + len - fudge, NULL, 0))
+		return ibufp + len - fudge;
+
 	result = write(interface->wfdesc, buf + fudge, ibufp + len - fudge);
 	if (result < 0)
 		log_error ("send_packet: %m");
@@ -353,70 +395,31 @@ ssize_t send_packet (interface, packet, raw, len, from, to, hto)
 #endif /* USE_LPF_SEND */
 
 #ifdef USE_LPF_RECEIVE
-ssize_t receive_packet (interface, buf, len, from, hfrom)
-	struct interface_info *interface;
-	unsigned char *buf;
-	size_t len;
-	struct sockaddr_in *from;
-	struct hardware *hfrom;
-{
-	int length = 0;
-	int offset = 0;
-	int csum_ready = 1;
-	unsigned char ibuf [1536];
-	unsigned bufix = 0;
-	unsigned paylen;
-	struct iovec iov = {
-		.iov_base = ibuf,
-		.iov_len = sizeof ibuf,
-	};
 #ifdef PACKET_AUXDATA
-	/*
-	 * We only need cmsgbuf if we are getting the aux data and we
-	 * only get the auxdata if it is actually defined
-	 */
-	unsigned char cmsgbuf[CMSG_LEN(sizeof(struct tpacket_auxdata))];
-	struct msghdr msg = {
-		.msg_iov = &iov,
-		.msg_iovlen = 1,
-		.msg_control = cmsgbuf,
-		.msg_controllen = sizeof(cmsgbuf),
-	};
-#else
-	struct msghdr msg = {
-		.msg_iov = &iov,
-		.msg_iovlen = 1,
-		.msg_control = NULL,
-		.msg_controllen = 0,
-	};
-#endif /* PACKET_AUXDATA */
-
-	length = recvmsg (interface->rfdesc, &msg, 0);
-	if (length <= 0)
-		return length;
-
-#ifdef PACKET_AUXDATA
-	{
-	/*  Use auxiliary packet data to:
-	 *
-	 *  a. Weed out extraneous VLAN-tagged packets - If the NIC driver is
-	 *  handling VLAN encapsulation (i.e. stripping/adding VLAN tags),
-	 *  then an inbound VLAN packet will be seen twice: Once by
-	 *  the parent interface (e.g. eth0) with a VLAN tag != 0; and once
-	 *  by the vlan interface (e.g. eth0.n) with a VLAN tag of 0 (i.e none).
-	 *  We want to discard the packet sent to the parent and thus respond
-	 *  only over the vlan interface.  (Drivers for Intel PRO/1000 series
-	 *  NICs perform VLAN encapsulation, while drivers for PCnet series
-	 *  do not, for example. The linux kernel makes stripped vlan info
-	 *  visible to user space via CMSG/auxdata, this appears to not be
-	 *  true for BSD OSs.).  NOTE: this is only supported on linux flavors
-	 *  which define the tpacket_auxdata.tp_vlan_tci.
-	 *
-	 *  b. Determine if checksum is valid for use. It may not be if
-	 *  checksum offloading is enabled on the interface.  */
+/*  Use auxiliary packet data to:
+ *
+ *  a. Weed out extraneous VLAN-tagged packets - If the NIC driver is
+ *  handling VLAN encapsulation (i.e. stripping/adding VLAN tags),
+ *  then an inbound VLAN packet will be seen twice: Once by
+ *  the parent interface (e.g. eth0) with a VLAN tag != 0; and once
+ *  by the vlan interface (e.g. eth0.n) with a VLAN tag of 0 (i.e none).
+ *  We want to discard the packet sent to the parent and thus respond
+ *  only over the vlan interface.  (Drivers for Intel PRO/1000 series
+ *  NICs perform VLAN encapsulation, while drivers for PCnet series
+ *  do not, for example. The linux kernel makes stripped vlan info
+ *  visible to user space via CMSG/auxdata, this appears to not be
+ *  true for BSD OSs.).  NOTE: this is only supported on linux flavors
+ *  which define the tpacket_auxdata.tp_vlan_tci.
+ *
+ *  b. Determine if checksum is valid for use. It may not be if
+ *  checksum offloading is enabled on the interface.
+ *
+ *  Returns zero if the packet should be discarded.  */
+static int lpf_check_auxdata (struct msghdr *msg, int *csum_ready)
+{
 	struct cmsghdr *cmsg;
 
-	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
 		if (cmsg->cmsg_level == SOL_PACKET &&
 		    cmsg->cmsg_type == PACKET_AUXDATA) {
 			struct tpacket_auxdata *aux = (void *)CMSG_DATA(cmsg);
@@ -427,15 +430,30 @@ ssize_t receive_packet (interface, buf, len, from, hfrom)
 				return 0;
 #endif
 
-			csum_ready = ((aux->tp_status & TP_STATUS_CSUMNOTREADY)
-				      ? 0 : 1);
+			*csum_ready = ((aux->tp_status & TP_STATUS_CSUMNOTREADY)
+				       ? 0 : 1);
 		}
 	}
-
-	}
+	return 1;
+}
 #endif /* PACKET_AUXDATA */
 
-	bufix = 0;
+/* Strip the link, IP and UDP headers from a frame and copy the
+   payload out to buf. */
+static ssize_t lpf_decode_frame (interface, ibuf, length, csum_ready,
+				 buf, from, hfrom)
+	struct interface_info *interface;
+	unsigned char *ibuf;
+	int length;
+	int csum_ready;
+	unsigned char *buf;
+	struct sockaddr_in *from;
+	struct hardware *hfrom;
+{
+	int offset = 0;
+	unsigned bufix = 0;
+	unsigned paylen;
+
 	/* Decode the physical header... */
 	offset = decode_hw_header (interface, ibuf, bufix, hfrom);
 
@@ -468,6 +486,128 @@ ssize_t receive_packet (interface, buf, len, from, hfrom)
 	return paylen;
 }
 
+#if defined (LPF_RECV_BATCH) && defined (MSG_WAITFORONE)
+/* Hand out the next frame from the interface's receive batch, refilling
+   the batch with a single recvmmsg() call once it has been drained. */
+static ssize_t lpf_receive_batched (interface, buf, from, hfrom)
+	struct interface_info *interface;
+	unsigned char *buf;
+	struct sockaddr_in *from;
+	struct hardware *hfrom;
+{
+	struct lpf_recv_batch *batch;
+	struct msghdr *msg;
+	int csum_ready = 1;
+	int i, count;
+
+	batch = (struct lpf_recv_batch *)interface -> rbuf;
+
+	if (interface -> rbuf_offset == interface -> rbuf_len) {
+		for (i = 0; i < LPF_RECV_BATCH; i++) {
+			batch -> iov [i].iov_base = batch -> frames [i];
+			batch -> iov [i].iov_len = sizeof batch -> frames [i];
+			msg = &batch -> msgs [i].msg_hdr;
+			memset (msg, 0, sizeof *msg);
+			msg -> msg_iov = &batch -> iov [i];
+			msg -> msg_iovlen = 1;
+#ifdef PACKET_AUXDATA
+			msg -> msg_control = batch -> cmsgbuf [i];
+			msg -> msg_controllen = sizeof batch -> cmsgbuf [i];
+#endif
+		}
+
+		/* We're only called when the socket is readable, so don't
+		   wait around for the rest of the batch to fill up. */
+		count = recvmmsg (interface -> rfdesc, batch -> msgs,
+				  LPF_RECV_BATCH, MSG_DONTWAIT, NULL);
+		if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (count <= 0)
+			return count;
+		interface -> rbuf_offset = 0;
+		interface -> rbuf_len = count;
+	}
+
+	i = interface -> rbuf_offset++;
+	if (batch -> msgs [i].msg_len == 0)
+		return 0;
+
+#ifdef PACKET_AUXDATA
+	if (!lpf_check_auxdata (&batch -> msgs [i].msg_hdr, &csum_ready))
+		return 0;
+#endif
+
+	return lpf_decode_frame (interface, batch -> frames [i],
+				 (int)batch -> msgs [i].msg_len, csum_ready,
+				 buf, from, hfrom);
+}
+#endif
+
+ssize_t receive_packet (interface, buf, len, from, hfrom)
+	struct interface_info *interface;
+	unsigned char *buf;
+	size_t len;
+	struct sockaddr_in *from;
+	struct hardware *hfrom;
+{
+	int length = 0;
+	int csum_ready = 1;
+	unsigned char ibuf [1536];
+	struct iovec iov = {
+		.iov_base = ibuf,
+		.iov_len = sizeof ibuf,
+	};
+#ifdef PACKET_AUXDATA
+	/*
+	 * We only need cmsgbuf if we are getting the aux data and we
+	 * only get the auxdata if it is actually defined
+	 */
+	unsigned char cmsgbuf[CMSG_LEN(sizeof(struct tpacket_auxdata))];
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cmsgbuf,
+		.msg_controllen = sizeof(cmsgbuf),
+	};
+#else
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = NULL,
+		.msg_controllen = 0,
+	};
+#endif /* PACKET_AUXDATA */
+
+#if defined (LPF_RECV_BATCH) && defined (MSG_WAITFORONE)
+	if (lpf_recv_batching && interface -> rbuf) {
+		ssize_t result;
+
+		result = lpf_receive_batched (interface, buf, from, hfrom);
+		if (result >= 0 || errno != ENOSYS)
+			return result;
+
+		/* Old kernel: read one frame at a time from now on. */
+		log_info ("recvmmsg() not supported, %s",
+			  "not batching packet reads.");
+		lpf_recv_batching = 0;
+		interface -> rbuf_offset = 0;
+		interface -> rbuf_len = 0;
+	}
+#endif
+
+	length = recvmsg (interface->rfdesc, &msg, 0);
+	if (length <= 0)
+		return length;
+
+#ifdef PACKET_AUXDATA
+	if (!lpf_check_auxdata (&msg, &csum_ready))
+		return 0;
+#endif /* PACKET_AUXDATA */
+
+	return lpf_decode_frame (interface, ibuf, length, csum_ready,
+				 buf, from, hfrom);
+}
+
 int can_unicast_without_arp (ip)
 	struct interface_info *ip;
 {
@@ -203,7 +203,19 @@ int parse_option_buffer (options, buffer, length, universe)
 		}
 
 		op = lookup_option(universe, options, code);
-		if (op == NULL) {
+		if (op == NULL && universe->lookup_func ==
+				  lookup_indexed_option) {
+			/* Indexed spaces only note where the option is, and
+			   make the option cache if it's looked up. */
+			if (save_raw_indexed_option(universe, options, bp,
+						    bp->data + offset, len,
+						    code) == 0) {
+				log_error("parse_option_buffer: "
+					  "save_raw_indexed_option failed");
+				buffer_dereference(&bp, MDL);
+				return (0);
+			}
+		} else if (op == NULL) {
 			/* If we don't have an option create one */
 			if (save_option_buffer(universe, options, bp,
 					       bp->data + offset, len,
@@ -510,6 +522,30 @@ int fqdn_universe_decode (struct option_state *options,
 	return 1;
 }
 
+#define PRIORITY_COUNT 300
+
+/* Codes of configured options between min and max, for cons_options(). */
+struct priority_walk {
+	unsigned *list;
+	int *len;
+	unsigned min, max;
+};
+
+static void
+add_priority_code(struct option_cache *oc, struct packet *packet,
+		  struct lease *lease, struct client_state *client_state,
+		  struct option_state *in_options,
+		  struct option_state *cfg_options,
+		  struct binding_scope **scope, struct universe *u, void *stuff)
+{
+	struct priority_walk *walk = stuff;
+	unsigned code = oc->option->code;
+
+	if (code >= walk->min && code < walk->max &&
+	    *walk->len < PRIORITY_COUNT && code != DHO_DHCP_AGENT_OPTIONS)
+		walk->list[(*walk->len)++] = code;
+}
+
 /*
  * Load all options into a buffer, and then split them out into the three
  * separate fields in the dhcp packet (options, file, and sname) where
@@ -526,7 +562,6 @@ cons_options(struct packet *inpacket, struct dhcp_packet *outpacket,
 	     int overload_avail, int terminate, int bootpp,
 	     struct data_string *prl, const char *vuname)
 {
-#define PRIORITY_COUNT 300
 	unsigned priority_list[PRIORITY_COUNT];
 	int priority_len;
 	unsigned char buffer[4096], agentopts[1024];
@@ -537,7 +572,7 @@ cons_options(struct packet *inpacket, struct dhcp_packet *outpacket,
 	int i;
 	struct option_cache *op;
 	struct data_string ds;
-	pair pp, *hash;
+	struct priority_walk walk;
 	int overload_used = 0;
 	int of1 = 0, of2 = 0;
 
@@ -727,25 +762,19 @@ cons_options(struct packet *inpacket, struct dhcp_packet *outpacket,
 		 * standard DHCP option space.  Actually, if a site
 		 * option space hasn't been specified, we wind up
 		 * treating the dhcp option space as the site option
-		 * space, and the first for loop is skipped, because
+		 * space, and the first walk is skipped, because
 		 * it's slightly more general to do it this way,
 		 * taking the 1Q99 DHCP futures work into account.
 		 */
+		walk.list = priority_list;
+		walk.len = &priority_len;
 		if (cfg_options->site_code_min) {
-		    for (i = 0; i < OPTION_HASH_SIZE; i++) {
-			hash = cfg_options->universes[dhcp_universe.index];
-			if (hash) {
-			    for (pp = hash[i]; pp; pp = pp->cdr) {
-				op = (struct option_cache *)(pp->car);
-				if (op->option->code <
-				     cfg_options->site_code_min &&
-				    priority_len < PRIORITY_COUNT &&
-				    op->option->code != DHO_DHCP_AGENT_OPTIONS)
-					priority_list[priority_len++] =
-						op->option->code;
-			    }
-			}
-		    }
+			walk.min = 0;
+			walk.max = cfg_options->site_code_min;
+			option_space_foreach(inpacket, lease, client_state,
+					     in_options, cfg_options, scope,
+					     &dhcp_universe, &walk,
+					     add_priority_code);
 		}
 
 		/*
@@ -753,19 +782,12 @@ cons_options(struct packet *inpacket, struct dhcp_packet *outpacket,
 		 * is no site option space, we'll be cycling through the
 		 * dhcp option space.
 		 */
-		for (i = 0; i < OPTION_HASH_SIZE; i++) {
-		    hash = cfg_options->universes[cfg_options->site_universe];
-		    if (hash != NULL)
-			for (pp = hash[i]; pp; pp = pp->cdr) {
-				op = (struct option_cache *)(pp->car);
-				if (op->option->code >=
-				     cfg_options->site_code_min &&
-				    priority_len < PRIORITY_COUNT &&
-				    op->option->code != DHO_DHCP_AGENT_OPTIONS)
-					priority_list[priority_len++] =
-						op->option->code;
-			}
-		}
+		walk.min = cfg_options->site_code_min;
+		walk.max = UINT_MAX;
+		option_space_foreach(inpacket, lease, client_state,
+				     in_options, cfg_options, scope,
+				     universes[cfg_options->site_universe],
+				     &walk, add_priority_code);
 
 		/*
 		 * Put any spaces that are encapsulated on the list,
@@ -1205,6 +1227,70 @@ store_options6(char *buf, int buflen,
 	return bufpos;
 }
 
+/*
+ * Most of the options a server sends are constants from its
+ * configuration - routers, domain-name-servers, domain-name and so on -
+ * and every reply used to evaluate and encode each of them afresh.  The
+ * first time store_options() stores a constant option it keeps the
+ * encoded option on the option cache, and from then on copies it
+ * straight into the packet whenever it fits without being split.  The
+ * configuration's option caches are made anew when it's read, and an
+ * OMAPI change makes new ones too, so a kept encoding can't go stale.
+ * Options made for one reply, such as the lease time and the server
+ * identifier, hold data rather than an expression and are encoded each
+ * time.
+ */
+
+struct option_wire {
+	int terminate;		/* Whether text was NUL terminated. */
+	unsigned len;
+	unsigned char data [1];
+};
+
+/* Is oc's value a constant that can be kept encoded? */
+
+static int option_cache_constant (struct option_cache *oc)
+{
+#if defined (DEBUG_EXPRESSIONS)
+	/* Log every evaluation. */
+	return 0;
+#else
+	if (!(oc -> flags & OPTION_CONST_CHECKED)) {
+		oc -> flags |= OPTION_CONST_CHECKED;
+
+		/* An encapsulation depends on the rest of the options. */
+		if (!oc -> data.data && oc -> option &&
+		    oc -> option -> format [0] != 'e' &&
+		    oc -> option -> format [0] != 'E' &&
+		    expression_is_constant (oc -> expression))
+			oc -> flags |= OPTION_CONST;
+	}
+	return (oc -> flags & OPTION_CONST) != 0;
+#endif
+}
+
+/* Keep the encoding of an option whose value is od, length bytes long
+   once the NUL (if tto is set) is added. */
+
+static void option_wire_save (struct option_cache *oc, unsigned code,
+			      struct data_string *od, unsigned length,
+			      int tto, int terminate)
+{
+	struct option_wire *wire;
+
+	wire = dmalloc (sizeof *wire + length + 1, MDL);
+	if (!wire)
+		return;
+	wire -> terminate = terminate;
+	wire -> len = length + 2;
+	wire -> data [0] = code;
+	wire -> data [1] = length;
+	memcpy (&wire -> data [2], od -> data, length - tto);
+	if (tto)
+		wire -> data [length + 1] = 0;
+	oc -> wire = wire;
+}
+
 /*
  * Store all the requested options into the requested buffer.
  * XXX: ought to be static
@@ -1333,6 +1419,19 @@ store_options(int *ocount,
 
 	    oc = lookup_option (u, cfg_options, code);
 
+	    /* A constant option that's been stored before goes in as it
+	       was encoded then, if it fits in the options buffer. */
+	    if (oc && oc->wire && oc->wire->terminate == terminate) {
+		length = oc->wire->len - 2;
+		if ((!six && !tix && (i == priority_len - 1) &&
+		     (bufix + 2 + length < bufend)) ||
+		    (bufix + 5 + length < bufend)) {
+			memcpy(buffer + bufix, oc->wire->data, oc->wire->len);
+			bufix += oc->wire->len;
+			continue;
+		}
+	    }
+
 	    if (oc && oc->option)
 		option_reference(&option, oc->option, MDL);
 	    else
@@ -1471,6 +1570,10 @@ store_options(int *ocount,
 		    tto = 0;
 	    }
 
+	    if (oc && !oc->wire && !have_encapsulation && length <= 255 &&
+		option_cache_constant(oc))
+		    option_wire_save(oc, code, &od, length, tto, terminate);
+
 	    /* Try to store the option. */
 
 	    /* If the option's length is more than 255, we must store it
@@ -2710,6 +2813,7 @@ void
 save_option(struct universe *universe, struct option_state *options,
 	    struct option_cache *oc)
 {
+	options->generation++;
 	if (universe->save_func)
 		(*universe->save_func)(universe, options, oc, ISC_FALSE);
 	else
@@ -2721,6 +2825,7 @@ void
 also_save_option(struct universe *universe, struct option_state *options,
 		 struct option_cache *oc)
 {
+	options->generation++;
 	if (universe->save_func)
 		(*universe->save_func)(universe, options, oc, ISC_TRUE);
 	else
@@ -2800,6 +2905,7 @@ void delete_option (universe, options, code)
 	struct option_state *options;
 	int code;
 {
+	options -> generation++;
 	if (universe -> delete_func)
 		(*universe -> delete_func) (universe, options, code);
 	else
@@ -2840,8 +2946,6 @@ void delete_hashed_option (universe, options, code)
 	}
 }
 
-extern struct option_cache *free_option_caches; /* XXX */
-
 int option_cache_dereference (ptr, file, line)
 	struct option_cache **ptr;
 	const char *file;
@@ -2870,10 +2974,11 @@ int option_cache_dereference (ptr, file, line)
 		if ((*ptr) -> next)
 			option_cache_dereference (&((*ptr) -> next),
 						  file, line);
-		/* Put it back on the free list... */
-		(*ptr) -> expression = (struct expression *)free_option_caches;
-		free_option_caches = *ptr;
-		dmalloc_reuse (free_option_caches, (char *)0, 0, 0);
+		if ((*ptr) -> wire)
+			dfree ((*ptr) -> wire, file, line);
+		slab_free (&option_cache_pool, *ptr, file, line);
+		*ptr = (struct option_cache *)0;
+		return 1;
 	}
 	if ((*ptr) -> refcnt < 0) {
 		log_error ("%s(%d): negative refcnt!", file, line);
@@ -2924,6 +3029,370 @@ int hashed_option_state_dereference (universe, state, file, line)
 	return 1;
 }
 
+/*
+ * Option spaces whose codes fit in a byte - the dhcp space, and any
+ * space declared with "code width 1" - keep their options in an
+ * option_index rather than a hash table.  A bitmap records which codes
+ * are present and the option caches are kept in an array in code order,
+ * so an option is found by counting the bits set below its code instead
+ * of walking a hash chain, and walking the space visits the options in
+ * code order.  The array only holds the options that are present, which
+ * keeps the many option states hung off the configuration small.
+ *
+ * Options read from a packet aren't made into option caches straight
+ * away.  parse_option_buffer() checks that they're well formed and
+ * notes where each one is in its copy of the packet in a second bitmap
+ * and array; the option cache is made the first time the option is
+ * looked up, and most of the options a client sends never are.  Walking
+ * the space makes option caches of everything still noted.
+ */
+
+#define OPTION_INDEX_CODES	256
+#define OPTION_INDEX_WORDS	(OPTION_INDEX_CODES / 32)
+
+/* Initial number of entries an index has room for. */
+#if !defined (OPTION_INDEX_SIZE)
+# define OPTION_INDEX_SIZE	8
+#endif
+
+/* Which codes are present, and how many are present below each word
+   of the bitmap, so that a code's place in an array kept in code order
+   can be worked out from the code. */
+struct code_map {
+	u_int32_t bits [OPTION_INDEX_WORDS];
+	unsigned char below [OPTION_INDEX_WORDS];
+};
+
+/* An option from a packet that hasn't been made into an option cache. */
+struct option_slice {
+	struct buffer *bp;
+	unsigned char *data;
+	unsigned len;
+	unsigned code;
+};
+
+struct option_index {
+	struct code_map map;		/* Option caches, ... */
+	unsigned count, size;
+	struct option_cache **ocs;
+	struct code_map raw_map;	/* ... and options still in a packet. */
+	unsigned raw_count, raw_size;
+	struct option_slice *raw;
+};
+
+#define code_map_has(m, code) \
+	((m) -> bits [(code) >> 5] & (1U << ((code) & 31)))
+
+static unsigned code_map_bits (u_int32_t x)
+{
+	x = x - ((x >> 1) & 0x55555555);
+	x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+	x = (x + (x >> 4)) & 0x0f0f0f0f;
+	return (x * 0x01010101) >> 24;
+}
+
+/* Where the entry for this code is, or would go, in the array. */
+
+static unsigned code_map_rank (struct code_map *m, unsigned code)
+{
+	return (m -> below [code >> 5] +
+		code_map_bits (m -> bits [code >> 5] &
+			       ((1U << (code & 31)) - 1)));
+}
+
+static void code_map_add (struct code_map *m, unsigned code)
+{
+	unsigned i;
+
+	m -> bits [code >> 5] |= 1U << (code & 31);
+	for (i = (code >> 5) + 1; i < OPTION_INDEX_WORDS; i++)
+		m -> below [i]++;
+}
+
+static void code_map_remove (struct code_map *m, unsigned code)
+{
+	unsigned i;
+
+	m -> bits [code >> 5] &= ~(1U << (code & 31));
+	for (i = (code >> 5) + 1; i < OPTION_INDEX_WORDS; i++)
+		m -> below [i]--;
+}
+
+/* Return an array with room for one more than count entries of elsize
+   bytes, which is array itself unless it's full. */
+
+static void *option_index_grow (void *array, unsigned *size,
+				 unsigned count, size_t elsize)
+{
+	void *bigger;
+	unsigned n;
+
+	if (count < *size)
+		return array;
+
+	n = *size ? *size * 2 : OPTION_INDEX_SIZE;
+	bigger = dmalloc (n * elsize, MDL);
+	if (!bigger)
+		return NULL;
+	if (array) {
+		memcpy (bigger, array, count * elsize);
+		dfree (array, MDL);
+	}
+	*size = n;
+	return bigger;
+}
+
+/* Find the index for universe in options, making one if need be. */
+
+static struct option_index *option_index_get (struct universe *universe,
+					      struct option_state *options)
+{
+	struct option_index *ix = options -> universes [universe -> index];
+
+	if (!ix) {
+		ix = dmalloc (sizeof *ix, MDL);
+		if (!ix)
+			return NULL;
+		options -> universes [universe -> index] = (void *)ix;
+	}
+	return ix;
+}
+
+/* Save oc in ix, which has no option from a packet with the same code
+   still waiting to be made into an option cache. */
+
+static void option_index_store (struct universe *universe,
+				struct option_index *ix,
+				struct option_cache *oc, isc_boolean_t appendp)
+{
+	struct option_cache **ocloc, **ocs;
+	unsigned code = oc -> option -> code;
+	unsigned rank;
+
+	rank = code_map_rank (&ix -> map, code);
+	if (code_map_has (&ix -> map, code)) {
+		ocloc = &ix -> ocs [rank];
+
+		/* As with hashed spaces, either append it onto the tail of
+		   the ->next list or replace what's there. */
+		if (appendp) {
+			do {
+				ocloc = &(*ocloc)->next;
+			} while (*ocloc != NULL);
+		} else {
+			option_cache_dereference(ocloc, MDL);
+		}
+
+		option_cache_reference(ocloc, oc, MDL);
+		return;
+	}
+
+	/* Make room for one more, then open a slot at rank. */
+	ocs = option_index_grow (ix -> ocs, &ix -> size, ix -> count,
+				 sizeof *ocs);
+	if (!ocs) {
+		log_error ("no memory to store %s.%s",
+			   universe -> name, oc -> option -> name);
+		return;
+	}
+	ix -> ocs = ocs;
+	memmove (&ix -> ocs [rank + 1], &ix -> ocs [rank],
+		 (ix -> count - rank) * sizeof *ix -> ocs);
+	ix -> ocs [rank] = (struct option_cache *)0;
+	option_cache_reference (&ix -> ocs [rank], oc, MDL);
+	ix -> count++;
+	code_map_add (&ix -> map, code);
+}
+
+/* Forget the option from a packet with this code. */
+
+static void option_index_drop_raw (struct option_index *ix, unsigned code)
+{
+	unsigned rank = code_map_rank (&ix -> raw_map, code);
+
+	buffer_dereference (&ix -> raw [rank].bp, MDL);
+	ix -> raw_count--;
+	memmove (&ix -> raw [rank], &ix -> raw [rank + 1],
+		 (ix -> raw_count - rank) * sizeof *ix -> raw);
+	memset (&ix -> raw [ix -> raw_count], 0, sizeof *ix -> raw);
+	code_map_remove (&ix -> raw_map, code);
+}
+
+/* Make the option from a packet with this code into an option cache. */
+
+static struct option_cache *option_index_cook (struct universe *universe,
+					       struct option_index *ix,
+					       unsigned code)
+{
+	struct option_slice *slice;
+	struct option_cache *oc = NULL;
+
+	slice = &ix -> raw [code_map_rank (&ix -> raw_map, code)];
+	if (!prepare_option_buffer (universe, slice -> bp, slice -> data,
+				    slice -> len, code, 1, &oc)) {
+		log_error ("can't store %s option %u from packet",
+			   universe -> name, code);
+		if (oc)
+			option_cache_dereference (&oc, MDL);
+		option_index_drop_raw (ix, code);
+		return (struct option_cache *)0;
+	}
+	option_index_drop_raw (ix, code);
+	option_index_store (universe, ix, oc, ISC_FALSE);
+	option_cache_dereference (&oc, MDL);
+
+	if (!code_map_has (&ix -> map, code))
+		return (struct option_cache *)0;
+	return ix -> ocs [code_map_rank (&ix -> map, code)];
+}
+
+struct option_cache *lookup_indexed_option (universe, options, code)
+	struct universe *universe;
+	struct option_state *options;
+	unsigned code;
+{
+	struct option_index *ix;
+
+	if (universe -> index >= options -> universe_count ||
+	    !(ix = options -> universes [universe -> index]) ||
+	    code >= OPTION_INDEX_CODES)
+		return (struct option_cache *)0;
+
+	if (code_map_has (&ix -> map, code))
+		return ix -> ocs [code_map_rank (&ix -> map, code)];
+	if (code_map_has (&ix -> raw_map, code))
+		return option_index_cook (universe, ix, code);
+	return (struct option_cache *)0;
+}
+
+void
+save_indexed_option(struct universe *universe, struct option_state *options,
+		    struct option_cache *oc, isc_boolean_t appendp)
+{
+	struct option_index *ix;
+	unsigned code = oc -> option -> code;
+
+	if (oc -> refcnt == 0)
+		abort ();
+
+	if (code >= OPTION_INDEX_CODES) {
+		log_error ("can't store %s.%s: code %u is out of range",
+			   universe -> name, oc -> option -> name, code);
+		return;
+	}
+
+	ix = option_index_get (universe, options);
+	if (!ix) {
+		log_error ("no memory to store %s.%s",
+			   universe -> name, oc -> option -> name);
+		return;
+	}
+
+	/* An option from a packet that's being replaced needn't be made
+	   into an option cache first. */
+	if (code_map_has (&ix -> raw_map, code)) {
+		if (appendp)
+			option_index_cook (universe, ix, code);
+		else
+			option_index_drop_raw (ix, code);
+	}
+	option_index_store (universe, ix, oc, appendp);
+}
+
+/* Note an option read from a packet into bp, to be made into an option
+   cache when it's first looked up.  The caller has made sure there's
+   no option with this code in the space already. */
+
+int save_raw_indexed_option (struct universe *universe,
+			     struct option_state *options,
+			     struct buffer *bp, unsigned char *data,
+			     unsigned len, unsigned code)
+{
+	struct option_index *ix;
+	struct option_slice *raw;
+	unsigned rank;
+
+	if (code >= OPTION_INDEX_CODES)
+		return 0;
+
+	ix = option_index_get (universe, options);
+	if (!ix)
+		return 0;
+	raw = option_index_grow (ix -> raw, &ix -> raw_size, ix -> raw_count,
+				 sizeof *raw);
+	if (!raw)
+		return 0;
+	ix -> raw = raw;
+
+	options -> generation++;
+	rank = code_map_rank (&ix -> raw_map, code);
+	memmove (&ix -> raw [rank + 1], &ix -> raw [rank],
+		 (ix -> raw_count - rank) * sizeof *ix -> raw);
+	raw = &ix -> raw [rank];
+	raw -> bp = (struct buffer *)0;
+	buffer_reference (&raw -> bp, bp, MDL);
+	raw -> data = data;
+	raw -> len = len;
+	raw -> code = code;
+	ix -> raw_count++;
+	code_map_add (&ix -> raw_map, code);
+	return 1;
+}
+
+void delete_indexed_option (universe, options, code)
+	struct universe *universe;
+	struct option_state *options;
+	int code;
+{
+	struct option_index *ix = options -> universes [universe -> index];
+	unsigned rank;
+
+	/* There may not be any options in this space. */
+	if (!ix || code < 0 || code >= OPTION_INDEX_CODES)
+		return;
+
+	if (code_map_has (&ix -> raw_map, code)) {
+		option_index_drop_raw (ix, code);
+		return;
+	}
+	if (!code_map_has (&ix -> map, code))
+		return;
+
+	rank = code_map_rank (&ix -> map, code);
+	option_cache_dereference (&ix -> ocs [rank], MDL);
+	ix -> count--;
+	memmove (&ix -> ocs [rank], &ix -> ocs [rank + 1],
+		 (ix -> count - rank) * sizeof *ix -> ocs);
+	ix -> ocs [ix -> count] = (struct option_cache *)0;
+	code_map_remove (&ix -> map, code);
+}
+
+int indexed_option_state_dereference (universe, state, file, line)
+	struct universe *universe;
+	struct option_state *state;
+	const char *file;
+	int line;
+{
+	struct option_index *ix;
+	unsigned i;
+
+	ix = (struct option_index *)(state -> universes [universe -> index]);
+	if (!ix)
+		return 0;
+
+	for (i = 0; i < ix -> count; i++)
+		option_cache_dereference (&ix -> ocs [i], file, line);
+	if (ix -> ocs)
+		dfree (ix -> ocs, file, line);
+	for (i = 0; i < ix -> raw_count; i++)
+		buffer_dereference (&ix -> raw [i].bp, file, line);
+	if (ix -> raw)
+		dfree (ix -> raw, file, line);
+	dfree (ix, file, line);
+	state -> universes [universe -> index] = (void *)0;
+	return 1;
+}
+
 /* The 'data_string' primitive doesn't have an appension mechanism.
  * This function must then append a new option onto an existing buffer
  * by first duplicating the original buffer and appending the desired
@@ -3181,6 +3650,50 @@ int hashed_option_space_encapsulate (result, packet, lease, client_state,
 	return status;
 }
 
+int indexed_option_space_encapsulate (result, packet, lease, client_state,
+				      in_options, cfg_options, scope, universe)
+	struct data_string *result;
+	struct packet *packet;
+	struct lease *lease;
+	struct client_state *client_state;
+	struct option_state *in_options;
+	struct option_state *cfg_options;
+	struct binding_scope **scope;
+	struct universe *universe;
+{
+	struct option_index *ix;
+	int status;
+	unsigned i;
+
+	if (universe -> index >= cfg_options -> universe_count)
+		return 0;
+
+	ix = cfg_options -> universes [universe -> index];
+	if (!ix)
+		return 0;
+
+	/* Make option caches of any options still in a packet. */
+	while (ix -> raw_count)
+		option_index_cook (universe, ix, ix -> raw [0].code);
+
+	/* Append each configured option, in code order, onto the buffer
+	 * in encapsulated format appropriate to the universe.
+	 */
+	status = 0;
+	for (i = 0; i < ix -> count; i++) {
+		if (store_option(result, universe, packet, lease,
+				 client_state, in_options, cfg_options,
+				 scope, ix -> ocs [i]))
+			status = 1;
+	}
+
+	if (search_subencapsulation(result, packet, lease, client_state,
+				    in_options, cfg_options, scope, universe))
+		status = 1;
+
+	return status;
+}
+
 int nwip_option_space_encapsulate (result, packet, lease, client_state,
 				   in_options, cfg_options, scope, universe)
 	struct data_string *result;
@@ -3759,6 +4272,37 @@ void hashed_option_space_foreach (struct packet *packet, struct lease *lease,
 	}
 }
 
+void indexed_option_space_foreach (struct packet *packet, struct lease *lease,
+				   struct client_state *client_state,
+				   struct option_state *in_options,
+				   struct option_state *cfg_options,
+				   struct binding_scope **scope,
+				   struct universe *u, void *stuff,
+				   void (*func) (struct option_cache *,
+						 struct packet *,
+						 struct lease *,
+						 struct client_state *,
+						 struct option_state *,
+						 struct option_state *,
+						 struct binding_scope **,
+						 struct universe *, void *))
+{
+	struct option_cache *oc;
+	unsigned code;
+
+	if (cfg_options -> universe_count <= u -> index)
+		return;
+
+	/* Look each code up afresh, as func may save or delete options
+	   in this space. */
+	for (code = 0; code < OPTION_INDEX_CODES; code++) {
+		oc = lookup_indexed_option (u, cfg_options, code);
+		if (oc)
+			(*func) (oc, packet, lease, client_state,
+				 in_options, cfg_options, scope, u, stuff);
+	}
+}
+
 void
 save_linked_option(struct universe *universe, struct option_state *options,
 		   struct option_cache *oc, isc_boolean_t appendp)
@@ -3959,12 +4503,18 @@ void do_packet (interface, packet, len, from_port, from, hfrom)
 		log_error("do_packet: no memory for incoming packet!");
 		return;
 	}
+	/* Buffers and option states for this packet come from its arena. */
+	decoded_packet->arena = packet_arena_new();
+	packet_arena = decoded_packet->arena;
+
 	decoded_packet->raw = packet;
 	decoded_packet->packet_length = len;
 	decoded_packet->client_port = from_port;
 	decoded_packet->client_addr = from;
 	interface_reference(&decoded_packet->interface, interface, MDL);
 	decoded_packet->haddr = hfrom;
+	decoded_packet->unicast = interface->received_unicast ? ISC_TRUE
+							      : ISC_FALSE;
 
 	if (packet->hlen > sizeof packet->chaddr) {
 		packet_dereference(&decoded_packet, MDL);
@@ -4012,6 +4562,7 @@ void do_packet (interface, packet, len, from_port, from, hfrom)
 
 	/* If the caller kept the packet, they'll have upped the refcnt. */
 	packet_dereference(&decoded_packet, MDL);
+	packet_arena = NULL;
 
 #if defined (DEBUG_MEMORY_LEAKAGE)
 	log_info("generation %ld: %ld new, %ld outstanding, %ld long-term",
@@ -4074,6 +4625,8 @@ do_packet6(struct interface_info *interface, const char *packet,
 		log_error("do_packet6: no memory for incoming packet.");
 		return;
 	}
+	decoded_packet->arena = packet_arena_new();
+	packet_arena = decoded_packet->arena;
 
 	if (!option_state_allocate(&decoded_packet->options, MDL)) {
 		log_error("do_packet6: no memory for options.");
@@ -4163,6 +4716,7 @@ do_packet6(struct interface_info *interface, const char *packet,
 	dhcpv6(decoded_packet);
 
 	packet_dereference(&decoded_packet, MDL);
+	packet_arena = NULL;
 
 #if defined (DEBUG_MEMORY_LEAKAGE)
 	log_info("generation %ld: %ld new, %ld outstanding, %ld long-term",
@@ -0,0 +1,268 @@
+/* optmemo.c
+
+   Per-packet memory of evaluated option caches. */
+
+/*
+ * Copyright (c) 2017 by Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *   Internet Systems Consortium, Inc.
+ *   950 Charter Street
+ *   Redwood City, CA 94063
+ *   <info@isc.org>
+ *   https://www.isc.org/
+ *
+ */
+
+/*
+ * While the server answers a packet it looks up and evaluates the same
+ * option caches several times over - ddns-hostname, for example, is
+ * evaluated by ack_lease() and again by the DDNS code.  When an option
+ * cache's expression depends only on the packet and on variables, its
+ * value can't change unless the packet's options or the bindings do, so
+ * evaluate_option_cache() remembers it in a small table hung off the
+ * packet and hands back the same value the next time.
+ *
+ * An entry is keyed by the option cache and the binding scope it was
+ * evaluated in, and is good only as long as the packet's option state
+ * and the bindings haven't changed since.  option_state->generation is
+ * bumped whenever an option is saved into or deleted from a state, and
+ * binding_generation whenever a binding is set, unset or freed, which
+ * is what set, unset, define and let statements do.  Expressions that
+ * look at the lease, the client state, the configuration options or
+ * anything outside the server (DNS lookups, "execute") are never
+ * remembered.
+ */
+
+#include "dhcpd.h"
+
+/* Number of option caches remembered per packet; a power of two. */
+#if !defined (OPTION_MEMO_SIZE)
+# define OPTION_MEMO_SIZE	16
+#endif
+
+struct option_memo_entry {
+	struct option_cache *oc;
+	struct binding_scope *scope;
+	unsigned options_generation;
+	unsigned binding_generation;
+	int status;
+	struct data_string value;
+};
+
+struct option_memo {
+	struct option_memo_entry entries [OPTION_MEMO_SIZE];
+};
+
+unsigned binding_generation;
+
+static unsigned long memo_hits, memo_misses;
+
+/* Does expr depend only on the packet's options and on bindings? */
+
+static int expression_memoizable (struct expression *expr)
+{
+	if (!expr)
+		return 1;
+
+	switch (expr -> op) {
+	      case expr_const_data:
+	      case expr_const_int:
+	      case expr_option:
+	      case expr_exists:
+	      case expr_hardware:
+	      case expr_filename:
+	      case expr_sname:
+	      case expr_null:
+	      case expr_variable_exists:
+	      case expr_variable_reference:
+		return 1;
+
+	      case expr_substring:
+		return (expression_memoizable (expr -> data.substring.expr) &&
+			expression_memoizable (expr -> data.substring.offset) &&
+			expression_memoizable (expr -> data.substring.len));
+
+	      case expr_suffix:
+		return (expression_memoizable (expr -> data.suffix.expr) &&
+			expression_memoizable (expr -> data.suffix.len));
+
+	      case expr_packet:
+		return (expression_memoizable (expr -> data.packet.offset) &&
+			expression_memoizable (expr -> data.packet.len));
+
+	      case expr_equal:
+	      case expr_not_equal:
+	      case expr_regex_match:
+	      case expr_iregex_match:
+	      case expr_and:
+	      case expr_or:
+	      case expr_concat:
+	      case expr_add:
+	      case expr_subtract:
+	      case expr_multiply:
+	      case expr_divide:
+	      case expr_remainder:
+	      case expr_binary_and:
+	      case expr_binary_or:
+	      case expr_binary_xor:
+		return (expression_memoizable (expr -> data.equal [0]) &&
+			expression_memoizable (expr -> data.equal [1]));
+
+	      case expr_not:
+	      case expr_lcase:
+	      case expr_ucase:
+	      case expr_extract_int8:
+	      case expr_extract_int16:
+	      case expr_extract_int32:
+	      case expr_encode_int8:
+	      case expr_encode_int16:
+	      case expr_encode_int32:
+		return expression_memoizable (expr -> data.not);
+
+	      case expr_binary_to_ascii:
+		return (expression_memoizable (expr -> data.b2a.base) &&
+			expression_memoizable (expr -> data.b2a.width) &&
+			expression_memoizable (expr -> data.b2a.separator) &&
+			expression_memoizable (expr -> data.b2a.buffer));
+
+	      case expr_reverse:
+		return (expression_memoizable (expr -> data.reverse.width) &&
+			expression_memoizable (expr -> data.reverse.buffer));
+
+	      case expr_pick_first_value:
+		return (expression_memoizable
+			(expr -> data.pick_first_value.car) &&
+			expression_memoizable
+			(expr -> data.pick_first_value.cdr));
+
+	      case expr_v6relay:
+		return (expression_memoizable (expr -> data.v6relay.relay) &&
+			expression_memoizable (expr -> data.v6relay.roption));
+
+	      default:
+		return 0;
+	}
+}
+
+/* Can the value of oc be remembered?   Worked out once per option
+   cache and kept in its flags. */
+
+static int option_cache_memoizable (struct option_cache *oc)
+{
+	if (!(oc -> flags & OPTION_MEMO_CHECKED)) {
+		oc -> flags |= OPTION_MEMO_CHECKED;
+		if (expression_memoizable (oc -> expression))
+			oc -> flags |= OPTION_MEMO_PURE;
+	}
+	return (oc -> flags & OPTION_MEMO_PURE) != 0;
+}
+
+/* Evaluate the expression in oc, or return the value it had the last
+   time it was evaluated for this packet if nothing it depends on has
+   changed since. */
+
+int evaluate_option_memo (result, packet, lease, client_state,
+			  in_options, cfg_options, scope, oc, file, line)
+	struct data_string *result;
+	struct packet *packet;
+	struct lease *lease;
+	struct client_state *client_state;
+	struct option_state *in_options;
+	struct option_state *cfg_options;
+	struct binding_scope **scope;
+	struct option_cache *oc;
+	const char *file;
+	int line;
+{
+	struct option_memo_entry *entry;
+	struct binding_scope *sp;
+	unsigned long hash;
+	int memoize, status;
+
+#if defined (DEBUG_EXPRESSIONS)
+	/* Log every evaluation. */
+	memoize = 0;
+#else
+	memoize = (packet && in_options && in_options == packet -> options &&
+		   option_cache_memoizable (oc));
+#endif
+	if (memoize && !packet -> memo)
+		packet -> memo = arena_alloc (packet -> arena,
+					      sizeof *packet -> memo, MDL);
+	if (!memoize || !packet -> memo)
+		return evaluate_compiled_data (result, packet, lease,
+					       client_state, in_options,
+					       cfg_options, scope,
+					       oc -> expression, file, line);
+
+	sp = scope ? *scope : NULL;
+	hash = (unsigned long)oc;
+	hash = (hash >> 4) ^ (hash >> 12);
+	entry = &packet -> memo -> entries [hash & (OPTION_MEMO_SIZE - 1)];
+
+	if (entry -> oc == oc && entry -> scope == sp &&
+	    entry -> options_generation == in_options -> generation &&
+	    entry -> binding_generation == binding_generation) {
+		memo_hits++;
+		if (entry -> status)
+			data_string_copy (result, &entry -> value, file, line);
+		return entry -> status;
+	}
+	memo_misses++;
+
+	status = evaluate_compiled_data (result, packet, lease, client_state,
+					 in_options, cfg_options, scope,
+					 oc -> expression, file, line);
+
+	/* The entry holds a reference to the option cache so that it
+	   can't be freed and another one made at the same address. */
+	if (entry -> oc)
+		option_cache_dereference (&entry -> oc, MDL);
+	data_string_forget (&entry -> value, MDL);
+	option_cache_reference (&entry -> oc, oc, MDL);
+	entry -> scope = sp;
+	entry -> options_generation = in_options -> generation;
+	entry -> binding_generation = binding_generation;
+	entry -> status = status;
+	if (status)
+		data_string_copy (&entry -> value, result, MDL);
+	return status;
+}
+
+/* Forget everything remembered for a packet. */
+
+void option_memo_forget (struct option_memo **memo)
+{
+	struct option_memo_entry *entry;
+	int i;
+
+	for (i = 0; i < OPTION_MEMO_SIZE; i++) {
+		entry = &(*memo) -> entries [i];
+		if (entry -> oc)
+			option_cache_dereference (&entry -> oc, MDL);
+		data_string_forget (&entry -> value, MDL);
+	}
+	arena_free (*memo, MDL);
+	*memo = NULL;
+}
+
+void option_memo_stats ()
+{
+	unsigned long total = memo_hits + memo_misses;
+
+	if (total)
+		log_info ("option memo: %lu hits, %lu misses (%lu%% hit rate)",
+			  memo_hits, memo_misses, memo_hits * 100 / total);
+}
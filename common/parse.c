@@ -1437,12 +1437,24 @@ void parse_option_space_decl (cfile)
 	if (!hsize)
 		hsize = DEFAULT_SPACE_HASH_SIZE;
 
-	nu -> lookup_func = lookup_hashed_option;
-	nu -> option_state_dereference = hashed_option_state_dereference;
-	nu -> foreach = hashed_option_space_foreach;
-	nu -> save_func = save_hashed_option;
-	nu -> delete_func = delete_hashed_option;
-	nu -> encapsulate = hashed_option_space_encapsulate;
+	if (tsize == 1) {
+		/* Codes fit in a byte, so index them directly. */
+		nu -> lookup_func = lookup_indexed_option;
+		nu -> option_state_dereference =
+			indexed_option_state_dereference;
+		nu -> foreach = indexed_option_space_foreach;
+		nu -> save_func = save_indexed_option;
+		nu -> delete_func = delete_indexed_option;
+		nu -> encapsulate = indexed_option_space_encapsulate;
+	} else {
+		nu -> lookup_func = lookup_hashed_option;
+		nu -> option_state_dereference =
+			hashed_option_state_dereference;
+		nu -> foreach = hashed_option_space_foreach;
+		nu -> save_func = save_hashed_option;
+		nu -> delete_func = delete_hashed_option;
+		nu -> encapsulate = hashed_option_space_encapsulate;
+	}
 	nu -> decode = parse_option_buffer;
 	nu -> length_size = lsize;
 	nu -> tag_size = tsize;
@@ -1559,6 +1571,12 @@ int parse_option_code_definition (cfile, option)
 		return 0;
 	}
 	option -> code = atoi (val);
+	if (option -> universe -> tag_size == 1 && option -> code > 255) {
+		parse_warn (cfile, "option code %u doesn't fit in a byte.",
+			    option -> code);
+		skip_to_semi (cfile);
+		return 0;
+	}
 
 	token = next_token (&val, (unsigned *)0, cfile);
 	if (token != EQUAL) {
@@ -350,11 +350,11 @@ void hash_dump (table)
 	if (!table)
 		return;
 
-	for (i = 0; i < table -> hash_count; i++) {
-		if (!table -> buckets [i])
+	for (i = 0; i < hash_chain_count (table); i++) {
+		if (!hash_chain (table, i))
 			continue;
 		log_info ("hash bucket %d:", i);
-		for (bp = table -> buckets [i]; bp; bp = bp -> next) {
+		for (bp = hash_chain (table, i); bp; bp = bp -> next) {
 			if (bp -> len)
 				dump_raw (bp -> name, bp -> len);
 			else
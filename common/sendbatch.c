@@ -0,0 +1,224 @@
+/* sendbatch.c
+
+   Batched packet transmission. */
+
+/*
+ * Copyright (c) 2017 by Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *   Internet Systems Consortium, Inc.
+ *   950 Charter Street
+ *   Redwood City, CA 94063
+ *   <info@isc.org>
+ *   https://www.isc.org/
+ *
+ */
+
+/*
+ * Code that sends a burst of packets (e.g., the delayed-ACK flush in
+ * the server, or a relay forwarding a request to several servers) can
+ * bracket the burst with begin_send_batch() and flush_send_batch().
+ * In between, the send_packet() implementations that support it hand
+ * their assembled frames to queue_batched_send() instead of writing
+ * them out, and the whole batch goes out with one sendmmsg() call per
+ * socket when it is flushed or fills up.
+ *
+ * Because the packets are queued, send_packet() reports success for a
+ * queued packet; errors are logged when the batch is flushed, and
+ * flush_send_batch() returns the number of queued packets that could
+ * not be sent so that callers keeping statistics can correct them.
+ */
+
+#include "dhcpd.h"
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+
+#if defined (MSG_WAITFORONE)	/* i.e., we have recvmmsg()/sendmmsg() */
+#if !defined (SEND_BATCH_MAX)
+# define SEND_BATCH_MAX 64
+#endif
+#define SEND_BATCH_FRAME 1536
+
+struct send_batch_entry {
+	int fd;
+	size_t len;
+	socklen_t tolen;
+	struct sockaddr_storage to;
+	unsigned char frame [SEND_BATCH_FRAME];
+};
+
+static struct send_batch_entry *send_batch;
+static struct mmsghdr send_batch_msgs [SEND_BATCH_MAX];
+static struct iovec send_batch_iov [SEND_BATCH_MAX];
+static int send_batch_count;
+static int send_batch_depth;
+static int send_batch_failed;
+
+/* Cleared if the kernel turns out not to support sendmmsg(). */
+static int send_batching = 1;
+
+static void send_batch_one (struct send_batch_entry *e)
+{
+	if (sendto (e -> fd, e -> frame, e -> len, 0,
+		    e -> tolen ? (struct sockaddr *)&e -> to : NULL,
+		    e -> tolen) < 0) {
+		log_error ("send_packet: %m");
+		send_batch_failed++;
+	}
+}
+
+/* Send out everything that's been queued. */
+static void send_batch_drain ()
+{
+	int i, j, n, result;
+
+	for (i = 0; i < send_batch_count; i = j) {
+		/* Collect the run of packets going out the same socket. */
+		for (j = i; j < send_batch_count; j++) {
+			struct send_batch_entry *e = &send_batch [j];
+			struct msghdr *msg = &send_batch_msgs [j].msg_hdr;
+
+			if (e -> fd != send_batch [i].fd)
+				break;
+			send_batch_iov [j].iov_base = e -> frame;
+			send_batch_iov [j].iov_len = e -> len;
+			memset (msg, 0, sizeof *msg);
+			msg -> msg_iov = &send_batch_iov [j];
+			msg -> msg_iovlen = 1;
+			if (e -> tolen) {
+				msg -> msg_name = &e -> to;
+				msg -> msg_namelen = e -> tolen;
+			}
+		}
+
+		/* sendmmsg() stops at the first packet that fails; log
+		   that one and carry on with the rest. */
+		n = i;
+		while (n < j) {
+			if (!send_batching) {
+				send_batch_one (&send_batch [n++]);
+				continue;
+			}
+			result = sendmmsg (send_batch [i].fd,
+					   &send_batch_msgs [n], j - n, 0);
+			if (result > 0) {
+				n += result;
+			} else if (result < 0 && errno == ENOSYS) {
+				log_info ("sendmmsg() not supported, %s",
+					  "not batching packet sends.");
+				send_batching = 0;
+			} else {
+				log_error ("send_packet: %m");
+				send_batch_failed++;
+				n++;
+			}
+		}
+	}
+	send_batch_count = 0;
+}
+
+/* Start collecting packets.   Batches may nest; the packets go out when
+   the outermost batch is flushed. */
+void begin_send_batch ()
+{
+	if (!send_batch) {
+		send_batch = dmalloc (SEND_BATCH_MAX * sizeof *send_batch,
+				      MDL);
+		if (!send_batch) {
+			log_error ("No memory for send batch.");
+			return;
+		}
+	}
+	if (send_batch_depth++ == 0)
+		send_batch_failed = 0;
+}
+
+/* Returns the number of packets queued since the outermost
+   begin_send_batch() that failed to go out, or zero if this wasn't the
+   outermost flush. */
+int flush_send_batch ()
+{
+	if (send_batch_depth == 0)
+		return 0;
+	if (--send_batch_depth != 0)
+		return 0;
+	send_batch_drain ();
+	return send_batch_failed;
+}
+
+/* Queue a packet if we're batching.   Returns nonzero if the packet was
+   queued, zero if the caller should send it now. */
+int queue_batched_send (int fd, const unsigned char *buf, size_t len,
+			const struct sockaddr *to, socklen_t tolen)
+{
+	struct send_batch_entry *e;
+
+	if (send_batch_depth == 0 || !send_batch)
+		return 0;
+
+	/* Anything that won't fit goes out in order after what's queued. */
+	if (len > SEND_BATCH_FRAME || tolen > sizeof e -> to) {
+		send_batch_drain ();
+		return 0;
+	}
+
+	if (send_batch_count == SEND_BATCH_MAX)
+		send_batch_drain ();
+
+	e = &send_batch [send_batch_count++];
+	e -> fd = fd;
+	e -> len = len;
+	memcpy (e -> frame, buf, len);
+	e -> tolen = tolen;
+	if (tolen)
+		memcpy (&e -> to, to, tolen);
+	return 1;
+}
+
+#if defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+void relinquish_send_batch ()
+{
+	if (send_batch) {
+		dfree (send_batch, MDL);
+		send_batch = NULL;
+	}
+	send_batch_count = 0;
+	send_batch_depth = 0;
+	send_batch_failed = 0;
+}
+#endif
+#else /* !MSG_WAITFORONE */
+/* No sendmmsg(), so every packet goes out as it's sent. */
+void begin_send_batch ()
+{
+}
+
+int flush_send_batch ()
+{
+	return 0;
+}
+
+int queue_batched_send (int fd, const unsigned char *buf, size_t len,
+			const struct sockaddr *to, socklen_t tolen)
+{
+	return 0;
+}
+
+#if defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+void relinquish_send_batch ()
+{
+}
+#endif
+#endif /* MSG_WAITFORONE */
@@ -233,6 +233,30 @@ if_register_socket(struct interface_info *info, int family,
 	}
 #endif
 
+#if defined(SO_REUSEPORT)
+	/*
+	 * When the server runs as several workers with -reuseport, each
+	 * of them binds its own DHCPv4 sockets and the kernel spreads the
+	 * unicast packets over them.   The workers tell those from
+	 * broadcasts by the destination address in the packet info.
+	 */
+	if ((family == AF_INET) && dhcpv4_reuseport) {
+		flag = 1;
+		if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT,
+			       (char *)&flag, sizeof(flag)) < 0) {
+			log_fatal("Can't set SO_REUSEPORT option on dhcp "
+				  "socket: %m");
+		}
+#if defined(HAVE_V4_REUSEPORT)
+		if (setsockopt(sock, IPPROTO_IP, IP_PKTINFO,
+			       (char *)&flag, sizeof(flag)) < 0) {
+			log_fatal("Can't set IP_PKTINFO option on dhcp "
+				  "socket: %m");
+		}
+#endif
+	}
+#endif
+
 	/* Bind the socket to this interface's IP address. */
 	if (bind(sock, (struct sockaddr *)&name, name_len) < 0) {
 		log_error("Can't bind to dhcp address: %m");
@@ -635,6 +659,18 @@ ssize_t send_packet (interface, packet, raw, len, from, to, hto)
 #ifdef IGNORE_HOSTUNREACH
 	int retry = 0;
 	do {
+#else
+# if !(defined(IP_PKTINFO) && defined(IP_RECVPKTINFO) && \
+       defined(USE_V4_PKTINFO))
+	/*
+	 * If we're in the middle of a batch, the packet goes out when the
+	 * batch is flushed.  Not when we need to retry on errors or set
+	 * the outbound interface on the socket for each packet, though.
+	 */
+	if (queue_batched_send (interface -> wfdesc, (unsigned char *)raw,
+				len, (struct sockaddr *)to, sizeof *to))
+		return len;
+# endif
 #endif
 #if defined(IP_PKTINFO) && defined(IP_RECVPKTINFO) && defined(USE_V4_PKTINFO)
 		struct in_pktinfo pktinfo;
@@ -838,6 +874,64 @@ ssize_t send_packet6(struct interface_info *interface,
 #endif /* DHCPv6 */
 
 #ifdef USE_SOCKET_RECEIVE
+#if defined(HAVE_V4_REUSEPORT)
+/*
+ * With -reuseport the kernel hands a unicast packet to just one worker
+ * but a broadcast to all of them, so the workers need to know which
+ * each packet was.   Read the packet along with the address it was sent
+ * to, and return nonzero in *unicast if that is one of ours.
+ */
+static ssize_t
+receive_packet_unicast(int fd, unsigned char *buf, size_t len,
+		       struct sockaddr_in *from, int *unicast)
+{
+	struct msghdr m;
+	struct iovec v;
+	struct cmsghdr *cmsg;
+	struct in_pktinfo *pktinfo;
+	struct interface_info *ip;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(struct in_pktinfo))];
+	} control;
+	ssize_t result;
+	int i;
+
+	memset(&m, 0, sizeof(m));
+	m.msg_name = from;
+	m.msg_namelen = sizeof(*from);
+	v.iov_base = buf;
+	v.iov_len = len;
+	m.msg_iov = &v;
+	m.msg_iovlen = 1;
+	m.msg_control = &control;
+	m.msg_controllen = sizeof(control);
+
+	*unicast = 0;
+	result = recvmsg(fd, &m, 0);
+	if (result < 0)
+		return (result);
+
+	for (cmsg = CMSG_FIRSTHDR(&m); cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(&m, cmsg)) {
+		if ((cmsg->cmsg_level != IPPROTO_IP) ||
+		    (cmsg->cmsg_type != IP_PKTINFO))
+			continue;
+		pktinfo = (struct in_pktinfo *)CMSG_DATA(cmsg);
+		for (ip = interfaces; ip != NULL; ip = ip->next) {
+			for (i = 0; i < ip->address_count; i++) {
+				if (ip->addresses[i].s_addr ==
+				    pktinfo->ipi_addr.s_addr) {
+					*unicast = 1;
+					return (result);
+				}
+			}
+		}
+	}
+	return (result);
+}
+#endif
+
 ssize_t receive_packet (interface, buf, len, from, hfrom)
 	struct interface_info *interface;
 	unsigned char *buf;
@@ -949,6 +1043,13 @@ ssize_t receive_packet (interface, buf, len, from, hfrom)
 		errno = EIO;
 	}
 #else
+#if defined(HAVE_V4_REUSEPORT)
+	if (dhcpv4_reuseport)
+		result = receive_packet_unicast(interface->rfdesc, buf, len,
+						from,
+						&interface->received_unicast);
+	else
+#endif
 		result = recvfrom(interface -> rfdesc, (char *)buf, len, 0,
 				  (struct sockaddr *)from, &flen);
 #endif /* IP_PKTINFO ... */
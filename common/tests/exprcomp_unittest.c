@@ -0,0 +1,411 @@
+/*
+ * Copyright (C) 2017 by Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include "dhcpd.h"
+
+#include <sys/time.h>
+#include <atf-c.h>
+
+/*
+ * Test the compiled expression evaluator in exprcomp.c.   A compiled
+ * expression has to give exactly what the tree walker gives, so these
+ * tests evaluate the same expressions both ways and compare.
+ */
+
+static struct packet packet;
+static struct dhcp_packet raw;
+static struct option_state *options;
+
+/* Build a node with up to three children, dropping our references. */
+static struct expression *
+node(enum expr_op op, struct expression *a, struct expression *b,
+     struct expression *c)
+{
+	struct expression *expr = NULL;
+
+	ATF_REQUIRE(expression_allocate(&expr, MDL));
+	expr->op = op;
+	switch (op) {
+	      case expr_substring:
+		expr->data.substring.expr = a;
+		expr->data.substring.offset = b;
+		expr->data.substring.len = c;
+		break;
+	      case expr_binary_to_ascii:
+		expr->data.b2a.base = a;
+		expr->data.b2a.width = b;
+		expr->data.b2a.separator = c;
+		break;
+	      default:
+		/* Everything else keeps its operands in equal []. */
+		expr->data.equal[0] = a;
+		expr->data.equal[1] = b;
+		break;
+	}
+	return expr;
+}
+
+static struct expression *
+str(const char *s)
+{
+	struct expression *expr = NULL;
+
+	ATF_REQUIRE(make_const_data(&expr, (const unsigned char *)s,
+				    strlen(s), 1, 1, MDL));
+	return expr;
+}
+
+static struct expression *
+num(unsigned long n)
+{
+	struct expression *expr = NULL;
+
+	ATF_REQUIRE(make_const_int(&expr, n));
+	return expr;
+}
+
+static struct expression *
+opt(unsigned code)
+{
+	struct expression *expr = node(expr_option, NULL, NULL, NULL);
+
+	memset(&expr->data, 0, sizeof expr->data);
+	ATF_REQUIRE(option_code_hash_lookup(&expr->data.option,
+					    dhcp_universe.code_hash,
+					    &code, 0, MDL));
+	return expr;
+}
+
+static struct expression *
+exists(unsigned code)
+{
+	struct expression *expr = node(expr_exists, NULL, NULL, NULL);
+
+	memset(&expr->data, 0, sizeof expr->data);
+	ATF_REQUIRE(option_code_hash_lookup(&expr->data.exists,
+					    dhcp_universe.code_hash,
+					    &code, 0, MDL));
+	return expr;
+}
+
+static void
+setup(void)
+{
+	static int done;
+
+	if (done)
+		return;
+	done = 1;
+
+	initialize_common_option_spaces();
+	ATF_REQUIRE(option_state_allocate(&options, MDL));
+	ATF_REQUIRE(add_option(options, DHO_HOST_NAME, "Client-One", 10));
+	ATF_REQUIRE(add_option(options, DHO_VENDOR_CLASS_IDENTIFIER,
+			       "MSFT 5.0", 8));
+	ATF_REQUIRE(add_option(options, DHO_DHCP_CLIENT_IDENTIFIER,
+			       "\001\000\033\041\257\000\001", 7));
+
+	memset(&raw, 0, sizeof raw);
+	raw.htype = HTYPE_ETHER;
+	raw.hlen = 6;
+	memcpy(raw.chaddr, "\000\033\041\257\000\001", 6);
+	memset(&packet, 0, sizeof packet);
+	packet.raw = &raw;
+	packet.packet_length = sizeof raw;
+	packet.options = options;
+	packet.known = 1;
+}
+
+/* Evaluate a boolean expression both ways and check they agree. */
+static void
+check_boolean(const char *name, struct expression *expr, int status,
+	      int result)
+{
+	int tree_result = -1, compiled_result = -1;
+	int tree_status, compiled_status;
+	int pass;
+
+	/* The second pass runs the program compiled by the first. */
+	for (pass = 0; pass < 2; pass++) {
+		tree_status = evaluate_boolean_expression(&tree_result,
+							  &packet, NULL, NULL,
+							  options, NULL,
+							  &global_scope, expr);
+		compiled_status = evaluate_compiled_boolean(&compiled_result,
+							    &packet, NULL,
+							    NULL, options,
+							    NULL,
+							    &global_scope,
+							    expr);
+		if (tree_status != status ||
+		    (status && tree_result != result))
+			atf_tc_fail("%s: tree walker gave %d/%d", name,
+				    tree_status, tree_result);
+		if (compiled_status != status ||
+		    (status && compiled_result != result))
+			atf_tc_fail("%s: compiled gave %d/%d", name,
+				    compiled_status, compiled_result);
+	}
+	expression_dereference(&expr, MDL);
+}
+
+/* Evaluate a data expression both ways and check they agree. */
+static void
+check_data(const char *name, struct expression *expr, int status,
+	   const char *result, unsigned len)
+{
+	struct data_string tree, compiled;
+	int tree_status, compiled_status;
+	int pass;
+
+	for (pass = 0; pass < 2; pass++) {
+		memset(&tree, 0, sizeof tree);
+		memset(&compiled, 0, sizeof compiled);
+		tree_status = evaluate_data_expression(&tree, &packet, NULL,
+						       NULL, options, NULL,
+						       &global_scope, expr,
+						       MDL);
+		compiled_status = evaluate_compiled_data(&compiled, &packet,
+							 NULL, NULL, options,
+							 NULL, &global_scope,
+							 expr, MDL);
+		if (tree_status != status ||
+		    (status && (tree.len != len ||
+				memcmp(tree.data, result, len) != 0)))
+			atf_tc_fail("%s: tree walker gave %d/%.*s", name,
+				    tree_status, (int)tree.len, tree.data);
+		if (compiled_status != status ||
+		    (status && (compiled.len != len ||
+				memcmp(compiled.data, result, len) != 0)))
+			atf_tc_fail("%s: compiled gave %d/%.*s", name,
+				    compiled_status, (int)compiled.len,
+				    compiled.data);
+		if (status && compiled.terminated != tree.terminated)
+			atf_tc_fail("%s: termination differs", name);
+		data_string_forget(&tree, MDL);
+		data_string_forget(&compiled, MDL);
+	}
+	expression_dereference(&expr, MDL);
+}
+
+ATF_TC(compiled_boolean);
+ATF_TC_HEAD(compiled_boolean, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify that compiled boolean "
+			  "expressions give what the tree walker gives");
+}
+
+ATF_TC_BODY(compiled_boolean, tc)
+{
+	setup();
+
+	check_boolean("substring equal",
+		      node(expr_equal,
+			   node(expr_substring, opt(DHO_VENDOR_CLASS_IDENTIFIER),
+				num(0), num(4)),
+			   str("MSFT"), NULL), 1, 1);
+	check_boolean("substring not equal",
+		      node(expr_not_equal,
+			   node(expr_substring, opt(DHO_HOST_NAME),
+				num(0), num(4)),
+			   str("MSFT"), NULL), 1, 1);
+	check_boolean("exists and",
+		      node(expr_and, exists(DHO_VENDOR_CLASS_IDENTIFIER),
+			   node(expr_known, NULL, NULL, NULL), NULL), 1, 1);
+	check_boolean("doesn't exist",
+		      node(expr_or, exists(DHO_USER_CLASS),
+			   node(expr_static, NULL, NULL, NULL), NULL), 1, 0);
+	check_boolean("missing options are equal",
+		      node(expr_equal, opt(DHO_USER_CLASS),
+			   opt(DHO_DOMAIN_NAME), NULL), 1, 1);
+	check_boolean("missing option isn't equal",
+		      node(expr_equal, opt(DHO_USER_CLASS),
+			   str("x"), NULL), 1, 0);
+	check_boolean("different kinds",
+		      node(expr_equal, num(4), str("\004"), NULL), 1, 0);
+	check_boolean("and false",
+		      node(expr_and,
+			   node(expr_static, NULL, NULL, NULL),
+			   node(expr_known, NULL, NULL, NULL), NULL), 0, 0);
+	check_boolean("and true",
+		      node(expr_and,
+			   node(expr_known, NULL, NULL, NULL),
+			   node(expr_equal, num(1), num(1), NULL),
+			   NULL), 1, 1);
+	check_boolean("or short circuit",
+		      node(expr_or,
+			   node(expr_known, NULL, NULL, NULL),
+			   node(expr_static, NULL, NULL, NULL), NULL), 1, 1);
+	check_boolean("or",
+		      node(expr_or,
+			   node(expr_static, NULL, NULL, NULL),
+			   node(expr_equal,
+				node(expr_extract_int8,
+				     opt(DHO_DHCP_CLIENT_IDENTIFIER),
+				     NULL, NULL),
+				num(1), NULL), NULL), 1, 1);
+	check_boolean("not of a failure",
+		      node(expr_not,
+			   node(expr_and,
+				node(expr_static, NULL, NULL, NULL),
+				node(expr_known, NULL, NULL, NULL), NULL),
+			   NULL, NULL), 0, 0);
+	check_boolean("constant",
+		      node(expr_not,
+			   node(expr_equal,
+				node(expr_concat, str("ab"), str("cd"), NULL),
+				str("abcd"), NULL), NULL, NULL), 1, 0);
+}
+
+ATF_TC(compiled_data);
+ATF_TC_HEAD(compiled_data, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify that compiled data "
+			  "expressions give what the tree walker gives");
+}
+
+ATF_TC_BODY(compiled_data, tc)
+{
+	struct expression *expr;
+
+	setup();
+
+	check_data("substring",
+		   node(expr_substring, opt(DHO_HOST_NAME), num(2), num(4)),
+		   1, "ient", 4);
+	check_data("substring past the end",
+		   node(expr_substring, opt(DHO_HOST_NAME), num(20), num(4)),
+		   1, "", 0);
+	check_data("suffix",
+		   node(expr_suffix, opt(DHO_HOST_NAME), num(3), NULL),
+		   1, "One", 3);
+	check_data("missing option",
+		   node(expr_concat, opt(DHO_USER_CLASS), str("x"), NULL),
+		   0, NULL, 0);
+	check_data("concat hardware",
+		   node(expr_concat, node(expr_hardware, NULL, NULL, NULL),
+			str("!"), NULL),
+		   1, "\001\000\033\041\257\000\001!", 8);
+	check_data("lcase",
+		   node(expr_lcase,
+			node(expr_concat, opt(DHO_HOST_NAME),
+			     opt(DHO_VENDOR_CLASS_IDENTIFIER), NULL),
+			NULL, NULL), 1, "client-onemsft 5.0", 18);
+	check_data("ucase",
+		   node(expr_ucase, opt(DHO_HOST_NAME), NULL, NULL),
+		   1, "CLIENT-ONE", 10);
+	check_data("encode extract",
+		   node(expr_encode_int16,
+			node(expr_extract_int32,
+			     node(expr_substring,
+				  opt(DHO_DHCP_CLIENT_IDENTIFIER),
+				  num(1), num(4)), NULL, NULL),
+			NULL, NULL), 1, "\041\257", 2);
+	check_data("extract too short",
+		   node(expr_encode_int8,
+			node(expr_extract_int16,
+			     node(expr_suffix, opt(DHO_HOST_NAME), num(1),
+				  NULL), NULL, NULL),
+			NULL, NULL), 0, NULL, 0);
+
+	/* binary-to-ascii isn't compiled, so it goes to the tree walker. */
+	expr = node(expr_binary_to_ascii, num(16), num(8), str(":"));
+	expr->data.b2a.buffer = node(expr_hardware, NULL, NULL, NULL);
+	check_data("fallback",
+		   node(expr_concat, str("id "), expr, NULL),
+		   1, "id 1:0:1b:21:af:0:1", 19);
+
+	expr = node(expr_concat, str("con"), str("stant"), NULL);
+	check_data("constant", expr, 1, "constant", 8);
+}
+
+static double
+elapsed(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) +
+	       (now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+ATF_TC(compiled_speed);
+ATF_TC_HEAD(compiled_speed, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Compare compiled expressions with "
+			  "the tree walker");
+	/* Only when asked for, e.g. atf-run -v benchmark=yes. */
+	atf_tc_set_md_var(tc, "require.config", "benchmark");
+}
+
+ATF_TC_BODY(compiled_speed, tc)
+{
+#define SPEED_EVALS 1000000
+	struct expression *expr;
+	struct timeval start;
+	double t_tree, t_compiled;
+	int i, result;
+
+	setup();
+
+	/* A typical vendor class match. */
+	expr = node(expr_and, exists(DHO_VENDOR_CLASS_IDENTIFIER),
+		    node(expr_or,
+			 node(expr_equal,
+			      node(expr_substring,
+				   opt(DHO_VENDOR_CLASS_IDENTIFIER),
+				   num(0), num(9)),
+			      str("PXEClient"), NULL),
+			 node(expr_equal,
+			      node(expr_substring,
+				   opt(DHO_VENDOR_CLASS_IDENTIFIER),
+				   num(0), num(4)),
+			      node(expr_concat, str("MS"), str("FT"), NULL),
+			      NULL), NULL), NULL);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < SPEED_EVALS; i++)
+		if (!evaluate_boolean_expression(&result, &packet, NULL, NULL,
+						 options, NULL, &global_scope,
+						 expr) || !result)
+			atf_tc_fail("tree walker failed");
+	t_tree = elapsed(&start);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < SPEED_EVALS; i++)
+		if (!evaluate_compiled_boolean(&result, &packet, NULL, NULL,
+					       options, NULL, &global_scope,
+					       expr) || !result)
+			atf_tc_fail("compiled expression failed");
+	t_compiled = elapsed(&start);
+
+	expression_dereference(&expr, MDL);
+
+	/* Timings vary too much between machines to test them. */
+	printf("%d evaluations: tree %.3fs, compiled %.3fs\n",
+	       SPEED_EVALS, t_tree, t_compiled);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, compiled_boolean);
+	ATF_TP_ADD_TC(tp, compiled_data);
+	ATF_TP_ADD_TC(tp, compiled_speed);
+
+	return (atf_no_error());
+}
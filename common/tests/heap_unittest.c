@@ -0,0 +1,327 @@
+/*
+ * Copyright (C) 2017 by Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include "dhcpd.h"
+
+#include <sys/time.h>
+#include <atf-c.h>
+
+/*
+ * Test the four-ary heap in heap4.c, and compare its speed with the
+ * binary heap from libisc that the server used before.
+ */
+
+/* Number of elements in the benchmark. */
+#define BENCH_COUNT	1000000
+
+struct elem {
+	isc_uint64_t key;
+	unsigned int index;
+};
+
+static unsigned long seed;
+
+/* A fixed sequence, so that a failure can be repeated. */
+static unsigned long
+next_random(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return ((seed >> 16) & 0x7fffffff);
+}
+
+static isc_boolean_t
+elem_less(void *a, void *b)
+{
+	return (((struct elem *)a)->key < ((struct elem *)b)->key);
+}
+
+static void
+elem_index(void *elt, unsigned int index)
+{
+	((struct elem *)elt)->index = index;
+}
+
+/* Check that every element is where the heap says it is. */
+static void
+check_indexes(dhcp_heap_t *heap, struct elem *elems, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (elems[i].index == 0)
+			continue;
+		if (dhcp_heap_element(heap, elems[i].index) != &elems[i])
+			atf_tc_fail("element %d isn't at index %u",
+				    i, elems[i].index);
+	}
+}
+
+/* Take everything off the top of the heap, checking the order. */
+static void
+check_order(dhcp_heap_t *heap, int count)
+{
+	struct elem *elt;
+	isc_uint64_t last = 0;
+	int n;
+
+	for (n = 0; n < count; n++) {
+		elt = dhcp_heap_element(heap, 1);
+		if (elt->index != 1)
+			atf_tc_fail("top element has index %u", elt->index);
+		if (elt->key < last)
+			atf_tc_fail("key %llu came after %llu",
+				    (unsigned long long)elt->key,
+				    (unsigned long long)last);
+		last = elt->key;
+		dhcp_heap_delete(heap, 1);
+		elt->index = 0;
+	}
+}
+
+ATF_TC(heap_order);
+ATF_TC_HEAD(heap_order, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify that elements come off the "
+			  "heap in order of their keys");
+}
+
+ATF_TC_BODY(heap_order, tc)
+{
+	dhcp_heap_t *heap = NULL;
+	struct elem elems[5000];
+	int i, count = sizeof(elems) / sizeof(elems[0]);
+
+	seed = 1;
+	/* A small size increment makes the heap grow several times. */
+	ATF_REQUIRE(dhcp_heap_create(elem_less, elem_index, 100, &heap) ==
+		    ISC_R_SUCCESS);
+
+	for (i = 0; i < count; i++) {
+		/* Plenty of equal keys, and some above 32 bits. */
+		elems[i].key = next_random() % 1000;
+		if (i % 7 == 0)
+			elems[i].key |= (isc_uint64_t)next_random() << 32;
+		ATF_REQUIRE(dhcp_heap_insert(heap, &elems[i]) ==
+			    ISC_R_SUCCESS);
+	}
+	check_indexes(heap, elems, count);
+	check_order(heap, count);
+
+	dhcp_heap_destroy(&heap);
+	ATF_REQUIRE(heap == NULL);
+}
+
+ATF_TC(heap_update);
+ATF_TC_HEAD(heap_update, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify that the heap stays in order "
+			  "as keys change and elements are deleted");
+}
+
+ATF_TC_BODY(heap_update, tc)
+{
+	dhcp_heap_t *heap = NULL;
+	struct elem elems[3000];
+	int i, j, live, count = sizeof(elems) / sizeof(elems[0]);
+
+	seed = 2;
+	ATF_REQUIRE(dhcp_heap_create(elem_less, elem_index, 0, &heap) ==
+		    ISC_R_SUCCESS);
+	for (i = 0; i < count; i++) {
+		elems[i].key = next_random() % 100000;
+		ATF_REQUIRE(dhcp_heap_insert(heap, &elems[i]) ==
+			    ISC_R_SUCCESS);
+	}
+
+	live = count;
+	for (i = 0; i < 20000; i++) {
+		j = next_random() % count;
+		if (elems[j].index == 0)
+			continue;
+		switch (next_random() % 4) {
+		      case 0:
+			dhcp_heap_delete(heap, elems[j].index);
+			elems[j].index = 0;
+			live--;
+			break;
+		      case 1:
+			elems[j].key /= 2;
+			dhcp_heap_increased(heap, elems[j].index);
+			break;
+		      default:
+			elems[j].key += next_random() % 1000;
+			dhcp_heap_decreased(heap, elems[j].index);
+			break;
+		}
+	}
+	check_indexes(heap, elems, count);
+	check_order(heap, live);
+
+	dhcp_heap_destroy(&heap);
+}
+
+/* Count and mark the elements seen by dhcp_heap_foreach(). */
+static void
+count_elem(void *elt, void *uap)
+{
+	((struct elem *)elt)->key = 0;
+	(*(int *)uap)++;
+}
+
+ATF_TC(heap_foreach);
+ATF_TC_HEAD(heap_foreach, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify that dhcp_heap_foreach() "
+			  "visits every element once");
+}
+
+ATF_TC_BODY(heap_foreach, tc)
+{
+	dhcp_heap_t *heap = NULL;
+	struct elem elems[100];
+	int i, n = 0, count = sizeof(elems) / sizeof(elems[0]);
+
+	ATF_REQUIRE(dhcp_heap_create(elem_less, NULL, 0, &heap) ==
+		    ISC_R_SUCCESS);
+	for (i = 0; i < count; i++) {
+		elems[i].key = i + 1;
+		ATF_REQUIRE(dhcp_heap_insert(heap, &elems[i]) ==
+			    ISC_R_SUCCESS);
+	}
+	dhcp_heap_foreach(heap, count_elem, &n);
+	if (n != count)
+		atf_tc_fail("foreach saw %d elements, expected %d", n, count);
+	for (i = 0; i < count; i++)
+		if (elems[i].key != 0)
+			atf_tc_fail("foreach missed element %d", i);
+
+	dhcp_heap_destroy(&heap);
+}
+
+static double
+elapsed(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return ((now.tv_sec - start->tv_sec) +
+		(now.tv_usec - start->tv_usec) / 1000000.0);
+}
+
+static void
+report(const char *name, const char *op, double secs)
+{
+	printf("%-10s %-14s %8.3f s %8.1f ns/op\n", name, op, secs,
+	       secs * 1e9 / BENCH_COUNT);
+}
+
+ATF_TC(heap_benchmark);
+ATF_TC_HEAD(heap_benchmark, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Time insert, delete and decrease-key "
+			  "on the four-ary heap and the libisc heap");
+	/* Only when asked for, e.g. atf-run -v benchmark=yes. */
+	atf_tc_set_md_var(tc, "require.config", "benchmark");
+}
+
+ATF_TC_BODY(heap_benchmark, tc)
+{
+	struct elem *elems;
+	isc_uint64_t *keys;
+	unsigned int *order;
+	dhcp_heap_t *heap = NULL;
+	isc_heap_t *iheap = NULL;
+	isc_mem_t *mctx = NULL;
+	struct timeval start;
+	unsigned int i, j, t;
+
+	elems = malloc(BENCH_COUNT * sizeof(*elems));
+	keys = malloc(BENCH_COUNT * sizeof(*keys));
+	order = malloc(BENCH_COUNT * sizeof(*order));
+	ATF_REQUIRE(elems != NULL && keys != NULL && order != NULL);
+
+	/* Lease expiry times over about a day, and a random order in
+	   which to touch the elements. */
+	seed = 3;
+	for (i = 0; i < BENCH_COUNT; i++) {
+		keys[i] = 1500000000 + next_random() % 86400;
+		order[i] = i;
+	}
+	for (i = BENCH_COUNT - 1; i > 0; i--) {
+		j = next_random() % (i + 1);
+		t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+
+	ATF_REQUIRE(dhcp_heap_create(elem_less, elem_index, 0, &heap) ==
+		    ISC_R_SUCCESS);
+	for (i = 0; i < BENCH_COUNT; i++)
+		elems[i].key = keys[i];
+	gettimeofday(&start, NULL);
+	for (i = 0; i < BENCH_COUNT; i++)
+		dhcp_heap_insert(heap, &elems[i]);
+	report("dhcp_heap", "insert", elapsed(&start));
+	gettimeofday(&start, NULL);
+	for (i = 0; i < BENCH_COUNT; i++) {
+		elems[order[i]].key -= 3600;
+		dhcp_heap_increased(heap, elems[order[i]].index);
+	}
+	report("dhcp_heap", "decrease-key", elapsed(&start));
+	gettimeofday(&start, NULL);
+	for (i = 0; i < BENCH_COUNT; i++)
+		dhcp_heap_delete(heap, elems[order[i]].index);
+	report("dhcp_heap", "delete", elapsed(&start));
+	dhcp_heap_destroy(&heap);
+
+	ATF_REQUIRE(isc_mem_create(0, 0, &mctx) == ISC_R_SUCCESS);
+	ATF_REQUIRE(isc_heap_create(mctx, elem_less, elem_index, 0, &iheap) ==
+		    ISC_R_SUCCESS);
+	for (i = 0; i < BENCH_COUNT; i++)
+		elems[i].key = keys[i];
+	gettimeofday(&start, NULL);
+	for (i = 0; i < BENCH_COUNT; i++)
+		isc_heap_insert(iheap, &elems[i]);
+	report("isc_heap", "insert", elapsed(&start));
+	gettimeofday(&start, NULL);
+	for (i = 0; i < BENCH_COUNT; i++) {
+		elems[order[i]].key -= 3600;
+		isc_heap_increased(iheap, elems[order[i]].index);
+	}
+	report("isc_heap", "decrease-key", elapsed(&start));
+	gettimeofday(&start, NULL);
+	for (i = 0; i < BENCH_COUNT; i++)
+		isc_heap_delete(iheap, elems[order[i]].index);
+	report("isc_heap", "delete", elapsed(&start));
+	isc_heap_destroy(&iheap);
+	isc_mem_destroy(&mctx);
+
+	free(order);
+	free(keys);
+	free(elems);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, heap_order);
+	ATF_TP_ADD_TC(tp, heap_update);
+	ATF_TP_ADD_TC(tp, heap_foreach);
+	ATF_TP_ADD_TC(tp, heap_benchmark);
+
+	return (atf_no_error());
+}
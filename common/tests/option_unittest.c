@@ -0,0 +1,401 @@
+/*
+ * Copyright (C) 2017 by Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include "dhcpd.h"
+
+#include <atf-c.h>
+
+/*
+ * Test the indexed option storage used by the dhcp option space.  Most
+ * of these tests save and delete options and check that lookups and
+ * walks of the space agree with a plain array of what should be there.
+ */
+
+static struct option_cache *expect[256];
+static struct option unknown[256];
+
+static void
+setup(void)
+{
+	static int done;
+
+	if (!done) {
+		initialize_common_option_spaces();
+		done = 1;
+	}
+	memset(expect, 0, sizeof(expect));
+}
+
+/* Make an option cache for code in the dhcp space. */
+static struct option_cache *
+make_oc(unsigned code)
+{
+	struct option_cache *oc = NULL;
+
+	ATF_REQUIRE(option_cache_allocate(&oc, MDL));
+	if (!option_code_hash_lookup(&oc->option, dhcp_universe.code_hash,
+				     &code, 0, MDL)) {
+		/* Not every code has an option defined for it.  These
+		   hold a reference of their own so they're never freed. */
+		if (unknown[code].name == NULL) {
+			unknown[code].name = "unknown";
+			unknown[code].format = "X";
+			unknown[code].universe = &dhcp_universe;
+			unknown[code].code = code;
+			unknown[code].refcnt = 1;
+		}
+		option_reference(&oc->option, &unknown[code], MDL);
+	}
+	return oc;
+}
+
+struct walk {
+	int count;
+	int last;
+};
+
+static void
+visit(struct option_cache *oc, struct packet *packet, struct lease *lease,
+      struct client_state *client_state, struct option_state *in_options,
+      struct option_state *cfg_options, struct binding_scope **scope,
+      struct universe *u, void *stuff)
+{
+	struct walk *walk = stuff;
+
+	if ((int)oc->option->code <= walk->last)
+		atf_tc_fail("option %u visited after %d", oc->option->code,
+			    walk->last);
+	if (oc != expect[oc->option->code])
+		atf_tc_fail("wrong option %u visited", oc->option->code);
+	walk->last = oc->option->code;
+	walk->count++;
+}
+
+/* Check that options holds exactly what expect says it should. */
+static void
+check(struct option_state *options)
+{
+	struct walk walk;
+	int code, n = 0;
+
+	for (code = 0; code < 256; code++) {
+		if (lookup_option(&dhcp_universe, options, code) !=
+		    expect[code])
+			atf_tc_fail("lookup of option %d is wrong", code);
+		if (expect[code])
+			n++;
+	}
+	if (lookup_option(&dhcp_universe, options, 256) != NULL)
+		atf_tc_fail("found an option past the end of the space");
+
+	walk.count = 0;
+	walk.last = -1;
+	option_space_foreach(NULL, NULL, NULL, NULL, options, NULL,
+			     &dhcp_universe, &walk, visit);
+	if (walk.count != n)
+		atf_tc_fail("walk visited %d options, expected %d",
+			    walk.count, n);
+}
+
+ATF_TC(option_index_order);
+ATF_TC_HEAD(option_index_order, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify that options are found and "
+			  "walked in code order");
+}
+
+ATF_TC_BODY(option_index_order, tc)
+{
+	static unsigned codes[] = { 12, 255, 0, 31, 32, 3, 64, 63, 200, 1 };
+	struct option_state *options = NULL;
+	struct option_cache *oc, *other;
+	int i;
+
+	setup();
+	ATF_REQUIRE(option_state_allocate(&options, MDL));
+	check(options);
+
+	for (i = 0; i < sizeof(codes) / sizeof(codes[0]); i++) {
+		oc = make_oc(codes[i]);
+		save_option(&dhcp_universe, options, oc);
+		expect[codes[i]] = oc;
+		option_cache_dereference(&oc, MDL);
+		check(options);
+	}
+
+	/* Saving an option again replaces it. */
+	oc = make_oc(32);
+	save_option(&dhcp_universe, options, oc);
+	expect[32] = oc;
+	option_cache_dereference(&oc, MDL);
+	check(options);
+
+	/* Saving it as well hangs it off the end of the first one. */
+	oc = make_oc(32);
+	also_save_option(&dhcp_universe, options, oc);
+	other = lookup_option(&dhcp_universe, options, 32);
+	if (other != expect[32] || other->next != oc)
+		atf_tc_fail("option wasn't appended");
+	option_cache_dereference(&oc, MDL);
+
+	for (i = 0; i < sizeof(codes) / sizeof(codes[0]); i += 2) {
+		delete_option(&dhcp_universe, options, codes[i]);
+		expect[codes[i]] = NULL;
+		check(options);
+	}
+
+	/* Deleting what isn't there is harmless. */
+	delete_option(&dhcp_universe, options, 12);
+	delete_option(&dhcp_universe, options, 100);
+	check(options);
+
+	option_state_dereference(&options, MDL);
+}
+
+ATF_TC(option_index_random);
+ATF_TC_HEAD(option_index_random, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify that the option index keeps "
+			  "up with random saves and deletes");
+}
+
+ATF_TC_BODY(option_index_random, tc)
+{
+	struct option_state *options = NULL;
+	struct option_cache *oc;
+	unsigned code;
+	int i;
+
+	setup();
+	srandom(19);
+	ATF_REQUIRE(option_state_allocate(&options, MDL));
+
+	for (i = 0; i < 5000; i++) {
+		/* Alternate between crowding the low codes and spreading
+		   out over the whole space. */
+		code = random() % ((i / 500) % 2 ? 256 : 40);
+		if (random() % 3) {
+			oc = make_oc(code);
+			save_option(&dhcp_universe, options, oc);
+			expect[code] = oc;
+			option_cache_dereference(&oc, MDL);
+		} else {
+			delete_option(&dhcp_universe, options, code);
+			expect[code] = NULL;
+		}
+		if (i % 50 == 0)
+			check(options);
+	}
+	check(options);
+
+	option_state_dereference(&options, MDL);
+}
+
+/* Check that option code in options holds value. */
+static void
+check_value(struct option_state *options, unsigned code, const char *value)
+{
+	struct option_cache *oc;
+
+	oc = lookup_option(&dhcp_universe, options, code);
+	if (oc == NULL)
+		atf_tc_fail("option %u is missing", code);
+	if (oc->data.len != strlen(value) ||
+	    memcmp(oc->data.data, value, oc->data.len) != 0)
+		atf_tc_fail("option %u is \"%.*s\", expected \"%s\"", code,
+			    (int)oc->data.len, oc->data.data, value);
+}
+
+static void
+collect(struct option_cache *oc, struct packet *packet, struct lease *lease,
+	struct client_state *client_state, struct option_state *in_options,
+	struct option_state *cfg_options, struct binding_scope **scope,
+	struct universe *u, void *stuff)
+{
+	unsigned *codes = stuff;
+
+	codes[++codes[0]] = oc->option->code;
+}
+
+ATF_TC(option_index_packet);
+ATF_TC_HEAD(option_index_packet, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify that options parsed from a "
+			  "packet are found when they're looked up");
+}
+
+ATF_TC_BODY(option_index_packet, tc)
+{
+	static unsigned char buf[] = {
+		DHO_DHCP_MESSAGE_TYPE, 1, DHCPDISCOVER,
+		DHO_HOST_NAME, 3, 'o', 'n', 'e',
+		DHO_PAD,
+		DHO_VENDOR_CLASS_IDENTIFIER, 4, 'M', 'S', 'F', 'T',
+		DHO_HOST_NAME, 3, 't', 'w', 'o',
+		DHO_DHCP_CLIENT_IDENTIFIER, 2, 1, 2,
+		DHO_END
+	};
+	static unsigned char bad[] = {
+		DHO_HOST_NAME, 3, 'o', 'n', 'e',
+		DHO_VENDOR_CLASS_IDENTIFIER, 10, 'M', 'S', 'F', 'T'
+	};
+	static unsigned expect_codes[] = {
+		3, DHO_HOST_NAME, DHO_DHCP_MESSAGE_TYPE,
+		DHO_VENDOR_CLASS_IDENTIFIER
+	};
+	struct option_state *options = NULL;
+	struct option_cache *oc;
+	unsigned codes[256];
+
+	setup();
+	ATF_REQUIRE(option_state_allocate(&options, MDL));
+	if (!parse_option_buffer(options, buf, sizeof(buf), &dhcp_universe))
+		atf_tc_fail("can't parse options");
+
+	/* A repeated option is the two copies run together. */
+	check_value(options, DHO_VENDOR_CLASS_IDENTIFIER, "MSFT");
+	check_value(options, DHO_HOST_NAME, "onetwo");
+	check_value(options, DHO_VENDOR_CLASS_IDENTIFIER, "MSFT");
+
+	/* Options that were never looked at can be deleted or replaced. */
+	delete_option(&dhcp_universe, options, DHO_DHCP_CLIENT_IDENTIFIER);
+	if (lookup_option(&dhcp_universe, options,
+			  DHO_DHCP_CLIENT_IDENTIFIER) != NULL)
+		atf_tc_fail("deleted option is still there");
+	oc = make_oc(DHO_DHCP_MESSAGE_TYPE);
+	save_option(&dhcp_universe, options, oc);
+	if (lookup_option(&dhcp_universe, options,
+			  DHO_DHCP_MESSAGE_TYPE) != oc)
+		atf_tc_fail("option wasn't replaced");
+	option_cache_dereference(&oc, MDL);
+
+	codes[0] = 0;
+	option_space_foreach(NULL, NULL, NULL, NULL, options, NULL,
+			     &dhcp_universe, codes, collect);
+	if (memcmp(codes, expect_codes, sizeof(expect_codes)) != 0)
+		atf_tc_fail("walk visited the wrong options");
+	option_state_dereference(&options, MDL);
+
+	/* Bad options are still caught when the packet is parsed. */
+	ATF_REQUIRE(option_state_allocate(&options, MDL));
+	if (parse_option_buffer(options, bad, sizeof(bad), &dhcp_universe))
+		atf_tc_fail("parsed an option that runs off the end");
+	option_state_dereference(&options, MDL);
+}
+
+/* Make an option cache for code whose value is the expression expr. */
+static struct option_cache *
+make_expr_oc(unsigned code, struct expression *expr)
+{
+	struct option_cache *oc = make_oc(code);
+
+	expression_reference(&oc->expression, expr, MDL);
+	expression_dereference(&expr, MDL);
+	return oc;
+}
+
+static struct expression *
+const_data(const void *data, unsigned len)
+{
+	struct expression *expr = NULL;
+
+	ATF_REQUIRE(make_const_data(&expr, data, len, 0, 1, MDL));
+	return expr;
+}
+
+ATF_TC(option_wire_cache);
+ATF_TC_HEAD(option_wire_cache, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify that constant options are "
+			  "encoded once and stored the same way after");
+}
+
+ATF_TC_BODY(option_wire_cache, tc)
+{
+	static unsigned char routers[] = {
+		DHO_ROUTERS, 8, 10, 0, 0, 1, 10, 0, 0, 2
+	};
+	static unsigned char domain[] = {
+		DHO_DOMAIN_NAME, 12, 'e', 'x', 'a', 'm', 'p', 'l', 'e',
+		'.', 'c', 'o', 'm', 0
+	};
+	static unsigned char lease_time[] = {
+		DHO_DHCP_LEASE_TIME, 4, 0, 0, 14, 16
+	};
+	struct option_state *options = NULL;
+	struct option_cache *rt, *dn, *lt;
+	struct expression *expr = NULL;
+	struct dhcp_packet first, second;
+	int len, len2;
+
+	setup();
+	ATF_REQUIRE(option_state_allocate(&options, MDL));
+
+	ATF_REQUIRE(make_concat(&expr, const_data(routers + 2, 4),
+				const_data(routers + 6, 4)));
+	rt = make_expr_oc(DHO_ROUTERS, expr);
+	save_option(&dhcp_universe, options, rt);
+	dn = make_expr_oc(DHO_DOMAIN_NAME, const_data(domain + 2, 11));
+	save_option(&dhcp_universe, options, dn);
+
+	/* The lease time is made for each reply, so it isn't kept. */
+	lt = make_oc(DHO_DHCP_LEASE_TIME);
+	ATF_REQUIRE(buffer_allocate(&lt->data.buffer, 4, MDL));
+	memcpy(lt->data.buffer->data, lease_time + 2, 4);
+	lt->data.data = lt->data.buffer->data;
+	lt->data.len = 4;
+	save_option(&dhcp_universe, options, lt);
+
+	memset(&first, 0, sizeof(first));
+	len = cons_options(NULL, &first, NULL, NULL, 0, NULL, options, NULL,
+			   0, 1, 0, NULL, NULL);
+	if (rt->wire == NULL || dn->wire == NULL)
+		atf_tc_fail("constant options weren't kept encoded");
+	if (lt->wire != NULL)
+		atf_tc_fail("lease time was kept encoded");
+
+	memset(&second, 0, sizeof(second));
+	len2 = cons_options(NULL, &second, NULL, NULL, 0, NULL, options,
+			    NULL, 0, 1, 0, NULL, NULL);
+	if (len != len2 || memcmp(&first, &second, sizeof(first)) != 0)
+		atf_tc_fail("options were stored differently the second time");
+
+	/* The lease time is always sent early, and routers before the
+	   rest. */
+	if (memcmp(second.options + 4, lease_time, sizeof(lease_time)) != 0 ||
+	    memcmp(second.options + 4 + sizeof(lease_time), routers,
+		   sizeof(routers)) != 0 ||
+	    memcmp(second.options + 4 + sizeof(lease_time) + sizeof(routers),
+		   domain, sizeof(domain)) != 0)
+		atf_tc_fail("options weren't stored as expected");
+
+	option_cache_dereference(&rt, MDL);
+	option_cache_dereference(&dn, MDL);
+	option_cache_dereference(&lt, MDL);
+	option_state_dereference(&options, MDL);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, option_index_order);
+	ATF_TP_ADD_TC(tp, option_index_random);
+	ATF_TP_ADD_TC(tp, option_index_packet);
+	ATF_TP_ADD_TC(tp, option_wire_cache);
+
+	return (atf_no_error());
+}
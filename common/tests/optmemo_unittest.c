@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2017 by Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include "dhcpd.h"
+
+#include <atf-c.h>
+
+/*
+ * Test the per-packet option memo in optmemo.c.  A remembered value
+ * has to be thrown away as soon as anything it was computed from
+ * changes, so most of these tests evaluate an option cache, change
+ * something and check that the new value comes back.
+ */
+
+static struct packet *packet;
+static struct dhcp_packet raw;
+
+static void
+setup(void)
+{
+	static int done;
+
+	if (!done) {
+		initialize_common_option_spaces();
+		done = 1;
+	}
+
+	ATF_REQUIRE(packet_allocate(&packet, MDL));
+	memset(&raw, 0, sizeof raw);
+	raw.htype = HTYPE_ETHER;
+	raw.hlen = 6;
+	memcpy(raw.chaddr, "\000\033\041\257\000\001", 6);
+	packet->raw = &raw;
+	packet->packet_length = sizeof raw;
+	ATF_REQUIRE(option_state_allocate(&packet->options, MDL));
+	ATF_REQUIRE(add_option(packet->options, DHO_HOST_NAME, "one", 3));
+}
+
+/* Make an option cache holding expr, dropping our reference to it. */
+static struct option_cache *
+make_oc(struct expression *expr)
+{
+	struct option_cache *oc = NULL;
+
+	ATF_REQUIRE(option_cache_allocate(&oc, MDL));
+	oc->expression = expr;
+	return oc;
+}
+
+static struct expression *
+node(enum expr_op op)
+{
+	struct expression *expr = NULL;
+
+	ATF_REQUIRE(expression_allocate(&expr, MDL));
+	expr->op = op;
+	return expr;
+}
+
+static struct expression *
+host_name(void)
+{
+	struct expression *expr = node(expr_option);
+	unsigned code = DHO_HOST_NAME;
+
+	ATF_REQUIRE(option_code_hash_lookup(&expr->data.option,
+					    dhcp_universe.code_hash,
+					    &code, 0, MDL));
+	return expr;
+}
+
+static struct expression *
+variable(const char *name)
+{
+	struct expression *expr = node(expr_variable_reference);
+
+	expr->data.variable = dmalloc(strlen(name) + 1, MDL);
+	ATF_REQUIRE(expr->data.variable != NULL);
+	strcpy(expr->data.variable, name);
+	return expr;
+}
+
+/* Evaluate oc for the packet and check the result. */
+static void
+check(const char *name, struct option_cache *oc,
+      struct binding_scope **scope, const char *expect)
+{
+	struct data_string ds;
+
+	memset(&ds, 0, sizeof ds);
+	if (!evaluate_option_cache(&ds, packet, NULL, NULL, packet->options,
+				   NULL, scope, oc, MDL))
+		atf_tc_fail("%s: evaluation failed", name);
+	if (ds.len != strlen(expect) || memcmp(ds.data, expect, ds.len) != 0)
+		atf_tc_fail("%s: got \"%.*s\", expected \"%s\"", name,
+			    (int)ds.len, ds.data, expect);
+	data_string_forget(&ds, MDL);
+}
+
+ATF_TC(memo_hit);
+ATF_TC_HEAD(memo_hit, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify that an option cache is "
+			  "evaluated once per packet");
+}
+
+ATF_TC_BODY(memo_hit, tc)
+{
+	struct option_cache *oc, *la;
+	struct data_string ds;
+
+	setup();
+
+	/* The memo doesn't watch the fixed fields of the packet, so
+	   changing one behind the server's back shows whether the first
+	   value was kept. */
+	oc = make_oc(node(expr_filename));
+	strcpy((char *)raw.file, "boot1");
+	check("first", oc, NULL, "boot1");
+	strcpy((char *)raw.file, "boot2");
+	check("remembered", oc, NULL, "boot1");
+	if (!(oc->flags & OPTION_MEMO_PURE))
+		atf_tc_fail("filename wasn't remembered");
+
+	/* A new packet starts afresh. */
+	packet_dereference(&packet, MDL);
+	setup();
+	strcpy((char *)raw.file, "boot2");
+	check("new packet", oc, NULL, "boot2");
+
+	/* Anything that depends on the lease is never remembered. */
+	la = make_oc(node(expr_leased_address));
+	memset(&ds, 0, sizeof ds);
+	if (evaluate_option_cache(&ds, packet, NULL, NULL, packet->options,
+				  NULL, NULL, la, MDL))
+		data_string_forget(&ds, MDL);
+	if (la->flags & OPTION_MEMO_PURE)
+		atf_tc_fail("leased-address was remembered");
+
+	option_cache_dereference(&la, MDL);
+	option_cache_dereference(&oc, MDL);
+	packet_dereference(&packet, MDL);
+}
+
+ATF_TC(memo_options);
+ATF_TC_HEAD(memo_options, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify that changing the packet's "
+			  "options forgets remembered values");
+}
+
+ATF_TC_BODY(memo_options, tc)
+{
+	struct option_cache *oc;
+
+	setup();
+
+	oc = make_oc(host_name());
+	check("first", oc, NULL, "one");
+	check("again", oc, NULL, "one");
+
+	delete_option(&dhcp_universe, packet->options, DHO_HOST_NAME);
+	ATF_REQUIRE(add_option(packet->options, DHO_HOST_NAME, "two", 3));
+	check("replaced", oc, NULL, "two");
+
+	option_cache_dereference(&oc, MDL);
+	packet_dereference(&packet, MDL);
+}
+
+ATF_TC(memo_bindings);
+ATF_TC_HEAD(memo_bindings, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify that changing bindings "
+			  "forgets remembered values");
+}
+
+ATF_TC_BODY(memo_bindings, tc)
+{
+	struct option_cache *oc;
+	struct binding_scope *scope = NULL, *other = NULL;
+	struct data_string value;
+
+	setup();
+	ATF_REQUIRE(binding_scope_allocate(&scope, MDL));
+	ATF_REQUIRE(binding_scope_allocate(&other, MDL));
+
+	memset(&value, 0, sizeof value);
+	value.data = (const unsigned char *)"a";
+	value.len = 1;
+	ATF_REQUIRE(bind_ds_value(&scope, "x", &value));
+	value.data = (const unsigned char *)"b";
+	ATF_REQUIRE(bind_ds_value(&other, "x", &value));
+
+	oc = make_oc(variable("x"));
+	check("first", oc, &scope, "a");
+
+	/* The same option cache in another scope isn't the same value. */
+	check("other scope", oc, &other, "b");
+	check("back", oc, &scope, "a");
+	check("again", oc, &scope, "a");
+
+	value.data = (const unsigned char *)"c";
+	ATF_REQUIRE(bind_ds_value(&scope, "x", &value));
+	check("rebound", oc, &scope, "c");
+
+	option_cache_dereference(&oc, MDL);
+	binding_scope_dereference(&scope, MDL);
+	binding_scope_dereference(&other, MDL);
+	packet_dereference(&packet, MDL);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, memo_hit);
+	ATF_TP_ADD_TC(tp, memo_options);
+	ATF_TP_ADD_TC(tp, memo_bindings);
+
+	return (atf_no_error());
+}
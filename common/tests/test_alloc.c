@@ -637,6 +637,168 @@ ATF_TC_BODY(dmalloc_small, tc) {
     checkBuffer(0X0FFFFFFF, MDL);
 }
 
+ATF_TC(slab_alloc);
+
+ATF_TC_HEAD(slab_alloc, tc) {
+    atf_tc_set_md_var(tc, "descr", "slab_alloc basic test");
+}
+
+ATF_TC_BODY(slab_alloc, tc) {
+    static struct slab_pool pool = SLAB_POOL("test", struct data_string);
+    struct data_string *a, *b;
+
+    a = slab_alloc(&pool, MDL);
+    if (a == NULL) {
+        atf_tc_fail("slab_alloc failed");
+    }
+    if ((a->data != NULL) || (a->buffer != NULL) || (a->len != 0)) {
+        atf_tc_fail("object not zeroed");
+    }
+    a->len = 42;
+    b = slab_alloc(&pool, MDL);
+    if ((b == NULL) || (b == a)) {
+        atf_tc_fail("second slab_alloc failed");
+    }
+    if ((pool.in_use != 2) || (pool.peak != 2) || (pool.allocs != 2)) {
+        atf_tc_fail("bad counts %lu/%lu/%lu",
+                    pool.in_use, pool.peak, pool.allocs);
+    }
+
+    slab_free(&pool, a, MDL);
+    slab_free(&pool, b, MDL);
+    if ((pool.in_use != 0) || (pool.peak != 2)) {
+        atf_tc_fail("bad counts after free %lu/%lu",
+                    pool.in_use, pool.peak);
+    }
+
+    /* A freed object comes back zeroed. */
+    a = slab_alloc(&pool, MDL);
+    if ((a == NULL) || (a->len != 0)) {
+        atf_tc_fail("reused object not zeroed");
+    }
+    slab_free(&pool, a, MDL);
+}
+
+ATF_TC(slab_size_class);
+
+ATF_TC_HEAD(slab_size_class, tc) {
+    atf_tc_set_md_var(tc, "descr", "slab pools of the same size share "
+                      "their free objects");
+}
+
+ATF_TC_BODY(slab_size_class, tc) {
+    static struct slab_pool pool1 = SLAB_POOL("test1", char[40]);
+    static struct slab_pool pool2 = SLAB_POOL("test2", char[44]);
+    char *a, *b;
+
+    a = slab_alloc(&pool1, MDL);
+    b = slab_alloc(&pool2, MDL);
+    if ((a == NULL) || (b == NULL)) {
+        atf_tc_fail("slab_alloc failed");
+    }
+    if (pool1.sclass != pool2.sclass) {
+        atf_tc_fail("pools not in the same size class");
+    }
+
+#if !defined (DEBUG_MEMORY_LEAKAGE) && !defined (DEBUG_MALLOC_POOL) && \
+		!defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+    /* Without memory debugging, the last object freed is the next one
+       handed out, whichever pool asks for it. */
+    slab_free(&pool1, a, MDL);
+    if (slab_alloc(&pool2, MDL) != a) {
+        atf_tc_fail("freed object not reused");
+    }
+    if ((pool1.in_use != 0) || (pool2.in_use != 2)) {
+        atf_tc_fail("bad counts %lu/%lu", pool1.in_use, pool2.in_use);
+    }
+    slab_free(&pool2, a, MDL);
+#else
+    slab_free(&pool1, a, MDL);
+#endif
+    slab_free(&pool2, b, MDL);
+}
+
+ATF_TC(packet_arena);
+
+ATF_TC_HEAD(packet_arena, tc) {
+    atf_tc_set_md_var(tc, "descr", "packet arena allocation and "
+                      "data_string_promote");
+}
+
+ATF_TC_BODY(packet_arena, tc) {
+    struct packet_arena *arena, *arena2, *first;
+    struct buffer *a = NULL, *b = NULL;
+    struct data_string ds;
+
+    arena = packet_arena_new();
+#if defined (DEBUG_MEMORY_LEAKAGE) || defined (DEBUG_MALLOC_POOL) || \
+		defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+    if (arena != NULL) {
+        atf_tc_fail("arenas are off with memory debugging");
+    }
+    atf_tc_skip("arenas are off with memory debugging");
+#endif
+    if (arena == NULL) {
+        atf_tc_fail("packet_arena_new failed");
+    }
+    packet_arena = arena;
+    first = arena;
+
+    /* Small buffers come out of the arena, zeroed. */
+    if (!buffer_allocate(&a, 16, MDL) || !buffer_allocate(&b, 16, MDL)) {
+        atf_tc_fail("buffer_allocate failed");
+    }
+    if (!arena_owned(a) || !arena_owned(b)) {
+        atf_tc_fail("buffer not in the arena");
+    }
+    if ((a->data[0] != 0) || (a->data[15] != 0)) {
+        atf_tc_fail("buffer not zeroed");
+    }
+
+    /* One that doesn't fit goes to the heap. */
+    memset(&ds, 0, sizeof(ds));
+    if (!buffer_allocate(&ds.buffer, 1024 * 1024, MDL)) {
+        atf_tc_fail("buffer_allocate failed");
+    }
+    if (arena_owned(ds.buffer)) {
+        atf_tc_fail("large buffer in the arena");
+    }
+    data_string_forget(&ds, MDL);
+
+    /* Promoting copies the data out of the arena. */
+    memcpy(a->data, "abcdef", 6);
+    buffer_reference(&ds.buffer, a, MDL);
+    ds.data = a->data + 2;
+    ds.len = 3;
+    if (!data_string_promote(&ds, MDL)) {
+        atf_tc_fail("data_string_promote failed");
+    }
+    if ((ds.buffer == a) || arena_owned(ds.buffer) ||
+        (memcmp(ds.data, "cde", 3) != 0) || (a->refcnt != 1)) {
+        atf_tc_fail("data_string_promote didn't copy the data");
+    }
+
+    /* The arena outlives the packet until its last object is freed. */
+    packet_arena_release(&arena);
+    if ((arena != NULL) || (packet_arena != NULL)) {
+        atf_tc_fail("packet_arena_release didn't clear pointers");
+    }
+    buffer_dereference(&a, MDL);
+    if (!buffer_allocate(&a, 16, MDL) || arena_owned(a)) {
+        atf_tc_fail("allocated without a current arena");
+    }
+    buffer_dereference(&a, MDL);
+    buffer_dereference(&b, MDL);
+    data_string_forget(&ds, MDL);
+
+    /* Now it's been reset, the next packet gets it. */
+    arena2 = packet_arena_new();
+    if (arena2 != first) {
+        atf_tc_fail("arena not reused");
+    }
+    packet_arena_release(&arena2);
+}
+
 ATF_TP_ADD_TCS(tp)
 {
     ATF_TP_ADD_TC(tp, buffer_allocate);
@@ -655,6 +817,9 @@ ATF_TP_ADD_TCS(tp)
     ATF_TP_ADD_TC(tp, dmalloc_med2);
     ATF_TP_ADD_TC(tp, dmalloc_med3);
     ATF_TP_ADD_TC(tp, dmalloc_small);
+    ATF_TP_ADD_TC(tp, slab_alloc);
+    ATF_TP_ADD_TC(tp, slab_size_class);
+    ATF_TP_ADD_TC(tp, packet_arena);
 
     return (atf_no_error());
 }
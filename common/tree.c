@@ -2715,9 +2715,9 @@ int evaluate_option_cache (result, packet, lease, client_state,
 	}
 	if (!oc -> expression)
 		return 0;
-	return evaluate_data_expression (result, packet, lease, client_state,
-					 in_options, cfg_options, scope,
-					 oc -> expression, file, line);
+	return evaluate_option_memo (result, packet, lease, client_state,
+				     in_options, cfg_options, scope,
+				     oc, file, line);
 }
 
 /* Evaluate an option cache and extract a boolean from the result.
@@ -2794,9 +2794,9 @@ int evaluate_boolean_expression_result (ignorep, packet, lease, client_state,
 	if (!expr)
 		return 0;
 	
-	if (!evaluate_boolean_expression (&result, packet, lease, client_state,
-					  in_options, cfg_options,
-					  scope, expr))
+	if (!evaluate_compiled_boolean (&result, packet, lease, client_state,
+					in_options, cfg_options,
+					scope, expr))
 		return 0;
 
 	if (result == 2) {
@@ -2838,6 +2838,9 @@ void expression_dereference (eptr, file, line)
 #endif
 	}
 
+	if (expr -> program)
+		expression_program_forget (expr);
+
 	/* Dereference subexpressions. */
 	switch (expr -> op) {
 		/* All the binary operators can be handled the same way. */
@@ -3771,6 +3774,7 @@ int free_bindings (struct binding_scope *scope, const char *file, int line)
 {
 	struct binding *bp, *next;
 
+	binding_generation++;
 	for (bp = scope -> bindings; bp; bp = next) {
 		next = bp -> next;
 		if (bp -> name)
@@ -4086,6 +4090,7 @@ int bind_ds_value (struct binding_scope **scope,
 	binding = create_binding (scope, name);
 	if (!binding)
 		return 0;
+	binding_generation++;
 
 	if (binding -> value)
 		binding_value_dereference (&binding -> value, MDL);
@@ -4094,6 +4099,7 @@ int bind_ds_value (struct binding_scope **scope,
 		return 0;
 
 	data_string_copy (&binding -> value -> value.data, value, MDL);
+	data_string_promote (&binding -> value -> value.data, MDL);
 	binding -> value -> type = binding_data;
 
 	return 1;
@@ -72,12 +72,17 @@
 #include "ns_name.h"
 
 struct hash_table;
+struct ip4_hash_table;
 typedef struct hash_table group_hash_t;
 typedef struct hash_table universe_hash_t;
 typedef struct hash_table option_name_hash_t;
 typedef struct hash_table option_code_hash_t;
 typedef struct hash_table dns_zone_hash_t;
+#if defined (USE_IP4_LEASE_HASH)
+typedef struct ip4_hash_table lease_ip_hash_t;
+#else
 typedef struct hash_table lease_ip_hash_t;
+#endif
 typedef struct hash_table lease_id_hash_t;
 typedef struct hash_table host_hash_t;
 typedef struct hash_table class_hash_t;
@@ -97,6 +102,7 @@ typedef time_t TIME;
 #include "tree.h"
 #include "inet.h"
 #include "dhctoken.h"
+#include "heap4.h"
 
 #include <omapip/omapip_p.h>
 
@@ -390,7 +396,14 @@ struct option_cache {
 	struct data_string data;
 
 	#define OPTION_HAD_NULLS	0x00000001
+	#define OPTION_MEMO_CHECKED	0x00000002
+	#define OPTION_MEMO_PURE	0x00000004
+	#define OPTION_CONST_CHECKED	0x00000008
+	#define OPTION_CONST		0x00000010
 	u_int32_t flags;
+
+	/* A constant option as store_options() last encoded it. */
+	struct option_wire *wire;
 };
 
 struct option_state {
@@ -398,6 +411,8 @@ struct option_state {
 	int universe_count;
 	int site_universe;
 	int site_code_min;
+	unsigned generation;	/* Bumped when an option is saved or
+				   deleted. */
 	void *universes [1];
 };
 
@@ -465,13 +480,21 @@ struct packet {
 
 	/*
 	 * ISC_TRUE if packet received unicast (as opposed to multicast).
-	 * Only used in DHCPv6.
+	 * Used in DHCPv6, and in DHCPv4 with -reuseport, where the
+	 * DHCPv4 workers need to tell unicasts from broadcasts.
 	 */
 	isc_boolean_t unicast;
 
 	/* Propogates server value SV_ECHO_CLIENT_ID so it is available
          * in cons_options() */
 	int sv_echo_client_id;
+
+	/* Arena for the buffers and option states made while handling
+	 * this packet, or NULL. */
+	struct packet_arena *arena;
+
+	/* Option caches already evaluated for this packet (optmemo.c). */
+	struct option_memo *memo;
 };
 
 /*
@@ -802,6 +825,7 @@ struct lease_state {
 #ifdef EUI_64
 #define SV_USE_EUI_64			90
 #endif
+#define SV_BACKGROUND_LEASE_REWRITE	91
 
 #if !defined (DEFAULT_PING_TIMEOUT)
 # define DEFAULT_PING_TIMEOUT 1
@@ -1059,6 +1083,7 @@ struct collection {
 
 	const char *name;
 	struct class *classes;
+	struct class_index *index;	/* Built by check_collection(). */
 };
 
 /* Used as an argument to parse_clasS_decl() */
@@ -1376,6 +1401,9 @@ struct interface_info {
 	unsigned int rbuf_max;		/* Size of read buffer. */
 	size_t rbuf_offset;		/* Current offset into buffer. */
 	size_t rbuf_len;		/* Length of data in buffer. */
+	int received_unicast;		/* Set by receive_packet() if the
+					   last packet was sent to one of
+					   our addresses (-reuseport only). */
 
 	struct ifreq *ifp;		/* Pointer to ifreq struct. */
 	int configured;			/* If set to 1, interface has at least
@@ -1405,16 +1433,12 @@ struct hardware_link {
 	struct hardware address;
 };
 
-struct leasequeue {
-	struct leasequeue *prev;
-	struct leasequeue *next;
-	struct lease *lease;
-};
-
 typedef void (*tvref_t)(void *, void *, const char *, int);
 typedef void (*tvunref_t)(void *, const char *, int);
 struct timeout {
 	struct timeout *next;
+	struct timeout *prev;
+	struct timeout *index_next;	/* (func, what) index chain */
 	struct timeval when;
 	void (*func) (void *);
 	void *what;
@@ -1680,14 +1704,22 @@ struct ipv6_pool {
 	iasubopt_hash_t *leases;		/* non-free leases */
 	isc_uint64_t num_active;		/* count of active leases */
 	isc_uint64_t num_abandoned;		/* count of abandoned leases */
-	isc_heap_t *active_timeouts;		/* timeouts for active leases */
+	dhcp_heap_t *active_timeouts;		/* timeouts for active leases */
 	int num_inactive;			/* count of inactive leases */
-	isc_heap_t *inactive_timeouts;		/* timeouts for expired or
+	dhcp_heap_t *inactive_timeouts;		/* timeouts for expired or
 						   released leases */
 	struct shared_network *shared_network;	/* shared_network for
 						   this pool */
 	struct subnet *subnet;			/* subnet for this pool */
 	struct ipv6_pond *ipv6_pond;		/* pond for this pool */
+	struct ipv6_pool_index *free_index;	/* addresses in use, for
+						   small pools */
+	struct prefix_tree *prefix_tree;	/* prefixes in use, for
+						   prefix pools */
+	time_t next_expiry;			/* when a lease is next due
+						   to be expired or removed */
+	unsigned int expiry_index;		/* place in the expiry heap,
+						   0 if not in it */
 };
 
 /*!
@@ -1913,6 +1945,9 @@ struct option_cache *lookup_hashed_option (struct universe *,
 struct option_cache *next_hashed_option(struct universe *,
 					struct option_state *,
 					struct option_cache *);
+struct option_cache *lookup_indexed_option (struct universe *,
+					    struct option_state *,
+					    unsigned);
 int save_option_buffer (struct universe *, struct option_state *,
 			struct buffer *, unsigned char *, unsigned,
 			unsigned, int);
@@ -1927,14 +1962,24 @@ void also_save_option(struct universe *, struct option_state *,
 		      struct option_cache *);
 void save_hashed_option(struct universe *, struct option_state *,
 			struct option_cache *, isc_boolean_t appendp);
+void save_indexed_option(struct universe *, struct option_state *,
+			 struct option_cache *, isc_boolean_t appendp);
+int save_raw_indexed_option (struct universe *, struct option_state *,
+			     struct buffer *, unsigned char *, unsigned,
+			     unsigned);
 void delete_option (struct universe *, struct option_state *, int);
 void delete_hashed_option (struct universe *,
 			   struct option_state *, int);
+void delete_indexed_option (struct universe *,
+			    struct option_state *, int);
 int option_cache_dereference (struct option_cache **,
 			      const char *, int);
 int hashed_option_state_dereference (struct universe *,
 				     struct option_state *,
 				     const char *, int);
+int indexed_option_state_dereference (struct universe *,
+				      struct option_state *,
+				      const char *, int);
 int store_option (struct data_string *,
 		  struct universe *, struct packet *, struct lease *,
 		  struct client_state *,
@@ -1954,6 +1999,13 @@ int hashed_option_space_encapsulate (struct data_string *,
 				     struct option_state *,
 				     struct binding_scope **,
 				     struct universe *);
+int indexed_option_space_encapsulate (struct data_string *,
+				      struct packet *, struct lease *,
+				      struct client_state *,
+				      struct option_state *,
+				      struct option_state *,
+				      struct binding_scope **,
+				      struct universe *);
 int nwip_option_space_encapsulate (struct data_string *,
 				   struct packet *, struct lease *,
 				   struct client_state *,
@@ -2004,6 +2056,20 @@ void hashed_option_space_foreach (struct packet *, struct lease *,
 					    struct option_state *,
 					    struct binding_scope **,
 					    struct universe *, void *));
+void indexed_option_space_foreach (struct packet *, struct lease *,
+				   struct client_state *,
+				   struct option_state *,
+				   struct option_state *,
+				   struct binding_scope **,
+				   struct universe *, void *,
+				   void (*) (struct option_cache *,
+					     struct packet *,
+					     struct lease *,
+					     struct client_state *,
+					     struct option_state *,
+					     struct option_state *,
+					     struct binding_scope **,
+					     struct universe *, void *));
 int linked_option_get (struct data_string *, struct universe *,
 		       struct packet *, struct lease *,
 		       struct client_state *,
@@ -2076,6 +2142,7 @@ extern struct timeval cur_tv;
 
 extern int ddns_update_style;
 extern int dont_use_fsync;
+extern int background_lease_rewrite;
 extern int server_id_check;
 
 extern int prefix_length_mode;
@@ -2085,6 +2152,7 @@ extern u_int32_t abandon_lease_time;
 
 extern const char *path_dhcpd_conf;
 extern const char *path_dhcpd_db;
+extern const char *path_dhcpd_bin_db;
 extern const char *path_dhcpd_pid;
 
 extern int dhcp_max_agent_option_packet_length;
@@ -2107,10 +2175,6 @@ isc_result_t dhcp_io_shutdown (omapi_object_t *, void *);
 isc_result_t dhcp_set_control_state (control_object_state_t oldstate,
 				     control_object_state_t newstate);
 
-#if defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
-void relinquish_ackqueue(void);
-#endif
-
 /* conflex.c */
 isc_result_t new_parse (struct parse **, int,
 			char *, unsigned, const char *, int);
@@ -2360,11 +2424,36 @@ int data_string_sprintfa(struct data_string *ds, const char *fmt, ...);
 int concat_dclists (struct data_string *, struct data_string *,
                     struct data_string *);
 
+/* exprcomp.c */
+int evaluate_compiled_boolean (int *,
+			       struct packet *, struct lease *,
+			       struct client_state *,
+			       struct option_state *, struct option_state *,
+			       struct binding_scope **,
+			       struct expression *);
+int evaluate_compiled_data (struct data_string *,
+			    struct packet *, struct lease *,
+			    struct client_state *,
+			    struct option_state *, struct option_state *,
+			    struct binding_scope **,
+			    struct expression *,
+			    const char *, int);
+void expression_program_forget (struct expression *);
+int expression_is_constant (struct expression *);
+
+/* optmemo.c */
+extern unsigned binding_generation;
+int evaluate_option_memo (struct data_string *,
+			  struct packet *, struct lease *,
+			  struct client_state *,
+			  struct option_state *, struct option_state *,
+			  struct binding_scope **,
+			  struct option_cache *, const char *, int);
+void option_memo_forget (struct option_memo **);
+void option_memo_stats (void);
+
 /* dhcp.c */
 extern int outstanding_pings;
-extern int max_outstanding_acks;
-extern int max_ack_delay_secs;
-extern int max_ack_delay_usecs;
 
 void dhcp (struct packet *);
 void dhcpdiscover (struct packet *, int);
@@ -2457,10 +2546,23 @@ OMAPI_OBJECT_ALLOC_DECL (dhcp_control,
 void relinquish_free_pairs (void);
 void relinquish_free_expressions (void);
 void relinquish_free_binding_values (void);
-void relinquish_free_option_caches (void);
 void relinquish_free_packets (void);
 #endif
 
+extern struct slab_pool option_cache_pool;
+extern struct packet_arena *packet_arena;
+
+struct packet_arena *packet_arena_new (void);
+void packet_arena_release (struct packet_arena **);
+#if defined (DEBUG_MEMORY_LEAKAGE) || \
+		defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+void relinquish_packet_arenas (void);
+#endif
+void *arena_alloc (struct packet_arena *, size_t, const char *, int);
+void arena_free (void *, const char *, int);
+int arena_owned (const void *);
+int data_string_promote (struct data_string *, const char *, int);
+
 int option_chain_head_allocate (struct option_chain_head **,
 				const char *, int);
 int option_chain_head_reference (struct option_chain_head **,
@@ -2796,6 +2898,7 @@ extern struct in_addr local_address;
 extern u_int16_t local_port;
 extern u_int16_t remote_port;
 extern int dhcpv4_over_dhcpv6;
+extern int dhcpv4_reuseport;
 extern int (*dhcp_interface_setup_hook) (struct interface_info *,
 					 struct iaddr *);
 extern int (*dhcp_interface_discovery_hook) (struct interface_info *);
@@ -3016,8 +3119,14 @@ void start_selecting6(struct client_state *client);
 void unconfigure6(struct client_state *client, const char *reason);
 
 /* db.c */
+extern FILE *db_file;
 int write_lease (struct lease *);
+int write_lease_stdio (struct lease *);
+size_t format_lease (char *, size_t, struct lease *);
+size_t format_ia (char *, size_t, const struct ia_xx *);
 int write_host (struct host_decl *);
+int write_host_to_file (FILE *, struct host_decl *);
+int write_host_text (const char *, size_t);
 int write_server_duid(void);
 #if defined (FAILOVER_PROTOCOL)
 int write_failover_state (dhcp_failover_state_t *);
@@ -3030,10 +3139,42 @@ int write_billing_class (struct class *);
 void commit_leases_timeout (void *);
 int commit_leases (void);
 int commit_leases_timed (void);
+unsigned long leases_written (void);
+int leases_committed (unsigned long);
+extern int group_commit;
+extern int max_outstanding_acks;
+extern int max_ack_delay_secs;
+extern int max_ack_delay_usecs;
+void defer_until_commit (void (*) (void *), void *, tvref_t, tvunref_t);
+void flush_commit_queue (void);
+#if defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+void relinquish_commit_queue (void);
+#endif
 void db_startup (int);
 int new_lease_file (void);
+int convert_leases (int, const char *);
 int group_writer (struct group_object *);
 int write_ia(const struct ia_xx *);
+int write_ia_stdio(const struct ia_xx *);
+
+/* binleases.c */
+int binary_leases_add (struct lease *);
+isc_result_t binary_leases_journal_check (const char *, off_t, u_int32_t *);
+int write_binary_leases (const char *, off_t);
+isc_result_t read_binary_leases (const char *, off_t *);
+int read_leases_parallel (const char *, off_t);
+#if defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+void relinquish_binary_leases (void);
+#endif
+
+/* sendbatch.c */
+void begin_send_batch (void);
+int flush_send_batch (void);
+int queue_batched_send (int, const unsigned char *, size_t,
+			const struct sockaddr *, socklen_t);
+#if defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+void relinquish_send_batch (void);
+#endif
 
 /* packet.c */
 u_int32_t checksum (unsigned char *, unsigned, u_int32_t);
@@ -3188,6 +3329,8 @@ void classify_client (struct packet *);
 int check_collection (struct packet *, struct lease *, struct collection *);
 void classify (struct packet *, struct class *);
 isc_result_t unlink_class (struct class **class);
+void invalidate_class_index (void);
+void forget_class_index (struct collection *);
 isc_result_t find_class (struct class **, const char *,
 			 const char *, int);
 void unbill_class (struct lease *);
@@ -3527,6 +3670,7 @@ void lease_remove(struct lease **, struct lease *);
 void lease_remove_all(struct lease **);
 #endif
 int lease_enqueue (struct lease *);
+int lease_dequeue (struct lease *);
 isc_result_t lease_instantiate(const void *, unsigned, void *);
 void expire_all_pools (void);
 void dump_subnets (void);
@@ -3820,6 +3964,22 @@ int find_hosts6(struct host_decl** host, struct packet* packet,
                 const struct data_string* client_id, char* file, int line);
 #endif
 
+/* workers.c */
+extern int dhcpd_workers;
+extern int dhcpd_worker_id;
+extern const char *path_dhcpd_shared_db;
+extern int worker_seeding;
+
+int worker_owns_packet (struct packet *);
+int worker_owns_address (struct iaddr);
+void worker_foreign_lease (struct lease *);
+int worker_adopt_lease (struct iaddr);
+void worker_need_leases (struct pool *);
+void worker_host_changed (struct host_decl *);
+void worker_lease_file_setup (void);
+void start_workers (int, int);
+void worker_inbox_setup (void);
+
 #if defined (BINARY_LEASES)
 /* leasechain.c */
 int lc_not_empty(struct leasechain *lc);
@@ -37,6 +37,24 @@
 # define KEY_HASH_SIZE		1009
 #endif
 
+/* Tables grow once they hold more than HASH_MAX_LOAD entries per bucket
+ * on average.  The new bucket array is HASH_GROWTH_FACTOR times the size
+ * of the old one, and entries are migrated HASH_REHASH_STEP old buckets
+ * at a time by each subsequent add, delete or lookup, so that no single
+ * operation pays for the whole resize.
+ */
+#if !defined (HASH_MAX_LOAD)
+# define HASH_MAX_LOAD		2
+#endif
+
+#if !defined (HASH_GROWTH_FACTOR)
+# define HASH_GROWTH_FACTOR	2
+#endif
+
+#if !defined (HASH_REHASH_STEP)
+# define HASH_REHASH_STEP	64
+#endif
+
 /* The purpose of the hashed_object_t struct is to not match anything else. */
 typedef struct {
 	int foo;
@@ -63,8 +81,66 @@ struct hash_table {
 	hash_comparator_t cmp;
 	unsigned (*do_hash)(const void *, unsigned, unsigned);
 
+	/* Number of entries in the table, and the largest bucket count
+	 * worth growing to given the range of do_hash. */
+	unsigned entries;
+	unsigned max_count;
+
+	/* Non-zero while hash_foreach() is walking the table; no buckets
+	 * are migrated and no resize is started while this is set. */
+	int iterating;
+
+	/* While a resize is in progress, old_buckets holds the previous
+	 * bucket array.  Chains below rehash_index have been moved to
+	 * buckets; the rest are still in old_buckets. */
+	struct hash_bucket **old_buckets;
+	unsigned old_count;
+	unsigned rehash_index;
+
+	/* The current bucket array, hash_count entries long.  Initially
+	 * this points at initial_buckets. */
+	struct hash_bucket **buckets;
+
 	/* This must remain the last entry in this table. */
-	struct hash_bucket *buckets [1];
+	struct hash_bucket *initial_buckets [1];
+};
+
+/* An open-addressed table keyed by IPv4 addresses.  The four byte keys
+ * are stored inline in small groups, so a probe compares a whole group
+ * of keys at once and usually touches a single cache line, rather than
+ * chasing hash_bucket pointers and calling a comparison function per
+ * entry.  A slot whose value is null is empty if its key is zero, and a
+ * tombstone left by a deletion if its key is IP4_HASH_TOMBSTONE; any
+ * key, including those two, may be stored in a slot with a value.
+ */
+#if !defined (IP4_HASH_GROUP_SIZE)
+# define IP4_HASH_GROUP_SIZE	4
+#endif
+#define IP4_HASH_TOMBSTONE	0xffffffffU
+
+struct ip4_hash_group {
+	u_int32_t keys [IP4_HASH_GROUP_SIZE];
+	hashed_object_t *values [IP4_HASH_GROUP_SIZE];
+};
+
+struct ip4_hash_table {
+	/* Number of slots, always a power of two multiple of the group
+	 * size, and the number of live entries and tombstones in them. */
+	unsigned hash_count;
+	unsigned entries;
+	unsigned tombstones;
+	hash_reference referencer;
+	hash_dereference dereferencer;
+
+	/* As for struct hash_table, growth is incremental: while
+	 * old_groups is non-null, groups below rehash_index have been
+	 * moved into groups and the rest are still in old_groups. */
+	int iterating;
+	unsigned group_mask;
+	struct ip4_hash_group *groups;
+	struct ip4_hash_group *old_groups;
+	unsigned old_mask;
+	unsigned rehash_index;
 };
 
 struct named_hash {
@@ -133,7 +209,55 @@ void name##_free_hash_table (hashtype **table, const char *file, int line)    \
 	free_hash_table ((struct hash_table **)table, file, line);	      \
 }
 
-void relinquish_hash_bucket_hunks (void);
+/* Generate the same functions as HASH_FUNCTIONS, for a table that
+ * is a struct ip4_hash_table rather than a struct hash_table. */
+#define IP4_HASH_FUNCTIONS(name, bufarg, type, hashtype, ref, deref)	      \
+void name##_hash_add (hashtype *table,					      \
+		      bufarg buf, unsigned len, type *ptr,		      \
+		      const char *file, int line)			      \
+{									      \
+	add_ip4_hash ((struct ip4_hash_table *)table, buf,		      \
+		      len, (hashed_object_t *)ptr, file, line);		      \
+}									      \
+									      \
+void name##_hash_delete (hashtype *table, bufarg buf, unsigned len,	      \
+			 const char *file, int line)			      \
+{									      \
+	delete_ip4_hash_entry ((struct ip4_hash_table *)table, buf, len,      \
+			       file, line);				      \
+}									      \
+									      \
+int name##_hash_lookup (type **ptr, hashtype *table,			      \
+			bufarg buf, unsigned len, const char *file, int line) \
+{									      \
+	return ip4_hash_lookup ((hashed_object_t **)ptr,		      \
+				(struct ip4_hash_table *)table,		      \
+				buf, len, file, line);			      \
+}									      \
+									      \
+unsigned char * name##_hash_report(hashtype *table)			      \
+{									      \
+	return ip4_hash_report((struct ip4_hash_table *)table);		      \
+}									      \
+									      \
+int name##_hash_foreach (hashtype *table, hash_foreach_func func)	      \
+{									      \
+	return ip4_hash_foreach ((struct ip4_hash_table *)table,	      \
+				 func);					      \
+}									      \
+									      \
+int name##_new_hash (hashtype **tp, unsigned c, const char *file, int line)   \
+{									      \
+	return new_ip4_hash ((struct ip4_hash_table **)tp,		      \
+			     (hash_reference)ref, (hash_dereference)deref, c, \
+			     file, line);				      \
+}									      \
+									      \
+void name##_free_hash_table (hashtype **table, const char *file, int line)    \
+{									      \
+	free_ip4_hash_table ((struct ip4_hash_table **)table, file, line);    \
+}
+
 int new_hash_table (struct hash_table **, unsigned, const char *, int);
 void free_hash_table (struct hash_table **, const char *, int);
 struct hash_bucket *new_hash_bucket (const char *, int);
@@ -148,6 +272,8 @@ unsigned do_id_hash(const void *, unsigned, unsigned);
 unsigned do_number_hash(const void *, unsigned, unsigned);
 unsigned do_ip4_hash(const void *, unsigned, unsigned);
 unsigned char *hash_report(struct hash_table *);
+unsigned hash_chain_count(struct hash_table *);
+struct hash_bucket *hash_chain(struct hash_table *, unsigned);
 void add_hash (struct hash_table *,
 		      const void *, unsigned, hashed_object_t *,
 		      const char *, int);
@@ -158,4 +284,16 @@ int hash_lookup (hashed_object_t **, struct hash_table *,
 int hash_foreach (struct hash_table *, hash_foreach_func);
 int casecmp (const void *s, const void *t, size_t len);
 
+int new_ip4_hash(struct ip4_hash_table **, hash_reference, hash_dereference,
+		 unsigned, const char *, int);
+void free_ip4_hash_table(struct ip4_hash_table **, const char *, int);
+void add_ip4_hash(struct ip4_hash_table *, const void *, unsigned,
+		  hashed_object_t *, const char *, int);
+void delete_ip4_hash_entry(struct ip4_hash_table *, const void *, unsigned,
+			   const char *, int);
+int ip4_hash_lookup(hashed_object_t **, struct ip4_hash_table *,
+		    const void *, unsigned, const char *, int);
+unsigned char *ip4_hash_report(struct ip4_hash_table *);
+int ip4_hash_foreach(struct ip4_hash_table *, hash_foreach_func);
+
 #endif /* OMAPI_HASH_H */
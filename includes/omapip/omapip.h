@@ -570,6 +570,25 @@ void dump_rc_history (void *);
 void rc_history_next (int);
 #endif
 void omapi_print_dmalloc_usage_by_caller (void);
+
+/* A typed slab pool; see slab_alloc() in omapip/alloc.c.   Declare one
+   with static storage as SLAB_POOL ("name", type); slab_alloc() adds it
+   to the list that slab_pool_stats() reports on. */
+struct slab_class;
+struct slab_pool {
+	const char *name;
+	size_t size;
+	struct slab_class *sclass;
+	unsigned long in_use;
+	unsigned long peak;
+	unsigned long allocs;
+	struct slab_pool *next;
+};
+#define SLAB_POOL(name, type) { name, sizeof (type), NULL, 0, 0, 0, NULL }
+
+void *slab_alloc (struct slab_pool *, const char *, int);
+void slab_free (struct slab_pool *, void *, const char *, int);
+void slab_pool_stats (void);
 isc_result_t omapi_object_allocate (omapi_object_t **,
 				    omapi_object_type_t *,
 				    size_t, const char *, int);
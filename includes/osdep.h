@@ -267,6 +267,14 @@
 # define HAVE_SO_BINDTODEVICE
 #endif
 
+/* The DHCPv4 workers can share sockets (-reuseport) if each can tell
+   the unicasts the kernel gives it alone from the broadcasts. */
+#if defined (USE_SOCKET_RECEIVE) && defined (SO_REUSEPORT) && \
+    defined (IP_PKTINFO) && \
+    !(defined (IP_RECVPKTINFO) && defined (USE_V4_PKTINFO))
+# define HAVE_V4_REUSEPORT
+#endif
+
 #if defined (AF_LINK) && !defined (HAVE_AF_LINK)
 # define HAVE_AF_LINK
 #endif
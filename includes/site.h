@@ -197,6 +197,15 @@
 
 /* #define USE_RAW_SOCKETS */
 
+/* Define this to the number of frames the Linux packet filter code
+   should pull off the socket with a single recvmmsg() call.   When a
+   large number of clients all start at once (e.g., after a power
+   outage) this cuts the per-packet system call overhead considerably.
+   If the running kernel doesn't support recvmmsg(), the server falls
+   back to reading one frame at a time. */
+
+/* #define LPF_RECV_BATCH 32 */
+
 /* Define this to keep the old program name (e.g., "dhcpd" for
    the DHCP server) in place of the (base) name the program was
    invoked with. */
@@ -219,6 +228,15 @@
 
 #define COMPACT_LEASES
 
+/* Define this to keep the server's lease-by-IP-address index in an
+   open-addressed table with the IPv4 addresses stored inline, rather
+   than in a general purpose chained hash table.  This avoids a pointer
+   chase and a comparison function call per entry examined, which
+   noticeably reduces cache misses per lookup with large numbers of
+   leases, at the cost of somewhat more memory for the table itself. */
+
+/* #define USE_IP4_LEASE_HASH */
+
 /* Define this if you want to be able to save and playback server operational
    traces. */
 
@@ -344,6 +362,47 @@
  * obtain the desired lease(s) fails. Applies to IPv4 mode only. */
 /* #define CALL_SCRIPT_ON_ONETRY_FAIL */
 
+/* The server reads a large DHCPv4 lease file at startup using up to
+   this many processes, one per CPU.  Set it to 1 to always read the
+   lease file in a single process.  LEASE_LOAD_PARALLEL_MIN is the
+   smallest lease file, in bytes, that is split up. */
+/* #define LEASE_LOAD_PROCESSES 8 */
+/* #define LEASE_LOAD_PARALLEL_MIN (16 * 1024 * 1024) */
+
+/* Size of the stdio buffer for the lease file.  Leases written between
+   two commits go out in as few writes as this allows. */
+/* #define LEASE_FILE_BUFSIZ 65536 */
+
+/* Option caches, hash buckets, IAs and IA addresses are allocated from
+   slab pools that get memory from malloc in hunks of this many bytes. */
+/* #define SLAB_HUNK_SIZE 16384 */
+
+/* Size of the arena that the buffers and option states made while
+   handling one packet are allocated from. */
+/* #define PACKET_ARENA_SIZE 8192 */
+
+/* Class and option expressions are compiled into programs for a small
+   stack machine.  EXPR_STACK_DEPTH limits how deep its value stack can
+   get; deeper expressions are evaluated as trees.  Intermediate values
+   are built in an area of EXPR_SCRATCH_SIZE bytes on the C stack. */
+/* #define EXPR_STACK_DEPTH 32 */
+/* #define EXPR_SCRATCH_SIZE 512 */
+
+/* Number of option cache values remembered while handling one packet.
+   Must be a power of two. */
+/* #define OPTION_MEMO_SIZE 16 */
+
+/* Number of options an option state first makes room for in an option
+   space whose codes fit in a byte, such as the dhcp space.  The room
+   is doubled as needed. */
+/* #define OPTION_INDEX_SIZE 8 */
+
+/* IPv6 address pools of up to 2^POOL6_INDEX_BITS addresses keep a bitmap
+   of the addresses in use, which takes 2^POOL6_INDEX_BITS / 8 bytes per
+   pool.  When the address hashed from a client's DUID is taken, the
+   next free one is found from the bitmap. */
+/* #define POOL6_INDEX_BITS 20 */
+
 /* Include definitions for various options.  In general these
    should be left as is, but if you have already defined one
    of these and prefer your definition you can comment the 
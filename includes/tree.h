@@ -281,6 +281,9 @@ struct expression {
 	} data;
 	int flags;
 #	define EXPR_EPHEMERAL	1
+
+	/* The compiled form of the tree rooted here, if any. */
+	struct expr_program *program;
 };		
 
 /* DNS host entry structure... */
@@ -512,6 +512,176 @@ void omapi_print_dmalloc_usage_by_caller ()
 }
 #endif /* DEBUG_MEMORY_LEAKAGE || DEBUG_MALLOC_POOL */
 
+/*
+ * Typed slab pools.
+ *
+ * Small objects that are allocated and freed all the time (option caches,
+ * hash buckets, IAs and their addresses) come from slab pools instead of
+ * one dmalloc() each.  Each pool has a type name and keeps its own counts
+ * for slab_pool_stats(); the memory itself belongs to a size class shared
+ * by every pool whose objects round up to the same size, so an object
+ * freed by one type can be handed out to another.  A size class gets its
+ * memory in hunks of SLAB_HUNK_SIZE bytes and never gives it back; freed
+ * objects go on the class's free list, linked through their first word.
+ *
+ * When memory debugging is compiled in, slab_alloc() and slab_free() are
+ * just dmalloc() and dfree(), so that every object is still tracked.
+ */
+
+#if !defined (SLAB_HUNK_SIZE)
+# define SLAB_HUNK_SIZE	16384
+#endif
+
+/* Objects are rounded up to a multiple of this. */
+#define SLAB_ALIGN	16
+
+struct slab_hunk {
+	struct slab_hunk *next;
+};
+
+struct slab_class {
+	struct slab_class *next;
+	size_t size;
+	unsigned per_hunk;
+	void *free;
+	unsigned long free_count;
+	unsigned long hunk_count;
+	struct slab_hunk *hunks;
+};
+
+static struct slab_class *slab_classes;
+static struct slab_pool *slab_pools;
+
+static int slab_pool_init (struct slab_pool *pool)
+{
+	struct slab_class *sc;
+	size_t size;
+
+	size = (pool -> size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+	if (size < sizeof (void *))
+		size = sizeof (void *);
+
+	for (sc = slab_classes; sc; sc = sc -> next)
+		if (sc -> size == size)
+			break;
+	if (!sc) {
+		sc = dmalloc (sizeof *sc, MDL);
+		if (!sc)
+			return 0;
+		sc -> size = size;
+		sc -> per_hunk = (SLAB_HUNK_SIZE - SLAB_ALIGN) / size;
+		if (sc -> per_hunk < 8)
+			sc -> per_hunk = 8;
+		sc -> next = slab_classes;
+		slab_classes = sc;
+	}
+
+	pool -> sclass = sc;
+	pool -> next = slab_pools;
+	slab_pools = pool;
+	return 1;
+}
+
+#if !defined (DEBUG_MEMORY_LEAKAGE) && !defined (DEBUG_MALLOC_POOL) && \
+		!defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+/* Add a hunk's worth of objects to a size class's free list. */
+static int slab_grow (struct slab_class *sc, const char *file, int line)
+{
+	struct slab_hunk *hunk;
+	char *obj;
+	unsigned i;
+
+	hunk = dmalloc (SLAB_ALIGN + sc -> per_hunk * sc -> size, file, line);
+	if (!hunk)
+		return 0;
+	hunk -> next = sc -> hunks;
+	sc -> hunks = hunk;
+	sc -> hunk_count++;
+
+	obj = (char *)hunk + SLAB_ALIGN;
+	for (i = 0; i < sc -> per_hunk; i++) {
+		*(void **)obj = sc -> free;
+		sc -> free = obj;
+		obj += sc -> size;
+	}
+	sc -> free_count += sc -> per_hunk;
+	return 1;
+}
+#endif
+
+/* Allocate a zeroed object from a pool. */
+void *slab_alloc (struct slab_pool *pool, const char *file, int line)
+{
+	void *rval;
+#if !defined (DEBUG_MEMORY_LEAKAGE) && !defined (DEBUG_MALLOC_POOL) && \
+		!defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+	struct slab_class *sc;
+#endif
+
+	if (!pool -> sclass && !slab_pool_init (pool))
+		return NULL;
+
+#if defined (DEBUG_MEMORY_LEAKAGE) || defined (DEBUG_MALLOC_POOL) || \
+		defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+	rval = dmalloc (pool -> size, file, line);
+	if (!rval)
+		return NULL;
+#else
+	sc = pool -> sclass;
+	if (!sc -> free && !slab_grow (sc, file, line))
+		return NULL;
+	rval = sc -> free;
+	sc -> free = *(void **)rval;
+	sc -> free_count--;
+	memset (rval, 0, pool -> size);
+#endif
+
+	pool -> allocs++;
+	if (++pool -> in_use > pool -> peak)
+		pool -> peak = pool -> in_use;
+	return rval;
+}
+
+/* Return an object to its pool. */
+void slab_free (struct slab_pool *pool, void *ptr, const char *file, int line)
+{
+	if (!ptr) {
+		log_error ("slab_free %s(%d): free on null pointer.",
+			   file, line);
+		return;
+	}
+	pool -> in_use--;
+
+#if defined (DEBUG_MEMORY_LEAKAGE) || defined (DEBUG_MALLOC_POOL) || \
+		defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+	dfree (ptr, file, line);
+#else
+	*(void **)ptr = pool -> sclass -> free;
+	pool -> sclass -> free = ptr;
+	pool -> sclass -> free_count++;
+#endif
+}
+
+/* Log how much memory each pool and size class is using. */
+void slab_pool_stats ()
+{
+	struct slab_pool *pool;
+	struct slab_class *sc;
+
+	for (pool = slab_pools; pool; pool = pool -> next)
+		log_info ("slab %s: %lu in use (%lu bytes), peak %lu, "
+			  "%lu allocations", pool -> name, pool -> in_use,
+			  pool -> in_use * (unsigned long)pool -> sclass -> size,
+			  pool -> peak, pool -> allocs);
+	for (sc = slab_classes; sc; sc = sc -> next)
+		log_info ("slab %lu-byte objects: %lu hunks (%lu bytes), "
+			  "%lu free", (unsigned long)sc -> size,
+			  sc -> hunk_count,
+			  sc -> hunk_count * (unsigned long)(SLAB_ALIGN +
+					      sc -> per_hunk * sc -> size),
+			  sc -> free_count);
+}
+
 isc_result_t omapi_object_allocate (omapi_object_t **o,
 				    omapi_object_type_t *type,
 				    size_t size,
@@ -52,6 +52,24 @@ find_length(const void *key,
 	return 0;
 }
 
+/*
+ * Return the number of distinct values the hash function can produce,
+ * which is the largest bucket count it is useful to grow a table to.
+ * The string hashes fold their accumulator into 16 bits and the client
+ * identifier hash into 24 bits, so buckets beyond that would never be
+ * used.
+ */
+static unsigned
+find_range(unsigned (*do_hash)(const void *, unsigned, unsigned))
+{
+	if (do_hash == do_case_hash || do_hash == do_string_hash)
+		return 65536;
+	if (do_hash == do_id_hash)
+		return 1 << 24;
+
+	return UINT_MAX / HASH_GROWTH_FACTOR;
+}
+
 int new_hash_table (tp, count, file, line)
 	struct hash_table **tp;
 	unsigned count;
@@ -91,6 +109,8 @@ int new_hash_table (tp, count, file, line)
 	if (!rval)
 		return 0;
 	rval -> hash_count = count;
+	rval -> max_count = count;
+	rval -> buckets = rval -> initial_buckets;
 	*tp = rval;
 	return 1;
 }
@@ -107,87 +127,39 @@ void free_hash_table (tp, file, line)
 	int i;
 	struct hash_bucket *hbc, *hbn = (struct hash_bucket *)0;
 
-	for (i = 0; ptr != NULL && i < ptr -> hash_count; i++) {
-	    for (hbc = ptr -> buckets [i]; hbc; hbc = hbn) {
+	for (i = 0; ptr != NULL && i < hash_chain_count (ptr); i++) {
+	    for (hbc = hash_chain (ptr, i); hbc; hbc = hbn) {
 		hbn = hbc -> next;
 		if (ptr -> dereferencer && hbc -> value)
 		    (*ptr -> dereferencer) (&hbc -> value, MDL);
 	    }
-	    for (hbc = ptr -> buckets [i]; hbc; hbc = hbn) {
+	    for (hbc = hash_chain (ptr, i); hbc; hbc = hbn) {
 		hbn = hbc -> next;
 		free_hash_bucket (hbc, MDL);
 	    }
-	    ptr -> buckets [i] = (struct hash_bucket *)0;
 	}
 #endif
 
+	if (ptr != NULL) {
+		if (ptr -> old_buckets != NULL &&
+		    ptr -> old_buckets != ptr -> initial_buckets)
+			dfree(ptr -> old_buckets, MDL);
+		if (ptr -> buckets != ptr -> initial_buckets)
+			dfree(ptr -> buckets, MDL);
+	}
+
 	dfree((void *)ptr, MDL);
 	*tp = (struct hash_table *)0;
 }
 
-struct hash_bucket *free_hash_buckets;
-
-#if defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
-struct hash_bucket *hash_bucket_hunks;
-
-void relinquish_hash_bucket_hunks ()
-{
-	struct hash_bucket *c, *n, **p;
-
-	/* Account for all the hash buckets on the free list. */
-	p = &free_hash_buckets;
-	for (c = free_hash_buckets; c; c = c -> next) {
-		for (n = hash_bucket_hunks; n; n = n -> next) {
-			if (c > n && c < n + 127) {
-				*p = c -> next;
-				n -> len++;
-				break;
-			}
-		}
-		/* If we didn't delete the hash bucket from the free list,
-		   advance the pointer. */
-		if (!n)
-			p = &c -> next;
-	}
-		
-	for (c = hash_bucket_hunks; c; c = n) {
-		n = c -> next;
-		if (c -> len != 126) {
-			log_info ("hashbucket %lx hash_buckets %d free %u",
-				  (unsigned long)c, 127, c -> len);
-		}
-		dfree (c, MDL);
-	}
-}
-#endif
+static struct slab_pool hash_bucket_pool =
+	SLAB_POOL ("hash_bucket", struct hash_bucket);
 
 struct hash_bucket *new_hash_bucket (file, line)
 	const char *file;
 	int line;
 {
-	struct hash_bucket *rval;
-	int i = 0;
-	if (!free_hash_buckets) {
-		rval = dmalloc (127 * sizeof (struct hash_bucket),
-				file, line);
-		if (!rval)
-			return rval;
-# if defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
-		rval -> next = hash_bucket_hunks;
-		hash_bucket_hunks = rval;
-		hash_bucket_hunks -> len = 0;
-		i++;
-		rval++;
-#endif
-		for (; i < 127; i++) {
-			rval -> next = free_hash_buckets;
-			free_hash_buckets = rval;
-			rval++;
-		}
-	}
-	rval = free_hash_buckets;
-	free_hash_buckets = rval -> next;
-	return rval;
+	return slab_alloc (&hash_bucket_pool, file, line);
 }
 
 void free_hash_bucket (ptr, file, line)
@@ -195,18 +167,7 @@ void free_hash_bucket (ptr, file, line)
 	const char *file;
 	int line;
 {
-#if defined (DEBUG_MALLOC_POOL)
-	struct hash_bucket *hp;
-
-	for (hp = free_hash_buckets; hp; hp = hp -> next) {
-		if (hp == ptr) {
-			log_error ("hash bucket freed twice!");
-			abort ();
-		}
-	}
-#endif
-	ptr -> next = free_hash_buckets;
-	free_hash_buckets = ptr;
+	slab_free (&hash_bucket_pool, ptr, file, line);
 }
 
 int new_hash(struct hash_table **rp,
@@ -228,6 +189,12 @@ int new_hash(struct hash_table **rp,
 	(*rp)->dereferencer = dereferencer;
 	(*rp)->do_hash = hasher;
 
+	/* Allow the table to grow as far as the hash function can spread
+	 * entries, but never shrink below the size the caller asked for. */
+	(*rp)->max_count = find_range(hasher);
+	if ((*rp)->max_count < hsize)
+		(*rp)->max_count = hsize;
+
 	if (hasher == do_case_hash)
 		(*rp)->cmp = casecmp;
 	else
@@ -357,10 +324,16 @@ hash_report(struct hash_table *table)
 	if (table->hash_count == 0)
 		return (unsigned char *) "Invalid hash table.";
 
-	for (i = 0 ; i < table->hash_count ; i++) {
+	for (i = 0 ; i < hash_chain_count(table) ; i++) {
 		curlen = 0;
 
-		bp = table->buckets[i];
+		/* Buckets already migrated out of the old array of a
+		 * table being resized are not part of its shape. */
+		if ((i >= table->hash_count) &&
+		    (i - table->hash_count < table->rehash_index))
+			continue;
+
+		bp = hash_chain(table, i);
 		while (bp != NULL) {
 			curlen++;
 			bp = bp->next;
@@ -393,6 +366,111 @@ hash_report(struct hash_table *table)
 	return retbuf;
 }
 
+/*
+ * Return the number of bucket chains in the table, counting those of
+ * the old bucket array while a resize is in progress.  Together with
+ * hash_chain() this lets callers walk every entry without caring
+ * whether the table is part way through growing.
+ */
+unsigned
+hash_chain_count(struct hash_table *table)
+{
+	if (table->old_buckets != NULL)
+		return table->hash_count + table->old_count;
+	return table->hash_count;
+}
+
+struct hash_bucket *
+hash_chain(struct hash_table *table, unsigned i)
+{
+	if (i < table->hash_count)
+		return table->buckets[i];
+	return table->old_buckets[i - table->hash_count];
+}
+
+/*
+ * Move one chain from the old bucket array into the current one.  Each
+ * entry is appended to the tail of its new chain so that, for duplicate
+ * keys, the most recently added entry is still the first one found.
+ */
+static void
+rehash_chain(struct hash_table *table, unsigned index)
+{
+	struct hash_bucket *bp, *next, **tail;
+	unsigned hashno;
+
+	for (bp = table->old_buckets[index]; bp != NULL; bp = next) {
+		next = bp->next;
+		hashno = (*table->do_hash)(bp->name, bp->len,
+					   table->hash_count);
+		for (tail = &table->buckets[hashno]; *tail != NULL;
+		     tail = &(*tail)->next)
+			;
+		bp->next = NULL;
+		*tail = bp;
+	}
+	table->old_buckets[index] = NULL;
+}
+
+/*
+ * Migrate up to count chains of a table that is being resized.  Once
+ * the last chain has been moved the old bucket array is released.
+ */
+static void
+rehash_step(struct hash_table *table, unsigned count)
+{
+	if (table->old_buckets == NULL || table->iterating)
+		return;
+
+	while (count-- > 0 && table->rehash_index < table->old_count)
+		rehash_chain(table, table->rehash_index++);
+
+	if (table->rehash_index < table->old_count)
+		return;
+
+	if (table->old_buckets != table->initial_buckets)
+		dfree(table->old_buckets, MDL);
+	table->old_buckets = NULL;
+	table->old_count = 0;
+	table->rehash_index = 0;
+}
+
+/*
+ * Start growing the table if it has passed its load factor.  Only the
+ * new bucket array is allocated here; the entries themselves are moved
+ * a few chains at a time by rehash_step().
+ */
+static void
+maybe_grow(struct hash_table *table)
+{
+	struct hash_bucket **nb;
+	unsigned count;
+
+	if (table->old_buckets != NULL || table->iterating ||
+	    table->hash_count >= table->max_count ||
+	    table->entries / HASH_MAX_LOAD <= table->hash_count)
+		return;
+
+	count = table->hash_count * HASH_GROWTH_FACTOR + 1;
+	if (count > table->max_count)
+		count = table->max_count;
+
+	nb = dmalloc(count * sizeof(struct hash_bucket *), MDL);
+	if (nb == NULL) {
+		/* Not fatal: the table keeps working at its current size
+		 * and we'll try again on a later insert. */
+		log_debug("Can't grow hash table to %u buckets: no memory.",
+			  count);
+		return;
+	}
+
+	table->old_buckets = table->buckets;
+	table->old_count = table->hash_count;
+	table->rehash_index = 0;
+	table->buckets = nb;
+	table->hash_count = count;
+}
+
 void add_hash (table, key, len, pointer, file, line)
 	struct hash_table *table;
 	unsigned len;
@@ -411,6 +489,8 @@ void add_hash (table, key, len, pointer, file, line)
 	if (!len)
 		len = find_length(key, table->do_hash);
 
+	rehash_step(table, HASH_REHASH_STEP);
+
 	hashno = (*table->do_hash)(key, len, table->hash_count);
 	bp = new_hash_bucket (file, line);
 
@@ -427,6 +507,27 @@ void add_hash (table, key, len, pointer, file, line)
 	bp -> next = table -> buckets [hashno];
 	bp -> len = len;
 	table -> buckets [hashno] = bp;
+	table -> entries++;
+
+	maybe_grow(table);
+}
+
+/*
+ * If the table is being resized and the chain that key hashed to in the
+ * old bucket array hasn't been migrated yet, return that chain.
+ */
+static struct hash_bucket **
+find_old_chain(struct hash_table *table, const void *key, unsigned len)
+{
+	unsigned hashno;
+
+	if (table->old_buckets == NULL)
+		return NULL;
+
+	hashno = (*table->do_hash)(key, len, table->old_count);
+	if (hashno < table->rehash_index)
+		return NULL;
+	return &table->old_buckets[hashno];
 }
 
 void delete_hash_entry (table, key, len, file, line)
@@ -436,9 +537,9 @@ void delete_hash_entry (table, key, len, file, line)
 	const char *file;
 	int line;
 {
-	int hashno;
-	struct hash_bucket *bp, *pbp = (struct hash_bucket *)0;
+	struct hash_bucket *bp, **bpp, **chains [2];
 	void *foo;
+	int i;
 
 	if (!table)
 		return;
@@ -446,28 +547,36 @@ void delete_hash_entry (table, key, len, file, line)
 	if (!len)
 		len = find_length(key, table->do_hash);
 
-	hashno = (*table->do_hash)(key, len, table->hash_count);
+	rehash_step(table, HASH_REHASH_STEP);
 
-	/* Go through the list looking for an entry that matches;
+	/* The entry may be in the current chain, or, if the table is
+	   being resized and its old chain hasn't been migrated yet, in
+	   the old one.  Newer entries are always in the current chain. */
+	chains [0] = &table -> buckets [(*table->do_hash)(key, len,
+							  table->hash_count)];
+	chains [1] = find_old_chain(table, key, len);
+
+	/* Go through the lists looking for an entry that matches;
 	   if we find it, delete it. */
-	for (bp = table -> buckets [hashno]; bp; bp = bp -> next) {
-		if ((!bp -> len &&
-		     !strcmp ((const char *)bp->name, key)) ||
-		    (bp -> len == len &&
-		     !(table -> cmp)(bp->name, key, len))) {
-			if (pbp) {
-				pbp -> next = bp -> next;
-			} else {
-				table -> buckets [hashno] = bp -> next;
-			}
-			if (bp -> value && table -> dereferencer) {
-				foo = &bp -> value;
-				(*(table -> dereferencer)) (foo, file, line);
+	for (i = 0; i < 2 && chains [i]; i++) {
+		for (bpp = chains [i]; (bp = *bpp) != NULL;
+		     bpp = &bp -> next) {
+			if ((!bp -> len &&
+			     !strcmp ((const char *)bp->name, key)) ||
+			    (bp -> len == len &&
+			     !(table -> cmp)(bp->name, key, len))) {
+				*bpp = bp -> next;
+				if (bp -> value && table -> dereferencer) {
+					foo = &bp -> value;
+					(*(table -> dereferencer)) (foo,
+								    file,
+								    line);
+				}
+				free_hash_bucket (bp, file, line);
+				table -> entries--;
+				return;
 			}
-			free_hash_bucket (bp, file, line);
-			break;
 		}
-		pbp = bp;	/* jwg, 9/6/96 - nice catch! */
 	}
 }
 
@@ -480,7 +589,7 @@ int hash_lookup (vp, table, key, len, file, line)
 	int line;
 {
 	int hashno;
-	struct hash_bucket *bp;
+	struct hash_bucket *bp, **old;
 
 	if (!table)
 		return 0;
@@ -492,42 +601,60 @@ int hash_lookup (vp, table, key, len, file, line)
 			  "initialized to zero (from %s:%d).", file, line);
 	}
 
-	hashno = (*table->do_hash)(key, len, table->hash_count);
+	rehash_step(table, HASH_REHASH_STEP);
 
-	for (bp = table -> buckets [hashno]; bp; bp = bp -> next) {
-		if (len == bp -> len
-		    && !(*table->cmp)(bp->name, key, len)) {
-			if (table -> referencer)
-				(*table -> referencer) (vp, bp -> value,
-							file, line);
-			else
-				*vp = bp -> value;
-			return 1;
+	hashno = (*table->do_hash)(key, len, table->hash_count);
+	bp = table -> buckets [hashno];
+	old = find_old_chain(table, key, len);
+
+	for (;;) {
+		for (; bp; bp = bp -> next) {
+			if (len == bp -> len
+			    && !(*table->cmp)(bp->name, key, len)) {
+				if (table -> referencer)
+					(*table -> referencer) (vp, bp -> value,
+								file, line);
+				else
+					*vp = bp -> value;
+				return 1;
+			}
 		}
+		if (old == NULL)
+			break;
+		bp = *old;
+		old = NULL;
 	}
 	return 0;
 }
 
 int hash_foreach (struct hash_table *table, hash_foreach_func func)
 {
-	int i;
+	unsigned i;
 	struct hash_bucket *bp, *next;
 	int count = 0;
 
 	if (!table)
 		return 0;
 
-	for (i = 0; i < table -> hash_count; i++) {
-		bp = table -> buckets [i];
+	/* Callers may add or delete entries as we go; hold off moving
+	   chains between bucket arrays until we're done. */
+	table -> iterating++;
+
+	for (i = 0; i < hash_chain_count (table); i++) {
+		bp = hash_chain (table, i);
 		while (bp) {
 			next = bp -> next;
 			if ((*func)(bp->name, bp->len, bp->value)
-							!= ISC_R_SUCCESS)
+							!= ISC_R_SUCCESS) {
+				table -> iterating--;
 				return count;
+			}
 			bp = next;
 			count++;
 		}
 	}
+
+	table -> iterating--;
 	return count;
 }
 
@@ -557,3 +684,505 @@ int casecmp (const void *v1, const void *v2, size_t len)
 	}
 	return 0;
 }
+
+/*
+ * Open-addressed IPv4 tables.
+ *
+ * Slots are arranged in groups of IP4_HASH_GROUP_SIZE keys followed by
+ * their values.  A key hashes to a group, and probing moves on to the
+ * next group only when the current one is full, so a lookup compares
+ * all of a group's keys at once and almost always finishes within one
+ * group.  Tables grow when more than three quarters of the slots are in
+ * use or tombstoned, and, like the chained tables above, migrate their
+ * old contents a few groups at a time.
+ */
+
+static unsigned
+ip4_hash_group(u_int32_t key, unsigned mask)
+{
+	/* Mix all the bits of the address into the low ones, so that
+	 * consecutive addresses are spread across the table rather than
+	 * filling neighbouring groups. */
+	key = ntohl(key);
+	key = ((key >> 16) ^ key) * 0x45d9f3b;
+	key = ((key >> 16) ^ key) * 0x45d9f3b;
+	key = (key >> 16) ^ key;
+	return key & mask;
+}
+
+/*
+ * Find key in an array of groups.  Returns the group holding it and
+ * sets *slot, or returns NULL.
+ *
+ * The keys of a group are compared in a single pass that builds a
+ * bitmask of matching slots and of empty slots; this is written as a
+ * plain loop over the group so the compiler can unroll and vectorize
+ * it.
+ */
+static struct ip4_hash_group *
+ip4_hash_find(struct ip4_hash_group *groups, unsigned mask, u_int32_t key,
+	      unsigned *slot)
+{
+	struct ip4_hash_group *grp;
+	unsigned g, probes, match, empty, i;
+
+	g = ip4_hash_group(key, mask);
+	for (probes = 0; probes <= mask; probes++) {
+		grp = &groups[(g + probes) & mask];
+
+		match = empty = 0;
+		for (i = 0; i < IP4_HASH_GROUP_SIZE; i++) {
+			match |= (unsigned)(grp->keys[i] == key) << i;
+			empty |= (unsigned)(grp->keys[i] == 0) << i;
+		}
+
+		for (i = 0; match != 0; i++, match >>= 1) {
+			if ((match & 1) && grp->values[i] != NULL) {
+				*slot = i;
+				return grp;
+			}
+		}
+
+		/* A zero key with no value is an empty slot, which ends
+		   the probe sequence. */
+		for (i = 0; empty != 0; i++, empty >>= 1) {
+			if ((empty & 1) && grp->values[i] == NULL)
+				return NULL;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Put key in the first empty or tombstoned slot of its probe sequence
+ * in the table's current groups, and return that group and slot.  The
+ * caller must know that the key isn't already there.
+ */
+static struct ip4_hash_group *
+ip4_hash_place(struct ip4_hash_table *table, u_int32_t key, unsigned *slot)
+{
+	struct ip4_hash_group *grp;
+	unsigned g, probes, i;
+
+	g = ip4_hash_group(key, table->group_mask);
+	for (probes = 0; probes <= table->group_mask; probes++) {
+		grp = &table->groups[(g + probes) & table->group_mask];
+		for (i = 0; i < IP4_HASH_GROUP_SIZE; i++) {
+			if (grp->values[i] != NULL)
+				continue;
+			if (grp->keys[i] == IP4_HASH_TOMBSTONE)
+				table->tombstones--;
+			grp->keys[i] = key;
+			*slot = i;
+			return grp;
+		}
+	}
+	return NULL;
+}
+
+static void
+ip4_hash_remove(struct ip4_hash_table *table, struct ip4_hash_group *grp,
+		unsigned slot, const char *file, int line)
+{
+	void *foo;
+
+	if (table->dereferencer != NULL) {
+		foo = &grp->values[slot];
+		(*table->dereferencer)(foo, file, line);
+	}
+	grp->values[slot] = NULL;
+	grp->keys[slot] = IP4_HASH_TOMBSTONE;
+	table->entries--;
+
+	/* Tombstones in the old groups go away with them. */
+	if (grp >= table->groups && grp <= &table->groups[table->group_mask])
+		table->tombstones++;
+}
+
+/*
+ * Migrate up to count groups of a table that is being resized, and
+ * release the old groups once they have all been moved.  Values are
+ * moved, not re-referenced.  Each slot moved out of the old groups
+ * becomes a tombstone there: linear probing can leave a key outside
+ * its home group, so a lookup that falls back to the old groups can't
+ * tell from rehash_index alone whether a key has been moved.
+ */
+static void
+ip4_rehash_step(struct ip4_hash_table *table, unsigned count)
+{
+	struct ip4_hash_group *grp, *ngrp;
+	unsigned i, slot;
+
+	if (table->old_groups == NULL || table->iterating)
+		return;
+
+	while (count-- > 0 && table->rehash_index <= table->old_mask) {
+		grp = &table->old_groups[table->rehash_index++];
+		for (i = 0; i < IP4_HASH_GROUP_SIZE; i++) {
+			if (grp->values[i] == NULL)
+				continue;
+			ngrp = ip4_hash_place(table, grp->keys[i], &slot);
+			if (ngrp == NULL)
+				log_fatal("IPv4 hash table overflow at %s:%d.",
+					  MDL);
+			ngrp->values[slot] = grp->values[i];
+			grp->values[i] = NULL;
+			grp->keys[i] = IP4_HASH_TOMBSTONE;
+		}
+	}
+
+	if (table->rehash_index <= table->old_mask)
+		return;
+
+	dfree(table->old_groups, MDL);
+	table->old_groups = NULL;
+	table->old_mask = 0;
+	table->rehash_index = 0;
+}
+
+static int
+ip4_hash_alloc_groups(struct ip4_hash_table *table, unsigned ngroups,
+		      const char *file, int line)
+{
+	struct ip4_hash_group *groups;
+
+	groups = dmalloc(ngroups * sizeof(struct ip4_hash_group), file, line);
+	if (groups == NULL)
+		return 0;
+
+	table->groups = groups;
+	table->group_mask = ngroups - 1;
+	table->hash_count = ngroups * IP4_HASH_GROUP_SIZE;
+	table->tombstones = 0;
+	return 1;
+}
+
+/*
+ * Make room for one more entry.  If the table is past its load factor
+ * a new set of groups is allocated - twice as many, unless most of the
+ * used slots are tombstones, in which case the same number - and the
+ * existing entries are migrated to it incrementally.
+ */
+static void
+ip4_hash_maybe_grow(struct ip4_hash_table *table)
+{
+	struct ip4_hash_group *old;
+	unsigned old_mask, ngroups;
+
+	if ((table->entries + table->tombstones + 1) * 4 <=
+	    table->hash_count * 3)
+		return;
+
+	/* Don't move anything while hash_foreach is running.  There is
+	   still a quarter of the table free, and we'll grow on the first
+	   insert after it's done. */
+	if (table->iterating)
+		return;
+
+	/* Still moving entries from the last resize; finish that off
+	   before starting another. */
+	if (table->old_groups != NULL)
+		ip4_rehash_step(table, table->old_mask + 1);
+
+	ngroups = table->group_mask + 1;
+	if (table->entries * 2 >= table->hash_count)
+		ngroups *= 2;
+
+	old = table->groups;
+	old_mask = table->group_mask;
+	if (!ip4_hash_alloc_groups(table, ngroups, MDL)) {
+		log_debug("Can't grow IPv4 hash table to %u slots: "
+			  "no memory.", ngroups * IP4_HASH_GROUP_SIZE);
+		return;
+	}
+	table->old_groups = old;
+	table->old_mask = old_mask;
+	table->rehash_index = 0;
+}
+
+int
+new_ip4_hash(struct ip4_hash_table **rp,
+	     hash_reference referencer, hash_dereference dereferencer,
+	     unsigned hsize, const char *file, int line)
+{
+	struct ip4_hash_table *rval;
+	unsigned ngroups;
+
+	if (rp == NULL) {
+		log_error("%s(%d): new_ip4_hash called with null pointer.",
+			  file, line);
+#if defined (POINTER_DEBUG)
+		abort();
+#endif
+		return 0;
+	}
+	if (*rp != NULL) {
+		log_error("%s(%d): non-null target for new_ip4_hash.",
+			  file, line);
+#if defined (POINTER_DEBUG)
+		abort();
+#endif
+	}
+
+	if (hsize == 0)
+		hsize = DEFAULT_HASH_SIZE;
+
+	/* Round up to a power of two number of groups. */
+	for (ngroups = 1; ngroups * IP4_HASH_GROUP_SIZE < hsize; ngroups <<= 1)
+		;
+
+	rval = dmalloc(sizeof(struct ip4_hash_table), file, line);
+	if (rval == NULL)
+		return 0;
+	if (!ip4_hash_alloc_groups(rval, ngroups, file, line)) {
+		dfree(rval, file, line);
+		return 0;
+	}
+	rval->referencer = referencer;
+	rval->dereferencer = dereferencer;
+	*rp = rval;
+	return 1;
+}
+
+void
+free_ip4_hash_table(struct ip4_hash_table **tp, const char *file, int line)
+{
+	struct ip4_hash_table *ptr = *tp;
+
+	if (ptr == NULL)
+		return;
+
+#if defined (DEBUG_MEMORY_LEAKAGE) || \
+		defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+	if (ptr->dereferencer != NULL) {
+		struct ip4_hash_group *grp;
+		unsigned g, i;
+
+		for (g = 0; g <= ptr->group_mask; g++) {
+			grp = &ptr->groups[g];
+			for (i = 0; i < IP4_HASH_GROUP_SIZE; i++)
+				if (grp->values[i] != NULL)
+					(*ptr->dereferencer)(&grp->values[i],
+							     MDL);
+		}
+		for (g = ptr->rehash_index;
+		     ptr->old_groups != NULL && g <= ptr->old_mask; g++) {
+			grp = &ptr->old_groups[g];
+			for (i = 0; i < IP4_HASH_GROUP_SIZE; i++)
+				if (grp->values[i] != NULL)
+					(*ptr->dereferencer)(&grp->values[i],
+							     MDL);
+		}
+	}
+#endif
+
+	if (ptr->old_groups != NULL)
+		dfree(ptr->old_groups, file, line);
+	dfree(ptr->groups, file, line);
+	dfree(ptr, file, line);
+	*tp = NULL;
+}
+
+/*
+ * Look key up in the table, checking the not yet migrated old groups
+ * too if the table is being resized.
+ */
+static struct ip4_hash_group *
+ip4_hash_find_any(struct ip4_hash_table *table, u_int32_t key,
+		  unsigned *slot)
+{
+	struct ip4_hash_group *grp;
+
+	grp = ip4_hash_find(table->groups, table->group_mask, key, slot);
+	if (grp == NULL && table->old_groups != NULL)
+		grp = ip4_hash_find(table->old_groups, table->old_mask,
+				    key, slot);
+	return grp;
+}
+
+void
+add_ip4_hash(struct ip4_hash_table *table, const void *key, unsigned len,
+	     hashed_object_t *pointer, const char *file, int line)
+{
+	struct ip4_hash_group *grp;
+	unsigned slot;
+	u_int32_t k;
+	void *foo;
+
+	if (table == NULL)
+		return;
+
+	if (len != 0 && len != 4) {
+		log_error("%s(%d): IPv4 hash key with length %u.",
+			  file, line, len);
+		return;
+	}
+	memcpy(&k, key, 4);
+
+	ip4_rehash_step(table, HASH_REHASH_STEP);
+
+	/* Unlike the chained tables, which keep duplicates with the
+	   newest shadowing the rest, an address has a single entry and
+	   adding it again replaces the old value. */
+	grp = ip4_hash_find_any(table, k, &slot);
+	if (grp != NULL)
+		ip4_hash_remove(table, grp, slot, file, line);
+
+	ip4_hash_maybe_grow(table);
+
+	grp = ip4_hash_place(table, k, &slot);
+	if (grp == NULL) {
+		log_error("Can't add entry to IPv4 hash table: table full.");
+		return;
+	}
+	if (table->referencer != NULL) {
+		foo = &grp->values[slot];
+		(*table->referencer)(foo, pointer, file, line);
+	} else
+		grp->values[slot] = pointer;
+	table->entries++;
+}
+
+void
+delete_ip4_hash_entry(struct ip4_hash_table *table, const void *key,
+		      unsigned len, const char *file, int line)
+{
+	struct ip4_hash_group *grp;
+	unsigned slot;
+	u_int32_t k;
+
+	if (table == NULL || (len != 0 && len != 4))
+		return;
+	memcpy(&k, key, 4);
+
+	ip4_rehash_step(table, HASH_REHASH_STEP);
+
+	grp = ip4_hash_find_any(table, k, &slot);
+	if (grp != NULL)
+		ip4_hash_remove(table, grp, slot, file, line);
+}
+
+int
+ip4_hash_lookup(hashed_object_t **vp, struct ip4_hash_table *table,
+		const void *key, unsigned len, const char *file, int line)
+{
+	struct ip4_hash_group *grp;
+	unsigned slot;
+	u_int32_t k;
+
+	if (table == NULL || (len != 0 && len != 4))
+		return 0;
+
+	if (*vp != NULL) {
+		log_fatal("Internal inconsistency: storage value has not been "
+			  "initialized to zero (from %s:%d).", file, line);
+	}
+	memcpy(&k, key, 4);
+
+	ip4_rehash_step(table, HASH_REHASH_STEP);
+
+	grp = ip4_hash_find_any(table, k, &slot);
+	if (grp == NULL)
+		return 0;
+
+	if (table->referencer != NULL)
+		(*table->referencer)(vp, grp->values[slot], file, line);
+	else
+		*vp = grp->values[slot];
+	return 1;
+}
+
+unsigned char *
+ip4_hash_report(struct ip4_hash_table *table)
+{
+	static unsigned char retbuf[sizeof("Contents/Size (%): "
+					   "2147483647/2147483647 "
+					   "(2147483647%). "
+					   "Tombstones/max probe: "
+					   "2147483647/2147483647")];
+	struct ip4_hash_group *grp;
+	unsigned g, i, pct, dist, maxdist = 0;
+
+	if (table == NULL)
+		return (unsigned char *) "No table.";
+
+	if (table->hash_count == 0)
+		return (unsigned char *) "Invalid hash table.";
+
+	/* The longest probe sequence, in groups, needed to reach an
+	   entry in the current groups. */
+	for (g = 0; g <= table->group_mask; g++) {
+		grp = &table->groups[g];
+		for (i = 0; i < IP4_HASH_GROUP_SIZE; i++) {
+			if (grp->values[i] == NULL)
+				continue;
+			dist = (g - ip4_hash_group(grp->keys[i],
+						   table->group_mask)) &
+				table->group_mask;
+			if (dist + 1 > maxdist)
+				maxdist = dist + 1;
+		}
+	}
+
+	if (table->entries >= (UINT_MAX / 100))
+		pct = table->entries / ((table->hash_count / 100) + 1);
+	else
+		pct = (table->entries * 100) / table->hash_count;
+
+	if (table->entries > 2147483647 ||
+	    table->hash_count > 2147483647 ||
+	    table->tombstones > 2147483647)
+		return (unsigned char *) "Report out of range for display.";
+
+	sprintf((char *)retbuf,
+		"Contents/Size (%%): %u/%u (%u%%). "
+		"Tombstones/max probe: %u/%u",
+		table->entries, table->hash_count, pct,
+		table->tombstones, maxdist);
+
+	return retbuf;
+}
+
+int
+ip4_hash_foreach(struct ip4_hash_table *table, hash_foreach_func func)
+{
+	struct ip4_hash_group *groups[2], *grp;
+	unsigned masks[2], start[2], g, i, j;
+	int count = 0;
+
+	if (table == NULL)
+		return 0;
+
+	groups[0] = table->old_groups;
+	masks[0] = table->old_mask;
+	start[0] = table->rehash_index;
+	groups[1] = table->groups;
+	masks[1] = table->group_mask;
+	start[1] = 0;
+
+	/* Callers may add or delete entries as we go.  That only ever
+	   fills or tombstones slots while we're iterating; nothing is
+	   moved between groups until we're done. */
+	table->iterating++;
+
+	for (j = 0; j < 2; j++) {
+		if (groups[j] == NULL)
+			continue;
+		for (g = start[j]; g <= masks[j]; g++) {
+			grp = &groups[j][g];
+			for (i = 0; i < IP4_HASH_GROUP_SIZE; i++) {
+				if (grp->values[i] == NULL)
+					continue;
+				if ((*func)(&grp->keys[i], 4, grp->values[i])
+				    != ISC_R_SUCCESS) {
+					table->iterating--;
+					return count;
+				}
+				count++;
+			}
+		}
+	}
+
+	table->iterating--;
+	return count;
+}
@@ -758,6 +758,7 @@ do_relay4(struct interface_info *ip, struct dhcp_packet *packet,
 	struct sockaddr_in to;
 	struct interface_info *out;
 	struct hardware hto, *htop;
+	int sent = 0, failed;
 
 	if (packet->hlen > sizeof packet->chaddr) {
 		log_info("Discarding packet with invalid hlen, received on "
@@ -880,7 +881,10 @@ do_relay4(struct interface_info *ip, struct dhcp_packet *packet,
 		return;
 
 	/* Otherwise, it's a BOOTREQUEST, so forward it to all the
-	   servers. */
+	   servers, sending the copies out together.   A queued copy
+	   isn't known to have gone out until the batch is flushed, so
+	   the copies are only counted as relayed once that's done. */
+	begin_send_batch();
 	for (sp = servers; sp; sp = sp->next) {
 		if (send_packet((fallback_interface
 				 ? fallback_interface : interfaces),
@@ -892,10 +896,12 @@ do_relay4(struct interface_info *ip, struct dhcp_packet *packet,
 			       print_hw_addr(packet->htype, packet->hlen,
 					      packet->chaddr),
 			       inet_ntoa(sp->to.sin_addr));
-			++client_packets_relayed;
+			++sent;
 		}
 	}
-				 
+	failed = flush_send_batch();
+	client_packet_errors += failed;
+	client_packets_relayed += sent - failed;
 }
 
 /* Strip any Relay Agent Information options from the DHCP packet
@@ -0,0 +1,852 @@
+/* binleases.c
+
+   Binary lease files. */
+
+/*
+ * Copyright (c) 2017 by Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *   Internet Systems Consortium, Inc.
+ *   950 Charter Street
+ *   Redwood City, CA 94063
+ *   <info@isc.org>
+ *   https://www.isc.org/
+ *
+ */
+
+/*
+ * Reading a large lease file through the configuration lexer takes a
+ * long time, so the server can also keep a binary copy of its leases,
+ * which it maps into memory at startup and loads without parsing.
+ *
+ * A binary lease file holds the same leases as a freshly written lease
+ * file.  IPv4 leases that consist only of their fixed fields (times,
+ * binding states, hardware address, uid and client hostname) are stored
+ * as fixed-size records, with the uids and hostnames in a heap after
+ * them.  Everything else (classes, hosts, failover states, IPv6 leases
+ * and IPv4 leases with bindings, agent options or on-events) is kept as
+ * lease file text and is parsed as usual.  All numbers are big-endian.
+ *
+ * With -lbf the server writes a binary lease file each time it rewrites
+ * its lease file, and records how long the lease file was at that point
+ * along with a hash of its last few kilobytes.  At startup, if the lease
+ * file still starts the same way, the server loads the binary lease file
+ * and parses only what was appended to the lease file after that.
+ * Otherwise it ignores the binary file and reads the lease file as
+ * before.  The text lease file is always written and is the one that
+ * counts; dhcpd -convert-leases converts between the two formats.
+ */
+
+#include "dhcpd.h"
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <limits.h>
+#include <errno.h>
+
+#define BL_MAGIC		"DHCPLBIN"
+#define BL_VERSION		1
+#define BL_HEADER_SIZE		128
+#define BL_RECORD_SIZE		96
+
+/* Header layout. */
+#define BLH_MAGIC		0
+#define BLH_VERSION		8
+#define BLH_RECORD_SIZE		12
+#define BLH_RECORD_COUNT	16
+#define BLH_RECORD_OFFSET	24
+#define BLH_HEAP_OFFSET		32
+#define BLH_HEAP_LEN		40
+#define BLH_TEXT_OFFSET		48
+#define BLH_TEXT_LEN		56
+#define BLH_JOURNAL_LEN		64
+#define BLH_JOURNAL_CHECK	72
+#define BLH_FAMILY		76
+
+/* Record layout. */
+#define BLR_ADDR		0
+#define BLR_BINDING_STATE	4
+#define BLR_NEXT_STATE		5
+#define BLR_REWIND_STATE	6
+#define BLR_FLAGS		7
+#define BLR_STARTS		8
+#define BLR_ENDS		16
+#define BLR_TSTP		24
+#define BLR_TSFP		32
+#define BLR_ATSFP		40
+#define BLR_CLTT		48
+#define BLR_HLEN		56
+#define BLR_UID_LEN		58
+#define BLR_UID			60
+#define BLR_HWADDR		64	/* HARDWARE_ADDR_LEN + 1 bytes */
+#define BLR_HOSTNAME_LEN	86
+#define BLR_HOSTNAME		88
+
+/* How much of the end of the covered lease file gets hashed. */
+#define BL_JOURNAL_WINDOW	4096
+
+/* The most processes used to read a lease file, and how big the lease
+   file has to be before it's worth using more than one. */
+#if !defined (LEASE_LOAD_PROCESSES)
+# define LEASE_LOAD_PROCESSES	8
+#endif
+#if !defined (LEASE_LOAD_PARALLEL_MIN)
+# define LEASE_LOAD_PARALLEL_MIN	(16 * 1024 * 1024)
+#endif
+
+/* State while a binary lease file is being written. */
+static int bl_writing;
+static int bl_error;
+static FILE *bl_file;
+static FILE *bl_text;
+static u_int64_t bl_count;
+static unsigned char *bl_heap;
+static size_t bl_heap_len, bl_heap_max;
+
+static void put_u64 (unsigned char *buf, u_int64_t val)
+{
+	putULong (buf, (u_int32_t)(val >> 32));
+	putULong (buf + 4, (u_int32_t)val);
+}
+
+static u_int64_t get_u64 (const unsigned char *buf)
+{
+	return (((u_int64_t)getULong (buf)) << 32) | getULong (buf + 4);
+}
+
+/* Binding states are written the way write_lease() writes them. */
+static u_int8_t bl_state (binding_state_t state)
+{
+	if (state > 0 && state <= FTS_LAST)
+		return state;
+	return FTS_ABANDONED;
+}
+
+static int bl_heap_add (const void *data, size_t len, u_int32_t *offset)
+{
+	unsigned char *n;
+	size_t max;
+
+	if (bl_heap_len + len > 0xffffffffUL)
+		return 0;
+	if (bl_heap_len + len > bl_heap_max) {
+		max = bl_heap_max ? bl_heap_max * 2 : 65536;
+		while (max < bl_heap_len + len)
+			max *= 2;
+		n = dmalloc (max, MDL);
+		if (!n)
+			return 0;
+		if (bl_heap) {
+			memcpy (n, bl_heap, bl_heap_len);
+			dfree (bl_heap, MDL);
+		}
+		bl_heap = n;
+		bl_heap_max = max;
+	}
+	memcpy (bl_heap + bl_heap_len, data, len);
+	*offset = bl_heap_len;
+	bl_heap_len += len;
+	return 1;
+}
+
+/* Called by write_lease().   If a binary lease file is being written
+   and this lease can be stored as a record, store it and return 1;
+   otherwise return 0 so that write_lease() writes it out as text. */
+int binary_leases_add (struct lease *lease)
+{
+	unsigned char rec [BL_RECORD_SIZE];
+	struct binding *b;
+	size_t hostlen = 0;
+	u_int32_t offset;
+
+	if (!bl_writing)
+		return 0;
+
+	/* Anything beyond the fixed fields is written as text. */
+	if (lease -> ip_addr.len != 4 || lease -> agent_options ||
+	    lease -> on_star.on_expiry || lease -> on_star.on_release ||
+	    (lease -> billing_class && lease -> ends > cur_time) ||
+	    lease -> hardware_addr.hlen > sizeof lease -> hardware_addr.hbuf)
+		return 0;
+	if (lease -> scope) {
+		for (b = lease -> scope -> bindings; b; b = b -> next)
+			if (b -> value)
+				return 0;
+	}
+	if (lease -> client_hostname &&
+	    db_printable ((unsigned char *)lease -> client_hostname)) {
+		hostlen = strlen (lease -> client_hostname);
+		if (hostlen > 0xffff)
+			return 0;
+	}
+
+	if (bl_error)
+		return 1;
+
+	memset (rec, 0, sizeof rec);
+	memcpy (&rec [BLR_ADDR], lease -> ip_addr.iabuf, 4);
+	rec [BLR_BINDING_STATE] = bl_state (lease -> binding_state);
+	rec [BLR_NEXT_STATE] = bl_state (lease -> next_binding_state);
+	rec [BLR_REWIND_STATE] = bl_state (lease -> rewind_binding_state);
+	rec [BLR_FLAGS] = lease -> flags & (RESERVED_LEASE | BOOTP_LEASE);
+	put_u64 (&rec [BLR_STARTS], lease -> starts);
+	put_u64 (&rec [BLR_ENDS], lease -> ends);
+	put_u64 (&rec [BLR_TSTP], lease -> tstp);
+	put_u64 (&rec [BLR_TSFP], lease -> tsfp);
+	put_u64 (&rec [BLR_ATSFP], lease -> atsfp);
+	put_u64 (&rec [BLR_CLTT], lease -> cltt);
+	rec [BLR_HLEN] = lease -> hardware_addr.hlen;
+	memcpy (&rec [BLR_HWADDR], lease -> hardware_addr.hbuf,
+		lease -> hardware_addr.hlen);
+	if (lease -> uid_len) {
+		if (!bl_heap_add (lease -> uid, lease -> uid_len, &offset))
+			goto fail;
+		putUShort (&rec [BLR_UID_LEN], lease -> uid_len);
+		putULong (&rec [BLR_UID], offset);
+	}
+	if (hostlen) {
+		if (!bl_heap_add (lease -> client_hostname, hostlen, &offset))
+			goto fail;
+		putUShort (&rec [BLR_HOSTNAME_LEN], hostlen);
+		putULong (&rec [BLR_HOSTNAME], offset);
+	}
+
+	if (fwrite (rec, sizeof rec, 1, bl_file) != 1)
+		goto fail;
+	bl_count++;
+	return 1;
+
+      fail:
+	log_error ("Can't write binary lease %s: %m",
+		   piaddr (lease -> ip_addr));
+	bl_error = 1;
+	return 1;
+}
+
+/* Hash the last part of the first len bytes of a lease file, so that we
+   can tell later on whether a binary lease file still goes with it. */
+isc_result_t binary_leases_journal_check (const char *path, off_t len,
+					  u_int32_t *check)
+{
+	unsigned char buf [BL_JOURNAL_WINDOW];
+	off_t start;
+	ssize_t n;
+	int fd;
+	u_int32_t hash = 2166136261U;
+	ssize_t i;
+
+	if ((fd = open (path, O_RDONLY)) < 0)
+		return ISC_R_NOTFOUND;
+	start = len > (off_t)sizeof buf ? len - (off_t)sizeof buf : 0;
+	if (lseek (fd, start, SEEK_SET) < 0 ||
+	    (n = read (fd, buf, len - start)) != len - start) {
+		close (fd);
+		return ISC_R_IOERROR;
+	}
+	close (fd);
+
+	for (i = 0; i < n; i++) {
+		hash ^= buf [i];
+		hash *= 16777619U;
+	}
+	*check = hash;
+	return ISC_R_SUCCESS;
+}
+
+/* Start writing a binary lease file to f.   Until bl_finish(),
+   write_lease() stores what it can in records and writes everything else
+   as text to a temporary file that stands in for db_file. */
+static int bl_start (FILE *f)
+{
+	unsigned char hdr [BL_HEADER_SIZE];
+
+	bl_text = tmpfile ();
+	if (!bl_text) {
+		log_error ("Can't create temporary file: %m");
+		return 0;
+	}
+	memset (hdr, 0, sizeof hdr);
+	if (fwrite (hdr, sizeof hdr, 1, f) != 1) {
+		log_error ("Can't write binary lease file: %m");
+		fclose (bl_text);
+		bl_text = NULL;
+		return 0;
+	}
+
+	bl_file = f;
+	bl_writing = 1;
+	bl_error = 0;
+	bl_count = 0;
+	bl_heap_len = 0;
+	db_file = bl_text;
+	return 1;
+}
+
+/* Put the heap, the text and the header after the records.   The
+   caller closes the file. */
+static int bl_finish (off_t journal_len, u_int32_t check, int sync)
+{
+	unsigned char hdr [BL_HEADER_SIZE];
+	char buf [8192];
+	u_int64_t text_offset, text_len, heap_offset;
+	size_t n;
+
+	bl_writing = 0;
+	if (bl_error)
+		goto fail;
+
+	heap_offset = BL_HEADER_SIZE + bl_count * BL_RECORD_SIZE;
+	if (bl_heap_len && fwrite (bl_heap, bl_heap_len, 1, bl_file) != 1)
+		goto write_fail;
+
+	text_offset = heap_offset + bl_heap_len;
+	text_len = 0;
+	if (fflush (bl_text) == EOF)
+		goto write_fail;
+	rewind (bl_text);
+	while ((n = fread (buf, 1, sizeof buf, bl_text)) > 0) {
+		if (fwrite (buf, n, 1, bl_file) != 1)
+			goto write_fail;
+		text_len += n;
+	}
+	if (ferror (bl_text))
+		goto write_fail;
+
+	memset (hdr, 0, sizeof hdr);
+	memcpy (&hdr [BLH_MAGIC], BL_MAGIC, 8);
+	putULong (&hdr [BLH_VERSION], BL_VERSION);
+	putULong (&hdr [BLH_RECORD_SIZE], BL_RECORD_SIZE);
+	put_u64 (&hdr [BLH_RECORD_COUNT], bl_count);
+	put_u64 (&hdr [BLH_RECORD_OFFSET], BL_HEADER_SIZE);
+	put_u64 (&hdr [BLH_HEAP_OFFSET], heap_offset);
+	put_u64 (&hdr [BLH_HEAP_LEN], bl_heap_len);
+	put_u64 (&hdr [BLH_TEXT_OFFSET], text_offset);
+	put_u64 (&hdr [BLH_TEXT_LEN], text_len);
+	put_u64 (&hdr [BLH_JOURNAL_LEN], journal_len);
+	putULong (&hdr [BLH_JOURNAL_CHECK], check);
+	putULong (&hdr [BLH_FAMILY], local_family == AF_INET ? 4 : 6);
+	if (fseek (bl_file, 0, SEEK_SET) < 0 ||
+	    fwrite (hdr, sizeof hdr, 1, bl_file) != 1 ||
+	    fflush (bl_file) == EOF)
+		goto write_fail;
+	if (sync && dont_use_fsync == 0 && fsync (fileno (bl_file)) < 0)
+		goto write_fail;
+
+	fclose (bl_text);
+	bl_text = NULL;
+	bl_file = NULL;
+	return 1;
+
+      write_fail:
+	log_error ("Can't write binary lease file: %m");
+      fail:
+	fclose (bl_text);
+	bl_text = NULL;
+	bl_file = NULL;
+	return 0;
+}
+
+/* Write a binary lease file holding everything write_leases() would
+   write to a lease file.   journal_len is how much of the lease file
+   (path_dhcpd_db) it stands for, or zero if it stands on its own.
+   The caller takes care of db_file and the other lease file state. */
+int write_binary_leases (const char *path, off_t journal_len)
+{
+	char tmpname [512];
+	u_int32_t check = 0;
+	FILE *f;
+	int ok;
+
+	if (journal_len &&
+	    binary_leases_journal_check (path_dhcpd_db, journal_len,
+					 &check) != ISC_R_SUCCESS) {
+		log_error ("Can't read back %s: %m", path_dhcpd_db);
+		return 0;
+	}
+
+	if (snprintf (tmpname, sizeof tmpname, "%s.new", path) >=
+	    sizeof tmpname) {
+		log_error ("binary lease file path too long");
+		return 0;
+	}
+	f = fopen (tmpname, "w");
+	if (!f) {
+		log_error ("Can't create binary lease file %s: %m", tmpname);
+		return 0;
+	}
+
+	ok = bl_start (f);
+	if (ok) {
+		ok = write_leases ();
+		ok = bl_finish (journal_len, check, 1) && ok;
+	}
+	if (fclose (f) == EOF)
+		ok = 0;
+	if (!ok) {
+		(void) unlink (tmpname);
+		return 0;
+	}
+	if (rename (tmpname, path) < 0) {
+		log_error ("Can't install binary lease file %s: %m", path);
+		(void) unlink (tmpname);
+		return 0;
+	}
+	log_info ("Wrote %lu leases to binary lease file.",
+		  (unsigned long)bl_count);
+	return 1;
+}
+
+/* Turn a record back into a lease and enter it. */
+static int read_binary_lease (const unsigned char *rec,
+			      const unsigned char *heap, u_int64_t heap_len)
+{
+	struct lease *lease = NULL;
+	unsigned uid_len, host_len;
+	u_int32_t uid_off, host_off;
+	int i;
+
+	uid_len = getUShort (&rec [BLR_UID_LEN]);
+	uid_off = getULong (&rec [BLR_UID]);
+	host_len = getUShort (&rec [BLR_HOSTNAME_LEN]);
+	host_off = getULong (&rec [BLR_HOSTNAME]);
+	if ((u_int64_t)uid_off + uid_len > heap_len ||
+	    (u_int64_t)host_off + host_len > heap_len ||
+	    rec [BLR_HLEN] > HARDWARE_ADDR_LEN + 1)
+		return 0;
+	for (i = BLR_BINDING_STATE; i <= BLR_REWIND_STATE; i++)
+		if (rec [i] == 0 || rec [i] > FTS_LAST)
+			return 0;
+
+	if (lease_allocate (&lease, MDL) != ISC_R_SUCCESS)
+		log_fatal ("No memory for binary lease.");
+
+	lease -> ip_addr.len = 4;
+	memcpy (lease -> ip_addr.iabuf, &rec [BLR_ADDR], 4);
+	lease -> binding_state = rec [BLR_BINDING_STATE];
+	lease -> next_binding_state = rec [BLR_NEXT_STATE];
+	lease -> rewind_binding_state = rec [BLR_REWIND_STATE];
+	lease -> flags = rec [BLR_FLAGS] & (RESERVED_LEASE | BOOTP_LEASE);
+	lease -> starts = get_u64 (&rec [BLR_STARTS]);
+	lease -> ends = get_u64 (&rec [BLR_ENDS]);
+	lease -> tstp = get_u64 (&rec [BLR_TSTP]);
+	lease -> tsfp = get_u64 (&rec [BLR_TSFP]);
+	lease -> atsfp = get_u64 (&rec [BLR_ATSFP]);
+	lease -> cltt = get_u64 (&rec [BLR_CLTT]);
+
+	/* As in parse_lease_declaration(), a missing tstp means ends. */
+	if (!lease -> tstp)
+		lease -> tstp = lease -> ends;
+
+	lease -> hardware_addr.hlen = rec [BLR_HLEN];
+	memcpy (lease -> hardware_addr.hbuf, &rec [BLR_HWADDR],
+		lease -> hardware_addr.hlen);
+
+	if (uid_len) {
+		if (uid_len < sizeof lease -> uid_buf) {
+			lease -> uid = lease -> uid_buf;
+			lease -> uid_max = sizeof lease -> uid_buf;
+		} else {
+			lease -> uid = dmalloc (uid_len, MDL);
+			if (!lease -> uid)
+				log_fatal ("No memory for lease uid");
+			lease -> uid_max = uid_len;
+		}
+		memcpy (lease -> uid, heap + uid_off, uid_len);
+		lease -> uid_len = uid_len;
+	}
+
+	if (host_len) {
+		lease -> client_hostname = dmalloc (host_len + 1, MDL);
+		if (!lease -> client_hostname)
+			log_fatal ("No memory for client hostname.");
+		memcpy (lease -> client_hostname, heap + host_off, host_len);
+		lease -> client_hostname [host_len] = 0;
+	}
+
+	enter_lease (lease);
+	lease_dereference (&lease, MDL);
+	return 1;
+}
+
+/* Map a file into memory. */
+static isc_result_t bl_map (int fd, const char *name,
+			    const unsigned char **map, size_t *size)
+{
+	struct stat st;
+
+	if (fstat (fd, &st) < 0 || st.st_size < BL_HEADER_SIZE) {
+		log_error ("%s: not a binary lease file.", name);
+		return DHCP_R_FORMERR;
+	}
+	*map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (*map == MAP_FAILED) {
+		log_error ("Can't map binary lease file %s: %m", name);
+		return ISC_R_IOERROR;
+	}
+	*size = st.st_size;
+	return ISC_R_SUCCESS;
+}
+
+/* Load the leases in a mapped binary lease file.   If check_journal is
+   set, first make sure it still goes with the lease file. */
+static isc_result_t bl_load (const unsigned char *map, size_t size,
+			     const char *name, int check_journal,
+			     off_t *journal_len, u_int64_t *loaded)
+{
+	const unsigned char *rec;
+	struct parse *cfile = NULL;
+	u_int64_t count, rec_off, heap_off, heap_len, text_off, text_len;
+	u_int64_t jlen, i;
+	u_int32_t check, jcheck;
+	unsigned bad = 0;
+	isc_result_t status;
+
+	if (memcmp (&map [BLH_MAGIC], BL_MAGIC, 8) ||
+	    getULong (&map [BLH_VERSION]) != BL_VERSION ||
+	    getULong (&map [BLH_RECORD_SIZE]) != BL_RECORD_SIZE) {
+		log_error ("%s: not a binary lease file I can read.", name);
+		return DHCP_R_FORMERR;
+	}
+	if (getULong (&map [BLH_FAMILY]) != (local_family == AF_INET ? 4 : 6)) {
+		log_error ("%s: binary lease file is for the other protocol.",
+			   name);
+		return DHCP_R_FORMERR;
+	}
+
+	count = get_u64 (&map [BLH_RECORD_COUNT]);
+	rec_off = get_u64 (&map [BLH_RECORD_OFFSET]);
+	heap_off = get_u64 (&map [BLH_HEAP_OFFSET]);
+	heap_len = get_u64 (&map [BLH_HEAP_LEN]);
+	text_off = get_u64 (&map [BLH_TEXT_OFFSET]);
+	text_len = get_u64 (&map [BLH_TEXT_LEN]);
+	jlen = get_u64 (&map [BLH_JOURNAL_LEN]);
+	jcheck = getULong (&map [BLH_JOURNAL_CHECK]);
+	if (rec_off < BL_HEADER_SIZE || rec_off > size ||
+	    count > (size - rec_off) / BL_RECORD_SIZE ||
+	    heap_off > size || heap_len > size - heap_off ||
+	    text_off > size || text_len > size - text_off ||
+	    text_len > UINT_MAX) {
+		log_error ("%s: binary lease file is damaged.", name);
+		return DHCP_R_FORMERR;
+	}
+
+	/* Make sure the lease file still starts out the way it did when
+	   this was written. */
+	if (check_journal && jlen) {
+		if (binary_leases_journal_check (path_dhcpd_db, jlen,
+						 &check) != ISC_R_SUCCESS ||
+		    check != jcheck) {
+			log_info ("%s doesn't match %s, not using it.",
+				  name, path_dhcpd_db);
+			return ISC_R_NOTFOUND;
+		}
+	}
+
+	/* Everything that wasn't stored as a record, in the order it was
+	   written, and then the records. */
+	if (text_len) {
+		status = new_parse (&cfile, -1, (char *)map + text_off,
+				    text_len, name, 0);
+		if (status != ISC_R_SUCCESS)
+			return status;
+		(void) lease_file_subparse (cfile);
+		end_parse (&cfile);
+	}
+
+	rec = map + rec_off;
+	for (i = 0; i < count; i++, rec += BL_RECORD_SIZE)
+		if (!read_binary_lease (rec, map + heap_off, heap_len))
+			bad++;
+	if (bad)
+		log_error ("%s: skipped %u damaged lease records.", name, bad);
+
+	*journal_len = jlen;
+	*loaded = count - bad;
+	return ISC_R_SUCCESS;
+}
+
+/* Load a binary lease file.   On success, *journal_len is set to how much
+   of the lease file the binary file already covers, so the caller can
+   parse the rest.   If the binary file is missing, damaged or doesn't go
+   with the current lease file, nothing is loaded and an error is
+   returned. */
+isc_result_t read_binary_leases (const char *path, off_t *journal_len)
+{
+	const unsigned char *map;
+	size_t size;
+	u_int64_t loaded;
+	isc_result_t status;
+	int fd;
+
+	if ((fd = open (path, O_RDONLY)) < 0) {
+		if (errno == ENOENT)
+			return ISC_R_NOTFOUND;
+		log_error ("Can't open binary lease file %s: %m", path);
+		return ISC_R_IOERROR;
+	}
+	status = bl_map (fd, path, &map, &size);
+	close (fd);
+	if (status != ISC_R_SUCCESS)
+		return status;
+
+	status = bl_load (map, size, path, 1, journal_len, &loaded);
+	if (status == ISC_R_SUCCESS)
+		log_info ("Read %lu leases from binary lease file %s.",
+			  (unsigned long)loaded, path);
+	munmap ((void *)map, size);
+	return status;
+}
+
+/*
+ * Parallel lease file loading.
+ *
+ * Most of the time it takes to read a large lease file goes into the
+ * lexer and parse_lease_declaration().   The server's data structures
+ * aren't thread safe, so instead of threads we use processes, and use
+ * binary lease files to get the results back: the lease file is split
+ * into chunks at lease boundaries, and each chunk is parsed by a child
+ * process that writes the leases it found, the last one for each
+ * address, to a temporary binary lease file.   The server then loads
+ * those in file order, so later leases still replace earlier ones.
+ *
+ * The chunks are split where a line starting with "lease" follows one
+ * holding just a closing brace, which is always the start of a lease in
+ * a lease file the server wrote.   A child stops at the first thing
+ * that isn't a lease (a class or host declaration, say) and the server
+ * parses the rest of that chunk itself; if a child fails, the server
+ * parses its whole chunk.
+ */
+
+static const char bl_boundary [] = "\n}\nlease ";
+
+/* Return the offset of the first lease at or after offset start. */
+static size_t bl_next_lease (const char *buf, size_t start, size_t len)
+{
+	const char *p = buf + start;
+
+	while ((p = memchr (p, '\n', len - (p - buf))) != NULL) {
+		if (len - (p - buf) < sizeof bl_boundary - 1)
+			break;
+		if (!memcmp (p, bl_boundary, sizeof bl_boundary - 1))
+			return (p - buf) + 3;
+		p++;
+	}
+	return len;
+}
+
+/* Parse some lease file text the usual way. */
+static void bl_parse_text (char *buf, size_t len, const char *name)
+{
+	struct parse *cfile = NULL;
+
+	if (len == 0)
+		return;
+	if (new_parse (&cfile, -1, buf, len, name, 0) != ISC_R_SUCCESS)
+		return;
+	(void) lease_file_subparse (cfile);
+	end_parse (&cfile);
+}
+
+static isc_result_t bl_chunk_write_lease (const void *name, unsigned len,
+					  void *object)
+{
+	write_lease ((struct lease *)object);
+	return ISC_R_SUCCESS;
+}
+
+/* In the child: parse the leases in a chunk and write them to out as a
+   binary lease file.   The journal length in its header says how far
+   into the chunk we got. */
+static int bl_parse_chunk (char *buf, size_t len, const char *name,
+			   FILE *out)
+{
+	struct parse *cfile = NULL;
+	lease_ip_hash_t *seen = NULL;
+	struct lease *lease, *old;
+	enum dhcp_token token;
+	const char *val;
+	size_t done;
+
+	if (new_parse (&cfile, -1, buf, len, name, 0) != ISC_R_SUCCESS ||
+	    !lease_ip_new_hash (&seen, LEASE_HASH_SIZE, MDL))
+		return 0;
+
+	for (;;) {
+		if (cfile -> token)
+			return 0;
+		done = cfile -> bufix;
+		token = next_token (&val, NULL, cfile);
+		if (token == END_OF_FILE) {
+			done = len;
+			break;
+		}
+		if (token != LEASE)
+			break;
+
+		lease = NULL;
+		if (!parse_lease_declaration (&lease, cfile) ||
+		    cfile -> warnings_occurred)
+			return 0;
+
+		/* Only the last lease for each address counts. */
+		old = NULL;
+		if (lease_ip_hash_lookup (&old, seen, lease -> ip_addr.iabuf,
+					  lease -> ip_addr.len, MDL)) {
+			lease_ip_hash_delete (seen, lease -> ip_addr.iabuf,
+					      lease -> ip_addr.len, MDL);
+			lease_dereference (&old, MDL);
+		}
+		lease_ip_hash_add (seen, lease -> ip_addr.iabuf,
+				   lease -> ip_addr.len, lease, MDL);
+		lease_dereference (&lease, MDL);
+	}
+
+	if (!bl_start (out))
+		return 0;
+	lease_ip_hash_foreach (seen, bl_chunk_write_lease);
+	return bl_finish (done, 0, 0);
+}
+
+/* Read the lease file from offset on, using several processes if it's
+   big enough to be worth it.   Returns zero without having read anything
+   if the caller should read the lease file itself. */
+int read_leases_parallel (const char *path, off_t offset)
+{
+	struct lease_chunk {
+		size_t start, end;
+		pid_t pid;
+		FILE *out;
+	} *chunks;
+	const unsigned char *map;
+	struct stat st;
+	char *buf;
+	size_t len, first, start, size;
+	u_int64_t loaded;
+	off_t done;
+	long ncpu;
+	pid_t pid;
+	int fd, i, n, status;
+
+	if (local_family != AF_INET)
+		return 0;
+#if defined (TRACING)
+	if (trace_record () || trace_playback ())
+		return 0;
+#endif
+	ncpu = sysconf (_SC_NPROCESSORS_ONLN);
+	if (ncpu > LEASE_LOAD_PROCESSES)
+		ncpu = LEASE_LOAD_PROCESSES;
+	if (ncpu < 2)
+		return 0;
+
+	if ((fd = open (path, O_RDONLY)) < 0)
+		return 0;
+	if (fstat (fd, &st) < 0 || st.st_size < offset ||
+	    st.st_size - offset < LEASE_LOAD_PARALLEL_MIN) {
+		close (fd);
+		return 0;
+	}
+	len = st.st_size;
+	buf = mmap (NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (buf == MAP_FAILED)
+		return 0;
+
+	chunks = dmalloc (ncpu * sizeof *chunks, MDL);
+	if (!chunks) {
+		munmap (buf, len);
+		return 0;
+	}
+
+	/* Whatever comes before the first lease is parsed here. */
+	if (len - offset >= 6 && !memcmp (buf + offset, "lease ", 6))
+		first = offset;
+	else
+		first = bl_next_lease (buf, offset, len);
+
+	n = 0;
+	start = first;
+	for (i = 1; i <= ncpu && start < len; i++) {
+		chunks [n].start = start;
+		chunks [n].end = i == ncpu ? len
+			: bl_next_lease (buf, first + (len - first) / ncpu * i,
+					 len);
+		if (chunks [n].end <= start)
+			continue;
+		start = chunks [n].end;
+
+		chunks [n].pid = -1;
+		chunks [n].out = tmpfile ();
+		if (chunks [n].out) {
+			fflush (NULL);
+			chunks [n].pid = fork ();
+		}
+		if (chunks [n].pid == 0) {
+			status = bl_parse_chunk (buf + chunks [n].start,
+						 chunks [n].end -
+						 chunks [n].start,
+						 path, chunks [n].out);
+			_exit (status ? 0 : 1);
+		}
+		n++;
+	}
+
+	bl_parse_text (buf + offset, first - offset, path);
+
+	/* Load the chunks in order as they come in. */
+	for (i = 0; i < n; i++) {
+		struct lease_chunk *c = &chunks [i];
+
+		done = 0;
+		if (c -> pid > 0) {
+			/* Only trust what the child wrote if we know it
+			   finished cleanly. */
+			status = 0;
+			while ((pid = waitpid (c -> pid, &status, 0)) < 0 &&
+			       errno == EINTR)
+				;
+			if (pid == c -> pid &&
+			    WIFEXITED (status) && WEXITSTATUS (status) == 0 &&
+			    bl_map (fileno (c -> out), path,
+				    &map, &size) == ISC_R_SUCCESS) {
+				if (bl_load (map, size, path, 0, &done,
+					     &loaded) != ISC_R_SUCCESS ||
+				    done > (off_t)(c -> end - c -> start))
+					done = 0;
+				munmap ((void *)map, size);
+			}
+		}
+		if (c -> out)
+			fclose (c -> out);
+
+		/* Parse whatever the child didn't. */
+		bl_parse_text (buf + c -> start + done,
+			       c -> end - c -> start - done, path);
+	}
+
+	log_info ("Read %s using %d processes.", path, n);
+	dfree (chunks, MDL);
+	munmap (buf, len);
+	return 1;
+}
+
+#if defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+void relinquish_binary_leases ()
+{
+	if (bl_heap) {
+		dfree (bl_heap, MDL);
+		bl_heap = NULL;
+	}
+	bl_heap_len = bl_heap_max = 0;
+}
+#endif
@@ -56,6 +56,10 @@ void bootp (packet)
 	if (packet -> raw -> op != BOOTREQUEST)
 		return;
 
+	/* In worker mode, leave other workers' clients to them. */
+	if (!worker_owns_packet (packet))
+		return;
+
 	/* %Audit% This is log output. %2004.06.17,Safe%
 	 * If we truncate we hope the user can get a hint from the log.
 	 */
@@ -59,135 +59,619 @@ void classify_client (packet)
 			    &global_scope, default_classification_rules, NULL);
 }
 
-int check_collection (packet, lease, collection)
-	struct packet *packet;
-	struct lease *lease;
-	struct collection *collection;
+/* Match index.
+
+   Most "match if" expressions just compare one value taken from the
+   packet with a constant - "option vendor-class-identifier = "foo"",
+   or "substring (option vendor-class-identifier, 0, 9) = "PXEClient"",
+   possibly or'd together.   Rather than evaluate each of those in turn,
+   check_collection() groups the classes in a collection by the value
+   they compare (the key), evaluates each key once per packet and looks
+   the result up in a hash of the constants.   Classes whose expressions
+   have any other form are evaluated as before, and the two lists are
+   merged so that classes still match in the order they were declared.
+
+   The index is rebuilt the next time it's used after any class is
+   added, removed or given a new match expression. */
+
+struct class_match {
+	struct class_match *next;	/* Next in hash bucket. */
+	const unsigned char *data;	/* Constant compared with the key. */
+	unsigned len;
+	int prefix;			/* Key need only start with data. */
+	int seq;			/* Position of class in collection. */
+	struct class *class;
+};
+
+struct class_key {
+	struct class_key *next;
+	struct expression *key;
+	struct class_match **hash;
+	unsigned hash_size;		/* Always a power of two. */
+	unsigned *prefix_lens;		/* Distinct lengths of prefixes. */
+	int nprefix_lens;
+};
+
+struct class_index {
+	int generation;
+	int busy;
+	struct class_key *keys;
+	struct class_match *matches;	/* All matches, for freeing. */
+	int nmatches;
+	struct class **plain;		/* Classes that aren't indexed. */
+	int *plain_seq;
+	int nplain;
+	struct class_match **hits;	/* Scratch, nmatches long. */
+};
+
+static int class_index_generation = 1;
+
+/* Called whenever the set of classes in a collection or the match
+   expression of one of them changes. */
+
+void invalidate_class_index ()
+{
+	class_index_generation++;
+}
+
+/* Can expr be evaluated once per packet and shared by several classes? */
+
+static int class_key_expression (struct expression *expr)
+{
+	switch (expr -> op) {
+	      case expr_option:
+	      case expr_hardware:
+	      case expr_const_data:
+	      case expr_const_int:
+		return 1;
+
+	      case expr_substring:
+		return (class_key_expression (expr -> data.substring.expr) &&
+			class_key_expression (expr -> data.substring.offset) &&
+			class_key_expression (expr -> data.substring.len));
+
+	      case expr_suffix:
+		return (class_key_expression (expr -> data.suffix.expr) &&
+			class_key_expression (expr -> data.suffix.len));
+
+	      case expr_packet:
+		return (class_key_expression (expr -> data.packet.offset) &&
+			class_key_expression (expr -> data.packet.len));
+
+	      case expr_concat:
+		return (class_key_expression (expr -> data.concat [0]) &&
+			class_key_expression (expr -> data.concat [1]));
+
+	      case expr_lcase:
+	      case expr_ucase:
+		return class_key_expression (expr -> data.lcase);
+
+	      default:
+		return 0;
+	}
+}
+
+/* Do a and b compute the same key? */
+
+static int class_key_same (struct expression *a, struct expression *b)
+{
+	if (a == b)
+		return 1;
+	if (a -> op != b -> op)
+		return 0;
+
+	switch (a -> op) {
+	      case expr_option:
+		return (a -> data.option -> universe ==
+			b -> data.option -> universe &&
+			a -> data.option -> code == b -> data.option -> code);
+
+	      case expr_hardware:
+		return 1;
+
+	      case expr_const_data:
+		return (a -> data.const_data.len ==
+			b -> data.const_data.len &&
+			(a -> data.const_data.len == 0 ||
+			 !memcmp (a -> data.const_data.data,
+				  b -> data.const_data.data,
+				  a -> data.const_data.len)));
+
+	      case expr_const_int:
+		return a -> data.const_int == b -> data.const_int;
+
+	      case expr_substring:
+		return (class_key_same (a -> data.substring.expr,
+					b -> data.substring.expr) &&
+			class_key_same (a -> data.substring.offset,
+					b -> data.substring.offset) &&
+			class_key_same (a -> data.substring.len,
+					b -> data.substring.len));
+
+	      case expr_suffix:
+		return (class_key_same (a -> data.suffix.expr,
+					b -> data.suffix.expr) &&
+			class_key_same (a -> data.suffix.len,
+					b -> data.suffix.len));
+
+	      case expr_packet:
+		return (class_key_same (a -> data.packet.offset,
+					b -> data.packet.offset) &&
+			class_key_same (a -> data.packet.len,
+					b -> data.packet.len));
+
+	      case expr_concat:
+		return (class_key_same (a -> data.concat [0],
+					b -> data.concat [0]) &&
+			class_key_same (a -> data.concat [1],
+					b -> data.concat [1]));
+
+	      case expr_lcase:
+	      case expr_ucase:
+		return class_key_same (a -> data.lcase, b -> data.lcase);
+
+	      default:
+		return 0;
+	}
+}
+
+/* Break a match expression into the key it tests and the constants it
+   compares that key with.   Returns the number of matches added to
+   *matches, or -1 if the expression isn't something we can index. */
+
+static int class_match_terms (struct expression *expr,
+			      struct expression **key,
+			      struct class_match *matches, int max)
+{
+	struct expression *left, *right, *k;
+	int n, m;
+
+	if (expr -> op == expr_or) {
+		n = class_match_terms (expr -> data.or [0], key, matches, max);
+		if (n < 0)
+			return -1;
+		m = class_match_terms (expr -> data.or [1], key,
+				       matches + n, max - n);
+		if (m < 0)
+			return -1;
+		return n + m;
+	}
+
+	if (expr -> op != expr_equal || max < 1)
+		return -1;
+
+	left = expr -> data.equal [0];
+	right = expr -> data.equal [1];
+	if (left -> op == expr_const_data) {
+		left = expr -> data.equal [1];
+		right = expr -> data.equal [0];
+	}
+	if (right -> op != expr_const_data || left -> op == expr_const_int ||
+	    !class_key_expression (left))
+		return -1;
+
+	memset (matches, 0, sizeof *matches);
+	matches -> data = right -> data.const_data.data;
+	matches -> len = right -> data.const_data.len;
+
+	/* substring (k, 0, n) = "n bytes" is a prefix test on k. */
+	k = left;
+	if (left -> op == expr_substring &&
+	    left -> data.substring.offset -> op == expr_const_int &&
+	    left -> data.substring.offset -> data.const_int == 0 &&
+	    left -> data.substring.len -> op == expr_const_int &&
+	    left -> data.substring.len -> data.const_int == matches -> len) {
+		k = left -> data.substring.expr;
+		matches -> prefix = 1;
+	}
+
+	if (!*key)
+		*key = k;
+	else if (!class_key_same (*key, k))
+		return -1;
+	return 1;
+}
+
+static unsigned class_match_hash (const unsigned char *data, unsigned len)
+{
+	unsigned hash = 2166136261U;
+
+	while (len--)
+		hash = (hash ^ *data++) * 16777619U;
+	return hash;
+}
+
+static void class_index_free (struct class_index *index)
 {
-	struct class *class, *nc;
+	struct class_key *ck;
+
+	while ((ck = index -> keys)) {
+		index -> keys = ck -> next;
+		if (ck -> hash)
+			dfree (ck -> hash, MDL);
+		if (ck -> prefix_lens)
+			dfree (ck -> prefix_lens, MDL);
+		dfree (ck, MDL);
+	}
+	if (index -> matches)
+		dfree (index -> matches, MDL);
+	if (index -> plain)
+		dfree (index -> plain, MDL);
+	if (index -> plain_seq)
+		dfree (index -> plain_seq, MDL);
+	if (index -> hits)
+		dfree (index -> hits, MDL);
+	dfree (index, MDL);
+}
+
+void forget_class_index (struct collection *collection)
+{
+	if (collection -> index) {
+		class_index_free (collection -> index);
+		collection -> index = NULL;
+	}
+}
+
+/* Count the matches a class expression can contribute. */
+
+static int class_match_count (struct expression *expr)
+{
+	if (expr -> op == expr_or)
+		return (class_match_count (expr -> data.or [0]) +
+			class_match_count (expr -> data.or [1]));
+	return 1;
+}
+
+static struct class_index *class_index_build (struct collection *collection)
+{
+	struct class_index *index;
+	struct class_key *ck, **ckp;
+	struct class_match *m, **mp;
+	struct class *class;
+	struct expression *key;
+	int nclasses, max, seq, n, i, j;
+	unsigned bucket;
+
+	index = dmalloc (sizeof *index, MDL);
+	if (!index)
+		return NULL;
+	index -> generation = class_index_generation;
+
+	nclasses = max = 0;
+	for (class = collection -> classes; class; class = class -> nic) {
+		nclasses++;
+		if (class -> expr)
+			max += class_match_count (class -> expr);
+	}
+
+	index -> plain = dmalloc (nclasses * sizeof *index -> plain + 1, MDL);
+	index -> plain_seq = dmalloc (nclasses * sizeof (int) + 1, MDL);
+	index -> matches = dmalloc (max * sizeof *index -> matches + 1, MDL);
+	index -> hits = dmalloc (max * sizeof *index -> hits + 1, MDL);
+	if (!index -> plain || !index -> plain_seq ||
+	    !index -> matches || !index -> hits)
+		goto fail;
+
+	/* Sort the classes into those with indexable expressions and
+	   those without, and find the key each indexable one tests. */
+	seq = 0;
+	for (class = collection -> classes; class; class = class -> nic) {
+		n = -1;
+		key = NULL;
+#if !defined (DEBUG_CLASS_MATCHING)
+		if (class -> expr)
+			n = class_match_terms (class -> expr, &key,
+					       index -> matches +
+					       index -> nmatches,
+					       max - index -> nmatches);
+#endif
+		if (n < 0) {
+			index -> plain [index -> nplain] = class;
+			index -> plain_seq [index -> nplain++] = seq++;
+			continue;
+		}
+
+		for (ckp = &index -> keys; *ckp; ckp = &(*ckp) -> next)
+			if (class_key_same ((*ckp) -> key, key))
+				break;
+		if (!*ckp) {
+			*ckp = dmalloc (sizeof **ckp, MDL);
+			if (!*ckp)
+				goto fail;
+			(*ckp) -> key = key;
+		}
+
+		for (i = 0; i < n; i++) {
+			m = &index -> matches [index -> nmatches++];
+			m -> class = class;
+			m -> seq = seq;
+			/* Borrow the bucket pointer to remember the key
+			   until the hashes are built below. */
+			m -> next = (struct class_match *)*ckp;
+		}
+		seq++;
+	}
+
+	/* Build each key's hash and list of prefix lengths. */
+	for (ck = index -> keys; ck; ck = ck -> next) {
+		n = 0;
+		for (i = 0; i < index -> nmatches; i++)
+			if (index -> matches [i].next ==
+			    (struct class_match *)ck)
+				n++;
+		for (ck -> hash_size = 8; ck -> hash_size < n * 2;
+		     ck -> hash_size <<= 1)
+			;
+		ck -> hash = dmalloc (ck -> hash_size * sizeof *ck -> hash,
+				      MDL);
+		ck -> prefix_lens = dmalloc (n * sizeof (unsigned), MDL);
+		if (!ck -> hash || !ck -> prefix_lens)
+			goto fail;
+	}
+	for (i = index -> nmatches - 1; i >= 0; i--) {
+		m = &index -> matches [i];
+		ck = (struct class_key *)m -> next;
+		if (m -> prefix) {
+			for (j = 0; j < ck -> nprefix_lens; j++)
+				if (ck -> prefix_lens [j] == m -> len)
+					break;
+			if (j == ck -> nprefix_lens)
+				ck -> prefix_lens [ck -> nprefix_lens++] =
+					m -> len;
+		}
+		/* Insert in reverse so each bucket is in class order. */
+		bucket = (class_match_hash (m -> data, m -> len) &
+			  (ck -> hash_size - 1));
+		for (mp = &ck -> hash [bucket]; *mp && (*mp) -> seq < m -> seq;
+		     mp = &(*mp) -> next)
+			;
+		m -> next = *mp;
+		*mp = m;
+	}
+	return index;
+
+      fail:
+	log_error ("no memory for class match index.");
+	class_index_free (index);
+	return NULL;
+}
+
+/* Add every match for key that the value data satisfies to hits.
+   If whole is set, data is the entire key value, so exact matches
+   count; otherwise it's a prefix of the key and only prefix matches
+   do. */
+
+static int class_key_lookup (struct class_key *ck,
+			     const unsigned char *data, unsigned len,
+			     int whole, struct class_match **hits, int nhits)
+{
+	struct class_match *m;
+
+	for (m = ck -> hash [class_match_hash (data, len) &
+			     (ck -> hash_size - 1)]; m; m = m -> next)
+		if (m -> len == len && (whole || m -> prefix) &&
+		    (len == 0 || !memcmp (m -> data, data, len)))
+			hits [nhits++] = m;
+	return nhits;
+}
+
+/* Decide whether the client matches one class in a collection.
+   If known is set, the class's match expression has already been
+   found to be true. */
+
+static int check_class (struct packet *packet, struct lease *lease,
+			struct class *class, int known)
+{
+	struct class *nc;
 	struct data_string data;
-	int matched = 0;
 	int status;
 	int ignorep;
 	int classfound;
 
-	for (class = collection -> classes; class; class = class -> nic) {
 #if defined (DEBUG_CLASS_MATCHING)
-		log_info ("checking against class %s...", class -> name);
+	log_info ("checking against class %s...", class -> name);
 #endif
-		memset (&data, 0, sizeof data);
-
-		/* If there is a "match if" expression, check it.   If
-		   we get a match, and there's no subclass expression,
-		   it's a match.   If we get a match and there is a subclass
-		   expression, then we check the submatch.   If it's not a
-		   match, that's final - we don't check the submatch. */
-
-		if (class -> expr) {
-			status = (evaluate_boolean_expression_result
-				  (&ignorep, packet, lease,
-				   (struct client_state *)0,
-				   packet -> options, (struct option_state *)0,
-				   lease ? &lease -> scope : &global_scope,
-				   class -> expr));
-			if (status) {
-				if (!class -> submatch) {
-					matched = 1;
+	memset (&data, 0, sizeof data);
+
+	/* If there is a "match if" expression, check it.   If
+	   we get a match, and there's no subclass expression,
+	   it's a match.   If we get a match and there is a subclass
+	   expression, then we check the submatch.   If it's not a
+	   match, that's final - we don't check the submatch. */
+
+	if (class -> expr) {
+		status = known || (evaluate_boolean_expression_result
+				   (&ignorep, packet, lease,
+				    (struct client_state *)0,
+				    packet -> options,
+				    (struct option_state *)0,
+				    lease ? &lease -> scope : &global_scope,
+				    class -> expr));
+		if (!status)
+			return 0;
+		if (!class -> submatch) {
 #if defined (DEBUG_CLASS_MATCHING)
-					log_info ("matches class.");
+			log_info ("matches class.");
 #endif
-					classify (packet, class);
-					continue;
-				}
-			} else
-				continue;
+			classify (packet, class);
+			return 1;
 		}
+	}
 
-		/* Check to see if the client matches an existing subclass.
-		   If it doesn't, and this is a spawning class, spawn a new
-		   subclass and put the client in it. */
-		if (class -> submatch) {
-			status = (evaluate_data_expression
-				  (&data, packet, lease,
-				   (struct client_state *)0,
-				   packet -> options, (struct option_state *)0,
-				   lease ? &lease -> scope : &global_scope,
-				   class -> submatch, MDL));
-			if (status && data.len) {
-				nc = (struct class *)0;
-				classfound = class_hash_lookup (&nc, class -> hash,
-					(const char *)data.data, data.len, MDL);
+	/* Check to see if the client matches an existing subclass.
+	   If it doesn't, and this is a spawning class, spawn a new
+	   subclass and put the client in it. */
+	if (!class -> submatch)
+		return 0;
+	status = (evaluate_compiled_data
+		  (&data, packet, lease,
+		   (struct client_state *)0,
+		   packet -> options, (struct option_state *)0,
+		   lease ? &lease -> scope : &global_scope,
+		   class -> submatch, MDL));
+	if (!status || !data.len)
+		return 0;
+
+	nc = (struct class *)0;
+	classfound = class_hash_lookup (&nc, class -> hash,
+		(const char *)data.data, data.len, MDL);
 
 #ifdef LDAP_CONFIGURATION
-				if (!classfound && find_subclass_in_ldap (class, &nc, &data))
-					classfound = 1;
+	if (!classfound && find_subclass_in_ldap (class, &nc, &data))
+		classfound = 1;
 #endif
 
-				if (classfound) {
+	if (classfound) {
 #if defined (DEBUG_CLASS_MATCHING)
-					log_info ("matches subclass %s.",
-					      print_hex_1 (data.len,
-							   data.data, 60));
+		log_info ("matches subclass %s.",
+		      print_hex_1 (data.len,
+				   data.data, 60));
 #endif
-					data_string_forget (&data, MDL);
-					classify (packet, nc);
-					matched = 1;
-					class_dereference (&nc, MDL);
-					continue;
-				}
-				if (!class -> spawning) {
-					data_string_forget (&data, MDL);
-					continue;
-				}
-				/* XXX Write out the spawned class? */
+		data_string_forget (&data, MDL);
+		classify (packet, nc);
+		class_dereference (&nc, MDL);
+		return 1;
+	}
+	if (!class -> spawning) {
+		data_string_forget (&data, MDL);
+		return 0;
+	}
+	/* XXX Write out the spawned class? */
 #if defined (DEBUG_CLASS_MATCHING)
-				log_info ("spawning subclass %s.",
-				      print_hex_1 (data.len, data.data, 60));
+	log_info ("spawning subclass %s.",
+	      print_hex_1 (data.len, data.data, 60));
 #endif
-				status = class_allocate (&nc, MDL);
-				group_reference (&nc -> group,
-						 class -> group, MDL);
-				class_reference (&nc -> superclass,
-						 class, MDL);
-				nc -> lease_limit = class -> lease_limit;
-				nc -> dirty = 1;
-				if (nc -> lease_limit) {
-					nc -> billed_leases =
-						(dmalloc
-						 (nc -> lease_limit *
-						  sizeof (struct lease *),
-						  MDL));
-					if (!nc -> billed_leases) {
-						log_error ("no memory for%s",
-							   " billing");
-						data_string_forget
-							(&nc -> hash_string,
-							 MDL);
-						class_dereference (&nc, MDL);
-						data_string_forget (&data,
-								    MDL);
-						continue;
-					}
-					memset (nc -> billed_leases, 0,
-						(nc -> lease_limit *
-						 sizeof (struct lease *)));
-				}
-				data_string_copy (&nc -> hash_string, &data,
-						  MDL);
-				data_string_forget (&data, MDL);
-				if (!class -> hash)
-				    class_new_hash(&class->hash,
-						   SCLASS_HASH_SIZE, MDL);
-				class_hash_add (class -> hash,
-						(const char *)
-						nc -> hash_string.data,
-						nc -> hash_string.len,
-						nc, MDL);
-				classify (packet, nc);
-				class_dereference (&nc, MDL);
-			}
+	status = class_allocate (&nc, MDL);
+	group_reference (&nc -> group,
+			 class -> group, MDL);
+	class_reference (&nc -> superclass,
+			 class, MDL);
+	nc -> lease_limit = class -> lease_limit;
+	nc -> dirty = 1;
+	if (nc -> lease_limit) {
+		nc -> billed_leases =
+			(dmalloc
+			 (nc -> lease_limit *
+			  sizeof (struct lease *),
+			  MDL));
+		if (!nc -> billed_leases) {
+			log_error ("no memory for%s",
+				   " billing");
+			data_string_forget
+				(&nc -> hash_string,
+				 MDL);
+			class_dereference (&nc, MDL);
+			data_string_forget (&data,
+					    MDL);
+			return 0;
+		}
+		memset (nc -> billed_leases, 0,
+			(nc -> lease_limit *
+			 sizeof (struct lease *)));
+	}
+	data_string_copy (&nc -> hash_string, &data,
+			  MDL);
+	data_string_forget (&data, MDL);
+	data_string_promote (&nc -> hash_string, MDL);
+	if (!class -> hash)
+	    class_new_hash(&class->hash,
+			   SCLASS_HASH_SIZE, MDL);
+	class_hash_add (class -> hash,
+			(const char *)
+			nc -> hash_string.data,
+			nc -> hash_string.len,
+			nc, MDL);
+	classify (packet, nc);
+	class_dereference (&nc, MDL);
+	return 0;
+}
+
+int check_collection (packet, lease, collection)
+	struct packet *packet;
+	struct lease *lease;
+	struct collection *collection;
+{
+	struct class_index *index;
+	struct class_key *ck;
+	struct class_match *m;
+	struct class *class;
+	struct data_string data;
+	int matched = 0;
+	int nhits, i, j, k;
+
+	index = collection -> index;
+	if (index && index -> generation != class_index_generation &&
+	    !index -> busy) {
+		forget_class_index (collection);
+		index = NULL;
+	}
+	if (!index)
+		index = collection -> index = class_index_build (collection);
+
+	/* Without an index, or if a class in this collection checks the
+	   collection again, evaluate every class in turn. */
+	if (!index || index -> busy ||
+	    index -> generation != class_index_generation) {
+		for (class = collection -> classes; class;
+		     class = class -> nic)
+			if (check_class (packet, lease, class, 0))
+				matched = 1;
+		return matched;
+	}
+	index -> busy = 1;
+
+	/* Look up each key once. */
+	nhits = 0;
+	for (ck = index -> keys; ck; ck = ck -> next) {
+		memset (&data, 0, sizeof data);
+		if (!evaluate_compiled_data (&data, packet, lease,
+					     (struct client_state *)0,
+					     packet -> options,
+					     (struct option_state *)0,
+					     lease ? &lease -> scope
+						   : &global_scope,
+					     ck -> key, MDL))
+			continue;
+		nhits = class_key_lookup (ck, data.data, data.len, 1,
+					  index -> hits, nhits);
+		for (i = 0; i < ck -> nprefix_lens; i++)
+			if (ck -> prefix_lens [i] < data.len)
+				nhits = class_key_lookup
+					(ck, data.data, ck -> prefix_lens [i],
+					 0, index -> hits, nhits);
+		data_string_forget (&data, MDL);
+	}
+
+	/* Put the hits back in class order; there are rarely more than
+	   one or two. */
+	for (i = 1; i < nhits; i++) {
+		m = index -> hits [i];
+		for (j = i; j > 0 && index -> hits [j - 1] -> seq > m -> seq;
+		     j--)
+			index -> hits [j] = index -> hits [j - 1];
+		index -> hits [j] = m;
+	}
+
+	/* Merge them with the classes that have to be evaluated. */
+	i = j = 0;
+	while (i < index -> nplain || j < nhits) {
+		if (j == nhits ||
+		    (i < index -> nplain &&
+		     index -> plain_seq [i] < index -> hits [j] -> seq)) {
+			if (check_class (packet, lease,
+					 index -> plain [i++], 0))
+				matched = 1;
+			continue;
 		}
+		k = index -> hits [j] -> seq;
+		if (check_class (packet, lease, index -> hits [j] -> class, 1))
+			matched = 1;
+		/* An or'd expression can match more than once. */
+		while (j < nhits && index -> hits [j] -> seq == k)
+			j++;
 	}
+
+	index -> busy = 0;
 	return matched;
 }
 
@@ -220,6 +704,7 @@ isc_result_t unlink_class(struct class **class) {
 				}
 				cp->nic = 0;
 				class_dereference(class, MDL);
+				invalidate_class_index();
 
 				return ISC_R_SUCCESS;
 			}
@@ -2454,6 +2454,7 @@ int parse_class_declaration (cp, cfile, group, type)
 				break;
 			}
 			matchedonce = 1;
+			invalidate_class_index();
 			if (class->expr)
 				expression_dereference(&class->expr, MDL);
 			if (!parse_boolean_expression (&class->expr, cfile,
@@ -2571,6 +2572,7 @@ int parse_class_declaration (cp, cfile, group, type)
 				;
 			class_reference (&c -> nic, class, MDL);
 		}
+		invalidate_class_index();
 	}
 
 	if (cp)				/* should always be 0??? */
@@ -29,6 +29,8 @@
 #include "dhcpd.h"
 #include <ctype.h>
 #include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
 
 #define LEASE_REWRITE_PERIOD 3600
 
@@ -39,6 +41,24 @@ FILE *db_file;
 
 static int counting = 0;
 static int count = 0;
+
+/* Lease writes are numbered, so that a reply can tell whether the
+   writes made while building it have been committed yet. */
+static unsigned long writes_made = 0;
+static unsigned long writes_committed = 0;
+
+static int start_lease_file_rewrite (void);
+
+/* Room for one formatted lease or IA (see format_lease()); anything
+   bigger is written with stdio. */
+#if !defined (LEASE_FORMAT_BUFSIZ)
+# define LEASE_FORMAT_BUFSIZ	4096
+#endif
+
+/* The lease file's stdio buffer. */
+#if !defined (LEASE_FILE_BUFSIZ)
+# define LEASE_FILE_BUFSIZ	65536
+#endif
 TIME write_time;
 int lease_file_is_corrupt = 0;
 
@@ -93,15 +113,371 @@ write_binding_scope(FILE *db_file, struct binding *bnd, char *prepend) {
 	return ISC_R_SUCCESS;
 }
 
+/*
+ * Most leases and IAs hold nothing but times, states, addresses and
+ * client identifiers.  format_lease() and format_ia() write those into a
+ * buffer with the encoders below, without stdio or any allocation, and
+ * produce exactly what write_lease_stdio() and write_ia() would.  For
+ * anything else (bindings, agent options, billing classes, on-events),
+ * or if the buffer is too small, they return zero and the caller falls
+ * back on stdio.
+ */
+
+struct fmtbuf {
+	char *p, *end;
+	int overflow;
+};
+
+static void fmt_mem (struct fmtbuf *f, const char *s, size_t len)
+{
+	if (f -> overflow || len > (size_t)(f -> end - f -> p)) {
+		f -> overflow = 1;
+		return;
+	}
+	memcpy (f -> p, s, len);
+	f -> p += len;
+}
+
+static void fmt_str (struct fmtbuf *f, const char *s)
+{
+	fmt_mem (f, s, strlen (s));
+}
+
+static void fmt_uint (struct fmtbuf *f, unsigned long val)
+{
+	char buf [24];
+	int i = sizeof buf;
+
+	do {
+		buf [--i] = '0' + val % 10;
+		val /= 10;
+	} while (val);
+	fmt_mem (f, &buf [i], sizeof buf - i);
+}
+
+static void fmt_2digits (struct fmtbuf *f, unsigned val)
+{
+	char buf [2];
+
+	buf [0] = '0' + val / 10;
+	buf [1] = '0' + val % 10;
+	fmt_mem (f, buf, 2);
+}
+
+/* "xx:xx:...", as print_hw_addr() and buf_to_hex() do it. */
+static void fmt_hex (struct fmtbuf *f, const unsigned char *data, unsigned len)
+{
+	static const char digits [] = "0123456789abcdef";
+	unsigned i;
+
+	if (f -> overflow || len * 3 > (size_t)(f -> end - f -> p)) {
+		f -> overflow = 1;
+		return;
+	}
+	for (i = 0; i < len; i++) {
+		if (i)
+			*f -> p++ = ':';
+		*f -> p++ = digits [data [i] >> 4];
+		*f -> p++ = digits [data [i] & 15];
+	}
+}
+
+/* Escape a string the way quotify_buf() does. */
+static void fmt_quoted (struct fmtbuf *f, const unsigned char *s, unsigned len)
+{
+	char oct [4];
+	unsigned i;
+
+	for (i = 0; i < len && !f -> overflow; i++) {
+		if (s [i] == ' ')
+			fmt_mem (f, " ", 1);
+		else if (!isascii (s [i]) || !isprint (s [i])) {
+			oct [0] = '\\';
+			oct [1] = '0' + (s [i] >> 6);
+			oct [2] = '0' + ((s [i] >> 3) & 7);
+			oct [3] = '0' + (s [i] & 7);
+			fmt_mem (f, oct, 4);
+		} else if (s [i] == '"' || s [i] == '\\') {
+			oct [0] = '\\';
+			oct [1] = s [i];
+			fmt_mem (f, oct, 2);
+		} else
+			fmt_mem (f, (const char *)&s [i], 1);
+	}
+}
+
+static void fmt_lease_id (struct fmtbuf *f, const unsigned char *id,
+			  unsigned len)
+{
+	if (lease_id_format == TOKEN_HEX) {
+		fmt_hex (f, id, len);
+	} else {
+		fmt_mem (f, "\"", 1);
+		fmt_quoted (f, id, len);
+		fmt_mem (f, "\"", 1);
+	}
+}
+
+/* A time the way print_time() writes it: "w yyyy/mm/dd hh:mm:ss;" */
+static void fmt_time (struct fmtbuf *f, TIME t)
+{
+	const char *tval;
+	long days, secs, z, era, doe, yoe, doy, mp, y, m, d;
+
+	if (t == MAX_TIME) {
+		fmt_str (f, "never;");
+		return;
+	}
+
+	/* Local times, and years that need more than four digits, are
+	   left to print_time(). */
+	if (db_time_format == LOCAL_TIME_FORMAT || t < 0 ||
+	    t >= (TIME)253402300800LL) {
+		if ((tval = print_time (t)) == NULL)
+			f -> overflow = 1;
+		else
+			fmt_str (f, tval);
+		return;
+	}
+
+	/* Days since the epoch to a civil date, in the proleptic
+	   Gregorian calendar with 400-year eras starting in March. */
+	days = t / 86400;
+	secs = t % 86400;
+	z = days + 719468;
+	era = z / 146097;
+	doe = z - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	d = doy - (153 * mp + 2) / 5 + 1;
+	m = mp < 10 ? mp + 3 : mp - 9;
+	y = yoe + era * 400 + (m <= 2);
+
+	fmt_uint (f, (days + 4) % 7);		/* 1970/1/1 was a Thursday. */
+	fmt_mem (f, " ", 1);
+	fmt_uint (f, y);
+	fmt_mem (f, "/", 1);
+	fmt_2digits (f, m);
+	fmt_mem (f, "/", 1);
+	fmt_2digits (f, d);
+	fmt_mem (f, " ", 1);
+	fmt_2digits (f, secs / 3600);
+	fmt_mem (f, ":", 1);
+	fmt_2digits (f, secs / 60 % 60);
+	fmt_mem (f, ":", 1);
+	fmt_2digits (f, secs % 60);
+	fmt_mem (f, ";", 1);
+}
+
+static const char *fmt_state_name (binding_state_t state)
+{
+	return ((state > 0 && state <= FTS_LAST)
+		? binding_state_names [state - 1] : "abandoned");
+}
+
+/* Format a lease as write_lease_stdio() would write it.   Returns the
+   length, or zero if the lease has to be written with stdio. */
+size_t format_lease (char *buf, size_t size, struct lease *lease)
+{
+	struct fmtbuf f;
+	struct binding *b;
+	int i;
+
+	if (lease -> agent_options || lease -> on_star.on_expiry ||
+	    lease -> on_star.on_release ||
+	    (lease -> billing_class && lease -> ends > cur_time))
+		return 0;
+	if (lease -> scope) {
+		for (b = lease -> scope -> bindings; b; b = b -> next)
+			if (b -> value)
+				return 0;
+	}
+
+	f.p = buf;
+	f.end = buf + size;
+	f.overflow = 0;
+
+	fmt_str (&f, "lease ");
+	if (lease -> ip_addr.len == 4) {
+		for (i = 0; i < 4; i++) {
+			if (i)
+				fmt_mem (&f, ".", 1);
+			fmt_uint (&f, lease -> ip_addr.iabuf [i]);
+		}
+	} else
+		fmt_str (&f, piaddr (lease -> ip_addr));
+	fmt_str (&f, " {");
+
+	if (lease -> starts) {
+		fmt_str (&f, "\n  starts ");
+		fmt_time (&f, lease -> starts);
+	}
+	if (lease -> ends) {
+		fmt_str (&f, "\n  ends ");
+		fmt_time (&f, lease -> ends);
+	}
+	if (lease -> tstp) {
+		fmt_str (&f, "\n  tstp ");
+		fmt_time (&f, lease -> tstp);
+	}
+	if (lease -> tsfp) {
+		fmt_str (&f, "\n  tsfp ");
+		fmt_time (&f, lease -> tsfp);
+	}
+	if (lease -> atsfp) {
+		fmt_str (&f, "\n  atsfp ");
+		fmt_time (&f, lease -> atsfp);
+	}
+	if (lease -> cltt) {
+		fmt_str (&f, "\n  cltt ");
+		fmt_time (&f, lease -> cltt);
+	}
+
+	fmt_str (&f, "\n  binding state ");
+	fmt_str (&f, fmt_state_name (lease -> binding_state));
+	fmt_mem (&f, ";", 1);
+	if (lease -> binding_state != lease -> next_binding_state) {
+		fmt_str (&f, "\n  next binding state ");
+		fmt_str (&f, fmt_state_name (lease -> next_binding_state));
+		fmt_mem (&f, ";", 1);
+	}
+	if ((lease -> binding_state != lease -> rewind_binding_state) &&
+	    (lease -> rewind_binding_state > 0) &&
+	    (lease -> rewind_binding_state <= FTS_LAST)) {
+		fmt_str (&f, "\n  rewind binding state ");
+		fmt_str (&f, fmt_state_name (lease -> rewind_binding_state));
+		fmt_mem (&f, ";", 1);
+	}
+	if (lease -> flags & RESERVED_LEASE)
+		fmt_str (&f, "\n  reserved;");
+	if (lease -> flags & BOOTP_LEASE)
+		fmt_str (&f, "\n  dynamic-bootp;");
+
+	if (lease -> hardware_addr.hlen) {
+		fmt_str (&f, "\n  hardware ");
+		fmt_str (&f, hardware_types [lease -> hardware_addr.hbuf [0]]);
+		fmt_mem (&f, " ", 1);
+		fmt_hex (&f, &lease -> hardware_addr.hbuf [1],
+			 lease -> hardware_addr.hlen - 1);
+		fmt_mem (&f, ";", 1);
+	}
+	if (lease -> uid_len) {
+		fmt_str (&f, "\n  uid ");
+		fmt_lease_id (&f, lease -> uid, lease -> uid_len);
+		fmt_mem (&f, ";", 1);
+	}
+	if (lease -> client_hostname &&
+	    db_printable ((unsigned char *)lease -> client_hostname)) {
+		fmt_str (&f, "\n  client-hostname \"");
+		fmt_quoted (&f, (unsigned char *)lease -> client_hostname,
+			    strlen (lease -> client_hostname));
+		fmt_str (&f, "\";");
+	}
+	fmt_str (&f, "\n}\n");
+
+	if (f.overflow)
+		return 0;
+	return f.p - buf;
+}
+
+/* Format an IA as write_ia() would write it.   Returns the length, or
+   zero if the IA has to be written with stdio. */
+size_t format_ia (char *buf, size_t size, const struct ia_xx *ia)
+{
+	struct fmtbuf f;
+	struct iasubopt *iasubopt;
+	struct binding *bnd;
+	char addr_buf [sizeof("ffff:ffff:ffff:ffff:ffff:ffff.255.255.255.255")];
+	int i;
+
+	for (i = 0; i < ia -> num_iasubopt; i++) {
+		iasubopt = ia -> iasubopt [i];
+		if (iasubopt -> state <= 0 || iasubopt -> state > FTS_LAST ||
+		    iasubopt -> on_star.on_expiry ||
+		    iasubopt -> on_star.on_release)
+			return 0;
+		if (iasubopt -> scope) {
+			for (bnd = iasubopt -> scope -> bindings; bnd;
+			     bnd = bnd -> next)
+				if (bnd -> value)
+					return 0;
+		}
+	}
+
+	f.p = buf;
+	f.end = buf + size;
+	f.overflow = 0;
+
+	switch (ia -> ia_type) {
+	      case D6O_IA_NA:
+		fmt_str (&f, "ia-na ");
+		break;
+	      case D6O_IA_TA:
+		fmt_str (&f, "ia-ta ");
+		break;
+	      case D6O_IA_PD:
+		fmt_str (&f, "ia-pd ");
+		break;
+	      default:
+		return 0;
+	}
+	fmt_lease_id (&f, ia -> iaid_duid.data, ia -> iaid_duid.len);
+	fmt_str (&f, " {\n");
+	if (ia -> cltt != MIN_TIME) {
+		fmt_str (&f, "  cltt ");
+		fmt_time (&f, ia -> cltt);
+		fmt_mem (&f, "\n", 1);
+	}
+
+	for (i = 0; i < ia -> num_iasubopt; i++) {
+		iasubopt = ia -> iasubopt [i];
+
+		inet_ntop (AF_INET6, &iasubopt -> addr,
+			   addr_buf, sizeof addr_buf);
+		if (ia -> ia_type != D6O_IA_PD) {
+			fmt_str (&f, "  iaaddr ");
+			fmt_str (&f, addr_buf);
+		} else {
+			fmt_str (&f, "  iaprefix ");
+			fmt_str (&f, addr_buf);
+			fmt_mem (&f, "/", 1);
+			fmt_uint (&f, iasubopt -> plen);
+		}
+		fmt_str (&f, " {\n    binding state ");
+		fmt_str (&f, binding_state_names [iasubopt -> state - 1]);
+		fmt_str (&f, ";\n    preferred-life ");
+		fmt_uint (&f, (unsigned)iasubopt -> prefer);
+		fmt_str (&f, ";\n    max-life ");
+		fmt_uint (&f, (unsigned)iasubopt -> valid);
+		fmt_str (&f, ";\n    ends ");
+		if ((iasubopt -> state == FTS_ACTIVE) ||
+		    (iasubopt -> state == FTS_ABANDONED) ||
+		    (iasubopt -> hard_lifetime_end_time != 0))
+			fmt_time (&f, iasubopt -> hard_lifetime_end_time);
+		else
+			fmt_time (&f, iasubopt -> soft_lifetime_end_time);
+		fmt_str (&f, "\n  }\n");
+	}
+	fmt_str (&f, "}\n\n");
+
+	if (f.overflow)
+		return 0;
+	return f.p - buf;
+}
+
 /* Write the specified lease to the current lease database file. */
 
 int write_lease (lease)
 	struct lease *lease;
 {
-	int errors = 0;
-	struct binding *b;
-	char *s;
-	const char *tval;
+	char buf [LEASE_FORMAT_BUFSIZ];
+	size_t len;
+
+	/* When writing a binary lease file, most leases don't need any
+	   text. */
+	if (binary_leases_add (lease))
+		return 1;
 
 	/* If the lease file is corrupt, don't try to write any more leases
 	   until we've written a good lease file. */
@@ -109,8 +485,35 @@ int write_lease (lease)
 		if (!new_lease_file ())
 			return 0;
 
+	len = format_lease (buf, sizeof buf, lease);
+	if (len == 0)
+		return write_lease_stdio (lease);
+
 	if (counting)
 		++count;
+	++writes_made;
+	if (fwrite (buf, len, 1, db_file) != 1) {
+		log_info ("write_lease: unable to write lease %s",
+		      piaddr (lease -> ip_addr));
+		lease_file_is_corrupt = 1;
+		return 0;
+	}
+	return 1;
+}
+
+/* Write a lease with stdio; write_lease() does this for leases that
+   format_lease() can't handle. */
+int write_lease_stdio (lease)
+	struct lease *lease;
+{
+	int errors = 0;
+	struct binding *b;
+	char *s;
+	const char *tval;
+
+	if (counting)
+		++count;
+	++writes_made;
 	errno = 0;
 	fprintf (db_file, "lease %s {", piaddr (lease -> ip_addr));
 	if (errno) {
@@ -446,6 +849,48 @@ int write_host (host)
 	return !errors;
 }
 
+/* Write a host declaration to some other file the way write_host()
+   writes it to the lease file, without disturbing the lease file. */
+int write_host_to_file (FILE *file, struct host_decl *host)
+{
+	FILE *saved_db_file = db_file;
+	int saved_counting = counting;
+	int saved_corrupt = lease_file_is_corrupt;
+	int result;
+
+	db_file = file;
+	counting = 0;
+	lease_file_is_corrupt = 0;
+	result = write_host (host);
+
+	db_file = saved_db_file;
+	counting = saved_counting;
+	lease_file_is_corrupt = saved_corrupt;
+	return result;
+}
+
+/* Copy a host declaration that write_host_to_file() wrote elsewhere
+   into the lease file. */
+int write_host_text (const char *text, size_t len)
+{
+	/* If the lease file is corrupt, don't try to write any more leases
+	   until we've written a good lease file. */
+	if (lease_file_is_corrupt)
+		if (!new_lease_file ())
+			return 0;
+
+	if (counting)
+		++count;
+
+	errno = 0;
+	if (fwrite (text, len, 1, db_file) != 1 || errno) {
+		log_info ("write_host_text: unable to write host");
+		lease_file_is_corrupt = 1;
+		return 0;
+	}
+	return 1;
+}
+
 int write_group (group)
 	struct group_object *group;
 {
@@ -516,14 +961,8 @@ int write_group (group)
  */
 int
 write_ia(const struct ia_xx *ia) {
-	struct iasubopt *iasubopt;
-	struct binding *bnd;
-	int i;
-	char addr_buf[sizeof("ffff:ffff:ffff:ffff:ffff:ffff.255.255.255.255")];
-	const char *binding_state;
-	const char *tval;
-	char *s;
-	int fprintf_ret;
+	char buf[LEASE_FORMAT_BUFSIZ];
+	size_t len;
 
 	/* 
 	 * If the lease file is corrupt, don't try to write any more 
@@ -535,9 +974,43 @@ write_ia(const struct ia_xx *ia) {
 		}
 	}
 
+	len = format_ia(buf, sizeof(buf), ia);
+	if (len == 0) {
+		return write_ia_stdio(ia);
+	}
+
 	if (counting) {
 		++count;
 	}
+	++writes_made;
+	if (fwrite(buf, len, 1, db_file) != 1) {
+		log_info("write_ia: unable to write ia");
+		lease_file_is_corrupt = 1;
+		return 0;
+	}
+	fflush(db_file);
+	return 1;
+}
+
+/*
+ * Write an IA with stdio; write_ia() does this for IAs that format_ia()
+ * can't handle.
+ */
+int
+write_ia_stdio(const struct ia_xx *ia) {
+	struct iasubopt *iasubopt;
+	struct binding *bnd;
+	int i;
+	char addr_buf[sizeof("ffff:ffff:ffff:ffff:ffff:ffff.255.255.255.255")];
+	const char *binding_state;
+	const char *tval;
+	char *s;
+	int fprintf_ret;
+
+	if (counting) {
+		++count;
+	}
+	++writes_made;
 
 	s = format_lease_id(ia->iaid_duid.data, ia->iaid_duid.len,
 			    lease_id_format, MDL);
@@ -1016,11 +1489,22 @@ int commit_leases ()
 		log_info("commit_leases: unable to commit, fflush(): %m");
 		return (0);
 	}
+	/* The lease file is only ever appended to, so there's no metadata
+	   we need other than its size, which fdatasync() takes care of. */
+#if defined (_POSIX_SYNCHRONIZED_IO) && (_POSIX_SYNCHRONIZED_IO > 0)
+	if ((dont_use_fsync == 0) &&
+	    (fdatasync(fileno (db_file)) < 0)) {
+		log_info ("commit_leases: unable to commit, fdatasync(): %m");
+		return (0);
+	}
+#else
 	if ((dont_use_fsync == 0) &&
 	    (fsync(fileno (db_file)) < 0)) {
 		log_info ("commit_leases: unable to commit, fsync(): %m");
 		return (0);
 	}
+#endif
+	writes_committed = writes_made;
 
 	/* If we haven't rewritten the lease database in over an
 	   hour, rewrite it now.  (The length of time should probably
@@ -1028,7 +1512,8 @@ int commit_leases ()
 	if (count && cur_time - write_time > LEASE_REWRITE_PERIOD) {
 		count = 0;
 		write_time = cur_time;
-		new_lease_file();
+		if (!background_lease_rewrite || !start_lease_file_rewrite ())
+			new_lease_file();
 	}
 	return (1);
 }
@@ -1048,10 +1533,253 @@ int commit_leases_timed()
 	return (1);
 }
 
+/* Return the number of the last lease write, for leases_committed(). */
+unsigned long leases_written()
+{
+	return (writes_made);
+}
+
+/* Return nonzero if the lease writes up to and including the given one
+   have been committed. */
+int leases_committed(unsigned long write)
+{
+	return (writes_committed >= write);
+}
+
+/*
+ * Group commit.  Anything that mustn't happen until the lease changes
+ * behind it are on disk (an ACK, say) is queued with defer_until_commit()
+ * after the lease is written.  The whole queue is committed with a single
+ * fdatasync() once it holds more than max_outstanding_acks entries, or
+ * when the queue has been waiting min_ack_delay_usecs since the last
+ * entry or max-ack-delay since the first one, and then the queued work
+ * is run in the order in which it was queued.
+ *
+ * Group commit is on by default when the server is built with
+ * --enable-delayed-ack, and otherwise once delayed-ack or max-ack-delay
+ * is configured.
+ */
+struct commit_waiter {
+	struct commit_waiter *next;
+	void (*func) (void *);
+	void *arg;
+	tvunref_t unref;
+};
+
+static struct commit_waiter *commit_queue_head, *commit_queue_tail;
+static struct commit_waiter *free_commit_waiters;
+static struct timeval max_fsync;
+
+#if defined (DELAYED_ACK)
+int group_commit = 1;
+#else
+int group_commit = 0;
+#endif
+int outstanding_acks;
+int max_outstanding_acks = DEFAULT_DELAYED_ACK;
+int max_ack_delay_secs = DEFAULT_ACK_DELAY_SECS;
+int max_ack_delay_usecs = DEFAULT_ACK_DELAY_USECS;
+int min_ack_delay_usecs = DEFAULT_MIN_ACK_DELAY_USECS;
+
+static void commit_queue_timer (void *);
+
+void defer_until_commit (void (*func) (void *), void *arg,
+			 tvref_t ref, tvunref_t unref)
+{
+	struct commit_waiter *w;
+	struct timeval next_fsync;
+
+	if (free_commit_waiters) {
+		w = free_commit_waiters;
+		free_commit_waiters = w -> next;
+	} else {
+		w = dmalloc (sizeof *w, MDL);
+		if (!w)
+			log_fatal ("defer_until_commit: no memory!");
+	}
+	memset (w, 0, sizeof *w);
+	w -> func = func;
+	if (ref)
+		(*ref) (&w -> arg, arg, MDL);
+	else
+		w -> arg = arg;
+	w -> unref = unref;
+
+	if (commit_queue_tail)
+		commit_queue_tail -> next = w;
+	else
+		commit_queue_head = w;
+	commit_queue_tail = w;
+
+	if (++outstanding_acks > max_outstanding_acks) {
+		/* Cancel any pending timeout and commit right now. */
+		cancel_timeout (commit_queue_timer, NULL);
+		flush_commit_queue ();
+		return;
+	}
+
+	if (max_fsync.tv_sec == 0 && max_fsync.tv_usec == 0) {
+		/* set the maximum time we'll wait */
+		max_fsync.tv_sec = cur_tv.tv_sec + max_ack_delay_secs;
+		max_fsync.tv_usec = cur_tv.tv_usec + max_ack_delay_usecs;
+
+		if (max_fsync.tv_usec >= 1000000) {
+			max_fsync.tv_sec++;
+			max_fsync.tv_usec -= 1000000;
+		}
+	}
+
+	/* Set the timeout */
+	next_fsync.tv_sec = cur_tv.tv_sec;
+	next_fsync.tv_usec = cur_tv.tv_usec + min_ack_delay_usecs;
+	if (next_fsync.tv_usec >= 1000000) {
+		next_fsync.tv_sec++;
+		next_fsync.tv_usec -= 1000000;
+	}
+	/* but not more than the max */
+	if ((next_fsync.tv_sec > max_fsync.tv_sec) ||
+	    ((next_fsync.tv_sec == max_fsync.tv_sec) &&
+	     (next_fsync.tv_usec > max_fsync.tv_usec))) {
+		next_fsync.tv_sec = max_fsync.tv_sec;
+		next_fsync.tv_usec = max_fsync.tv_usec;
+	}
+
+	add_timeout (&next_fsync, commit_queue_timer, NULL,
+		     (tvref_t) NULL, (tvunref_t) NULL);
+}
+
+/* Commit the leases and run everything that was waiting for them.
+   Any packets the queued work sends go out together as a batch. */
+void flush_commit_queue ()
+{
+	struct commit_waiter *w, *next;
+
+	/* Reset max fsync */
+	memset (&max_fsync, 0, sizeof max_fsync);
+
+	if (!commit_queue_head)
+		return;
+
+	commit_leases ();
+
+	/* Take the queue first, in case the work queues more. */
+	w = commit_queue_head;
+	commit_queue_head = commit_queue_tail = NULL;
+	outstanding_acks = 0;
+
+	begin_send_batch ();
+	for (; w; w = next) {
+		next = w -> next;
+		(*w -> func) (w -> arg);
+		if (w -> unref)
+			(*w -> unref) (&w -> arg, MDL);
+		w -> next = free_commit_waiters;
+		free_commit_waiters = w;
+	}
+	flush_send_batch ();
+}
+
+static void commit_queue_timer (void *foo)
+{
+	flush_commit_queue ();
+}
+
+#if defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+void relinquish_commit_queue ()
+{
+	struct commit_waiter *w, *next;
+
+	for (w = commit_queue_head; w; w = next) {
+		next = w -> next;
+		if (w -> unref)
+			(*w -> unref) (&w -> arg, MDL);
+		dfree (w, MDL);
+	}
+	commit_queue_head = commit_queue_tail = NULL;
+	for (w = free_commit_waiters; w; w = next) {
+		next = w -> next;
+		dfree (w, MDL);
+	}
+	free_commit_waiters = NULL;
+}
+#endif
+
+/* Write a binary lease file (see binleases.c) without disturbing the
+   state of the lease file proper.   journal_len is how much of the lease
+   file the binary file covers. */
+static int write_binary_lease_file (const char *path, off_t journal_len)
+{
+	FILE *saved_db_file = db_file;
+	int saved_counting = counting;
+	int saved_count = count;
+	int saved_corrupt = lease_file_is_corrupt;
+	unsigned long saved_writes_made = writes_made;
+	unsigned long saved_writes_committed = writes_committed;
+	int result;
+
+	/* Keep commit_leases() from starting a rewrite of its own. */
+	counting = 0;
+	count = 0;
+	lease_file_is_corrupt = 0;
+	result = write_binary_leases (path, journal_len);
+
+	db_file = saved_db_file;
+	counting = saved_counting;
+	count = saved_count;
+	lease_file_is_corrupt = saved_corrupt;
+	writes_made = saved_writes_made;
+	writes_committed = saved_writes_committed;
+	return result;
+}
+
+/* Read the lease file, skipping the first offset bytes, which a binary
+   lease file has already provided.   A big lease file is read by several
+   processes (see binleases.c). */
+static isc_result_t read_lease_file_from (off_t offset)
+{
+	struct parse *cfile = NULL;
+	isc_result_t status;
+	int file;
+
+	if (read_leases_parallel (path_dhcpd_db, offset))
+		return ISC_R_SUCCESS;
+	if (offset == 0)
+		return read_conf_file (path_dhcpd_db, (struct group *)0, 0, 1);
+
+	if ((file = open (path_dhcpd_db, O_RDONLY)) < 0) {
+		log_error ("Can't open lease database %s: %m", path_dhcpd_db);
+		return ISC_R_IOERROR;
+	}
+	status = new_parse (&cfile, file, NULL, 0, path_dhcpd_db, 0);
+	if (status != ISC_R_SUCCESS || cfile == NULL) {
+		close (file);
+		return status;
+	}
+	if (offset <= cfile -> buflen) {
+		cfile -> bufix = offset;
+		status = lease_file_subparse (cfile);
+	}
+	end_parse (&cfile);
+	return status;
+}
+
+/* Write the leases we've loaded out to path, as a binary lease file or
+   as a lease file, for dhcpd -convert-leases. */
+int convert_leases (int binary, const char *path)
+{
+	if (binary)
+		return write_binary_lease_file (path, 0);
+
+	path_dhcpd_bin_db = NULL;
+	path_dhcpd_db = path;
+	return new_lease_file ();
+}
+
 void db_startup (testp)
 	int testp;
 {
 	isc_result_t status;
+	off_t offset = 0;
 
 #if defined (TRACING)
 	if (!trace_playback ()) {
@@ -1060,9 +1788,27 @@ void db_startup (testp)
 		   in the lease file or not. */
 		authoring_byte_order = 0;
 
+		/* A worker without a lease file of its own yet starts out
+		   with its share of the leases in the configured file. */
+		if (path_dhcpd_shared_db && access (path_dhcpd_db, F_OK) < 0) {
+			worker_seeding = 1;
+			(void) read_conf_file (path_dhcpd_shared_db,
+					       (struct group *)0, 0, 1);
+			worker_seeding = 0;
+		}
+
+		/* If there's a binary lease file that goes with the lease
+		   file, load it, and only read the rest of the lease file. */
+		if (path_dhcpd_bin_db
+#if defined (TRACING)
+		    && !trace_record ()
+#endif
+		    && read_binary_leases (path_dhcpd_bin_db,
+					   &offset) != ISC_R_SUCCESS)
+			offset = 0;
+
 		/* Read in the existing lease file... */
-		status = read_conf_file (path_dhcpd_db,
-					 (struct group *)0, 0, 1);
+		status = read_lease_file_from (offset);
 		if (status != ISC_R_SUCCESS) {
 			/* XXX ignore status? */
 			;
@@ -1105,34 +1851,16 @@ void db_startup (testp)
 #endif
 }
 
-int new_lease_file ()
+/* Create a new lease file and open it for writing. */
+static FILE *create_lease_file (const char *fname)
 {
-	char newfname [512];
-	char backfname [512];
-	TIME t;
+	FILE *f;
 	int db_fd;
-	int db_validity;
-	FILE *new_db_file;
-
-	/* Make a temporary lease file... */
-	time(&t);
-
-	db_validity = lease_file_is_corrupt;
 
-	/* %Audit% Truncated filename causes panic. %2004.06.17,Safe%
-	 * This should never happen since the path is a configuration
-	 * variable from build-time or command-line.  But if it should,
-	 * either by malice or ignorance, we panic, since the potential
-	 * for havoc is high.
-	 */
-	if (snprintf (newfname, sizeof newfname, "%s.%d",
-		     path_dhcpd_db, (int)t) >= sizeof newfname)
-		log_fatal("new_lease_file: lease file path too long");
-
-	db_fd = open (newfname, O_WRONLY | O_TRUNC | O_CREAT, 0664);
+	db_fd = open (fname, O_WRONLY | O_TRUNC | O_CREAT, 0664);
 	if (db_fd < 0) {
 		log_error ("Can't create new lease file: %m");
-		return 0;
+		return NULL;
 	}
 
 #if defined (PARANOIA)
@@ -1150,39 +1878,43 @@ int new_lease_file ()
 	}
 #endif /* PARANOIA */
 
-	if ((new_db_file = fdopen(db_fd, "w")) == NULL) {
+	if ((f = fdopen(db_fd, "w")) == NULL) {
 		log_error("Can't fdopen new lease file: %m");
 		close(db_fd);
-		goto fdfail;
+		(void)unlink (fname);
+		return NULL;
 	}
+	/* Leases are appended in batches between commits; let each batch
+	   go out in as few writes as possible. */
+	(void) setvbuf (f, NULL, _IOFBF, LEASE_FILE_BUFSIZ);
+	return f;
+}
 
-	/* Close previous database, if any. */
-	if (db_file)
-		fclose(db_file);
-	db_file = new_db_file;
-
+/* Write the lease file header and everything we know of to db_file. */
+static int write_lease_file_contents ()
+{
 	errno = 0;
 	fprintf (db_file, "# The format of this file is documented in the %s",
 		 "dhcpd.leases(5) manual page.\n");
 
 	if (errno)
-		goto fail;
+		return 0;
 
 	fprintf (db_file, "# This lease file was written by isc-dhcp-%s\n\n",
 		 PACKAGE_VERSION);
 	if (errno)
-		goto fail;
+		return 0;
 
 	fprintf (db_file, "# authoring-byte-order entry is generated,"
                           " DO NOT DELETE\n");
 	if (errno)
-		goto fail;
+		return 0;
 
 	fprintf (db_file, "authoring-byte-order %s;\n\n",
 		 (DHCP_BYTE_ORDER == LITTLE_ENDIAN ?
 		  "little-endian" : "big-endian"));
 	if (errno)
-		goto fail;
+		return 0;
 
 	/* At this point we have a new lease file that, so far, could not
 	 * be described as either corrupt nor valid.
@@ -1191,8 +1923,14 @@ int new_lease_file ()
 
 	/* Write out all the leases that we know of... */
 	counting = 0;
-	if (!write_leases ())
-		goto fail;
+	return write_leases ();
+}
+
+/* Keep the current lease file as a backup and put newfname in its
+   place. */
+static int install_lease_file (const char *newfname)
+{
+	char backfname [512];
 
 #if defined (TRACING)
 	if (!trace_playback ()) {
@@ -1211,7 +1949,7 @@ int new_lease_file ()
 	    if (unlink (backfname) < 0 && errno != ENOENT) {
 		log_error ("Can't remove old lease database backup %s: %m",
 			   backfname);
-		goto fail;
+		return 0;
 	    }
 	    if (link(path_dhcpd_db, backfname) < 0) {
 		if (errno == ENOENT) {
@@ -1220,7 +1958,7 @@ int new_lease_file ()
 		} else {
 			log_error("Can't backup lease database %s to %s: %m",
 				  path_dhcpd_db, backfname);
-			goto fail;
+			return 0;
 		}
 	    }
 #if defined (TRACING)
@@ -1231,7 +1969,230 @@ int new_lease_file ()
 	if (rename (newfname, path_dhcpd_db) < 0) {
 		log_error ("Can't install new lease database %s to %s: %m",
 			   newfname, path_dhcpd_db);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Background lease file rewrites.
+ *
+ * Writing out every lease can take long enough that clients notice, so
+ * with background-lease-rewrite set the periodic rewrite is done by a
+ * child process working from a copy-on-write snapshot of the server's
+ * state.  The server keeps appending to the old lease file meanwhile.
+ * When the child is done, the server copies whatever it appended since
+ * the fork onto the end of the new file and then installs the new file
+ * the usual way.
+ */
+static pid_t rewrite_pid = -1;
+static off_t rewrite_offset;
+static char rewrite_fname [512];
+
+static void lease_file_rewrite_check (void *);
+
+static void finish_lease_file_rewrite ()
+{
+	FILE *new_db_file;
+	char buf [8192];
+	ssize_t n;
+	int fd;
+
+	new_db_file = fopen (rewrite_fname, "a");
+	if (!new_db_file) {
+		log_error ("Can't open new lease file %s: %m", rewrite_fname);
+		goto fail;
+	}
+	(void) setvbuf (new_db_file, NULL, _IOFBF, LEASE_FILE_BUFSIZ);
+
+	/* Bring over what was written to the old lease file since. */
+	if (fflush (db_file) == EOF ||
+	    (fd = open (path_dhcpd_db, O_RDONLY)) < 0) {
+		log_error ("Can't read back %s: %m", path_dhcpd_db);
+		goto fail;
+	}
+	if (lseek (fd, rewrite_offset, SEEK_SET) < 0) {
+		log_error ("Can't read back %s: %m", path_dhcpd_db);
+		close (fd);
+		goto fail;
+	}
+	while ((n = read (fd, buf, sizeof buf)) > 0)
+		if (fwrite (buf, n, 1, new_db_file) != 1)
+			break;
+	close (fd);
+	if (n != 0 || fflush (new_db_file) == EOF ||
+	    (dont_use_fsync == 0 && fsync (fileno (new_db_file)) < 0)) {
+		log_error ("Can't write new lease file %s: %m", rewrite_fname);
+		goto fail;
+	}
+
+	if (!install_lease_file (rewrite_fname))
+		goto fail;
+
+	fclose (db_file);
+	db_file = new_db_file;
+	log_info ("Rewrote %s in the background.", path_dhcpd_db);
+	return;
+
+      fail:
+	if (new_db_file)
+		fclose (new_db_file);
+	(void)unlink (rewrite_fname);
+}
+
+static void lease_file_rewrite_check (void *foo)
+{
+	struct timeval tv;
+	int status;
+	pid_t pid;
+
+	pid = waitpid (rewrite_pid, &status, WNOHANG);
+	if (pid == 0) {
+		tv.tv_sec = cur_tv.tv_sec + 1;
+		tv.tv_usec = cur_tv.tv_usec;
+		add_timeout (&tv, lease_file_rewrite_check, NULL, NULL, NULL);
+		return;
+	}
+	rewrite_pid = -1;
+
+	if (pid < 0 || !WIFEXITED (status) || WEXITSTATUS (status) != 0) {
+		log_error ("Background rewrite of %s failed.", path_dhcpd_db);
+		(void)unlink (rewrite_fname);
+		return;
+	}
+	finish_lease_file_rewrite ();
+}
+
+/* Start rewriting the lease file in a child process.   Returns zero if
+   the caller should rewrite it itself instead. */
+static int start_lease_file_rewrite ()
+{
+	FILE *new_db_file;
+	struct timeval tv;
+	off_t len;
+	TIME t;
+
+	if (rewrite_pid > 0)
+		return 1;
+	if (lease_file_is_corrupt || !db_file)
+		return 0;
+#if defined (TRACING)
+	if (trace_record () || trace_playback ())
+		return 0;
+#endif
+
+	if (fflush (db_file) == EOF ||
+	    (rewrite_offset = ftello (db_file)) < 0)
+		return 0;
+
+	time(&t);
+	if (snprintf (rewrite_fname, sizeof rewrite_fname, "%s.%d",
+		      path_dhcpd_db, (int)t) >= sizeof rewrite_fname)
+		log_fatal("new_lease_file: lease file path too long");
+	if ((new_db_file = create_lease_file (rewrite_fname)) == NULL)
+		return 0;
+
+	rewrite_pid = fork ();
+	if (rewrite_pid < 0) {
+		log_error ("Can't fork to rewrite the lease file: %m");
+		fclose (new_db_file);
+		(void)unlink (rewrite_fname);
+		return 0;
+	}
+
+	if (rewrite_pid == 0) {
+		/* The child writes the new file and the binary lease file
+		   that goes with it, and that's all. */
+		db_file = new_db_file;
+		count = 0;
+		if (!write_lease_file_contents ())
+			_exit (1);
+		if (path_dhcpd_bin_db) {
+			len = ftello (db_file);
+			path_dhcpd_db = rewrite_fname;
+			if (len < 0 ||
+			    !write_binary_lease_file (path_dhcpd_bin_db, len))
+				(void) unlink (path_dhcpd_bin_db);
+		}
+		_exit (fclose (db_file) == EOF ? 1 : 0);
+	}
+
+	fclose (new_db_file);
+	tv.tv_sec = cur_tv.tv_sec + 1;
+	tv.tv_usec = cur_tv.tv_usec;
+	add_timeout (&tv, lease_file_rewrite_check, NULL, NULL, NULL);
+	return 1;
+}
+
+/* Give up on a background rewrite, because the lease file is being
+   rewritten in the foreground. */
+static void cancel_lease_file_rewrite ()
+{
+	int status;
+
+	if (rewrite_pid <= 0)
+		return;
+	cancel_timeout (lease_file_rewrite_check, NULL);
+	kill (rewrite_pid, SIGKILL);
+	while (waitpid (rewrite_pid, &status, 0) < 0 && errno == EINTR)
+		;
+	rewrite_pid = -1;
+	(void)unlink (rewrite_fname);
+}
+
+int new_lease_file ()
+{
+	char newfname [512];
+	TIME t;
+	int db_validity;
+	FILE *new_db_file;
+
+	cancel_lease_file_rewrite ();
+
+	/* Make a temporary lease file... */
+	time(&t);
+
+	db_validity = lease_file_is_corrupt;
+
+	/* %Audit% Truncated filename causes panic. %2004.06.17,Safe%
+	 * This should never happen since the path is a configuration
+	 * variable from build-time or command-line.  But if it should,
+	 * either by malice or ignorance, we panic, since the potential
+	 * for havoc is high.
+	 */
+	if (snprintf (newfname, sizeof newfname, "%s.%d",
+		     path_dhcpd_db, (int)t) >= sizeof newfname)
+		log_fatal("new_lease_file: lease file path too long");
+
+	if ((new_db_file = create_lease_file (newfname)) == NULL)
+		return 0;
+
+	/* Close previous database, if any. */
+	if (db_file)
+		fclose(db_file);
+	db_file = new_db_file;
+
+	if (!write_lease_file_contents ())
 		goto fail;
+
+	if (!install_lease_file (newfname))
+		goto fail;
+
+	/* Write a binary lease file that goes with the new lease file.
+	   If we can't, get rid of the old one, which no longer does. */
+	if (path_dhcpd_bin_db
+#if defined (TRACING)
+	    && !trace_playback ()
+#endif
+	    ) {
+		off_t len = ftello (db_file);
+
+		if (len < 0 ||
+		    !write_binary_lease_file (path_dhcpd_bin_db, len)) {
+			log_error ("Removing out of date binary lease file %s.",
+				   path_dhcpd_bin_db);
+			(void) unlink (path_dhcpd_bin_db);
+		}
 	}
 
 	counting = 1;
@@ -1239,7 +2200,6 @@ int new_lease_file ()
 
       fail:
 	lease_file_is_corrupt = db_validity;
-      fdfail:
 	(void)unlink (newfname);
 	return 0;
 }
@@ -42,21 +42,8 @@ static int locate_network6(struct packet *packet);
 
 int outstanding_pings;
 
-#if defined(DELAYED_ACK)
 static void delayed_ack_enqueue(struct lease *);
-static void delayed_acks_timer(void *);
-
-
-struct leasequeue *ackqueue_head, *ackqueue_tail;
-static struct leasequeue *free_ackqueue;
-static struct timeval max_fsync;
-
-int outstanding_acks;
-int max_outstanding_acks = DEFAULT_DELAYED_ACK;
-int max_ack_delay_secs = DEFAULT_ACK_DELAY_SECS;
-int max_ack_delay_usecs = DEFAULT_ACK_DELAY_USECS;
-int min_ack_delay_usecs = DEFAULT_MIN_ACK_DELAY_USECS;
-#endif
+static void delayed_ack_reply(void *);
 
 static char dhcp_message [256];
 static int site_code_min;
@@ -95,6 +82,10 @@ dhcp (struct packet *packet) {
 	const char *errmsg;
 	struct data_string data;
 
+	/* In worker mode, leave other workers' clients to them. */
+	if (!worker_owns_packet(packet))
+		return;
+
 	if (!locate_network(packet) &&
 	    packet->packet_type != DHCPREQUEST &&
 	    packet->packet_type != DHCPINFORM && 
@@ -224,6 +215,7 @@ dhcp (struct packet *packet) {
 		if (packet->options->universe_count <= agent_universe.index)
 			packet->options->universe_count =
 						agent_universe.index + 1;
+		packet->options->generation++;
 
 		packet->agent_options_stashed = ISC_TRUE;
 	}
@@ -290,6 +282,7 @@ void dhcpdiscover (packet, ms_nulltp)
 	struct lease *lease = (struct lease *)0;
 	char msgbuf [1024]; /* XXX */
 	TIME when;
+	struct pool *pool;
 	const char *s;
 	int peer_has_leases = 0;
 #if defined (FAILOVER_PROTOCOL)
@@ -396,8 +389,17 @@ void dhcpdiscover (packet, ms_nulltp)
 				log_error ("%s: network %s: no free leases",
 					   msgbuf,
 					   packet -> shared_network -> name);
+
+			/* In worker mode, the other workers may have some
+			   to lend us by the time the client tries again. */
+			for (pool = packet -> shared_network -> pools;
+			     pool; pool = pool -> next)
+				worker_need_leases (pool);
 			return;
 		}
+
+		/* ...and ask to borrow more before the pool runs out. */
+		worker_need_leases (lease -> pool);
 	}
 
 #if defined (FAILOVER_PROTOCOL)
@@ -2149,16 +2151,21 @@ void ack_lease (packet, lease, offer, when, msg, ms_nulltp, hp)
 	struct in_addr from;
 	TIME remaining_time;
 	struct iaddr cip;
-#if defined(DELAYED_ACK) && !defined(DHCP4o6)
 	/* By default we don't do the enqueue */
 	isc_boolean_t enqueue = ISC_FALSE;
+#if !defined(DHCP4o6)
+	int delay_ack = group_commit;
+#else
+	int delay_ack = 0;
 #endif
+	int updated = 1;
 	int use_old_lease = 0;
 
 	unsigned i, j;
 	int s1;
 	int ignorep;
 	struct timeval tv;
+	pair p;
 
 	/* If we're already acking this lease, don't do it again. */
 	if (lease -> state)
@@ -3066,6 +3073,12 @@ void ack_lease (packet, lease, offer, when, msg, ms_nulltp, hp)
 			 (struct option_chain_head *)
 			 packet -> options -> universes [agent_universe.index],
 			 MDL);
+		/* They're kept with the lease, so get them out of the
+		   packet's arena. */
+		for (p = lt -> agent_options -> first; p; p = p -> cdr)
+		    data_string_promote
+			    (&((struct option_cache *)(p -> car)) -> data,
+			     MDL);
 	    }
 	}
 
@@ -3163,39 +3176,47 @@ void ack_lease (packet, lease, offer, when, msg, ms_nulltp, hp)
 			commit = 0;
 		}
 
-#if !defined(DELAYED_ACK) || defined(DHCP4o6)
-		/* Install the new information on 'lt' onto the lease at
-		 * 'lease'.  If this is a DHCPOFFER, it is a 'soft' promise,
-		 * if it is a DHCPACK, it is a 'hard' binding, so it needs
-		 * to be recorded and propogated immediately.  If the update
-		 * fails, don't ACK it (or BOOTREPLY) either; we may give
-		 * the same lease to another client later, and that would be
-		 * a conflict.
-		 */
-		if ((use_old_lease == 0) &&
-		    !supersede_lease(lease, lt, commit,
-				     offer == DHCPACK, offer == DHCPACK, 0)) {
-#else /* defined(DELAYED_ACK) && !defined(DHCP4o6) */
-		/*
-		 * If there already isn't a need for a lease commit, and we
-		 * can just answer right away, set a flag to indicate this.
-		 */
-		if (commit)
-			enqueue = ISC_TRUE;
-
-		/* Install the new information on 'lt' onto the lease at
-		 * 'lease'.  We will not 'commit' this information to disk
-		 * yet (fsync()), we will 'propogate' the information if
-		 * this is BOOTP or a DHCPACK, but we will not 'pimmediate'ly
-		 * transmit failover binding updates (this is delayed until
-		 * after the fsync()).  If the update fails, don't ACK it (or
-		 * BOOTREPLY either); we may give the same lease out to a
-		 * different client, and that would be a conflict.
-		 */
-		if ((use_old_lease == 0) &&
-		    !supersede_lease(lease, lt, 0,
-				     !offer || offer == DHCPACK, 0, 0)) {
-#endif
+		if (!delay_ack) {
+			/* Install the new information on 'lt' onto the
+			 * lease at 'lease'.  If this is a DHCPOFFER, it is
+			 * a 'soft' promise, if it is a DHCPACK, it is a
+			 * 'hard' binding, so it needs to be recorded and
+			 * propogated immediately.  If the update fails,
+			 * don't ACK it (or BOOTREPLY) either; we may give
+			 * the same lease to another client later, and that
+			 * would be a conflict.
+			 */
+			if (use_old_lease == 0)
+				updated = supersede_lease(lease, lt, commit,
+							  offer == DHCPACK,
+							  offer == DHCPACK, 0);
+		} else {
+			/*
+			 * If there already isn't a need for a lease commit,
+			 * and we can just answer right away, set a flag to
+			 * indicate this.
+			 */
+			if (commit)
+				enqueue = ISC_TRUE;
+
+			/* Install the new information on 'lt' onto the
+			 * lease at 'lease'.  We will not 'commit' this
+			 * information to disk yet (fsync()), we will
+			 * 'propogate' the information if this is BOOTP or a
+			 * DHCPACK, but we will not 'pimmediate'ly transmit
+			 * failover binding updates (this is delayed until
+			 * after the fsync()).  If the update fails, don't
+			 * ACK it (or BOOTREPLY either); we may give the same
+			 * lease out to a different client, and that would
+			 * be a conflict.
+			 */
+			if (use_old_lease == 0)
+				updated = supersede_lease(lease, lt, 0,
+							  !offer ||
+							  offer == DHCPACK,
+							  0, 0);
+		}
+		if (!updated) {
 			log_info ("%s: database update failed", msg);
 			free_lease_state (state, MDL);
 			lease_dereference (&lt, MDL);
@@ -3573,172 +3594,60 @@ void ack_lease (packet, lease, offer, when, msg, ms_nulltp, hp)
 		++outstanding_pings;
 	} else {
   		lease->cltt = cur_time;
-#if defined(DELAYED_ACK) && !defined(DHCP4o6)
 		if (enqueue)
 			delayed_ack_enqueue(lease);
-		else 
-#endif
+		else
 			dhcp_reply(lease);
 	}
 }
 
-#if defined(DELAYED_ACK)
-
 /*
  * CC: queue single ACK:
  * - write the lease (but do not fsync it yet)
- * - add to double linked list
- * - commit if more than xx ACKs pending
- * - if necessary set the max timer and bump the next timer
- *   but only up to the max timer value.
+ * - hand the ACK to the group commit queue, which commits the lease
+ *   file and sends the ACK once enough ACKs are pending or the
+ *   delay timers run out
  */
 
 static void
 delayed_ack_enqueue(struct lease *lease)
 {
-	struct leasequeue *q;
-
 	if (!write_lease(lease)) 
 		return;
-	if (free_ackqueue) {
-	   	q = free_ackqueue;
-		free_ackqueue = q->next;
-	} else {
-		q = ((struct leasequeue *)
-			     dmalloc(sizeof(struct leasequeue), MDL));
-		if (!q)
-			log_fatal("delayed_ack_enqueue: no memory!");
-	}
-	memset(q, 0, sizeof *q);
-	/* prepend to ackqueue*/
-	lease_reference(&q->lease, lease, MDL);
-	q->next = ackqueue_head;
-	ackqueue_head = q;
-	if (!ackqueue_tail) 
-		ackqueue_tail = q;
-	else
-		q->next->prev = q;
-
-	outstanding_acks++;
-	if (outstanding_acks > max_outstanding_acks) {
-		/* Cancel any pending timeout and call handler directly */
-		cancel_timeout(delayed_acks_timer, NULL);
-		delayed_acks_timer(NULL);
-	} else {
-		struct timeval next_fsync;
-
-		if (max_fsync.tv_sec == 0 && max_fsync.tv_usec == 0) {
-			/* set the maximum time we'll wait */
-			max_fsync.tv_sec = cur_tv.tv_sec + max_ack_delay_secs;
-			max_fsync.tv_usec = cur_tv.tv_usec +
-				max_ack_delay_usecs;
-
-			if (max_fsync.tv_usec >= 1000000) {
-				max_fsync.tv_sec++;
-				max_fsync.tv_usec -= 1000000;
-			}
-		}
-
-		/* Set the timeout */
-		next_fsync.tv_sec = cur_tv.tv_sec;
-		next_fsync.tv_usec = cur_tv.tv_usec + min_ack_delay_usecs;
-		if (next_fsync.tv_usec >= 1000000) {
-			next_fsync.tv_sec++;
-			next_fsync.tv_usec -= 1000000;
-		}
-		/* but not more than the max */
-		if ((next_fsync.tv_sec > max_fsync.tv_sec) ||
-		    ((next_fsync.tv_sec == max_fsync.tv_sec) &&
-		     (next_fsync.tv_usec > max_fsync.tv_usec))) {
-			next_fsync.tv_sec = max_fsync.tv_sec;
-			next_fsync.tv_usec = max_fsync.tv_usec;
-		}
-
-		add_timeout(&next_fsync, delayed_acks_timer, NULL,
-			    (tvref_t) NULL, (tvunref_t) NULL);
-	}
+	defer_until_commit(delayed_ack_reply, lease,
+			   (tvref_t)lease_reference,
+			   (tvunref_t)lease_dereference);
 }
 
-/* Processes any delayed acks:
- * Commits the leases and then for each delayed ack:
+/* Processes a delayed ack once its lease has been committed:
  *  - Update the failover peer if we're in failover
  *  - Send the REPLY to the client
  */
 static void
-delayed_acks_timer(void *foo)
+delayed_ack_reply(void *vlease)
 {
-	struct leasequeue *ack, *p;
-
-	/* Reset max fsync */
-	memset(&max_fsync, 0, sizeof(max_fsync));
-
-	if (!outstanding_acks) {
-		/* Nothing to do, so punt, shouldn't happen? */
-		return;
-	}
-
-	/* Commit the leases first */
-	commit_leases();
-
-	/* Now process the delayed ACKs
-	 - update failover peer
-	 - send out the ACK packets
-	 - move the queue slots to the free list
-	*/
-
-	/*  process from bottom to retain packet order */
-	for (ack = ackqueue_tail ; ack ; ack = p) { 
-		p = ack->prev;
+	struct lease *lease = vlease;
 
 #if defined(FAILOVER_PROTOCOL)
-		/* If we're in failover we need to send any deferred
-		* bind updates as well as the replies */
-		if (ack->lease->pool) {
-			dhcp_failover_state_t *fpeer;
-
-			fpeer = ack->lease->pool->failover_peer;
-			if (fpeer && fpeer->link_to_peer) {
-				dhcp_failover_send_updates(fpeer);
-			}
+	/* If we're in failover we need to send any deferred
+	 * bind updates as well as the replies */
+	if (lease->pool) {
+		dhcp_failover_state_t *fpeer;
+
+		fpeer = lease->pool->failover_peer;
+		if (fpeer && fpeer->link_to_peer) {
+			dhcp_failover_send_updates(fpeer);
 		}
-#endif
-
-		/* dhcp_reply() requires that the reply state still be valid */
-		if (ack->lease->state == NULL)
-			log_error("delayed ack for %s has gone stale",
-				  piaddr(ack->lease->ip_addr));
-		else {
-			dhcp_reply(ack->lease);
-		}
-
-		lease_dereference(&ack->lease, MDL);
-		ack->next = free_ackqueue;
-		free_ackqueue = ack;
 	}
-
-	ackqueue_head = NULL;
-	ackqueue_tail = NULL;
-	outstanding_acks = 0;
-}
-
-#if defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
-void
-relinquish_ackqueue(void)
-{
-	struct leasequeue *q, *n;
-	
-	for (q = ackqueue_head ; q ; q = n) {
-		n = q->next;
-		dfree(q, MDL);
-	}
-	for (q = free_ackqueue ; q ; q = n) {
-		n = q->next;
-		dfree(q, MDL);
-	}
-}
 #endif
 
-#endif /* defined(DELAYED_ACK) */
+	/* dhcp_reply() requires that the reply state still be valid */
+	if (lease->state == NULL)
+		log_error("delayed ack for %s has gone stale",
+			  piaddr(lease->ip_addr));
+	else
+		dhcp_reply(lease);
+}
 
 void dhcp_reply (lease)
 	struct lease *lease;
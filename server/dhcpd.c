@@ -76,6 +76,7 @@ option server.ddns-rev-domainname = \"in-addr.arpa.\";";
 #endif /* NSUPDATE */
 int ddns_update_style;
 int dont_use_fsync = 0; /* 0 = default, use fsync, 1 = don't use fsync */
+int background_lease_rewrite = 0;
 int server_id_check = 0; /* 0 = default, don't check server id, 1 = do check */
 int prefix_length_mode = PLM_EXACT;
 
@@ -85,6 +86,7 @@ u_int32_t abandon_lease_time = DEFAULT_ABANDON_LEASE_TIME;
 
 const char *path_dhcpd_conf = _PATH_DHCPD_CONF;
 const char *path_dhcpd_db = _PATH_DHCPD_DB;
+const char *path_dhcpd_bin_db = NULL;
 const char *path_dhcpd_pid = _PATH_DHCPD_PID;
 /* False (default) => we write and use a pid file */
 isc_boolean_t no_pid_file = ISC_FALSE;
@@ -171,7 +173,10 @@ static void omapi_listener_start (void *foo)
 #endif /* TRACING */
 
 #define DHCPD_USAGEC \
+"             [-lbf binary-lease-file]\n" \
+"             [-convert-leases {text|binary} file]\n" \
 "             [-pf pid-file] [--no-pid] [-s server]\n" \
+"             [-workers N [-reuseport]]\n" \
 "             [if0 [...ifN]]"
 
 #define DHCPD_USAGEH "{--version|--help|-h}"
@@ -272,6 +277,9 @@ main(int argc, char **argv) {
 	char *traceinfile = (char *)0;
 	char *traceoutfile = (char *)0;
 #endif
+	const char *no_workers = NULL;
+	const char *convert_path = NULL;
+	int convert_binary = 0;
 
 #if defined (PARANOIA)
 	char *set_user   = 0;
@@ -312,10 +320,36 @@ main(int argc, char **argv) {
 #ifndef DEBUG
 			daemon = 0;
 #endif
+			no_workers = argv [i];
 		} else if (!strcmp (argv [i], "-T")) {
 #ifndef DEBUG
 			daemon = 0;
 #endif
+			no_workers = argv [i];
+		} else if (!strcmp (argv [i], "-convert-leases")) {
+#ifndef DEBUG
+			daemon = 0;
+#endif
+			no_workers = argv [i];
+		} else if (!strcmp (argv [i], "-workers")) {
+			if (++i == argc)
+				usage(use_noarg, argv[i-1]);
+			dhcpd_workers = atoi (argv [i]);
+			if (dhcpd_workers < 1)
+				log_fatal ("-workers: %s is not a valid number "
+					   "of workers.", argv [i]);
+		} else if (!strcmp (argv [i], "-reuseport")) {
+#if defined (USE_SOCKETS) && defined (HAVE_V4_REUSEPORT)
+			dhcpv4_reuseport = 1;
+#else
+			log_fatal ("-reuseport needs a server built with "
+				   "--enable-use-sockets on a system "
+				   "with SO_REUSEPORT and IP_PKTINFO.");
+#endif
+#ifdef DHCPv6
+		} else if (!strcmp (argv [i], "-6")) {
+			no_workers = argv [i];
+#endif /* DHCPv6 */
 		} else if (!strcmp (argv [i], "--version")) {
 			const char vstring[] = "isc-dhcpd-";
 			IGNORE_RET(write(STDERR_FILENO, vstring,
@@ -358,10 +392,20 @@ main(int argc, char **argv) {
 #ifndef DEBUG
 			daemon = 0;
 #endif
+			no_workers = argv [i];
+		} else if (!strcmp (argv [i], "-tf")) {
+			no_workers = argv [i];
 #endif
 		}
 	}
 
+	/* The workers split up the DHCPv4 clients between them; testing,
+	   tracing and DHCPv6 all need a single server process. */
+	if (dhcpd_workers > 1 && no_workers != NULL)
+		log_fatal ("%s can't be used with -workers.", no_workers);
+	if (dhcpv4_reuseport && dhcpd_workers < 2)
+		log_fatal ("-reuseport is only useful with -workers.");
+
 #ifndef DEBUG
 	/* When not forbidden prepare to become a daemon */
 	if (daemon) {
@@ -388,6 +432,21 @@ main(int argc, char **argv) {
 	}
 #endif
 
+	/* Start the workers before creating the context, so that they
+	   don't share its socket manager.   Only the first worker tells
+	   the daemon parent it's up, and only it keeps a pid file. */
+	if (dhcpd_workers > 1) {
+#ifndef DEBUG
+		start_workers(dfd[1], daemon);
+		if (dhcpd_worker_id != 0)
+			dfd[1] = -1;
+#else
+		start_workers(-1, 0);
+#endif
+		if (dhcpd_worker_id != 0)
+			no_pid_file = ISC_TRUE;
+	}
+
 	/* Set up the isc and dns library managers */
 	status = dhcp_context_create(DHCP_CONTEXT_PRE_DB,
 				     NULL, NULL);
@@ -458,11 +517,34 @@ main(int argc, char **argv) {
 				usage(use_noarg, argv[i-1]);
 			path_dhcpd_db = argv [i];
 			no_dhcpd_db = 1;
+		} else if (!strcmp (argv [i], "-lbf")) {
+			if (++i == argc)
+				usage(use_noarg, argv[i-1]);
+			path_dhcpd_bin_db = argv [i];
+		} else if (!strcmp (argv [i], "-convert-leases")) {
+			/* Load the leases, write them out and exit. */
+			if (++i == argc)
+				usage(use_noarg, argv[i-1]);
+			if (!strcmp (argv [i], "binary"))
+				convert_binary = 1;
+			else if (strcmp (argv [i], "text"))
+				usage("Unknown lease file format: %s", argv[i]);
+			if (++i == argc)
+				usage(use_noarg, argv[i-2]);
+			convert_path = argv [i];
+			cftest = 1;
+			lftest = 1;
+			log_perror = -1;
 		} else if (!strcmp (argv [i], "-pf")) {
 			if (++i == argc)
 				usage(use_noarg, argv[i-1]);
 			path_dhcpd_pid = argv [i];
 			no_dhcpd_pid = 1;
+		} else if (!strcmp (argv [i], "-workers")) {
+			/* Handled above. */
+			i++;
+		} else if (!strcmp (argv [i], "-reuseport")) {
+			/* Handled above. */
 		} else if (!strcmp(argv[i], "--no-pid")) {
 			no_pid_file = ISC_TRUE;
                 } else if (!strcmp (argv [i], "-t")) {
@@ -600,6 +682,20 @@ main(int argc, char **argv) {
                         log_fatal("Failed to get realpath for %s: %s", path, 
                                    strerror(errno));
         }
+	if (path_dhcpd_bin_db && path_dhcpd_bin_db[0] != '/') {
+		/* It needn't exist yet, so make it absolute by hand. */
+		char *dir = realpath(".", NULL);
+
+		if (dir == NULL)
+			log_fatal("Failed to get realpath for .: %s",
+				  strerror(errno));
+		s = dmalloc(strlen(dir) + strlen(path_dhcpd_bin_db) + 2, MDL);
+		if (s == NULL)
+			log_fatal("No memory for binary lease file name.");
+		sprintf(s, "%s/%s", dir, path_dhcpd_bin_db);
+		free(dir);
+		path_dhcpd_bin_db = s;
+	}
 
 	if (!quiet) {
 		log_info("%s %s", message, PACKAGE_VERSION);
@@ -822,8 +918,15 @@ main(int argc, char **argv) {
 
 #if defined (FAILOVER_PROTOCOL)
 	dhcp_failover_sanity_check();
+
+	/* A failover peer expects one server on the other end. */
+	if (dhcpd_workers > 1 && failover_states != NULL)
+		log_fatal ("Failover peers can't be used with -workers.");
 #endif
 
+	/* Each worker keeps its own lease file. */
+	worker_lease_file_setup ();
+
 #if defined(DHCPv6) && defined(DHCP4o6)
 	if (dhcpv4_over_dhcpv6) {
 		if ((local_family == AF_INET) && (interfaces != NULL))
@@ -879,6 +982,13 @@ main(int argc, char **argv) {
 	/* Start up the database... */
 	db_startup (lftest);
 
+	if (convert_path) {
+		if (!convert_leases (convert_binary, convert_path))
+			log_fatal ("Unable to write the leases to %s.",
+				   convert_path);
+		exit (0);
+	}
+
 	if (lftest)
 		exit (0);
 
@@ -899,6 +1009,10 @@ main(int argc, char **argv) {
 #endif /* DHCPv6 && DHCP4o6 */
 	discover_interfaces(DISCOVER_SERVER);
 
+	/* Listen for messages from the other workers. */
+	if (dhcpd_workers > 1)
+		worker_inbox_setup();
+
 #ifdef DHCPv6
 	/*
 	 * Remove addresses from our pools that we should not issue
@@ -1304,7 +1418,7 @@ void postconf_initialization (int quiet)
 		}
 	}
 
-#if defined(DELAYED_ACK)
+	/* Configuring either of these turns on group commit. */
 	oc = lookup_option(&server_universe, options, SV_DELAYED_ACK);
 	if (oc &&
 	    evaluate_option_cache(&db, NULL, NULL, NULL, options, NULL,
@@ -1314,6 +1428,7 @@ void postconf_initialization (int quiet)
 		} else {
 			log_fatal("invalid max delayed ACK count ");
 		}
+		group_commit = 1;
 		data_string_forget(&db, MDL);
 	}
 
@@ -1329,10 +1444,10 @@ void postconf_initialization (int quiet)
 		timeval = getULong(db.data);
 		max_ack_delay_secs  = timeval / 1000000;
 		max_ack_delay_usecs = timeval % 1000000;
+		group_commit = 1;
 
 		data_string_forget(&db, MDL);
 	}
-#endif
 
 	oc = lookup_option(&server_universe, options, SV_DONT_USE_FSYNC);
 	if ((oc != NULL) &&
@@ -1342,6 +1457,14 @@ void postconf_initialization (int quiet)
 		log_error("Not using fsync() to flush lease writes");
 	}
 
+	oc = lookup_option(&server_universe, options,
+			   SV_BACKGROUND_LEASE_REWRITE);
+	if ((oc != NULL) &&
+	    evaluate_boolean_option_cache(NULL, NULL, NULL, NULL, options, NULL,
+					  &global_scope, oc, MDL)) {
+		background_lease_rewrite = 1;
+	}
+
        oc = lookup_option(&server_universe, options, SV_SERVER_ID_CHECK);
        if ((oc != NULL) &&
 	   evaluate_boolean_option_cache(NULL, NULL, NULL, NULL, options, NULL,
@@ -1389,8 +1512,11 @@ void postconf_initialization (int quiet)
 
 void postdb_startup (void)
 {
-	/* Initialize the omapi listener state. */
+	/* Initialize the omapi listener state.  In worker mode each
+	   worker only knows its own leases, so each one listens on its
+	   own port, counting up from the configured one. */
 	if (omapi_port != -1) {
+		omapi_port += dhcpd_worker_id;
 		omapi_listener_start (0);
 	}
 
@@ -1639,6 +1765,8 @@ static isc_result_t dhcp_io_shutdown_countdown (void *vlp)
 		    dhcp_failover_set_state (state, recover);
 		}
 	    }
+	    slab_pool_stats ();
+	    option_memo_stats ();
 #if defined (DEBUG_MEMORY_LEAKAGE) && \
 		defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
 	    free_everything ();
@@ -1650,6 +1778,8 @@ static isc_result_t dhcp_io_shutdown_countdown (void *vlp)
 	}		
 #else
 	if (shutdown_state == shutdown_done) {
+		slab_pool_stats ();
+		option_memo_stats ();
 #if defined (DEBUG_MEMORY_LEAKAGE) && \
 		defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
 		free_everything ();
@@ -161,6 +161,9 @@ static void schedule_lease_timeout_reply(struct reply_state *reply);
 static int eval_prefix_mode(int thislen, int preflen, int prefix_mode);
 static isc_result_t pick_v6_prefix_helper(struct reply_state *reply,
 					  int prefix_mode);
+static isc_result_t pick_v6_prefix_closest(struct reply_state *reply,
+					   int prefix_mode);
+static void log_prefix6_usage(struct shared_network *shared);
 
 static void unicast_reject(struct data_string *reply_ret, struct packet *packet,
 		  const struct data_string *client_id,
@@ -1497,11 +1500,11 @@ try_client_v6_prefix(struct iasubopt **pref,
  * PLM_EXACT – look for an exact match first, if none found then fail. This
  * is the default behavior.
  *
- * PLM_MAXIMUM  - look for an exact match first, then the first available whose
- * prefix length is less than client's plen, otherwise fail.
+ * PLM_MAXIMUM  - look for an exact match first, then the available prefix
+ * whose length is less than and closest to client's plen, otherwise fail.
  *
- * PLM_MINIMUM  - look for an exact match first, then the first available whose
- * prefix length is greater than client's plen, otherwise fail.
+ * PLM_MINIMUM  - look for an exact match first, then the available prefix
+ * whose length is greater than and closest to client's plen, otherwise fail.
  *
  * Note that the selection mode is configurable at the global scope only via
  * prefix-len-mode.
@@ -1603,9 +1606,65 @@ pick_v6_prefix(struct reply_state *reply) {
 	 * Presumably that means we have no prefixes for the client.
 	*/
 	log_debug("Unable to pick client prefix: no prefixes available");
+	log_prefix6_usage(reply->shared);
 	return ISC_R_NORESOURCES;
 }
 
+/*!
+ *
+ * \brief Log how many prefixes of each length a shared network has
+ *
+ * \param shared = the shared network whose PD pools are counted
+ */
+static void
+log_prefix6_usage(struct shared_network *shared) {
+	struct ipv6_pool *p;
+	struct ipv6_pond *pond;
+	isc_uint64_t total[129], active[129];
+	char jumbo[129], seen[129];
+	char *shared_name = "no name";
+	int i, len;
+
+	if (shared->name != NULL)
+		shared_name = shared->name;
+
+	memset(total, 0, sizeof(total));
+	memset(active, 0, sizeof(active));
+	memset(jumbo, 0, sizeof(jumbo));
+	memset(seen, 0, sizeof(seen));
+
+	for (pond = shared->ipv6_pond; pond != NULL; pond = pond->next) {
+		if (pond->ipv6_pools == NULL)
+			continue;
+
+		for (i = 0; (p = pond->ipv6_pools[i]) != NULL; i++) {
+			len = p->units;
+			if ((p->pool_type != D6O_IA_PD) ||
+			    (len < p->bits) || (len > 128))
+				continue;
+			seen[len] = 1;
+			if (len - p->bits >= 64)
+				jumbo[len] = 1;
+			else
+				total[len] += (isc_uint64_t)1 << (len - p->bits);
+			active[len] += p->num_active;
+		}
+	}
+
+	for (len = 0; len <= 128; len++) {
+		if (!seen[len])
+			continue;
+		if (jumbo[len])
+			log_debug("  /%d prefixes - shared network %s: "
+				  "2^64-1 < total, %llu active",
+				  len, shared_name, active[len]);
+		else
+			log_debug("  /%d prefixes - shared network %s: "
+				  "%llu total, %llu active",
+				  len, shared_name, total[len], active[len]);
+	}
+}
+
 /*!
  *
  * \brief  Get an IPv6 prefix for the client based upon selection mode.
@@ -1637,6 +1696,9 @@ pick_v6_prefix_helper(struct reply_state *reply, int prefix_mode) {
 	unsigned int attempts;
 	struct iasubopt **pref = &reply->lease;
 
+	if ((prefix_mode == PLM_MINIMUM) || (prefix_mode == PLM_MAXIMUM))
+		return pick_v6_prefix_closest(reply, prefix_mode);
+
 	for (pond = reply->shared->ipv6_pond; pond != NULL; pond = pond->next) {
 		if (((pond->prohibit_list != NULL) &&
 		     (permitted(reply->packet, pond->prohibit_list))) ||
@@ -1659,6 +1721,84 @@ pick_v6_prefix_helper(struct reply_state *reply, int prefix_mode) {
 	return ISC_R_NORESOURCES;
 }
 
+/*!
+ *
+ * \brief  Get an IPv6 prefix whose length is closest to the client's plen.
+ *
+ * Used for PLM_MINIMUM and PLM_MAXIMUM: of the lengths the mode allows,
+ * the pools whose length is nearest to the client's plen are tried
+ * first, and a pool of the next nearest length only when all of those
+ * are full.
+ *
+ * \param reply = the state structure for the current work on this request
+ *                if we create a lease we return it using reply->lease
+ * \prefix_mode = selection mode to use
+ *
+ * \return
+ * ISC_R_SUCCESS = we were able to find a prefix and are returning a
+ *                 pointer to the lease
+ * ISC_R_NORESOURCES = none of the pools allowed by the mode had a free
+ *                     prefix
+ */
+static isc_result_t
+pick_v6_prefix_closest(struct reply_state *reply, int prefix_mode) {
+	struct ipv6_pool *p;
+	struct ipv6_pond *pond;
+	int i, best;
+	unsigned int attempts;
+	char tried[129];
+
+	memset(tried, 0, sizeof(tried));
+	for (;;) {
+		/* Find the closest length we haven't tried yet. */
+		best = -1;
+		for (pond = reply->shared->ipv6_pond; pond != NULL;
+		     pond = pond->next) {
+			if (((pond->prohibit_list != NULL) &&
+			     (permitted(reply->packet, pond->prohibit_list))) ||
+			    ((pond->permit_list != NULL) &&
+			     (!permitted(reply->packet, pond->permit_list))))
+				continue;
+
+			for (i = 0; (p = pond->ipv6_pools[i]) != NULL; i++) {
+				if ((p->pool_type != D6O_IA_PD) ||
+				    (p->units < 0) || (p->units > 128) ||
+				    tried[p->units] ||
+				    (eval_prefix_mode(p->units, reply->preflen,
+						      prefix_mode) != 1))
+					continue;
+				if ((best < 0) ||
+				    (abs(p->units - reply->preflen) <
+				     abs(best - reply->preflen)))
+					best = p->units;
+			}
+		}
+		if (best < 0)
+			return ISC_R_NORESOURCES;
+
+		for (pond = reply->shared->ipv6_pond; pond != NULL;
+		     pond = pond->next) {
+			if (((pond->prohibit_list != NULL) &&
+			     (permitted(reply->packet, pond->prohibit_list))) ||
+			    ((pond->permit_list != NULL) &&
+			     (!permitted(reply->packet, pond->permit_list))))
+				continue;
+
+			for (i = 0; (p = pond->ipv6_pools[i]) != NULL; i++) {
+				if ((p->pool_type == D6O_IA_PD) &&
+				    (p->units == best) &&
+				    (create_prefix6(p, &reply->lease, &attempts,
+						    &reply->ia->iaid_duid,
+						    cur_time + 120)
+				     == ISC_R_SUCCESS)) {
+					return (ISC_R_SUCCESS);
+				}
+			}
+		}
+		tried[best] = 1;
+	}
+}
+
 /*!
  *
  * \brief Test a prefix length against another based on prefix length mode
@@ -7402,11 +7542,46 @@ log_packet_in(const struct packet *packet) {
 	data_string_forget(&s, MDL);
 }
 
+/*
+ * A reply that has to wait for the leases behind it to be committed.
+ * It sits in the group commit queue (see defer_until_commit()) and is
+ * sent once they are on disk.
+ */
+struct deferred_reply6 {
+	struct interface_info *interface;
+	struct sockaddr_in6 to_addr;
+	struct data_string reply;
+};
+
+static void
+send_deferred_reply6(void *arg) {
+	struct deferred_reply6 *d = arg;
+	int send_ret;
+
+	send_ret = send_packet6(d->interface, d->reply.data, d->reply.len,
+				&d->to_addr);
+	if (send_ret != d->reply.len) {
+		log_error("dhcpv6: send_packet6() sent %d of %d bytes",
+			  send_ret, d->reply.len);
+	}
+}
+
+static void
+free_deferred_reply6(void *ptr, const char *file, int line) {
+	struct deferred_reply6 **dp = ptr;
+
+	interface_dereference(&(*dp)->interface, file, line);
+	data_string_forget(&(*dp)->reply, file, line);
+	dfree(*dp, file, line);
+	*dp = NULL;
+}
+
 void
 dhcpv6(struct packet *packet) {
 	struct data_string reply;
 	struct sockaddr_in6 to_addr;
 	int send_ret;
+	unsigned long written;
 
 	/*
 	 * Log a message that we received this packet.
@@ -7416,6 +7591,7 @@ dhcpv6(struct packet *packet) {
 	/*
 	 * Build our reply packet.
 	 */
+	written = leases_written();
 	build_dhcpv6_reply(&reply, packet);
 
 	if (reply.data != NULL) {
@@ -7450,6 +7626,31 @@ dhcpv6(struct packet *packet) {
 			 piaddr(packet->client_addr),
 			 ntohs(to_addr.sin6_port));
 
+		/*
+		 * If building the reply wrote any leases, don't send it
+		 * until they have been committed.  Writes made for other
+		 * replies don't hold this one up.
+		 */
+		if (group_commit && (leases_written() != written) &&
+		    !leases_committed(leases_written())) {
+			struct deferred_reply6 *d;
+
+			d = dmalloc(sizeof(*d), MDL);
+			if (d != NULL) {
+				interface_reference(&d->interface,
+						    packet->interface, MDL);
+				d->to_addr = to_addr;
+				data_string_copy(&d->reply, &reply, MDL);
+				defer_until_commit(send_deferred_reply6, d,
+						   NULL, free_deferred_reply6);
+				data_string_forget(&reply, MDL);
+				return;
+			}
+
+			/* No room to queue it, so commit it right away. */
+			commit_leases();
+		}
+
 		send_ret = send_packet6(packet->interface,
 					reply.data, reply.len, &to_addr);
 		if (send_ret != reply.len) {
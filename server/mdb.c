@@ -94,6 +94,7 @@ isc_result_t enter_class(cd, dynamicp, commit)
 			/* nothing */ ;
 		class_reference (&c -> nic, cd, MDL);
 	}
+	invalidate_class_index ();
 
 	if (dynamicp && commit) {
 		const char *name = cd->name;
@@ -858,6 +859,7 @@ void new_address_range (cfile, low, high, subnet, pool, lpchain)
 	/* Fill out the lease structures with some minimal information. */
 	for (i = 0; i < num_addrs; i++) {
 		struct lease *lp = (struct lease *)0;
+
 #if defined (COMPACT_LEASES)
 		omapi_object_initialize ((omapi_object_t *)&address_range [i],
 					 dhcp_type_lease,
@@ -882,8 +884,12 @@ void new_address_range (cfile, low, high, subnet, pool, lpchain)
 		lp->rewind_binding_state = FTS_FREE;
 		lp->flags = 0;
 
-		/* Remember the lease in the IP address hash. */
-		if (find_lease_by_ip_addr (&lt, lp -> ip_addr, MDL)) {
+		/* Remember the lease in the IP address hash.  In worker
+		   mode, the leases for other workers' addresses are kept
+		   aside instead, in case they're lent to us. */
+		if (!worker_owns_address (lp -> ip_addr))
+			worker_foreign_lease (lp);
+		else if (find_lease_by_ip_addr (&lt, lp -> ip_addr, MDL)) {
 			if (lt -> pool) {
 				parse_warn (cfile,
 					    "lease %s is declared twice!",
@@ -907,10 +913,291 @@ void new_address_range (cfile, low, high, subnet, pool, lpchain)
 	}
 }
 
+/*
+ * Subnets are indexed by prefix in a path-compressed binary (Patricia)
+ * trie per address family, so that find_subnet() and
+ * find_grouped_subnet() cost a walk of at most one node per address bit
+ * rather than a scan of every subnet.  Each node covers the first 'bit'
+ * bits of 'key'.  Nodes with a subnet correspond to subnet declarations;
+ * nodes without one are glue nodes, which always have two children.
+ * Subnets declared more than once with the same prefix hang off the
+ * node through 'dup', newest first.
+ *
+ * A lookup returns the longest matching prefix, which is the order
+ * subnet_inner_than() asks enter_subnet() to keep the subnet list in.
+ *
+ * The trie can't represent a subnet with a non-contiguous netmask.  If
+ * one is ever declared we stop using the trie and fall back to scanning
+ * the subnet lists.
+ */
+struct subnet_trie_node {
+	struct subnet_trie_node *parent;
+	struct subnet_trie_node *child [2];
+	struct subnet_trie_node *dup;
+	struct subnet *subnet;
+	unsigned bit;
+	unsigned char key [16];
+};
+
+static struct subnet_trie_node *subnet_trie_v4;
+static struct subnet_trie_node *subnet_trie_v6;
+static int subnet_trie_unusable;
+
+#define SUBNET_TRIE_BIT(key, n) (((key) [(n) >> 3] >> (7 - ((n) & 7))) & 1)
+
+static struct subnet_trie_node **
+subnet_trie_root(unsigned len)
+{
+	if (len == 4)
+		return &subnet_trie_v4;
+	if (len == 16)
+		return &subnet_trie_v6;
+	return NULL;
+}
+
+/* Return the length of the prefix described by netmask, or -1 if the
+   netmask isn't contiguous. */
+static int
+subnet_prefix_len(struct iaddr netmask)
+{
+	unsigned i;
+	int len = 0;
+
+	for (i = 0; i < netmask.len * 8; i++) {
+		if (!SUBNET_TRIE_BIT(netmask.iabuf, i))
+			break;
+		len++;
+	}
+	for (; i < netmask.len * 8; i++) {
+		if (SUBNET_TRIE_BIT(netmask.iabuf, i))
+			return -1;
+	}
+	return len;
+}
+
+static struct subnet_trie_node *
+new_subnet_trie_node(const unsigned char *key, unsigned bit,
+		     struct subnet *subnet)
+{
+	struct subnet_trie_node *node;
+
+	node = dmalloc(sizeof(*node), MDL);
+	if (node == NULL)
+		log_fatal("No memory for subnet index.");
+	node->bit = bit;
+	memcpy(node->key, key, sizeof(node->key));
+	if (subnet != NULL)
+		subnet_reference(&node->subnet, subnet, MDL);
+	return node;
+}
+
+/* Point whatever pointed at old (its parent, or the root) at new. */
+static void
+subnet_trie_relink(struct subnet_trie_node **root,
+		   struct subnet_trie_node *old, struct subnet_trie_node *new)
+{
+	if (old->parent == NULL)
+		*root = new;
+	else if (old->parent->child [1] == old)
+		old->parent->child [1] = new;
+	else
+		old->parent->child [0] = new;
+}
+
+static void
+subnet_trie_insert(struct subnet *subnet)
+{
+	struct subnet_trie_node **root, *node, *parent, *new, *glue, *dup;
+	unsigned char key [16];
+	unsigned maxbits, check_bit, differ_bit, i, b;
+	int bitlen;
+
+	if (subnet_trie_unusable)
+		return;
+
+	root = subnet_trie_root(subnet->net.len);
+	bitlen = subnet_prefix_len(subnet->netmask);
+	if (root == NULL || bitlen < 0 ||
+	    subnet->net.len != subnet->netmask.len) {
+		log_debug("Subnet %s has a non-contiguous netmask; "
+			  "subnet lookups will use a linear search.",
+			  piaddr(subnet->net));
+		subnet_trie_unusable = 1;
+		return;
+	}
+
+	/* A subnet number with bits set outside its netmask can never be
+	   matched by find_subnet(), so leave it out. */
+	if (!addr_eq(subnet_number(subnet->net, subnet->netmask),
+		     subnet->net))
+		return;
+
+	maxbits = subnet->net.len * 8;
+	memset(key, 0, sizeof(key));
+	memcpy(key, subnet->net.iabuf, subnet->net.len);
+
+	if (*root == NULL) {
+		*root = new_subnet_trie_node(key, bitlen, subnet);
+		return;
+	}
+
+	/* Go down the trie as far as our key takes us, to find the node
+	   whose key shares the longest prefix with ours. */
+	node = *root;
+	while (node->bit < bitlen || node->subnet == NULL) {
+		b = node->bit < maxbits ? SUBNET_TRIE_BIT(key, node->bit) : 0;
+		if (node->child [b] == NULL)
+			break;
+		node = node->child [b];
+	}
+
+	check_bit = node->bit < bitlen ? node->bit : bitlen;
+	for (differ_bit = 0; differ_bit < check_bit; differ_bit++) {
+		if (SUBNET_TRIE_BIT(key, differ_bit) !=
+		    SUBNET_TRIE_BIT(node->key, differ_bit))
+			break;
+	}
+
+	/* Back up to the highest node that still covers differ_bit. */
+	for (parent = node->parent; parent && parent->bit >= differ_bit;
+	     parent = node->parent)
+		node = parent;
+
+	if (differ_bit == bitlen && node->bit == bitlen) {
+		if (node->subnet != NULL) {
+			/* Same prefix declared again: the newest one is
+			   found first, as with the subnet list. */
+			dup = new_subnet_trie_node(key, bitlen, NULL);
+			subnet_reference(&dup->subnet, node->subnet, MDL);
+			subnet_dereference(&node->subnet, MDL);
+			dup->dup = node->dup;
+			node->dup = dup;
+		}
+		subnet_reference(&node->subnet, subnet, MDL);
+		return;
+	}
+
+	new = new_subnet_trie_node(key, bitlen, subnet);
+
+	if (node->bit == differ_bit) {
+		/* The new node goes below node. */
+		new->parent = node;
+		b = node->bit < maxbits ? SUBNET_TRIE_BIT(key, node->bit) : 0;
+		node->child [b] = new;
+		return;
+	}
+
+	if (bitlen == differ_bit) {
+		/* The new node goes above node. */
+		b = bitlen < maxbits ? SUBNET_TRIE_BIT(node->key, bitlen) : 0;
+		new->child [b] = node;
+		new->parent = node->parent;
+		subnet_trie_relink(root, node, new);
+		node->parent = new;
+		return;
+	}
+
+	/* The new node and node diverge at differ_bit: join them with a
+	   glue node. */
+	for (i = differ_bit; i < maxbits; i++)
+		key [i >> 3] &= ~(1 << (7 - (i & 7)));
+	glue = new_subnet_trie_node(key, differ_bit, NULL);
+	glue->parent = node->parent;
+	b = SUBNET_TRIE_BIT(new->key, differ_bit);
+	glue->child [b] = new;
+	glue->child [!b] = node;
+	new->parent = glue;
+	subnet_trie_relink(root, node, glue);
+	node->parent = glue;
+}
+
+/*
+ * Find the subnets containing addr, longest prefix first.  Up to max
+ * matching nodes are stored in found and their number is returned;
+ * -1 means the trie can't be used and the caller must scan.
+ */
+static int
+subnet_trie_search(struct iaddr addr, struct subnet_trie_node **found,
+		   int max)
+{
+	struct subnet_trie_node **root, *node;
+	struct subnet_trie_node *stack [129];
+	unsigned char key [16];
+	unsigned maxbits, i;
+	int cnt = 0, nfound = 0;
+
+	if (subnet_trie_unusable)
+		return -1;
+
+	root = subnet_trie_root(addr.len);
+	if (root == NULL)
+		return 0;
+
+	maxbits = addr.len * 8;
+	memset(key, 0, sizeof(key));
+	memcpy(key, addr.iabuf, addr.len);
+
+	/* Collect every node with a subnet along addr's path... */
+	for (node = *root; node != NULL && node->bit < maxbits;
+	     node = node->child [SUBNET_TRIE_BIT(key, node->bit)]) {
+		if (node->subnet != NULL)
+			stack [cnt++] = node;
+	}
+	if (node != NULL && node->subnet != NULL)
+		stack [cnt++] = node;
+
+	/* ...and, deepest first, keep those whose prefix matches. */
+	while (cnt-- > 0 && nfound < max) {
+		node = stack [cnt];
+		for (i = 0; i < node->bit; i++) {
+			if (SUBNET_TRIE_BIT(key, i) !=
+			    SUBNET_TRIE_BIT(node->key, i))
+				break;
+		}
+		if (i == node->bit)
+			found [nfound++] = node;
+	}
+	return nfound;
+}
+
+#if defined (DEBUG_MEMORY_LEAKAGE) && \
+		defined (DEBUG_MEMORY_LEAKAGE_ON_EXIT)
+static void
+free_subnet_trie(struct subnet_trie_node **np)
+{
+	struct subnet_trie_node *node = *np, *dup;
+
+	if (node == NULL)
+		return;
+	free_subnet_trie(&node->child [0]);
+	free_subnet_trie(&node->child [1]);
+	while ((dup = node->dup) != NULL) {
+		node->dup = dup->dup;
+		subnet_dereference(&dup->subnet, MDL);
+		dfree(dup, MDL);
+	}
+	if (node->subnet != NULL)
+		subnet_dereference(&node->subnet, MDL);
+	dfree(node, MDL);
+	*np = NULL;
+}
+#endif
+
 int find_subnet (struct subnet **sp,
 		 struct iaddr addr, const char *file, int line)
 {
 	struct subnet *rv;
+	struct subnet_trie_node *node;
+
+	switch (subnet_trie_search(addr, &node, 1)) {
+	      case 0:
+		return 0;
+	      case 1:
+		if (subnet_reference (sp, node -> subnet,
+				      file, line) != ISC_R_SUCCESS)
+			return 0;
+		return 1;
+	}
 
 	for (rv = subnets; rv; rv = rv -> next_subnet) {
 #if defined(DHCP4o6)
@@ -932,6 +1219,24 @@ int find_grouped_subnet (struct subnet **sp,
 			 const char *file, int line)
 {
 	struct subnet *rv;
+	struct subnet_trie_node *found [129], *node;
+	int i, nfound;
+
+	/* Every subnet containing addr is on its path through the trie;
+	   take the most specific one in this shared network. */
+	nfound = subnet_trie_search(addr, found, 129);
+	for (i = 0; i < nfound; i++) {
+		for (node = found [i]; node; node = node -> dup) {
+			if (node -> subnet -> shared_network != share)
+				continue;
+			if (subnet_reference (sp, node -> subnet,
+					      file, line) != ISC_R_SUCCESS)
+				return 0;
+			return 1;
+		}
+	}
+	if (nfound >= 0)
+		return 0;
 
 	for (rv = share -> subnets; rv; rv = rv -> next_sibling) {
 #if defined(DHCP4o6)
@@ -989,6 +1294,8 @@ void enter_subnet (subnet)
 	struct subnet *next = (struct subnet *)0;
 	struct subnet *prev = (struct subnet *)0;
 
+	subnet_trie_insert (subnet);
+
 	/* Check for duplicates... */
 	if (subnets)
 	    subnet_reference (&next, subnets, MDL);
@@ -1019,7 +1326,6 @@ void enter_subnet (subnet)
 	if (prev)
 		subnet_dereference (&prev, MDL);
 
-	/* XXX use the BSD radix tree code instead of a linked list. */
 	if (subnets) {
 		subnet_reference (&subnet -> next_subnet, subnets, MDL);
 		subnet_dereference (&subnets, MDL);
@@ -1091,6 +1397,12 @@ void enter_lease (lease)
 {
 	struct lease *comp = (struct lease *)0;
 
+	/* Leases belonging to other workers aren't our business, unless
+	   this is one that another worker lent us. */
+	if (!worker_owns_address (lease -> ip_addr) &&
+	    !worker_adopt_lease (lease -> ip_addr))
+		return;
+
 	if (find_lease_by_ip_addr (&comp, lease -> ip_addr, MDL)) {
 		if (!comp -> pool) {
 			log_error ("undeclared lease found in database: %s",
@@ -2438,8 +2750,8 @@ int write_leases ()
 	/* Write all the dynamically-created group declarations. */
 	if (group_name_hash) {
 	    num_written = 0;
-	    for (i = 0; i < group_name_hash -> hash_count; i++) {
-		for (hb = group_name_hash -> buckets [i];
+	    for (i = 0; i < hash_chain_count (group_name_hash); i++) {
+		for (hb = hash_chain (group_name_hash, i);
 		     hb; hb = hb -> next) {
 			gp = (struct group_object *)hb -> value;
 			if ((gp -> flags & GROUP_OBJECT_DYNAMIC) ||
@@ -2457,8 +2769,8 @@ int write_leases ()
 	/* Write all the deleted host declarations. */
 	if (host_name_hash) {
 	    num_written = 0;
-	    for (i = 0; i < host_name_hash -> hash_count; i++) {
-		for (hb = host_name_hash -> buckets [i];
+	    for (i = 0; i < hash_chain_count (host_name_hash); i++) {
+		for (hb = hash_chain (host_name_hash, i);
 		     hb; hb = hb -> next) {
 			hp = (struct host_decl *)hb -> value;
 			if (((hp -> flags & HOST_DECL_STATIC) &&
@@ -2476,8 +2788,8 @@ int write_leases ()
 	/* Write all the new, dynamic host declarations. */
 	if (host_name_hash) {
 	    num_written = 0;
-	    for (i = 0; i < host_name_hash -> hash_count; i++) {
-		for (hb = host_name_hash -> buckets [i];
+	    for (i = 0; i < hash_chain_count (host_name_hash); i++) {
+		for (hb = hash_chain (host_name_hash, i);
 		     hb; hb = hb -> next) {
 			hp = (struct host_decl *)hb -> value;
 			if ((hp -> flags & HOST_DECL_DYNAMIC)) {
@@ -2734,6 +3046,59 @@ int lease_enqueue (struct lease *comp)
 	return 1;
 }
 
+/* Take a lease off whichever of its pool's queues lease_enqueue() put
+   it on, keeping the counts of FREE and BACKUP leases straight. */
+int lease_dequeue (struct lease *comp)
+{
+	LEASE_STRUCT_PTR lq;
+
+	if (!comp -> pool)
+		return 0;
+
+	switch (comp -> binding_state) {
+	      case FTS_FREE:
+		if (comp->flags & RESERVED_LEASE) {
+			lq = &comp->pool->reserved;
+		} else {
+			lq = &comp->pool->free;
+			comp->pool->free_leases--;
+		}
+		break;
+
+	      case FTS_ACTIVE:
+		lq = &comp -> pool -> active;
+		break;
+
+	      case FTS_EXPIRED:
+	      case FTS_RELEASED:
+	      case FTS_RESET:
+		lq = &comp -> pool -> expired;
+		break;
+
+	      case FTS_ABANDONED:
+		lq = &comp -> pool -> abandoned;
+		break;
+
+	      case FTS_BACKUP:
+		if (comp->flags & RESERVED_LEASE) {
+			lq = &comp->pool->reserved;
+		} else {
+			lq = &comp->pool->backup;
+			comp->pool->backup_leases--;
+		}
+		break;
+
+	      default:
+		log_error ("Lease with bogus binding state: %d",
+			   comp -> binding_state);
+		return 0;
+	}
+
+	LEASE_REMOVEP(lq, comp);
+
+	return 1;
+}
+
 /* For a given lease, sort it onto the right list in its pool and put it
    in each appropriate hash, understanding that it's already by definition
    in lease_ip_addr_hash. */
@@ -2944,8 +3309,13 @@ void dump_subnets ()
 	}
 }
 
+#if defined (USE_IP4_LEASE_HASH)
+IP4_HASH_FUNCTIONS(lease_ip, const unsigned char *, struct lease,
+		   lease_ip_hash_t, lease_reference, lease_dereference)
+#else
 HASH_FUNCTIONS(lease_ip, const unsigned char *, struct lease, lease_ip_hash_t,
 	       lease_reference, lease_dereference, do_ip4_hash)
+#endif
 HASH_FUNCTIONS(lease_id, const unsigned char *, struct lease, lease_id_hash_t,
 	       lease_reference, lease_dereference, do_id_hash)
 HASH_FUNCTIONS (host, const unsigned char *, struct host_decl, host_hash_t,
@@ -3025,6 +3395,7 @@ void free_everything(void)
 				  MDL);
 
 	for (lp = collections; lp; lp = lp -> next) {
+	    forget_class_index (lp);
 	    if (lp -> classes) {
 		class_reference (&cn, lp -> classes, MDL);
 		do {
@@ -3079,6 +3450,9 @@ void free_everything(void)
 	    interface_dereference (&interfaces, MDL);
 	}
 
+	free_subnet_trie (&subnet_trie_v4);
+	free_subnet_trie (&subnet_trie_v6);
+
 	/* Subnets are complicated because of the extra links. */
 	if (subnets) {
 	    subnet_reference (&sn, subnets, MDL);
@@ -3197,9 +3571,9 @@ void free_everything(void)
 
 	cancel_all_timeouts ();
 	relinquish_timeouts ();
-#if defined(DELAYED_ACK)
-	relinquish_ackqueue();
-#endif
+	relinquish_send_batch ();
+	relinquish_binary_leases ();
+	relinquish_commit_queue();
 	trace_free_all ();
 	group_dereference (&root_group, MDL);
 	executable_statement_dereference (&default_classification_rules, MDL);
@@ -3246,12 +3620,11 @@ void free_everything(void)
 	relinquish_free_pairs ();
 	relinquish_free_expressions ();
 	relinquish_free_binding_values ();
-	relinquish_free_option_caches ();
 	relinquish_free_packets ();
+	relinquish_packet_arenas ();
 #if defined(COMPACT_LEASES)
 	relinquish_lease_hunks ();
 #endif
-	relinquish_hash_bucket_hunks ();
 	omapi_type_relinquish ();
 }
 #endif /* DEBUG_MEMORY_LEAKAGE_ON_EXIT */
@@ -196,6 +196,9 @@ int num_pools;
  * - iasubopt must be a pointer to a (struct iasubopt *) pointer previously
  *   initialized to NULL
  */
+static struct slab_pool iasubopt_pool = SLAB_POOL("iasubopt", struct iasubopt);
+static struct slab_pool ia_pool = SLAB_POOL("ia", struct ia_xx);
+
 isc_result_t
 iasubopt_allocate(struct iasubopt **iasubopt, const char *file, int line) {
 	struct iasubopt *tmp;
@@ -209,7 +212,7 @@ iasubopt_allocate(struct iasubopt **iasubopt, const char *file, int line) {
 		return DHCP_R_INVALIDARG;
 	}
 
-	tmp = dmalloc(sizeof(*tmp), file, line);
+	tmp = slab_alloc(&iasubopt_pool, file, line);
 	if (tmp == NULL) {
 		return ISC_R_NOMEMORY;
 	}
@@ -297,7 +300,7 @@ iasubopt_dereference(struct iasubopt **iasubopt, const char *file, int line) {
 				(&tmp->on_star.on_release, MDL);
 		}
 
-		dfree(tmp, file, line);
+		slab_free(&iasubopt_pool, tmp, file, line);
 	}
 
 	return ISC_R_SUCCESS;
@@ -349,16 +352,18 @@ ia_allocate(struct ia_xx **ia, u_int32_t iaid,
 		return DHCP_R_INVALIDARG;
 	}
 
-	tmp = dmalloc(sizeof(*tmp), file, line);
+	tmp = slab_alloc(&ia_pool, file, line);
 	if (tmp == NULL) {
 		return ISC_R_NOMEMORY;
 	}
 
 	if (ia_make_key(&tmp->iaid_duid, iaid, 
 			duid, duid_len, file, line) != ISC_R_SUCCESS) {
-		dfree(tmp, file, line);
+		slab_free(&ia_pool, tmp, file, line);
 		return ISC_R_NOMEMORY;
 	}
+	/* The key lives as long as the IA does, not the packet. */
+	data_string_promote(&tmp->iaid_duid, file, line);
 
 	tmp->refcnt = 1;
 
@@ -425,7 +430,7 @@ ia_dereference(struct ia_xx **ia, const char *file, int line) {
 			dfree(tmp->iasubopt, file, line);
 		}
 		data_string_forget(&(tmp->iaid_duid), file, line);
-		dfree(tmp, file, line);
+		slab_free(&ia_pool, tmp, file, line);
 	}
 	return ISC_R_SUCCESS;
 }
@@ -609,6 +614,371 @@ lease_index_changed(void *iasubopt, unsigned int new_heap_index) {
 }
 
 
+/*
+ * Pools small enough to enumerate keep a bitmap of which of their
+ * addresses are in pool->leases, so that create_lease6() can go from
+ * a hashed address that is taken straight to the next one that isn't
+ * instead of rehashing until it gives up.
+ *
+ * Level 0 has one bit per address, set when the address is in use.
+ * Each higher level has one bit per word of the level below, set when
+ * that word is full, and the top level is a single word.  Finding the
+ * next free address climbs until a word with a clear bit turns up and
+ * then follows the first clear bit of each word back down, so it looks
+ * at no more than two words per level.
+ */
+#if !defined (POOL6_INDEX_BITS)
+# define POOL6_INDEX_BITS	20
+#endif
+
+#define POOL6_INDEX_LEVELS	((POOL6_INDEX_BITS + 4) / 5 + 1)
+
+struct ipv6_pool_index {
+	u_int32_t size;				/* addresses in the pool */
+	int levels;
+	u_int32_t bits[POOL6_INDEX_LEVELS];	/* bits in each level */
+	u_int32_t *map[POOL6_INDEX_LEVELS];
+};
+
+static void
+pool_index_create(struct ipv6_pool *pool) {
+	struct ipv6_pool_index *ix;
+	u_int32_t words[POOL6_INDEX_LEVELS];
+	u_int32_t nbits, total, *p;
+	int host_bits, levels, i;
+
+	host_bits = 128 - pool->bits;
+	if ((pool->pool_type == D6O_IA_PD) || (host_bits < 0) ||
+	    (host_bits > POOL6_INDEX_BITS))
+		return;
+
+	nbits = (u_int32_t)1 << host_bits;
+	total = 0;
+	levels = 0;
+	do {
+		words[levels] = (nbits + 31) / 32;
+		total += words[levels];
+		nbits = words[levels];
+	} while (words[levels++] > 1);
+
+	/* Without an index the pool is searched by hashing alone. */
+	ix = dmalloc(sizeof(*ix) + total * sizeof(u_int32_t), MDL);
+	if (ix == NULL)
+		return;
+
+	ix->size = (u_int32_t)1 << host_bits;
+	ix->levels = levels;
+	p = (u_int32_t *)(ix + 1);
+	nbits = ix->size;
+	for (i = 0; i < levels; i++) {
+		ix->bits[i] = nbits;
+		ix->map[i] = p;
+		/* Bits past the end are never free. */
+		if (nbits % 32)
+			p[words[i] - 1] = ~(u_int32_t)0 << (nbits % 32);
+		p += words[i];
+		nbits = words[i];
+	}
+	pool->free_index = ix;
+}
+
+/* Where addr is in the pool, which it must be in. */
+static u_int32_t
+pool_index_offset(const struct ipv6_pool *pool, const struct in6_addr *addr) {
+	const unsigned char *p = &addr->s6_addr[12];
+
+	return ((((u_int32_t)p[0] << 24) | ((u_int32_t)p[1] << 16) |
+		 ((u_int32_t)p[2] << 8) | (u_int32_t)p[3]) &
+		(pool->free_index->size - 1));
+}
+
+static void
+pool_index_address(const struct ipv6_pool *pool, u_int32_t offset,
+		   struct in6_addr *addr) {
+	int i;
+
+	*addr = pool->start_addr;
+	for (i = 15; offset != 0; i--, offset >>= 8)
+		addr->s6_addr[i] |= offset & 0xff;
+}
+
+static void
+pool_index_set(struct ipv6_pool_index *ix, u_int32_t n) {
+	u_int32_t *word;
+	int i;
+
+	for (i = 0; i < ix->levels; i++, n /= 32) {
+		word = &ix->map[i][n / 32];
+		*word |= (u_int32_t)1 << (n % 32);
+		if (*word != ~(u_int32_t)0)
+			break;
+	}
+}
+
+static void
+pool_index_clear(struct ipv6_pool_index *ix, u_int32_t n) {
+	u_int32_t *word;
+	int i, full;
+
+	for (i = 0; i < ix->levels; i++, n /= 32) {
+		word = &ix->map[i][n / 32];
+		full = (*word == ~(u_int32_t)0);
+		*word &= ~((u_int32_t)1 << (n % 32));
+		if (!full)
+			break;
+	}
+}
+
+static int
+lowest_bit(u_int32_t x) {
+	int n = 0;
+
+	if ((x & 0xffff) == 0) { n += 16; x >>= 16; }
+	if ((x & 0xff) == 0) { n += 8; x >>= 8; }
+	if ((x & 0xf) == 0) { n += 4; x >>= 4; }
+	if ((x & 0x3) == 0) { n += 2; x >>= 2; }
+	if ((x & 0x1) == 0) { n += 1; }
+	return n;
+}
+
+/* Find the first free address at or after *n. */
+static isc_boolean_t
+pool_index_next(const struct ipv6_pool_index *ix, u_int32_t *n) {
+	u_int32_t pos, free;
+	int i;
+
+	pos = *n;
+	for (i = 0; i < ix->levels; i++, pos = pos / 32 + 1) {
+		if (pos >= ix->bits[i])
+			continue;
+		free = ~ix->map[i][pos / 32] & (~(u_int32_t)0 << (pos % 32));
+		if (free != 0) {
+			pos = (pos & ~(u_int32_t)31) + lowest_bit(free);
+			break;
+		}
+	}
+	if (i == ix->levels)
+		return ISC_FALSE;
+
+	while (i-- > 0)
+		pos = pos * 32 + lowest_bit(~ix->map[i][pos]);
+	*n = pos;
+	return ISC_TRUE;
+}
+
+/*
+ * Prefix pools keep a binary tree of the prefixes in use, so that
+ * create_prefix6() can go from a hashed prefix that is taken straight
+ * to the next free one however large the pool is.
+ *
+ * A node stands for the prefixes under one bit string between the pool's
+ * length and the delegated length.  A NULL child has all of its prefixes
+ * free and a child pointing at prefix_full has none free, so the tree
+ * only has nodes where used and free prefixes meet.  Nodes whose children
+ * are both full or both free are merged back into their parent, as in a
+ * buddy allocator.
+ */
+struct prefix_node {
+	struct prefix_node *child[2];
+};
+
+struct prefix_tree {
+	struct prefix_node *root;
+};
+
+static struct prefix_node prefix_full;
+
+static struct slab_pool prefix_node_pool =
+	SLAB_POOL("prefix node", struct prefix_node);
+
+#define prefix_bit(pref, bit) \
+	(((pref)->s6_addr[(bit) / 8] >> (7 - (bit) % 8)) & 1)
+
+static void
+prefix_bit_set(struct in6_addr *pref, int bit, int value) {
+	if (value)
+		pref->s6_addr[bit / 8] |= 0x80 >> (bit % 8);
+	else
+		pref->s6_addr[bit / 8] &= ~(0x80 >> (bit % 8));
+}
+
+static void
+prefix_tree_create(struct ipv6_pool *pool) {
+	if ((pool->pool_type != D6O_IA_PD) || (pool->units < pool->bits) ||
+	    (pool->units > 128))
+		return;
+
+	/* Without a tree the pool is searched by hashing alone. */
+	pool->prefix_tree = dmalloc(sizeof(*pool->prefix_tree), MDL);
+}
+
+static void
+prefix_node_free(struct prefix_node *node) {
+	if ((node == NULL) || (node == &prefix_full))
+		return;
+	prefix_node_free(node->child[0]);
+	prefix_node_free(node->child[1]);
+	slab_free(&prefix_node_pool, node, MDL);
+}
+
+static void
+prefix_tree_free(struct prefix_tree **tree) {
+	prefix_node_free((*tree)->root);
+	dfree(*tree, MDL);
+	*tree = NULL;
+}
+
+/*
+ * Mark the prefix at pref as used (or free) in the subtree at node,
+ * which covers bits [bit, end) of it.  Returns the new subtree, or
+ * NULL in *nomem if a node couldn't be allocated.
+ */
+static struct prefix_node *
+prefix_node_mark(struct prefix_node *node, const struct in6_addr *pref,
+		 int bit, int end, int used, int *nomem) {
+	struct prefix_node *full = used ? &prefix_full : NULL;
+	struct prefix_node *split;
+	int b;
+
+	if ((bit == end) || (node == full))
+		return full;
+
+	if ((node == NULL) || (node == &prefix_full)) {
+		split = slab_alloc(&prefix_node_pool, MDL);
+		if (split == NULL) {
+			*nomem = 1;
+			return node;
+		}
+		split->child[0] = split->child[1] = node;
+		node = split;
+	}
+
+	b = prefix_bit(pref, bit);
+	node->child[b] = prefix_node_mark(node->child[b], pref,
+					  bit + 1, end, used, nomem);
+	if ((node->child[0] == full) && (node->child[1] == full)) {
+		slab_free(&prefix_node_pool, node, MDL);
+		return full;
+	}
+	return node;
+}
+
+static void
+prefix_tree_mark(struct ipv6_pool *pool, const struct in6_addr *pref,
+		 int used) {
+	int nomem = 0;
+
+	pool->prefix_tree->root =
+		prefix_node_mark(pool->prefix_tree->root, pref,
+				 pool->bits, pool->units, used, &nomem);
+
+	/* A tree that's missing a prefix is worse than none at all. */
+	if (nomem) {
+		log_error("Out of memory for the prefix tree, searching "
+			  "for free prefixes by hashing.");
+		prefix_tree_free(&pool->prefix_tree);
+	}
+}
+
+/*
+ * Set bits [bit, end) of pref to the first free prefix in the subtree at
+ * node, which must have one.
+ */
+static void
+prefix_node_first(const struct prefix_node *node, struct in6_addr *pref,
+		  int bit, int end) {
+	for (; bit < end; bit++) {
+		if (node == NULL) {
+			prefix_bit_set(pref, bit, 0);
+			continue;
+		}
+		if (node->child[0] != &prefix_full) {
+			prefix_bit_set(pref, bit, 0);
+			node = node->child[0];
+		} else {
+			prefix_bit_set(pref, bit, 1);
+			node = node->child[1];
+		}
+	}
+}
+
+/*
+ * Set bits [bit, end) of pref to the first free prefix at or after them
+ * in the subtree at node.  Looks at one path down the tree, plus one more
+ * from the point where it had to move right.
+ */
+static isc_boolean_t
+prefix_node_next(const struct prefix_node *node, struct in6_addr *pref,
+		 int bit, int end) {
+	int b;
+
+	if (node == &prefix_full)
+		return ISC_FALSE;
+	if (node == NULL)
+		return ISC_TRUE;
+
+	b = prefix_bit(pref, bit);
+	if (prefix_node_next(node->child[b], pref, bit + 1, end))
+		return ISC_TRUE;
+	if ((b == 1) || (node->child[1] == &prefix_full))
+		return ISC_FALSE;
+
+	prefix_bit_set(pref, bit, 1);
+	prefix_node_first(node->child[1], pref, bit + 1, end);
+	return ISC_TRUE;
+}
+
+/*
+ * Take the first free prefix in the pool at or after pref, wrapping
+ * around at the end.
+ */
+static isc_boolean_t
+prefix_tree_find(struct ipv6_pool *pool, struct in6_addr *pref) {
+	struct prefix_node *root;
+	struct iasubopt *test_iapref;
+
+	while (pool->prefix_tree != NULL) {
+		root = pool->prefix_tree->root;
+		if (root == &prefix_full)
+			return ISC_FALSE;
+		if (!prefix_node_next(root, pref, pool->bits, pool->units))
+			prefix_node_first(root, pref, pool->bits, pool->units);
+
+		test_iapref = NULL;
+		if (iasubopt_hash_lookup(&test_iapref, pool->leases,
+					 pref, sizeof(*pref), MDL) == 0)
+			return ISC_TRUE;
+		iasubopt_dereference(&test_iapref, MDL);
+		prefix_tree_mark(pool, pref, 1);
+	}
+	return ISC_FALSE;
+}
+
+/*
+ * Add a lease to or remove it from pool->leases, keeping the index
+ * or prefix tree in step.
+ */
+static void
+pool_leases_add(struct ipv6_pool *pool, struct iasubopt *lease) {
+	iasubopt_hash_add(pool->leases, &lease->addr,
+			  sizeof(lease->addr), lease, MDL);
+	if ((pool->free_index != NULL) && ipv6_in_pool(&lease->addr, pool))
+		pool_index_set(pool->free_index,
+			       pool_index_offset(pool, &lease->addr));
+	if ((pool->prefix_tree != NULL) && ipv6_in_pool(&lease->addr, pool))
+		prefix_tree_mark(pool, &lease->addr, 1);
+}
+
+static void
+pool_leases_delete(struct ipv6_pool *pool, struct in6_addr *addr) {
+	iasubopt_hash_delete(pool->leases, addr, sizeof(*addr), MDL);
+	if ((pool->free_index != NULL) && ipv6_in_pool(addr, pool))
+		pool_index_clear(pool->free_index,
+				 pool_index_offset(pool, addr));
+	if ((pool->prefix_tree != NULL) && ipv6_in_pool(addr, pool))
+		prefix_tree_mark(pool, addr, 0);
+}
+
 /*!
  *
  * \brief Create a new IPv6 lease pool structure
@@ -660,19 +1030,21 @@ ipv6_pool_allocate(struct ipv6_pool **pool, u_int16_t type,
 		dfree(tmp, file, line);
 		return ISC_R_NOMEMORY;
 	}
-	if (isc_heap_create(dhcp_gbl_ctx.mctx, lease_older, lease_index_changed,
-			    0, &(tmp->active_timeouts)) != ISC_R_SUCCESS) {
+	if (dhcp_heap_create(lease_older, lease_index_changed, 0,
+			     &(tmp->active_timeouts)) != ISC_R_SUCCESS) {
 		iasubopt_free_hash_table(&(tmp->leases), file, line);
 		dfree(tmp, file, line);
 		return ISC_R_NOMEMORY;
 	}
-	if (isc_heap_create(dhcp_gbl_ctx.mctx, lease_older, lease_index_changed,
-			    0, &(tmp->inactive_timeouts)) != ISC_R_SUCCESS) {
-		isc_heap_destroy(&(tmp->active_timeouts));
+	if (dhcp_heap_create(lease_older, lease_index_changed, 0,
+			     &(tmp->inactive_timeouts)) != ISC_R_SUCCESS) {
+		dhcp_heap_destroy(&(tmp->active_timeouts));
 		iasubopt_free_hash_table(&(tmp->leases), file, line);
 		dfree(tmp, file, line);
 		return ISC_R_NOMEMORY;
 	}
+	pool_index_create(tmp);
+	prefix_tree_create(tmp);
 
 	*pool = tmp;
 	return ISC_R_SUCCESS;
@@ -788,12 +1160,16 @@ ipv6_pool_dereference(struct ipv6_pool **pool, const char *file, int line) {
 	if (tmp->refcnt == 0) {
 		iasubopt_hash_foreach(tmp->leases, dereference_hash_entry);
 		iasubopt_free_hash_table(&(tmp->leases), file, line);
-		isc_heap_foreach(tmp->active_timeouts, 
-				 dereference_heap_entry, NULL);
-		isc_heap_destroy(&(tmp->active_timeouts));
-		isc_heap_foreach(tmp->inactive_timeouts, 
-				 dereference_heap_entry, NULL);
-		isc_heap_destroy(&(tmp->inactive_timeouts));
+		dhcp_heap_foreach(tmp->active_timeouts, 
+				  dereference_heap_entry, NULL);
+		dhcp_heap_destroy(&(tmp->active_timeouts));
+		dhcp_heap_foreach(tmp->inactive_timeouts, 
+				  dereference_heap_entry, NULL);
+		dhcp_heap_destroy(&(tmp->inactive_timeouts));
+		if (tmp->free_index != NULL)
+			dfree(tmp->free_index, MDL);
+		if (tmp->prefix_tree != NULL)
+			prefix_tree_free(&tmp->prefix_tree);
 		dfree(tmp, file, line);
 	}
 
@@ -1002,6 +1378,53 @@ static struct in6_addr rtany;
 /* Reserved Subnet Anycasts ::fdff:ffff:ffff:ff80-::fdff:ffff:ffff:ffff. */
 static struct in6_addr resany;
 
+/*
+ * Avoid reserved interface IDs. (cf. RFC 5453)
+ */
+static isc_boolean_t
+reserved_iid(const struct in6_addr *addr) {
+	if (memcmp(&addr->s6_addr[8], &rtany.s6_addr[8], 8) == 0) {
+		return ISC_TRUE;
+	}
+	if ((memcmp(&addr->s6_addr[8], &resany.s6_addr[8], 7) == 0) &&
+	    ((addr->s6_addr[15] & 0x80) == 0x80)) {
+		return ISC_TRUE;
+	}
+	return ISC_FALSE;
+}
+
+/*
+ * Take the first address in the pool at or after addr, wrapping around
+ * at the end, that isn't in use and doesn't have a reserved interface
+ * ID.  Addresses with reserved IDs are marked as used in the index so
+ * that they're passed over quickly the next time.
+ */
+static isc_boolean_t
+pool_index_find(struct ipv6_pool *pool, struct in6_addr *addr) {
+	struct ipv6_pool_index *ix = pool->free_index;
+	struct iasubopt *test_iaaddr;
+	u_int32_t n;
+
+	n = pool_index_offset(pool, addr);
+	for (;;) {
+		if (!pool_index_next(ix, &n)) {
+			n = 0;
+			if (!pool_index_next(ix, &n))
+				return ISC_FALSE;
+		}
+		pool_index_address(pool, n, addr);
+
+		test_iaaddr = NULL;
+		if (!reserved_iid(addr) &&
+		    (iasubopt_hash_lookup(&test_iaaddr, pool->leases,
+					  addr, sizeof(*addr), MDL) == 0))
+			return ISC_TRUE;
+		if (test_iaaddr != NULL)
+			iasubopt_dereference(&test_iaaddr, MDL);
+		pool_index_set(ix, n);
+	}
+}
+
 /*
  * Create a lease for the given address and client duid.
  *
@@ -1013,15 +1436,16 @@ static struct in6_addr resany;
  * to avoid getting stuck in a loop (this is important on small pools
  * where we can run out of space).
  *
+ * Pools of up to 2^POOL6_INDEX_BITS addresses keep an index of the
+ * addresses in use, so on a collision we take the next free address
+ * after the hashed one instead, and only fail if the pool is full.
+ *
  * We return the number of attempts that it took to find an available
  * lease. This tells callers when a pool is are filling up, as
  * well as an indication of how full the pool is; statistically the 
  * more full a pool is the more attempts must be made before finding
  * a free lease. Realistically this will only happen in very full
- * pools.
- *
- * We probably want different algorithms depending on the network size, in
- * the long term.
+ * pools.  An indexed pool counts the search as a single extra attempt.
  */
 isc_result_t
 create_lease6(struct ipv6_pool *pool, struct iasubopt **addr, 
@@ -1033,7 +1457,6 @@ create_lease6(struct ipv6_pool *pool, struct iasubopt **addr,
 	struct data_string new_ds;
 	struct iasubopt *iaaddr;
 	isc_result_t result;
-	isc_boolean_t reserved_iid;
 	static isc_boolean_t init_resiid = ISC_FALSE;
 
 	/*
@@ -1086,24 +1509,11 @@ create_lease6(struct ipv6_pool *pool, struct iasubopt **addr,
 			return DHCP_R_INVALIDARG;
 		}
 
-		/*
-		 * Avoid reserved interface IDs. (cf. RFC 5453)
-		 */
-		reserved_iid = ISC_FALSE;
-		if (memcmp(&tmp.s6_addr[8], &rtany.s6_addr[8], 8) == 0) {
-			reserved_iid = ISC_TRUE;
-		}
-		if (!reserved_iid &&
-		    (memcmp(&tmp.s6_addr[8], &resany.s6_addr[8], 7) == 0) &&
-		    ((tmp.s6_addr[15] & 0x80) == 0x80)) {
-			reserved_iid = ISC_TRUE;
-		}
-
 		/*
 		 * If this address is not in use, we're happy with it
 		 */
 		test_iaaddr = NULL;
-		if (!reserved_iid &&
+		if (!reserved_iid(&tmp) &&
 		    (iasubopt_hash_lookup(&test_iaaddr, pool->leases,
 					  &tmp, sizeof(tmp), MDL) == 0)) {
 			break;
@@ -1111,6 +1521,19 @@ create_lease6(struct ipv6_pool *pool, struct iasubopt **addr,
 		if (test_iaaddr != NULL)
 			iasubopt_dereference(&test_iaaddr, MDL);
 
+		/*
+		 * In a pool small enough to be indexed, take the next
+		 * free address after the one we hashed to.
+		 */
+		if (pool->free_index != NULL) {
+			if (!pool_index_find(pool, &tmp)) {
+				data_string_forget(&ds, MDL);
+				return ISC_R_NORESOURCES;
+			}
+			(*attempts)++;
+			break;
+		}
+
 		/* 
 		 * Otherwise, we create a new input, adding the address
 		 */
@@ -1361,7 +1784,7 @@ cleanup_lease6(ia_hash_t *ia_table,
 	 * Remove the old lease from the active heap and from the hash table
 	 * then remove the lease from the IA and clean up the IA if necessary.
 	 */
-	isc_heap_delete(pool->active_timeouts, test_iasubopt->heap_index);
+	dhcp_heap_delete(pool->active_timeouts, test_iasubopt->heap_index);
 	pool->num_active--;
 	if (pool->ipv6_pond)
 		pool->ipv6_pond->num_active--;
@@ -1372,8 +1795,7 @@ cleanup_lease6(ia_hash_t *ia_table,
 			pool->ipv6_pond->num_abandoned--;
 	}
 
-	iasubopt_hash_delete(pool->leases, &test_iasubopt->addr,
-			     sizeof(test_iasubopt->addr), MDL);
+	pool_leases_delete(pool, &test_iasubopt->addr);
 	ia_remove_iasubopt(old_ia, test_iasubopt, MDL);
 	if (old_ia->num_iasubopt <= 0) {
 		ia_hash_delete(ia_table,
@@ -1433,8 +1855,8 @@ add_lease6(struct ipv6_pool *pool, struct iasubopt *lease,
 		 */
 		if ((test_iasubopt->state == FTS_ACTIVE) ||
 		    (test_iasubopt->state == FTS_ABANDONED)) {
-			isc_heap_delete(pool->active_timeouts,
-					test_iasubopt->heap_index);
+			dhcp_heap_delete(pool->active_timeouts,
+					 test_iasubopt->heap_index);
 			pool->num_active--;
 			if (pool->ipv6_pond)
 				pool->ipv6_pond->num_active--;
@@ -1445,13 +1867,12 @@ add_lease6(struct ipv6_pool *pool, struct iasubopt *lease,
 					pool->ipv6_pond->num_abandoned--;
 			}
 		} else {
-			isc_heap_delete(pool->inactive_timeouts,
-					test_iasubopt->heap_index);
+			dhcp_heap_delete(pool->inactive_timeouts,
+					 test_iasubopt->heap_index);
 			pool->num_inactive--;
 		}
 
-		iasubopt_hash_delete(pool->leases, &test_iasubopt->addr, 
-				     sizeof(test_iasubopt->addr), MDL);
+		pool_leases_delete(pool, &test_iasubopt->addr);
 
 		/*
 		 * We're going to do a bit of evil trickery here.
@@ -1474,10 +1895,9 @@ add_lease6(struct ipv6_pool *pool, struct iasubopt *lease,
 	if ((tmp_iasubopt->state == FTS_ACTIVE) ||
 	    (tmp_iasubopt->state == FTS_ABANDONED)) {
 		tmp_iasubopt->hard_lifetime_end_time = valid_lifetime_end_time;
-		iasubopt_hash_add(pool->leases, &tmp_iasubopt->addr, 
-				  sizeof(tmp_iasubopt->addr), lease, MDL);
-		insert_result = isc_heap_insert(pool->active_timeouts,
-						tmp_iasubopt);
+		pool_leases_add(pool, lease);
+		insert_result = dhcp_heap_insert(pool->active_timeouts,
+						 tmp_iasubopt);
 		if (insert_result == ISC_R_SUCCESS) {
 			pool->num_active++;
 			if (pool->ipv6_pond)
@@ -1492,14 +1912,13 @@ add_lease6(struct ipv6_pool *pool, struct iasubopt *lease,
 
 	} else {
 		tmp_iasubopt->soft_lifetime_end_time = valid_lifetime_end_time;
-		insert_result = isc_heap_insert(pool->inactive_timeouts,
-						tmp_iasubopt);
+		insert_result = dhcp_heap_insert(pool->inactive_timeouts,
+						 tmp_iasubopt);
 		if (insert_result == ISC_R_SUCCESS)
 			pool->num_inactive++;
 	}
 	if (insert_result != ISC_R_SUCCESS) {
-		iasubopt_hash_delete(pool->leases, &lease->addr, 
-				     sizeof(lease->addr), MDL);
+		pool_leases_delete(pool, &lease->addr);
 		iasubopt_dereference(&tmp_iasubopt, MDL);
 		return insert_result;
 	}
@@ -1570,11 +1989,10 @@ move_lease_to_active(struct ipv6_pool *pool, struct iasubopt *lease) {
 	int old_heap_index;
 
 	old_heap_index = lease->heap_index;
-	insert_result = isc_heap_insert(pool->active_timeouts, lease);
+	insert_result = dhcp_heap_insert(pool->active_timeouts, lease);
 	if (insert_result == ISC_R_SUCCESS) {
-       		iasubopt_hash_add(pool->leases, &lease->addr, 
-				  sizeof(lease->addr), lease, MDL);
-		isc_heap_delete(pool->inactive_timeouts, old_heap_index);
+		pool_leases_add(pool, lease);
+		dhcp_heap_delete(pool->inactive_timeouts, old_heap_index);
 		pool->num_active++;
 		pool->num_inactive--;
 		lease->state = FTS_ACTIVE;
@@ -1597,12 +2015,12 @@ move_lease_to_active(struct ipv6_pool *pool, struct iasubopt *lease) {
  * This routine will compare the two and call the correct
  * heap routine to move the lease.  If the lease is active
  * and the new expiration time is greater (the normal case)
- * then we call isc_heap_decreased() as a larger time is a
+ * then we call dhcp_heap_decreased() as a larger time is a
  * lower priority.  If the new expiration time is less then
- * we call isc_heap_increased().
+ * we call dhcp_heap_increased().
  *
  * If the lease is abandoned then it will be on the active list
- * and we will always call isc_heap_increased() as the previous
+ * and we will always call dhcp_heap_increased() as the previous
  * expiration would have been all 1s (as close as we can get
  * to infinite).
  *
@@ -1623,17 +2041,17 @@ renew_lease6(struct ipv6_pool *pool, struct iasubopt *lease) {
 
 	if (lease->state == FTS_ACTIVE) {
 		if (old_end_time <= lease->hard_lifetime_end_time) {
-			isc_heap_decreased(pool->active_timeouts,
-					   lease->heap_index);
+			dhcp_heap_decreased(pool->active_timeouts,
+					    lease->heap_index);
 		} else {
-			isc_heap_increased(pool->active_timeouts,
-					   lease->heap_index);
+			dhcp_heap_increased(pool->active_timeouts,
+					    lease->heap_index);
 		}
 		return ISC_R_SUCCESS;
 	} else if (lease->state == FTS_ABANDONED) {
 		char tmp_addr[INET6_ADDRSTRLEN];
                 lease->state = FTS_ACTIVE;
-                isc_heap_increased(pool->active_timeouts, lease->heap_index);
+                dhcp_heap_increased(pool->active_timeouts, lease->heap_index);
 		log_info("Reclaiming previously abandoned address %s",
 			 inet_ntop(AF_INET6, &(lease->addr), tmp_addr,
 				   sizeof(tmp_addr)));
@@ -1658,7 +2076,7 @@ move_lease_to_inactive(struct ipv6_pool *pool, struct iasubopt *lease,
 	int old_heap_index;
 
 	old_heap_index = lease->heap_index;
-	insert_result = isc_heap_insert(pool->inactive_timeouts, lease);
+	insert_result = dhcp_heap_insert(pool->inactive_timeouts, lease);
 	if (insert_result == ISC_R_SUCCESS) {
 		/*
 		 * Handle expire and release statements
@@ -1706,9 +2124,8 @@ move_lease_to_inactive(struct ipv6_pool *pool, struct iasubopt *lease,
 			binding_scope_dereference(&lease->scope, MDL);
 		}
 
-		iasubopt_hash_delete(pool->leases, 
-				     &lease->addr, sizeof(lease->addr), MDL);
-		isc_heap_delete(pool->active_timeouts, old_heap_index);
+		pool_leases_delete(pool, &lease->addr);
+		dhcp_heap_delete(pool->active_timeouts, old_heap_index);
 		lease->state = state;
 		pool->num_active--;
 		pool->num_inactive++;
@@ -1750,7 +2167,7 @@ expire_lease6(struct iasubopt **leasep, struct ipv6_pool *pool, time_t now) {
 
 	if (pool->num_active > 0) {
 		tmp = (struct iasubopt *)
-				isc_heap_element(pool->active_timeouts, 1);
+				dhcp_heap_element(pool->active_timeouts, 1);
 		if (now > tmp->hard_lifetime_end_time) {
 			result = move_lease_to_inactive(pool, tmp,
 							FTS_EXPIRED);
@@ -1786,7 +2203,7 @@ decline_lease6(struct ipv6_pool *pool, struct iasubopt *lease) {
 		pool->ipv6_pond->num_abandoned++;
 
 	lease->hard_lifetime_end_time = MAX_TIME;
-	isc_heap_decreased(pool->active_timeouts, lease->heap_index);
+	dhcp_heap_decreased(pool->active_timeouts, lease->heap_index);
 	return ISC_R_SUCCESS;
 }
 
@@ -1876,6 +2293,11 @@ build_prefix6(struct in6_addr *pref,
  * to avoid getting stuck in a loop (this is important on small pools
  * where we can run out of space).
  *
+ * Prefix pools keep a tree of the prefixes in use, so on a collision we
+ * take the next free prefix after the hashed one from that instead, and
+ * only fail if the pool is full.  Hashing again is only needed if the
+ * tree couldn't be kept for want of memory.
+ *
  * We return the number of attempts that it took to find an available
  * prefix. This tells callers when a pool is are filling up, as
  * well as an indication of how full the pool is; statistically the 
@@ -1930,6 +2352,19 @@ create_prefix6(struct ipv6_pool *pool, struct iasubopt **pref,
 		}
 		iasubopt_dereference(&test_iapref, MDL);
 
+		/*
+		 * With a prefix tree, take the next free prefix after
+		 * the one we hashed to.
+		 */
+		if (pool->prefix_tree != NULL) {
+			if (!prefix_tree_find(pool, &tmp)) {
+				data_string_forget(&ds, MDL);
+				return ISC_R_NORESOURCES;
+			}
+			(*attempts)++;
+			break;
+		}
+
 		/* 
 		 * Otherwise, we create a new input, adding the prefix
 		 */
@@ -2007,8 +2442,7 @@ mark_lease_unavailable(struct ipv6_pool *pool, const struct in6_addr *addr) {
 	result = iasubopt_allocate(&dummy_iasubopt, MDL);
 	if (result == ISC_R_SUCCESS) {
 		dummy_iasubopt->addr = *addr;
-		iasubopt_hash_add(pool->leases, &dummy_iasubopt->addr,
-				  sizeof(*addr), dummy_iasubopt, MDL);
+		pool_leases_add(pool, dummy_iasubopt);
 	}
 	return result;
 }
@@ -2048,7 +2482,7 @@ cleanup_old_expired(struct ipv6_pool *pool) {
 	
 	while (pool->num_inactive > 0) {
 		tmp = (struct iasubopt *)
-				isc_heap_element(pool->inactive_timeouts, 1);
+				dhcp_heap_element(pool->inactive_timeouts, 1);
 		if (tmp->hard_lifetime_end_time != 0) {
 			timeout = tmp->hard_lifetime_end_time;
 			timeout += EXPIRED_IPV6_CLEANUP_TIME;
@@ -2059,7 +2493,7 @@ cleanup_old_expired(struct ipv6_pool *pool) {
 			break;
 		}
 
-		isc_heap_delete(pool->inactive_timeouts, tmp->heap_index);
+		dhcp_heap_delete(pool->inactive_timeouts, tmp->heap_index);
 		pool->num_inactive--;
 
 		if (tmp->ia != NULL) {
@@ -2103,12 +2537,141 @@ cleanup_old_expired(struct ipv6_pool *pool) {
 	}
 }
 
+/*
+ * All pools share one timer for expiring leases.  The pools with leases
+ * to expire or clean up are kept in a heap ordered by when the next one
+ * is due, and the timer is set for the pool at the top.  However many
+ * pools there are, the dispatcher has a single timeout to look after and
+ * one wakeup deals with everything that's due in all of them.
+ */
+static dhcp_heap_t *expiry_heap;
+static int num_expiry_pools;
+
+/* When the timer is set for, or MAX_TIME if it isn't. */
+static time_t expiry_armed = MAX_TIME;
+
+static isc_boolean_t
+pool_expires_sooner(void *a, void *b) {
+	return (((struct ipv6_pool *)a)->next_expiry <
+		((struct ipv6_pool *)b)->next_expiry);
+}
+
+static void
+pool_expiry_index_changed(void *pool, unsigned int new_heap_index) {
+	((struct ipv6_pool *)pool)->expiry_index = new_heap_index;
+}
+
+static void lease_timeout_support(void *unused);
+
+/*
+ * Set the timer for the first pool with something to do, if it isn't
+ * already set for then.
+ */
 static void
-lease_timeout_support(void *vpool) {
+set_expiry_timer(void) {
 	struct ipv6_pool *pool;
+	struct timeval tv;
+
+	if (num_expiry_pools == 0) {
+		if (expiry_armed != MAX_TIME) {
+			cancel_timeout(lease_timeout_support, NULL);
+			expiry_armed = MAX_TIME;
+		}
+		return;
+	}
+
+	pool = (struct ipv6_pool *)dhcp_heap_element(expiry_heap, 1);
+	if (pool->next_expiry != expiry_armed) {
+		tv.tv_sec = pool->next_expiry;
+		tv.tv_usec = 0;
+		add_timeout(&tv, lease_timeout_support, NULL, NULL, NULL);
+		expiry_armed = pool->next_expiry;
+	}
+}
+
+/*
+ * Work out when the pool next has a lease to expire or clean up, and
+ * move it to the right place in the expiry heap.
+ */
+static void
+schedule_pool_expiry(struct ipv6_pool *pool) {
+	struct iasubopt *tmp;
+	struct ipv6_pool *ref;
+	time_t timeout;
+	time_t next_timeout;
+
+	next_timeout = MAX_TIME;
+
+	if (pool->num_active > 0) {
+		tmp = (struct iasubopt *)
+				dhcp_heap_element(pool->active_timeouts, 1);
+		if (tmp->hard_lifetime_end_time < next_timeout) {
+			next_timeout = tmp->hard_lifetime_end_time + 1;
+		}
+	}
+
+	if (pool->num_inactive > 0) {
+		tmp = (struct iasubopt *)
+				dhcp_heap_element(pool->inactive_timeouts, 1);
+		if (tmp->hard_lifetime_end_time != 0) {
+			timeout = tmp->hard_lifetime_end_time;
+			timeout += EXPIRED_IPV6_CLEANUP_TIME;
+		} else {
+			timeout = tmp->soft_lifetime_end_time + 1;
+		}
+		if (timeout < next_timeout) {
+			next_timeout = timeout;
+		}
+	}
+
+	if (next_timeout >= MAX_TIME) {
+		/* Nothing to do, so the pool leaves the heap. */
+		if (pool->expiry_index != 0) {
+			dhcp_heap_delete(expiry_heap, pool->expiry_index);
+			pool->expiry_index = 0;
+			num_expiry_pools--;
+			ref = pool;
+			ipv6_pool_dereference(&ref, MDL);
+		}
+		return;
+	}
+
+	if (pool->expiry_index != 0) {
+		/* An earlier time is a higher priority. */
+		if (next_timeout < pool->next_expiry) {
+			pool->next_expiry = next_timeout;
+			dhcp_heap_increased(expiry_heap, pool->expiry_index);
+		} else if (next_timeout > pool->next_expiry) {
+			pool->next_expiry = next_timeout;
+			dhcp_heap_decreased(expiry_heap, pool->expiry_index);
+		}
+		return;
+	}
+
+	if ((expiry_heap == NULL) &&
+	    (dhcp_heap_create(pool_expires_sooner, pool_expiry_index_changed,
+			      0, &expiry_heap) != ISC_R_SUCCESS)) {
+		log_fatal("Out of memory for the IPv6 lease expiry heap.");
+	}
+
+	/* The heap holds a reference to each pool in it. */
+	pool->next_expiry = next_timeout;
+	ref = NULL;
+	ipv6_pool_reference(&ref, pool, MDL);
+	if (dhcp_heap_insert(expiry_heap, ref) != ISC_R_SUCCESS) {
+		log_fatal("Out of memory for the IPv6 lease expiry heap.");
+	}
+	num_expiry_pools++;
+}
+
+/*
+ * Expire the leases that are due in a pool and clean up the ones
+ * that have been expired for long enough.
+ */
+static void
+pool_expire_leases(struct ipv6_pool *pool) {
 	struct iasubopt *lease;
 	
-	pool = (struct ipv6_pool *)vpool;
 	for (;;) {
 		/*
 		 * Get the next lease scheduled to expire.
@@ -2135,6 +2698,47 @@ lease_timeout_support(void *vpool) {
 		iasubopt_dereference(&lease, MDL);
 	}
 
+	/*
+	 * Do some cleanup of our expired leases.
+	 */
+	cleanup_old_expired(pool);
+}
+
+static void
+lease_timeout_support(void *unused) {
+	struct ipv6_pool *top, *pool;
+
+	/* The timer has gone off, so it isn't set any more. */
+	expiry_armed = MAX_TIME;
+
+	/*
+	 * Deal with every pool that has something due.  Afterwards each
+	 * one's next time is in the future, so it sinks down the heap.
+	 */
+	while (num_expiry_pools > 0) {
+		top = (struct ipv6_pool *)dhcp_heap_element(expiry_heap, 1);
+		if (top->next_expiry > cur_time) {
+			break;
+		}
+
+		/* The heap may let go of the pool when it's done. */
+		pool = NULL;
+		ipv6_pool_reference(&pool, top, MDL);
+		pool_expire_leases(pool);
+		schedule_pool_expiry(pool);
+
+		/*
+		 * If a lease couldn't be expired the pool is still due.
+		 * Rather than go round again now, try it in a second.
+		 */
+		if ((pool->expiry_index != 0) &&
+		    (pool->next_expiry <= cur_time)) {
+			pool->next_expiry = cur_time + 1;
+			dhcp_heap_decreased(expiry_heap, pool->expiry_index);
+		}
+		ipv6_pool_dereference(&pool, MDL);
+	}
+
 	/*
 	 * If appropriate commit and rotate the lease file
 	 * As commit_leases_timed() checks to see if we've done any writes
@@ -2142,59 +2746,20 @@ lease_timeout_support(void *vpool) {
 	 */
 	(void) commit_leases_timed();
 
-	/*
-	 * Do some cleanup of our expired leases.
-	 */
-	cleanup_old_expired(pool);
-
 	/*
 	 * Schedule next round of expirations.
 	 */
-	schedule_lease_timeout(pool);
+	set_expiry_timer();
 }
 
 /*
- * For a given pool, add a timer that will remove the next
- * lease to expire.
+ * For a given pool, make sure the timer will go off when its next
+ * lease is due to be removed.
  */
 void 
 schedule_lease_timeout(struct ipv6_pool *pool) {
-	struct iasubopt *tmp;
-	time_t timeout;
-	time_t next_timeout;
-	struct timeval tv;
-
-	next_timeout = MAX_TIME;
-
-	if (pool->num_active > 0) {
-		tmp = (struct iasubopt *)
-				isc_heap_element(pool->active_timeouts, 1);
-		if (tmp->hard_lifetime_end_time < next_timeout) {
-			next_timeout = tmp->hard_lifetime_end_time + 1;
-		}
-	}
-
-	if (pool->num_inactive > 0) {
-		tmp = (struct iasubopt *)
-				isc_heap_element(pool->inactive_timeouts, 1);
-		if (tmp->hard_lifetime_end_time != 0) {
-			timeout = tmp->hard_lifetime_end_time;
-			timeout += EXPIRED_IPV6_CLEANUP_TIME;
-		} else {
-			timeout = tmp->soft_lifetime_end_time + 1;
-		}
-		if (timeout < next_timeout) {
-			next_timeout = timeout;
-		}
-	}
-
-	if (next_timeout < MAX_TIME) {
-		tv.tv_sec = next_timeout;
-		tv.tv_usec = 0;
-		add_timeout(&tv, lease_timeout_support, pool,
-			    (tvref_t)ipv6_pool_reference, 
-			    (tvunref_t)ipv6_pool_dereference);
-	}
+	schedule_pool_expiry(pool);
+	set_expiry_timer();
 }
 
 /*
@@ -2205,8 +2770,9 @@ schedule_all_ipv6_lease_timeouts(void) {
 	int i;
 
 	for (i=0; i<num_pools; i++) {
-		schedule_lease_timeout(pools[i]);
+		schedule_pool_expiry(pools[i]);
 	}
+	set_expiry_timer();
 }
 
 /* 
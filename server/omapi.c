@@ -1248,6 +1248,7 @@ isc_result_t dhcp_host_signal_handler (omapi_object_t *h,
 		status = enter_host (host, 1, 1);
 		if (status != ISC_R_SUCCESS)
 			return status;
+		worker_host_changed (host);
 		updatep = 1;
 	}
 
@@ -1601,6 +1602,7 @@ isc_result_t dhcp_host_remove (omapi_object_t *lp,
 	log_debug ("OMAPI delete host %s", hp -> name);
 #endif
 	delete_host (hp, 1);
+	worker_host_changed (hp);
 	return ISC_R_SUCCESS;
 }
 
@@ -2465,6 +2467,7 @@ isc_result_t binding_scope_set_value (struct binding_scope *scope, int createp,
 	}
 	binding_value_reference (&bp -> value, nv, MDL);
 	binding_value_dereference (&nv, MDL);
+	binding_generation++;
 	return ISC_R_SUCCESS;
 }
 
@@ -233,8 +233,9 @@ static struct option server_options[] = {
 	{ "dhcpv6-pid-file-name", "t",		&server_universe,  55, 1 },
 	{ "limit-addrs-per-ia", "L",		&server_universe,  56, 1 },
 	{ "limit-prefs-per-ia", "L",		&server_universe,  57, 1 },
-/* Assert a configuration parsing error if delayed-ack isn't compiled in. */
-#if defined(DELAYED_ACK) && !defined(DHCP4o6)
+/* Assert a configuration parsing error if DHCPv4-over-DHCPv6 is compiled in,
+   since its replies aren't queued for a group commit. */
+#if !defined(DHCP4o6)
 	{ "delayed-ack", "S",			&server_universe,  58, 1 },
 	{ "max-ack-delay", "L",			&server_universe,  59, 1 },
 #endif
@@ -280,6 +281,7 @@ static struct option server_options[] = {
 #ifdef EUI_64
 	{ "use-eui-64", "f",		&server_universe,  SV_USE_EUI_64, 1 },
 #endif
+	{ "background-lease-rewrite", "f",	&server_universe,  SV_BACKGROUND_LEASE_REWRITE, 1 },
 	{ NULL, NULL, NULL, 0, 0 }
 };
 
@@ -0,0 +1,416 @@
+/*
+ * Copyright (C) 2017 by Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include "dhcpd.h"
+
+#include <atf-c.h>
+
+/*
+ * Test the binary lease files in binleases.c.  The leases come from a
+ * lease file, are written out to a binary lease file and read back in,
+ * and each lease read has to be a new lease that matches the one it
+ * replaced.  A binary lease file that is truncated, damaged or doesn't
+ * go with the lease file has to be refused, or its damaged records
+ * skipped, without touching the leases already loaded.
+ */
+
+#define NLEASES		32
+
+/* The layout of a binary lease file; see binleases.c. */
+#define HEADER_SIZE	128
+#define RECORD_SIZE	96
+#define RECORD_UID	60
+
+#define BINFILE		"leases.bin"
+#define DBFILE		"leases.db"
+
+static const char *config =
+	"subnet 10.0.0.0 netmask 255.255.255.0 {\n"
+	"    range 10.0.0.10 10.0.0.41;\n"
+	"}\n";
+
+static struct iaddr
+lease_addr(int i)
+{
+	struct iaddr addr;
+
+	addr.len = 4;
+	addr.iabuf[0] = 10;
+	addr.iabuf[1] = 0;
+	addr.iabuf[2] = 0;
+	addr.iabuf[3] = 10 + i;
+	return addr;
+}
+
+/* Write a lease file entry for the i'th lease, varying with i. */
+static int
+lease_text(char *buf, size_t size, int i)
+{
+	static const char *states[] = {
+		"active", "free", "expired", "abandoned", "released"
+	};
+	char uid[80], host[40], *p;
+	int len, j, n;
+
+	/* Some uids fit in the lease, some don't. */
+	n = (i % 3 == 0) ? 20 : 7;
+	p = uid;
+	for (j = 0; j < n; j++)
+		p += sprintf(p, "%s%02x", j ? ":" : "", (i * 7 + j) & 0xff);
+	host[0] = 0;
+	if (i & 1)
+		sprintf(host, "  client-hostname \"client-%d\";\n", i);
+
+	len = snprintf(buf, size,
+		       "lease 10.0.0.%d {\n"
+		       "  starts epoch %d;\n"
+		       "  ends epoch %d;\n"
+		       "  cltt epoch %d;\n"
+		       "  tsfp epoch %d;\n"
+		       "  binding state %s;\n"
+		       "  next binding state free;\n"
+		       "  rewind binding state free;\n"
+		       "  hardware ethernet 00:1b:21:af:00:%02x;\n"
+		       "  uid %s;\n"
+		       "%s%s%s"
+		       "}\n",
+		       10 + i, 1500000000 + i * 37, 2000000000 + i,
+		       1500000000 + i * 37, (i & 4) ? 1500000100 + i : 0,
+		       states[i % 5], i, uid, host,
+		       (i % 8 == 2) ? "  dynamic-bootp;\n" : "",
+		       /* Only the text part of the file can hold this. */
+		       (i == NLEASES - 1) ? "  set foo = \"bar\";\n" : "");
+	ATF_REQUIRE(len > 0 && len < size);
+	return len;
+}
+
+static void
+setup(void)
+{
+	static int done;
+	struct parse *cfile = NULL;
+	char text[NLEASES * 512];
+	size_t len = 0;
+	int i;
+
+	if (done)
+		return;
+	done = 1;
+
+	ATF_REQUIRE(dhcp_context_create(DHCP_CONTEXT_PRE_DB, NULL, NULL) ==
+		    ISC_R_SUCCESS);
+	dhcp_db_objects_setup();
+	dhcp_common_objects_setup();
+	initialize_common_option_spaces();
+	initialize_server_option_spaces();
+	ATF_REQUIRE(group_allocate(&root_group, MDL));
+
+	ATF_REQUIRE(new_parse(&cfile, -1, (char *)config, strlen(config),
+			      "test", 0) == ISC_R_SUCCESS);
+	if (conf_file_subparse(cfile, root_group, ROOT_GROUP) !=
+	    ISC_R_SUCCESS)
+		atf_tc_fail("can't parse test configuration");
+	end_parse(&cfile);
+
+	for (i = 0; i < NLEASES; i++)
+		len += lease_text(text + len, sizeof(text) - len, i);
+	ATF_REQUIRE(new_parse(&cfile, -1, text, len, "test leases", 0) ==
+		    ISC_R_SUCCESS);
+	if (lease_file_subparse(cfile) != ISC_R_SUCCESS)
+		atf_tc_fail("can't parse test leases");
+	end_parse(&cfile);
+	expire_all_pools();
+}
+
+/* Take a reference to each of the test leases as they are now. */
+static void
+get_leases(struct lease **leases)
+{
+	int i;
+
+	for (i = 0; i < NLEASES; i++) {
+		leases[i] = NULL;
+		if (!find_lease_by_ip_addr(&leases[i], lease_addr(i), MDL))
+			atf_tc_fail("no lease for %s",
+				    piaddr(lease_addr(i)));
+	}
+}
+
+static void
+put_leases(struct lease **leases)
+{
+	int i;
+
+	for (i = 0; i < NLEASES; i++)
+		lease_dereference(&leases[i], MDL);
+}
+
+static int
+has_binding(struct lease *lease, const char *name)
+{
+	struct binding *b;
+
+	if (lease->scope == NULL)
+		return 0;
+	for (b = lease->scope->bindings; b != NULL; b = b->next)
+		if (strcmp(b->name, name) == 0)
+			return 1;
+	return 0;
+}
+
+/* Check that what was read back matches what was written. */
+static void
+check_lease(struct lease *old, struct lease *new)
+{
+	const char *addr = piaddr(old->ip_addr);
+
+	if (old == new)
+		atf_tc_fail("lease %s wasn't read", addr);
+	ATF_CHECK(memcmp(&new->ip_addr, &old->ip_addr,
+			 sizeof(old->ip_addr)) == 0);
+	ATF_CHECK_EQ(new->binding_state, old->binding_state);
+	ATF_CHECK_EQ(new->next_binding_state, old->next_binding_state);
+	ATF_CHECK_EQ(new->rewind_binding_state, old->rewind_binding_state);
+	ATF_CHECK_EQ(new->flags & (RESERVED_LEASE | BOOTP_LEASE),
+		     old->flags & (RESERVED_LEASE | BOOTP_LEASE));
+	ATF_CHECK_EQ(new->starts, old->starts);
+	ATF_CHECK_EQ(new->ends, old->ends);
+	ATF_CHECK_EQ(new->tstp, old->tstp);
+	ATF_CHECK_EQ(new->tsfp, old->tsfp);
+	ATF_CHECK_EQ(new->atsfp, old->atsfp);
+	ATF_CHECK_EQ(new->cltt, old->cltt);
+	ATF_CHECK_EQ(new->hardware_addr.hlen, old->hardware_addr.hlen);
+	ATF_CHECK(memcmp(new->hardware_addr.hbuf, old->hardware_addr.hbuf,
+			 old->hardware_addr.hlen) == 0);
+	ATF_CHECK_EQ(new->uid_len, old->uid_len);
+	ATF_CHECK(new->uid_len == old->uid_len &&
+		  memcmp(new->uid, old->uid, old->uid_len) == 0);
+	if (old->client_hostname == NULL)
+		ATF_CHECK(new->client_hostname == NULL);
+	else
+		ATF_CHECK(new->client_hostname != NULL &&
+			  strcmp(new->client_hostname,
+				 old->client_hostname) == 0);
+	ATF_CHECK_EQ(has_binding(new, "foo"), has_binding(old, "foo"));
+}
+
+/* Write the leases we have out to a binary lease file. */
+static void
+write_leases_file(off_t journal_len)
+{
+	FILE *saved = db_file;
+	int ok;
+
+	ok = write_binary_leases(BINFILE, journal_len);
+	db_file = saved;
+	if (!ok)
+		atf_tc_fail("can't write %s", BINFILE);
+}
+
+static void
+patch_file(const char *path, off_t offset, const void *data, size_t len)
+{
+	int fd;
+
+	fd = open(path, O_WRONLY);
+	ATF_REQUIRE(fd >= 0);
+	ATF_REQUIRE(pwrite(fd, data, len, offset) == len);
+	close(fd);
+}
+
+ATF_TC(binary_round_trip);
+ATF_TC_HEAD(binary_round_trip, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify that leases written to a "
+			  "binary lease file read back as they were");
+}
+
+ATF_TC_BODY(binary_round_trip, tc)
+{
+	struct lease *before[NLEASES], *after[NLEASES];
+	off_t journal_len = 1;
+	int i;
+
+	setup();
+	get_leases(before);
+	ATF_CHECK(has_binding(before[NLEASES - 1], "foo"));
+
+	write_leases_file(0);
+	ATF_REQUIRE(read_binary_leases(BINFILE, &journal_len) ==
+		    ISC_R_SUCCESS);
+	ATF_CHECK_EQ(journal_len, 0);
+
+	get_leases(after);
+	for (i = 0; i < NLEASES; i++)
+		check_lease(before[i], after[i]);
+	put_leases(before);
+	put_leases(after);
+
+	/* A file that isn't there is just not found. */
+	ATF_CHECK(read_binary_leases("no-such-file", &journal_len) ==
+		  ISC_R_NOTFOUND);
+}
+
+ATF_TC(binary_truncated);
+ATF_TC_HEAD(binary_truncated, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify that truncated and corrupt "
+			  "binary lease files are refused");
+}
+
+ATF_TC_BODY(binary_truncated, tc)
+{
+	struct lease *before[NLEASES], *after[NLEASES];
+	off_t journal_len;
+	int i;
+
+	setup();
+	get_leases(before);
+
+	/* Shorter than the header. */
+	write_leases_file(0);
+	ATF_REQUIRE(truncate(BINFILE, HEADER_SIZE / 2) == 0);
+	ATF_CHECK(read_binary_leases(BINFILE, &journal_len) ==
+		  DHCP_R_FORMERR);
+
+	/* Cut off in the middle of the records. */
+	write_leases_file(0);
+	ATF_REQUIRE(truncate(BINFILE, HEADER_SIZE + RECORD_SIZE * 2 + 5) ==
+		    0);
+	ATF_CHECK(read_binary_leases(BINFILE, &journal_len) ==
+		  DHCP_R_FORMERR);
+
+	/* Not a binary lease file at all. */
+	write_leases_file(0);
+	patch_file(BINFILE, 0, "X", 1);
+	ATF_CHECK(read_binary_leases(BINFILE, &journal_len) ==
+		  DHCP_R_FORMERR);
+
+	/* None of that should have changed the leases. */
+	get_leases(after);
+	for (i = 0; i < NLEASES; i++)
+		ATF_CHECK(after[i] == before[i]);
+	put_leases(before);
+	put_leases(after);
+}
+
+ATF_TC(binary_bad_offsets);
+ATF_TC_HEAD(binary_bad_offsets, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify that records pointing outside "
+			  "the heap are skipped and the rest read");
+}
+
+ATF_TC_BODY(binary_bad_offsets, tc)
+{
+	static const unsigned char bad[4] = { 0xff, 0xff, 0xff, 0xf0 };
+	struct lease *before[NLEASES], *after[NLEASES];
+	unsigned char rec[RECORD_SIZE];
+	off_t journal_len;
+	FILE *f;
+	int i, first;
+
+	setup();
+	get_leases(before);
+
+	/* Point the uid in the first record (every test lease has one)
+	   past the end of the heap. */
+	write_leases_file(0);
+	f = fopen(BINFILE, "r");
+	ATF_REQUIRE(f != NULL);
+	ATF_REQUIRE(fseek(f, HEADER_SIZE, SEEK_SET) == 0);
+	ATF_REQUIRE(fread(rec, sizeof(rec), 1, f) == 1);
+	fclose(f);
+	first = rec[3] - 10;
+	ATF_REQUIRE(first >= 0 && first < NLEASES);
+	patch_file(BINFILE, HEADER_SIZE + RECORD_UID, bad, sizeof(bad));
+
+	ATF_REQUIRE(read_binary_leases(BINFILE, &journal_len) ==
+		    ISC_R_SUCCESS);
+	get_leases(after);
+	for (i = 0; i < NLEASES; i++) {
+		if (i == first)
+			ATF_CHECK(after[i] == before[i]);
+		else
+			check_lease(before[i], after[i]);
+	}
+	put_leases(before);
+	put_leases(after);
+}
+
+ATF_TC(binary_journal);
+ATF_TC_HEAD(binary_journal, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify that a binary lease file is "
+			  "only used with the lease file it was written for");
+}
+
+ATF_TC_BODY(binary_journal, tc)
+{
+	static const char db[] =
+		"# The format of this file is documented in the "
+		"dhcpd.leases(5) manual page.\n"
+		"authoring-byte-order little-endian;\n";
+	struct lease *before[NLEASES], *after[NLEASES];
+	off_t journal_len = 0;
+	FILE *f;
+	int i;
+
+	setup();
+	path_dhcpd_db = DBFILE;
+	f = fopen(DBFILE, "w");
+	ATF_REQUIRE(f != NULL);
+	ATF_REQUIRE(fwrite(db, sizeof(db) - 1, 1, f) == 1);
+	ATF_REQUIRE(fclose(f) == 0);
+
+	/* It goes with the lease file as it is. */
+	write_leases_file(sizeof(db) - 1);
+	ATF_REQUIRE(read_binary_leases(BINFILE, &journal_len) ==
+		    ISC_R_SUCCESS);
+	ATF_CHECK_EQ(journal_len, sizeof(db) - 1);
+
+	get_leases(before);
+
+	/* But not once the part it stands for has changed... */
+	patch_file(DBFILE, 5, "#", 1);
+	journal_len = 0;
+	ATF_CHECK(read_binary_leases(BINFILE, &journal_len) ==
+		  ISC_R_NOTFOUND);
+	ATF_CHECK_EQ(journal_len, 0);
+
+	/* ...or the lease file has been cut short. */
+	ATF_REQUIRE(truncate(DBFILE, 10) == 0);
+	ATF_CHECK(read_binary_leases(BINFILE, &journal_len) ==
+		  ISC_R_NOTFOUND);
+
+	get_leases(after);
+	for (i = 0; i < NLEASES; i++)
+		ATF_CHECK(after[i] == before[i]);
+	put_leases(before);
+	put_leases(after);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, binary_round_trip);
+	ATF_TP_ADD_TC(tp, binary_truncated);
+	ATF_TP_ADD_TC(tp, binary_bad_offsets);
+	ATF_TP_ADD_TC(tp, binary_journal);
+
+	return (atf_no_error());
+}
@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2017 by Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include "dhcpd.h"
+
+#include <atf-c.h>
+
+/*
+ * Test the class match index in class.c.  check_collection() has to
+ * put a packet in the same classes, in the same order, as evaluating
+ * every class's match expression in turn would, so these tests work
+ * out the expected classes the slow way and compare.
+ */
+
+static const char *config =
+	"class \"pxe\" { match if substring (option vendor-class-identifier,"
+	"    0, 9) = \"PXEClient\"; }\n"
+	"class \"msft\" { match if substring (option vendor-class-identifier,"
+	"    0, 4) = \"MSFT\"; }\n"
+	"class \"plain\" { match if not exists user-class and"
+	"    substring (option vendor-class-identifier, 0, 3) = \"PXE\"; }\n"
+	"class \"exact\" { match if"
+	"    option vendor-class-identifier = \"MSFT 5.0\"; }\n"
+	"class \"either\" { match if option vendor-class-identifier = \"foo\""
+	"    or option vendor-class-identifier = \"MSFT 5.0\"; }\n"
+	"class \"mixed\" { match if"
+	"    substring (option vendor-class-identifier, 0, 4) = \"MSFT\""
+	"    or substring (option vendor-class-identifier, 0, 3) = \"PXE\""
+	"    or option vendor-class-identifier = \"foo\"; }\n"
+	"class \"long\" { match if"
+	"    substring (option vendor-class-identifier, 0, 12) = \"MSFT\"; }\n"
+	"class \"host\" { match if lcase (option host-name) = \"client-two\"; }\n"
+	"class \"empty\" { match if option vendor-class-identifier = \"\"; }\n"
+	"class \"user\" { match if option user-class = \"x\"; }\n"
+	"class \"vendor\" { match option vendor-class-identifier; }\n"
+	"subclass \"vendor\" \"MSFT 5.0\";\n"
+	"class \"and\" { match if known and"
+	"    option vendor-class-identifier = \"foo\"; }\n";
+
+static const char *vendors[] = {
+	"MSFT 5.0", "MSFT", "MSFT 98", "PXEClient:Arch:00000", "PXE", "PX",
+	"foo", "", NULL
+};
+
+static struct dhcp_packet raw;
+
+static void
+parse_config(const char *text)
+{
+	struct parse *cfile = NULL;
+
+	ATF_REQUIRE(new_parse(&cfile, -1, (char *)text, strlen(text),
+			      "test", 0) == ISC_R_SUCCESS);
+	if (conf_file_subparse(cfile, root_group, ROOT_GROUP) !=
+	    ISC_R_SUCCESS)
+		atf_tc_fail("can't parse test configuration");
+	end_parse(&cfile);
+}
+
+static void
+setup(void)
+{
+	static int done;
+
+	if (done)
+		return;
+	done = 1;
+
+	ATF_REQUIRE(dhcp_context_create(DHCP_CONTEXT_PRE_DB, NULL, NULL) ==
+		    ISC_R_SUCCESS);
+	dhcp_db_objects_setup();
+	dhcp_common_objects_setup();
+	initialize_common_option_spaces();
+	initialize_server_option_spaces();
+	ATF_REQUIRE(group_allocate(&root_group, MDL));
+	parse_config(config);
+}
+
+/* Build a packet whose vendor-class-identifier is vendor. */
+static void
+init_packet(struct packet *packet, const char *vendor)
+{
+	memset(packet, 0, sizeof(*packet));
+	memset(&raw, 0, sizeof(raw));
+	packet->raw = &raw;
+	packet->packet_length = sizeof(raw);
+	packet->known = 1;
+	ATF_REQUIRE(option_state_allocate(&packet->options, MDL));
+	ATF_REQUIRE(add_option(packet->options, DHO_HOST_NAME,
+			       "Client-One", 10));
+	if (vendor != NULL)
+		ATF_REQUIRE(add_option(packet->options,
+				       DHO_VENDOR_CLASS_IDENTIFIER,
+				       (void *)vendor, strlen(vendor)));
+}
+
+static void
+clear_packet(struct packet *packet)
+{
+	int i;
+
+	for (i = 0; i < packet->class_count; i++)
+		class_dereference(&packet->classes[i], MDL);
+	option_state_dereference(&packet->options, MDL);
+}
+
+/* Work out the classes the packet belongs in without the index. */
+static int
+expected_classes(struct packet *packet, struct class **classes)
+{
+	struct class *class, *nc;
+	struct data_string data;
+	int ignorep, n = 0;
+
+	for (class = default_collection.classes; class; class = class->nic) {
+		if (class->expr &&
+		    !evaluate_boolean_expression_result(&ignorep, packet,
+							NULL, NULL,
+							packet->options,
+							NULL, &global_scope,
+							class->expr))
+			continue;
+		if (n == PACKET_MAX_CLASSES)
+			break;
+		if (!class->submatch) {
+			classes[n++] = class;
+			continue;
+		}
+		memset(&data, 0, sizeof(data));
+		if (!evaluate_data_expression(&data, packet, NULL, NULL,
+					      packet->options, NULL,
+					      &global_scope, class->submatch,
+					      MDL))
+			continue;
+		nc = NULL;
+		if (data.len && class_hash_lookup(&nc, class->hash,
+						  (const char *)data.data,
+						  data.len, MDL)) {
+			classes[n++] = nc;
+			class_dereference(&nc, MDL);
+		}
+		data_string_forget(&data, MDL);
+	}
+	return n;
+}
+
+static void
+check_packets(void)
+{
+	struct packet packet;
+	struct class *expect[PACKET_MAX_CLASSES];
+	int i, j, n;
+
+	for (i = 0; i < sizeof(vendors) / sizeof(vendors[0]); i++) {
+		init_packet(&packet, vendors[i]);
+		n = expected_classes(&packet, expect);
+		check_collection(&packet, NULL, &default_collection);
+		if (packet.class_count != n)
+			atf_tc_fail("vendor \"%s\": %d classes, expected %d",
+				    vendors[i] ? vendors[i] : "(none)",
+				    packet.class_count, n);
+		for (j = 0; j < n; j++)
+			if (packet.classes[j] != expect[j])
+				atf_tc_fail("vendor \"%s\": class %d is %s",
+					    vendors[i] ? vendors[i] : "(none)",
+					    j, packet.classes[j]->name
+						? packet.classes[j]->name
+						: "a subclass");
+		clear_packet(&packet);
+	}
+}
+
+ATF_TC(class_index_matches);
+ATF_TC_HEAD(class_index_matches, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify that indexed classes match "
+			  "as evaluating each class would");
+}
+
+ATF_TC_BODY(class_index_matches, tc)
+{
+	static const char *expect[] = { "pxe", "plain", "mixed" };
+	struct packet packet;
+	int i;
+
+	setup();
+	check_packets();
+
+	/* This hits two prefix matches of different lengths on one key. */
+	init_packet(&packet, "PXEClient:Arch:00000");
+	check_collection(&packet, NULL, &default_collection);
+	if (packet.class_count != 3)
+		atf_tc_fail("PXE client is in %d classes", packet.class_count);
+	for (i = 0; i < 3; i++)
+		if (strcmp(packet.classes[i]->name, expect[i]) != 0)
+			atf_tc_fail("class %d is %s", i,
+				    packet.classes[i]->name);
+	clear_packet(&packet);
+}
+
+ATF_TC(class_index_changes);
+ATF_TC_HEAD(class_index_changes, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify that the class index follows "
+			  "classes being added and removed");
+}
+
+ATF_TC_BODY(class_index_changes, tc)
+{
+	struct class *class = NULL;
+
+	setup();
+	check_packets();
+
+	parse_config("class \"added\" { match if"
+		     "    option vendor-class-identifier = \"PXE\"; }\n");
+	check_packets();
+
+	ATF_REQUIRE(find_class(&class, "msft", MDL) == ISC_R_SUCCESS);
+	ATF_REQUIRE(unlink_class(&class) == ISC_R_SUCCESS);
+	check_packets();
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, class_index_matches);
+	ATF_TP_ADD_TC(tp, class_index_changes);
+
+	return (atf_no_error());
+}
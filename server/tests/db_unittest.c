@@ -0,0 +1,342 @@
+/*
+ * Copyright (C) 2017 by Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include "dhcpd.h"
+
+#include <sys/time.h>
+#include <atf-c.h>
+
+/*
+ * Test the lease formatting code in db.c.  format_lease() and
+ * format_ia() have to produce exactly what the stdio paths
+ * (write_lease_stdio() and write_ia_stdio()) write, so most of these
+ * tests write the same lease or IA both ways and compare.
+ */
+
+static void
+init_lease(struct lease *lease, int i)
+{
+	static char hostname[] = "client.example.org";
+	static char badname[] = "host \"with\" odd\\chars";
+
+	memset(lease, 0, sizeof(*lease));
+	lease->ip_addr.len = 4;
+	lease->ip_addr.iabuf[0] = 10;
+	lease->ip_addr.iabuf[1] = 0;
+	lease->ip_addr.iabuf[2] = i >> 8;
+	lease->ip_addr.iabuf[3] = i;
+	lease->starts = 1500000000 + i * 37;
+	lease->ends = lease->starts + 3600;
+	lease->tstp = lease->ends;
+	lease->cltt = lease->starts;
+	lease->binding_state = FTS_ACTIVE;
+	lease->next_binding_state = FTS_FREE;
+	lease->rewind_binding_state = FTS_FREE;
+	lease->hardware_addr.hlen = 7;
+	lease->hardware_addr.hbuf[0] = HTYPE_ETHER;
+	lease->hardware_addr.hbuf[1] = 0x00;
+	lease->hardware_addr.hbuf[2] = 0x1b;
+	lease->hardware_addr.hbuf[3] = 0x21;
+	lease->hardware_addr.hbuf[4] = 0xaf;
+	lease->hardware_addr.hbuf[5] = i >> 8;
+	lease->hardware_addr.hbuf[6] = i;
+	lease->uid = lease->uid_buf;
+	lease->uid_max = sizeof(lease->uid_buf);
+	memcpy(lease->uid, &lease->hardware_addr.hbuf[0], 7);
+	lease->uid[1] = ' ';
+	lease->uid[2] = '"';
+	lease->uid_len = 7;
+	if (i & 1) {
+		/* The lease file leaves out names it can't quote. */
+		lease->client_hostname = (i & 4) ? badname : hostname;
+	}
+	if (i & 2) {
+		lease->flags |= BOOTP_LEASE;
+		lease->ends = MAX_TIME;
+	}
+}
+
+/* Write the lease with stdio and return what was written. */
+static size_t
+stdio_lease(struct lease *lease, char *buf, size_t size)
+{
+	size_t len;
+
+	db_file = tmpfile();
+	ATF_REQUIRE(db_file != NULL);
+	if (!write_lease_stdio(lease))
+		atf_tc_fail("write_lease_stdio failed");
+	rewind(db_file);
+	len = fread(buf, 1, size, db_file);
+	fclose(db_file);
+	db_file = NULL;
+	return len;
+}
+
+/* Make an IA with some addresses or prefixes, varying with i. */
+static void
+init_ia(struct ia_xx *ia, struct iasubopt *subopts, struct iasubopt **ptrs,
+	int i)
+{
+	static const u_int16_t types[] = { D6O_IA_NA, D6O_IA_TA, D6O_IA_PD };
+	static unsigned char duid[] = "\1\0\0\0\0\1 \"id\\";
+	int j;
+
+	memset(ia, 0, sizeof(*ia));
+	ia->ia_type = types[i % 3];
+	duid[5] = i;
+	ia->iaid_duid.data = duid;
+	ia->iaid_duid.len = sizeof(duid) - 1;
+	ia->cltt = (i & 4) ? MIN_TIME : 1500000000 + i * 37;
+	ia->num_iasubopt = i % 4;
+	ia->iasubopt = ptrs;
+	for (j = 0; j < ia->num_iasubopt; j++) {
+		ptrs[j] = &subopts[j];
+		memset(&subopts[j], 0, sizeof(subopts[j]));
+		inet_pton(AF_INET6, "2001:db8::", &subopts[j].addr);
+		subopts[j].addr.s6_addr[14] = i;
+		subopts[j].addr.s6_addr[15] = j;
+		subopts[j].plen = 64 + j * 8;
+		subopts[j].state = 1 + (i + j) % FTS_LAST;
+		subopts[j].prefer = 300 * (j + 1);
+		subopts[j].valid = 600 * (j + 1);
+		subopts[j].soft_lifetime_end_time = ia->cltt + 300;
+		if ((i + j) & 8)
+			subopts[j].hard_lifetime_end_time = ia->cltt + 600;
+	}
+}
+
+/* Write the IA with stdio and return what was written. */
+static size_t
+stdio_ia(struct ia_xx *ia, char *buf, size_t size)
+{
+	size_t len;
+
+	db_file = tmpfile();
+	ATF_REQUIRE(db_file != NULL);
+	if (!write_ia_stdio(ia))
+		atf_tc_fail("write_ia_stdio failed");
+	rewind(db_file);
+	len = fread(buf, 1, size, db_file);
+	fclose(db_file);
+	db_file = NULL;
+	return len;
+}
+
+ATF_TC(format_lease_matches_stdio);
+ATF_TC_HEAD(format_lease_matches_stdio, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify that format_lease() writes "
+			  "leases exactly as write_lease_stdio() does");
+}
+
+ATF_TC_BODY(format_lease_matches_stdio, tc)
+{
+	struct lease lease;
+	char expect[4096], buf[4096];
+	size_t elen, len;
+	int i, format;
+
+	for (format = 0; format < 2; format++) {
+		lease_id_format = format ? TOKEN_HEX : TOKEN_OCTAL;
+		for (i = 0; i < 64; i++) {
+			init_lease(&lease, i);
+			elen = stdio_lease(&lease, expect, sizeof(expect));
+			len = format_lease(buf, sizeof(buf), &lease);
+			if (len != elen || memcmp(buf, expect, len) != 0)
+				atf_tc_fail("lease %d differs:\n%.*s\n%.*s", i,
+					    (int)elen, expect, (int)len, buf);
+		}
+	}
+	lease_id_format = TOKEN_OCTAL;
+}
+
+ATF_TC(format_ia_matches_stdio);
+ATF_TC_HEAD(format_ia_matches_stdio, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify that format_ia() writes "
+			  "IAs exactly as write_ia_stdio() does");
+}
+
+ATF_TC_BODY(format_ia_matches_stdio, tc)
+{
+	struct ia_xx ia;
+	struct iasubopt subopts[3], *ptrs[3];
+	char expect[4096], buf[4096];
+	size_t elen, len;
+	int i, format;
+
+	for (format = 0; format < 2; format++) {
+		lease_id_format = format ? TOKEN_HEX : TOKEN_OCTAL;
+		for (i = 0; i < 64; i++) {
+			init_ia(&ia, subopts, ptrs, i);
+			elen = stdio_ia(&ia, expect, sizeof(expect));
+			len = format_ia(buf, sizeof(buf), &ia);
+			if (len != elen || memcmp(buf, expect, len) != 0)
+				atf_tc_fail("IA %d differs:\n%.*s\n%.*s", i,
+					    (int)elen, expect, (int)len, buf);
+		}
+	}
+	lease_id_format = TOKEN_OCTAL;
+}
+
+ATF_TC(format_lease_text);
+ATF_TC_HEAD(format_lease_text, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify the text of a formatted lease");
+}
+
+ATF_TC_BODY(format_lease_text, tc)
+{
+	struct lease lease;
+	char buf[4096];
+	size_t len;
+	const char *expect =
+		"lease 10.0.0.1 {\n"
+		"  starts 5 2017/07/14 02:40:37;\n"
+		"  ends 5 2017/07/14 03:40:37;\n"
+		"  tstp 5 2017/07/14 03:40:37;\n"
+		"  cltt 5 2017/07/14 02:40:37;\n"
+		"  binding state active;\n"
+		"  next binding state free;\n"
+		"  rewind binding state free;\n"
+		"  hardware ethernet 00:1b:21:af:00:01;\n"
+		"  uid \"\\001 \\\"!\\257\\000\\001\";\n"
+		"  client-hostname \"client.example.org\";\n"
+		"}\n";
+
+	init_lease(&lease, 1);
+	len = format_lease(buf, sizeof(buf), &lease);
+	if (len != strlen(expect) || memcmp(buf, expect, len) != 0)
+		atf_tc_fail("got:\n%.*s", (int)len, buf);
+
+	/* If it doesn't fit, the caller has to use stdio. */
+	if (format_lease(buf, len - 1, &lease) != 0)
+		atf_tc_fail("format_lease overflowed its buffer");
+}
+
+ATF_TC(format_ia_text);
+ATF_TC_HEAD(format_ia_text, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Verify the text of a formatted IA");
+}
+
+ATF_TC_BODY(format_ia_text, tc)
+{
+	struct ia_xx ia;
+	struct iasubopt iaaddr, *iaaddrs[1];
+	char buf[4096];
+	size_t len;
+	const char *expect =
+		"ia-na \"\\001\\000\\000\\000\\000\\001\" {\n"
+		"  cltt 5 2017/07/14 02:40:00;\n"
+		"  iaaddr 2001:db8::1 {\n"
+		"    binding state active;\n"
+		"    preferred-life 300;\n"
+		"    max-life 600;\n"
+		"    ends 5 2017/07/14 02:50:00;\n"
+		"  }\n"
+		"}\n\n";
+
+	memset(&ia, 0, sizeof(ia));
+	memset(&iaaddr, 0, sizeof(iaaddr));
+	ia.ia_type = D6O_IA_NA;
+	ia.iaid_duid.data = (const unsigned char *)"\1\0\0\0\0\1";
+	ia.iaid_duid.len = 6;
+	ia.cltt = 1500000000;
+	ia.num_iasubopt = 1;
+	ia.iasubopt = iaaddrs;
+	iaaddrs[0] = &iaaddr;
+	inet_pton(AF_INET6, "2001:db8::1", &iaaddr.addr);
+	iaaddr.state = FTS_ACTIVE;
+	iaaddr.prefer = 300;
+	iaaddr.valid = 600;
+	iaaddr.hard_lifetime_end_time = 1500000600;
+
+	len = format_ia(buf, sizeof(buf), &ia);
+	if (len != strlen(expect) || memcmp(buf, expect, len) != 0)
+		atf_tc_fail("got:\n%.*s", (int)len, buf);
+}
+
+static double
+elapsed(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) +
+	       (now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+ATF_TC(format_lease_speed);
+ATF_TC_HEAD(format_lease_speed, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Compare format_lease() with the "
+			  "stdio path");
+	/* Only when asked for, e.g. atf-run -v benchmark=yes. */
+	atf_tc_set_md_var(tc, "require.config", "benchmark");
+}
+
+ATF_TC_BODY(format_lease_speed, tc)
+{
+#define SPEED_LEASES 200000
+	struct lease lease;
+	struct timeval start;
+	char buf[4096];
+	double t_stdio, t_format;
+	size_t len;
+	int i;
+
+	db_file = fopen("/dev/null", "w");
+	ATF_REQUIRE(db_file != NULL);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < SPEED_LEASES; i++) {
+		init_lease(&lease, i);
+		if (!write_lease_stdio(&lease))
+			atf_tc_fail("write_lease_stdio failed");
+	}
+	t_stdio = elapsed(&start);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < SPEED_LEASES; i++) {
+		init_lease(&lease, i);
+		len = format_lease(buf, sizeof(buf), &lease);
+		if (len == 0 || fwrite(buf, len, 1, db_file) != 1)
+			atf_tc_fail("format_lease failed");
+	}
+	t_format = elapsed(&start);
+
+	fclose(db_file);
+	db_file = NULL;
+
+	/* Timings vary too much between machines to test them. */
+	printf("%d leases: stdio %.3fs, format_lease %.3fs\n",
+	       SPEED_LEASES, t_stdio, t_format);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, format_lease_matches_stdio);
+	ATF_TP_ADD_TC(tp, format_ia_matches_stdio);
+	ATF_TP_ADD_TC(tp, format_lease_text);
+	ATF_TP_ADD_TC(tp, format_ia_text);
+	ATF_TP_ADD_TC(tp, format_lease_speed);
+
+	return (atf_no_error());
+}
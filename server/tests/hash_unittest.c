@@ -531,6 +531,237 @@ ATF_TC_BODY(lease_hash_basic_3hosts, tc) {
                            clientid3, sizeof(clientid3));
 }
 
+ATF_TC(lease_hash_grow);
+
+ATF_TC_HEAD(lease_hash_grow, tc) {
+    atf_tc_set_md_var(tc, "descr", "Verify that hash tables grow "
+                      "incrementally as entries are added.");
+    /*
+     * The following functions are tested:
+     * lease_ip_new_hash(), lease_ip_hash_add(), lease_ip_hash_lookup(),
+     * lease_ip_hash_delete(), lease_ip_hash_foreach()
+     */
+}
+
+static int grow_foreach_count;
+
+static isc_result_t grow_count(const void *name, unsigned len, void *object) {
+    grow_foreach_count++;
+    return (ISC_R_SUCCESS);
+}
+
+ATF_TC_BODY(lease_hash_grow, tc) {
+    lease_ip_hash_t *hash = NULL;
+    struct lease *lease = NULL, *check = NULL;
+    unsigned char *addrs;
+    unsigned i, initial = 11, count = 10000;
+
+    dhcp_db_objects_setup ();
+    dhcp_common_objects_setup ();
+
+    ATF_REQUIRE(lease_ip_new_hash(&hash, initial, MDL));
+    ATF_REQUIRE(lease_allocate(&lease, MDL) == ISC_R_SUCCESS);
+
+    addrs = malloc(count * 4);
+    ATF_REQUIRE(addrs != NULL);
+
+    for (i = 0; i < count; i++) {
+        putULong(addrs + (i * 4), 0x0a000000 + i);
+        lease_ip_hash_add(hash, addrs + (i * 4), 4, lease, MDL);
+
+        /* Entries added before and during a resize must stay visible. */
+        ATF_CHECK(lease_ip_hash_lookup(&check, hash, addrs, 4, MDL));
+        lease_dereference(&check, MDL);
+        ATF_CHECK(lease_ip_hash_lookup(&check, hash, addrs + (i * 4),
+                                       4, MDL));
+        lease_dereference(&check, MDL);
+    }
+
+    ATF_CHECK_MSG(hash->hash_count > initial, "hash table did not grow");
+    ATF_CHECK(hash->entries == count);
+    ATF_CHECK(lease->refcnt == count + 1);
+
+    grow_foreach_count = 0;
+    lease_ip_hash_foreach(hash, grow_count);
+    ATF_CHECK(grow_foreach_count == count);
+
+    for (i = 0; i < count; i += 2)
+        lease_ip_hash_delete(hash, addrs + (i * 4), 4, MDL);
+
+    for (i = 0; i < count; i++) {
+        ATF_CHECK(lease_ip_hash_lookup(&check, hash, addrs + (i * 4),
+                                       4, MDL) == (i & 1));
+        if (check != NULL)
+            lease_dereference(&check, MDL);
+    }
+    ATF_CHECK(hash->entries == count / 2);
+    ATF_CHECK(lease->refcnt == (count / 2) + 1);
+
+    lease_ip_free_hash_table(&hash, MDL);
+    lease_dereference(&lease, MDL);
+    free(addrs);
+}
+
+/* An IPv4 table of leases, whichever way lease_ip_hash_t is built. */
+typedef struct ip4_hash_table test_ip4_hash_t;
+HASH_FUNCTIONS_DECL(test_ip4, const unsigned char *, struct lease,
+                    test_ip4_hash_t)
+IP4_HASH_FUNCTIONS(test_ip4, const unsigned char *, struct lease,
+                   test_ip4_hash_t, lease_reference, lease_dereference)
+
+ATF_TC(ip4_hash_basic);
+
+ATF_TC_HEAD(ip4_hash_basic, tc) {
+    atf_tc_set_md_var(tc, "descr", "Verify the open-addressed IPv4 hash "
+                      "table: add, replace, delete, growth and foreach.");
+}
+
+ATF_TC_BODY(ip4_hash_basic, tc) {
+    test_ip4_hash_t *hash = NULL;
+    struct lease *lease1 = NULL, *lease2 = NULL, *check = NULL;
+    unsigned char *addrs;
+    unsigned char zero[4] = { 0, 0, 0, 0 };
+    unsigned char bcast[4] = { 255, 255, 255, 255 };
+    unsigned i, count = 10000;
+
+    dhcp_db_objects_setup ();
+    dhcp_common_objects_setup ();
+
+    ATF_REQUIRE(test_ip4_new_hash(&hash, 11, MDL));
+    ATF_REQUIRE(lease_allocate(&lease1, MDL) == ISC_R_SUCCESS);
+    ATF_REQUIRE(lease_allocate(&lease2, MDL) == ISC_R_SUCCESS);
+
+    addrs = malloc(count * 4);
+    ATF_REQUIRE(addrs != NULL);
+
+    for (i = 0; i < count; i++) {
+        putULong(addrs + (i * 4), 0xc0a80000 + i);
+        test_ip4_hash_add(hash, addrs + (i * 4), 4, lease1, MDL);
+        ATF_CHECK(test_ip4_hash_lookup(&check, hash, addrs, 4, MDL));
+        lease_dereference(&check, MDL);
+    }
+    ATF_CHECK(hash->entries == count);
+    ATF_CHECK(lease1->refcnt == count + 1);
+
+    /* Adding an address that's already there replaces its lease. */
+    test_ip4_hash_add(hash, addrs, 4, lease2, MDL);
+    ATF_CHECK(hash->entries == count);
+    ATF_CHECK(lease1->refcnt == count);
+    ATF_CHECK(lease2->refcnt == 2);
+    ATF_CHECK(test_ip4_hash_lookup(&check, hash, addrs, 4, MDL));
+    ATF_CHECK(check == lease2);
+    lease_dereference(&check, MDL);
+
+    /* Keys of the wrong length are never found. */
+    ATF_CHECK(!test_ip4_hash_lookup(&check, hash, addrs, 16, MDL));
+
+    /* Addresses that match the empty and tombstone markers still work. */
+    test_ip4_hash_add(hash, zero, 4, lease2, MDL);
+    test_ip4_hash_add(hash, bcast, 4, lease2, MDL);
+    ATF_CHECK(test_ip4_hash_lookup(&check, hash, zero, 4, MDL));
+    lease_dereference(&check, MDL);
+    test_ip4_hash_delete(hash, zero, 4, MDL);
+    ATF_CHECK(!test_ip4_hash_lookup(&check, hash, zero, 4, MDL));
+    ATF_CHECK(test_ip4_hash_lookup(&check, hash, bcast, 4, MDL));
+    lease_dereference(&check, MDL);
+    test_ip4_hash_delete(hash, bcast, 4, MDL);
+
+    for (i = 0; i < count; i += 2)
+        test_ip4_hash_delete(hash, addrs + (i * 4), 4, MDL);
+    ATF_CHECK(hash->entries == count / 2);
+    ATF_CHECK(lease2->refcnt == 1);
+
+    for (i = 0; i < count; i++) {
+        ATF_CHECK(test_ip4_hash_lookup(&check, hash, addrs + (i * 4),
+                                       4, MDL) == (i & 1));
+        if (check != NULL)
+            lease_dereference(&check, MDL);
+    }
+
+    grow_foreach_count = 0;
+    test_ip4_hash_foreach(hash, grow_count);
+    ATF_CHECK(grow_foreach_count == count / 2);
+
+    test_ip4_free_hash_table(&hash, MDL);
+    lease_dereference(&lease1, MDL);
+    lease_dereference(&lease2, MDL);
+    free(addrs);
+}
+
+ATF_TC(ip4_hash_resize_delete);
+
+ATF_TC_HEAD(ip4_hash_resize_delete, tc) {
+    atf_tc_set_md_var(tc, "descr", "Verify that entries deleted and added "
+                      "again while an IPv4 hash table is being resized "
+                      "aren't found in the old groups.");
+}
+
+ATF_TC_BODY(ip4_hash_resize_delete, tc) {
+    test_ip4_hash_t *hash = NULL;
+    struct lease *lease1 = NULL, *lease2 = NULL, *check = NULL;
+    unsigned char addr[4], zero[4] = { 0, 0, 0, 0 };
+    u_int32_t key, last;
+    unsigned g, i, count;
+
+    dhcp_db_objects_setup ();
+    dhcp_common_objects_setup ();
+
+    /* Big enough that a resize takes several operations to finish. */
+    ATF_REQUIRE(test_ip4_new_hash(&hash, 4096, MDL));
+    ATF_REQUIRE(lease_allocate(&lease1, MDL) == ISC_R_SUCCESS);
+    ATF_REQUIRE(lease_allocate(&lease2, MDL) == ISC_R_SUCCESS);
+
+    for (count = 0; hash->old_groups == NULL; count++) {
+        putULong(addr, 0x0a000000 + count);
+        test_ip4_hash_add(hash, addr, 4, lease1, MDL);
+    }
+    /* The last one went straight into the new groups. */
+    memcpy(&last, addr, 4);
+
+    /* Move some of the entries over, and find one that has been. */
+    ATF_CHECK(!test_ip4_hash_lookup(&check, hash, zero, 4, MDL));
+    ATF_REQUIRE(hash->old_groups != NULL && hash->rehash_index > 0);
+    key = 0;
+    for (g = 0; key == 0 && g <= hash->group_mask; g++)
+        for (i = 0; i < IP4_HASH_GROUP_SIZE; i++)
+            if (hash->groups[g].values[i] != NULL &&
+                hash->groups[g].keys[i] != last) {
+                key = hash->groups[g].keys[i];
+                break;
+            }
+    ATF_REQUIRE(key != 0);
+    memcpy(addr, &key, 4);
+
+    /* Delete it and add it back, as enter_lease() does.  It mustn't
+       turn up again in the old groups in between. */
+    test_ip4_hash_delete(hash, addr, 4, MDL);
+    ATF_CHECK(!test_ip4_hash_lookup(&check, hash, addr, 4, MDL));
+    if (check != NULL)
+        lease_dereference(&check, MDL);
+    test_ip4_hash_add(hash, addr, 4, lease2, MDL);
+    ATF_CHECK(test_ip4_hash_lookup(&check, hash, addr, 4, MDL));
+    ATF_CHECK(check == lease2);
+    if (check != NULL)
+        lease_dereference(&check, MDL);
+    ATF_CHECK(hash->entries == count);
+    ATF_CHECK(lease1->refcnt == count);
+    ATF_CHECK(lease2->refcnt == 2);
+
+    /* Once the resize is done, everything else is still there. */
+    for (i = 0; i < count; i++) {
+        putULong(addr, 0x0a000000 + i);
+        ATF_CHECK(test_ip4_hash_lookup(&check, hash, addr, 4, MDL));
+        ATF_CHECK(check == (memcmp(addr, &key, 4) ? lease1 : lease2));
+        if (check != NULL)
+            lease_dereference(&check, MDL);
+    }
+    ATF_CHECK(hash->old_groups == NULL);
+
+    test_ip4_free_hash_table(&hash, MDL);
+    lease_dereference(&lease1, MDL);
+    lease_dereference(&lease2, MDL);
+}
+
 #if 0
 /* This test is disabled as we solved the issue by prohibiting
    the code from using an improper client id earlier and restoring
@@ -600,6 +831,9 @@ ATF_TP_ADD_TCS(tp) {
     ATF_TP_ADD_TC(tp, lease_hash_string_2hosts);
     ATF_TP_ADD_TC(tp, lease_hash_string_3hosts);
     ATF_TP_ADD_TC(tp, lease_hash_negative1);
+    ATF_TP_ADD_TC(tp, lease_hash_grow);
+    ATF_TP_ADD_TC(tp, ip4_hash_basic);
+    ATF_TP_ADD_TC(tp, ip4_hash_resize_delete);
 #if 0 /* see comment in function */
     ATF_TP_ADD_TC(tp, uid_hash_rt29851);
 #endif
@@ -782,6 +782,184 @@ ATF_TC_BODY(expire_order_reduce, tc)
     }
 }
 
+/*
+ * Add a lease that ends at the given time to a pool.  Each lease gets
+ * an IA of its own so that expiring it has something to write.
+ */
+static void
+add_timed_lease(struct ipv6_pool *pool, struct data_string *uid,
+                u_int32_t iaid, time_t end)
+{
+    struct iasubopt *iaaddr;
+    struct ia_xx *ia;
+    unsigned int attempts;
+
+    iaaddr = NULL;
+    if (create_lease6(pool, &iaaddr, &attempts, uid, end) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: create_lease6() %s:%d", MDL);
+    }
+    ia = NULL;
+    if (ia_allocate(&ia, iaid, (const char *)uid->data, uid->len,
+                    MDL) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ia_allocate() %s:%d", MDL);
+    }
+    ia->ia_type = D6O_IA_NA;
+    if (ia_add_iasubopt(ia, iaaddr, MDL) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ia_add_iasubopt() %s:%d", MDL);
+    }
+    if (ia_reference(&iaaddr->ia, ia, MDL) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ia_reference() %s:%d", MDL);
+    }
+    if (renew_lease6(pool, iaaddr) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: renew_lease6() %s:%d", MDL);
+    }
+    if (iasubopt_dereference(&iaaddr, MDL) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: iasubopt_dereference() %s:%d", MDL);
+    }
+    if (ia_dereference(&ia, MDL) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ia_dereference() %s:%d", MDL);
+    }
+}
+
+/*
+ * Check that the expiry timer, the only timeout set in this test, is
+ * due at the given time, then move the clock on to then and run it.
+ */
+static void
+run_expiry_timer(time_t when)
+{
+    struct timeout *t;
+
+    t = timeouts;
+    if ((t == NULL) || (t->next != NULL)) {
+        atf_tc_fail("ERROR: expected one timeout %s:%d", MDL);
+    }
+    if (t->when.tv_sec != when) {
+        atf_tc_fail("ERROR: timer set for %ld, not %ld %s:%d",
+                    (long)t->when.tv_sec, (long)when, MDL);
+    }
+    cur_time = when;
+    (*t->func)(t->what);
+}
+
+/*
+ * Shared expiry timer.
+ * Put leases due at different times in two pools and check that the
+ * one timer expires just the leases that are due, in either pool, and
+ * that a pool with nothing left to do drops out of the schedule.
+ */
+ATF_TC(expire_timer);
+ATF_TC_HEAD(expire_timer, tc)
+{
+    atf_tc_set_md_var(tc, "descr", "This test case checks that the "
+                      "shared lease expiry timer expires the right leases.");
+}
+ATF_TC_BODY(expire_timer, tc)
+{
+    struct ipv6_pool *pool1, *pool2;
+    struct in6_addr addr;
+    char *uid;
+    struct data_string ds;
+    time_t last_cleanup;
+
+    /* set up dhcp globals */
+    dhcp_context_create(DHCP_CONTEXT_PRE_DB | DHCP_CONTEXT_POST_DB,
+			NULL, NULL);
+
+    /* and other common arguments */
+    uid = "client0";
+    memset(&ds, 0, sizeof(ds));
+    ds.len = strlen(uid);
+    if (!buffer_allocate(&ds.buffer, ds.len, MDL)) {
+        atf_tc_fail("Out of memory");
+    }
+    ds.data = ds.buffer->data;
+    memcpy((char *)ds.data, uid, ds.len);
+
+    /* Expiring a lease writes it out. */
+    db_file = tmpfile();
+    if (db_file == NULL) {
+        atf_tc_fail("ERROR: tmpfile() %s:%d", MDL);
+    }
+    cur_tv.tv_sec = 1000;
+    cur_tv.tv_usec = 0;
+    last_cleanup = 1020 + EXPIRED_IPV6_CLEANUP_TIME;
+
+    /* tests */
+    pool1 = NULL;
+    inet_pton(AF_INET6, "1:2:3:4::", &addr);
+    if (ipv6_pool_allocate(&pool1, D6O_IA_NA, &addr,
+                           64, 128, MDL) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ipv6_pool_allocate() %s:%d", MDL);
+    }
+    pool2 = NULL;
+    inet_pton(AF_INET6, "1:2:3:5::", &addr);
+    if (ipv6_pool_allocate(&pool2, D6O_IA_NA, &addr,
+                           64, 128, MDL) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ipv6_pool_allocate() %s:%d", MDL);
+    }
+
+    add_timed_lease(pool1, &ds, 1, 1010);
+    add_timed_lease(pool1, &ds, 2, 1020);
+    add_timed_lease(pool2, &ds, 3, last_cleanup + 1000);
+    schedule_lease_timeout(pool1);
+    schedule_lease_timeout(pool2);
+    if ((pool1->expiry_index == 0) || (pool2->expiry_index == 0)) {
+        atf_tc_fail("ERROR: pool not scheduled %s:%d", MDL);
+    }
+
+    /* The first lease in pool1 expires, and nothing else. */
+    run_expiry_timer(1011);
+    if ((pool1->num_active != 1) || (pool1->num_inactive != 1)) {
+        atf_tc_fail("ERROR: bad pool1 counts %s:%d", MDL);
+    }
+    if ((pool2->num_active != 1) || (pool2->num_inactive != 0)) {
+        atf_tc_fail("ERROR: bad pool2 counts %s:%d", MDL);
+    }
+
+    /* Then the second one. */
+    run_expiry_timer(1021);
+    if ((pool1->num_active != 0) || (pool1->num_inactive != 2)) {
+        atf_tc_fail("ERROR: bad pool1 counts %s:%d", MDL);
+    }
+    if (pool2->num_active != 1) {
+        atf_tc_fail("ERROR: bad pool2 counts %s:%d", MDL);
+    }
+
+    /* The expired leases are cleaned up an hour later, one by one. */
+    run_expiry_timer(1010 + EXPIRED_IPV6_CLEANUP_TIME);
+    if ((pool1->num_inactive != 1) || (pool1->expiry_index == 0)) {
+        atf_tc_fail("ERROR: bad pool1 after cleanup %s:%d", MDL);
+    }
+    run_expiry_timer(last_cleanup);
+    if (pool1->num_inactive != 0) {
+        atf_tc_fail("ERROR: bad pool1 after cleanup %s:%d", MDL);
+    }
+
+    /* pool1 has nothing left to do; pool2 is still waiting. */
+    if (pool1->expiry_index != 0) {
+        atf_tc_fail("ERROR: empty pool still scheduled %s:%d", MDL);
+    }
+    if ((pool2->num_active != 1) || (pool2->expiry_index == 0)) {
+        atf_tc_fail("ERROR: pool2 not scheduled %s:%d", MDL);
+    }
+    run_expiry_timer(last_cleanup + 1001);
+    if ((pool2->num_active != 0) || (pool2->num_inactive != 1)) {
+        atf_tc_fail("ERROR: bad pool2 counts %s:%d", MDL);
+    }
+
+    /* cleanup */
+    if (ipv6_pool_dereference(&pool1, MDL) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ipv6_pool_dereference() %s:%d", MDL);
+    }
+    if (ipv6_pool_dereference(&pool2, MDL) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ipv6_pool_dereference() %s:%d", MDL);
+    }
+    data_string_forget(&ds, MDL);
+    fclose(db_file);
+    db_file = NULL;
+}
+
 /*
  * Small pool.
  * check that a small pool behaves properly.
@@ -857,6 +1035,185 @@ ATF_TC_BODY(small_pool, tc)
     }
 }
 
+/*
+ * Full pool.
+ * Check that every address in a small pool can be handed out, that a
+ * full pool says so, and that a released address is found again.
+ */
+
+ATF_TC(full_pool);
+ATF_TC_HEAD(full_pool, tc)
+{
+    atf_tc_set_md_var(tc, "descr", "This test case checks that a small "
+                      "pool can be filled.");
+}
+ATF_TC_BODY(full_pool, tc)
+{
+    struct in6_addr addr, released;
+    struct ipv6_pool *pool;
+    struct iasubopt *iaaddr, *leases[256];
+    char uid[32];
+    struct data_string ds;
+    unsigned int attempts;
+    int i;
+
+    /* set up dhcp globals */
+    dhcp_context_create(DHCP_CONTEXT_PRE_DB | DHCP_CONTEXT_POST_DB,
+			NULL, NULL);
+
+    /* and other common arguments */
+    inet_pton(AF_INET6, "1:2:3:4::", &addr);
+
+    pool = NULL;
+    if (ipv6_pool_allocate(&pool, D6O_IA_NA, &addr,
+                           120, 128, MDL) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ipv6_pool_allocate() %s:%d", MDL);
+    }
+
+    /* 1:2:3:4:: itself is the subnet router anycast address, so there
+       are 255 addresses to hand out. */
+    memset(&ds, 0, sizeof(ds));
+    for (i = 0; i < 256; i++) {
+        sprintf(uid, "client%d", i);
+        ds.data = (const unsigned char *)uid;
+        ds.len = strlen(uid);
+        leases[i] = NULL;
+        if (create_lease6(pool, &leases[i], &attempts,
+                          &ds, 42) != (i < 255 ? ISC_R_SUCCESS
+                                               : ISC_R_NORESOURCES)) {
+            atf_tc_fail("ERROR: create_lease6() lease %d %s:%d", i, MDL);
+        }
+        if (i == 255) {
+            break;
+        }
+        if (attempts > 2) {
+            atf_tc_fail("ERROR: %u attempts for lease %d %s:%d",
+                        attempts, i, MDL);
+        }
+        if (renew_lease6(pool, leases[i]) != ISC_R_SUCCESS) {
+            atf_tc_fail("ERROR: renew_lease6() %s:%d", MDL);
+        }
+    }
+    if (pool->num_active != 255) {
+        atf_tc_fail("ERROR: bad num_active %s:%d", MDL);
+    }
+
+    /* Free one up and it's the only one to be had. */
+    released = leases[100]->addr;
+    if (release_lease6(pool, leases[100]) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: release_lease6() %s:%d", MDL);
+    }
+    ds.data = (const unsigned char *)"another client";
+    ds.len = 14;
+    iaaddr = NULL;
+    if (create_lease6(pool, &iaaddr, &attempts, &ds, 42) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: create_lease6() %s:%d", MDL);
+    }
+    if (memcmp(&iaaddr->addr, &released, sizeof(released)) != 0) {
+        atf_tc_fail("ERROR: released address wasn't reused %s:%d", MDL);
+    }
+    iasubopt_dereference(&iaaddr, MDL);
+
+    for (i = 0; i < 255; i++) {
+        iasubopt_dereference(&leases[i], MDL);
+    }
+    if (ipv6_pool_dereference(&pool, MDL) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ipv6_pool_dereference() %s:%d", MDL);
+    }
+}
+
+/*
+ * Full prefix pool.
+ * Check that every prefix in a pool can be delegated, that a full pool
+ * says so, and that a released prefix is found again.
+ */
+
+ATF_TC(full_prefix_pool);
+ATF_TC_HEAD(full_prefix_pool, tc)
+{
+    atf_tc_set_md_var(tc, "descr", "This test case checks that a prefix "
+                      "pool can be filled.");
+}
+ATF_TC_BODY(full_prefix_pool, tc)
+{
+    struct in6_addr addr, released;
+    struct ipv6_pool *pool;
+    struct iasubopt *iapref, *prefs[257];
+    char uid[32];
+    struct data_string ds;
+    unsigned int attempts;
+    int i, j;
+
+    /* set up dhcp globals */
+    dhcp_context_create(DHCP_CONTEXT_PRE_DB | DHCP_CONTEXT_POST_DB,
+			NULL, NULL);
+
+    /* and other common arguments */
+    inet_pton(AF_INET6, "2001:db8:1::", &addr);
+
+    pool = NULL;
+    if (ipv6_pool_allocate(&pool, D6O_IA_PD, &addr,
+                           48, 56, MDL) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ipv6_pool_allocate() %s:%d", MDL);
+    }
+
+    memset(&ds, 0, sizeof(ds));
+    for (i = 0; i < 257; i++) {
+        sprintf(uid, "client%d", i);
+        ds.data = (const unsigned char *)uid;
+        ds.len = strlen(uid);
+        prefs[i] = NULL;
+        if (create_prefix6(pool, &prefs[i], &attempts,
+                           &ds, 42) != (i < 256 ? ISC_R_SUCCESS
+                                                : ISC_R_NORESOURCES)) {
+            atf_tc_fail("ERROR: create_prefix6() prefix %d %s:%d", i, MDL);
+        }
+        if (i == 256) {
+            break;
+        }
+        if (attempts > 2) {
+            atf_tc_fail("ERROR: %u attempts for prefix %d %s:%d",
+                        attempts, i, MDL);
+        }
+        if (prefs[i]->plen != 56 || prefs[i]->addr.s6_addr[7] != 0 ||
+            !ipv6_in_pool(&prefs[i]->addr, pool)) {
+            atf_tc_fail("ERROR: bad prefix %d %s:%d", i, MDL);
+        }
+        for (j = 0; j < i; j++) {
+            if (memcmp(&prefs[i]->addr, &prefs[j]->addr,
+                       sizeof(addr)) == 0) {
+                atf_tc_fail("ERROR: prefix %d repeated %s:%d", i, MDL);
+            }
+        }
+        if (renew_lease6(pool, prefs[i]) != ISC_R_SUCCESS) {
+            atf_tc_fail("ERROR: renew_lease6() %s:%d", MDL);
+        }
+    }
+
+    /* Free one up and it's the only one to be had. */
+    released = prefs[200]->addr;
+    if (release_lease6(pool, prefs[200]) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: release_lease6() %s:%d", MDL);
+    }
+    ds.data = (const unsigned char *)"another client";
+    ds.len = 14;
+    iapref = NULL;
+    if (create_prefix6(pool, &iapref, &attempts, &ds, 42) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: create_prefix6() %s:%d", MDL);
+    }
+    if (memcmp(&iapref->addr, &released, sizeof(released)) != 0) {
+        atf_tc_fail("ERROR: released prefix wasn't reused %s:%d", MDL);
+    }
+    iasubopt_dereference(&iapref, MDL);
+
+    for (i = 0; i < 256; i++) {
+        iasubopt_dereference(&prefs[i], MDL);
+    }
+    if (ipv6_pool_dereference(&pool, MDL) != ISC_R_SUCCESS) {
+        atf_tc_fail("ERROR: ipv6_pool_dereference() %s:%d", MDL);
+    }
+}
+
 /*
  * Address to pool mapping.
  * Verify that we find the proper pool for an address
@@ -961,7 +1318,10 @@ ATF_TP_ADD_TCS(tp)
     ATF_TP_ADD_TC(tp, ipv6_pool_negative);
     ATF_TP_ADD_TC(tp, expire_order);
     ATF_TP_ADD_TC(tp, expire_order_reduce);
+    ATF_TP_ADD_TC(tp, expire_timer);
     ATF_TP_ADD_TC(tp, small_pool);
+    ATF_TP_ADD_TC(tp, full_pool);
+    ATF_TP_ADD_TC(tp, full_prefix_pool);
     ATF_TP_ADD_TC(tp, many_pools);
 
     return (atf_no_error());
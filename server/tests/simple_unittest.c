@@ -112,12 +112,98 @@ ATF_TC_BODY(parse_byte_order, tc)
 }
 #endif /*  DHCPv6 */
 
+/* Create a subnet for the given address and prefix length in share and
+   enter it into the subnet list and index. */
+static struct subnet *
+test_subnet(const char *net, int prefix_len, struct shared_network *share)
+{
+    struct subnet *subnet = NULL;
+    int i;
+
+    ATF_REQUIRE(subnet_allocate(&subnet, MDL) == ISC_R_SUCCESS);
+    subnet->net.len = 4;
+    ATF_REQUIRE(inet_pton(AF_INET, net, subnet->net.iabuf) == 1);
+    subnet->netmask.len = 4;
+    for (i = 0; i < prefix_len; i++)
+        subnet->netmask.iabuf[i / 8] |= 0x80 >> (i % 8);
+    shared_network_reference(&subnet->shared_network, share, MDL);
+    enter_subnet(subnet);
+    return (subnet);
+}
+
+static struct iaddr
+test_iaddr(const char *addr)
+{
+    struct iaddr ia;
+
+    ia.len = 4;
+    ATF_REQUIRE(inet_pton(AF_INET, addr, ia.iabuf) == 1);
+    return (ia);
+}
+
+ATF_TC(find_subnet_nested);
+
+ATF_TC_HEAD(find_subnet_nested, tc)
+{
+    atf_tc_set_md_var(tc, "descr", "Tests that find_subnet() and "
+                      "find_grouped_subnet() return the innermost "
+                      "matching subnet.");
+}
+
+ATF_TC_BODY(find_subnet_nested, tc)
+{
+    struct shared_network *share1 = NULL, *share2 = NULL;
+    struct subnet *wide, *mid, *narrow, *other, *found = NULL;
+
+    ATF_REQUIRE(shared_network_allocate(&share1, MDL) == ISC_R_SUCCESS);
+    ATF_REQUIRE(shared_network_allocate(&share2, MDL) == ISC_R_SUCCESS);
+
+    mid = test_subnet("10.1.0.0", 16, share1);
+    narrow = test_subnet("10.1.2.0", 24, share2);
+    wide = test_subnet("10.0.0.0", 8, share1);
+    other = test_subnet("192.168.0.0", 24, share2);
+
+    ATF_CHECK(find_subnet(&found, test_iaddr("10.1.2.3"), MDL));
+    ATF_CHECK(found == narrow);
+    subnet_dereference(&found, MDL);
+
+    ATF_CHECK(find_subnet(&found, test_iaddr("10.1.3.3"), MDL));
+    ATF_CHECK(found == mid);
+    subnet_dereference(&found, MDL);
+
+    ATF_CHECK(find_subnet(&found, test_iaddr("10.200.0.1"), MDL));
+    ATF_CHECK(found == wide);
+    subnet_dereference(&found, MDL);
+
+    ATF_CHECK(find_subnet(&found, test_iaddr("192.168.0.255"), MDL));
+    ATF_CHECK(found == other);
+    subnet_dereference(&found, MDL);
+
+    ATF_CHECK(!find_subnet(&found, test_iaddr("192.168.1.1"), MDL));
+    ATF_CHECK(!find_subnet(&found, test_iaddr("11.0.0.1"), MDL));
+
+    /* Within a shared network only its own subnets are candidates. */
+    ATF_CHECK(find_grouped_subnet(&found, share1, test_iaddr("10.1.2.3"),
+                                  MDL));
+    ATF_CHECK(found == mid);
+    subnet_dereference(&found, MDL);
+
+    ATF_CHECK(find_grouped_subnet(&found, share2, test_iaddr("10.1.2.3"),
+                                  MDL));
+    ATF_CHECK(found == narrow);
+    subnet_dereference(&found, MDL);
+
+    ATF_CHECK(!find_grouped_subnet(&found, share2, test_iaddr("10.1.3.3"),
+                                   MDL));
+}
+
 /* This macro defines main() method that will call specified
    test cases. tp and simple_test_case names can be whatever you want
    as long as it is a valid variable identifier. */
 ATF_TP_ADD_TCS(tp)
 {
     ATF_TP_ADD_TC(tp, simple_test_case);
+    ATF_TP_ADD_TC(tp, find_subnet_nested);
 #ifdef DHCPv6
     ATF_TP_ADD_TC(tp, parse_byte_order);
 #endif
@@ -0,0 +1,1090 @@
+/* workers.c
+
+   Worker processes for the DHCPv4 server. */
+
+/*
+ * Copyright (c) 2017 by Internet Systems Consortium, Inc. ("ISC")
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND ISC DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL ISC BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *   Internet Systems Consortium, Inc.
+ *   950 Charter Street
+ *   Redwood City, CA 94063
+ *   <info@isc.org>
+ *   https://www.isc.org/
+ *
+ */
+
+/*
+ * With "-workers N" the DHCPv4 server runs as N worker processes, plus
+ * a small supervisor that starts them and stops them all when one of
+ * them exits.   This is still experimental.
+ *
+ * Each worker reads the configuration and opens its own sockets, so
+ * every worker sees every packet.  The addresses in each range are
+ * split between the workers by hashing them: a worker only puts the
+ * leases for the addresses that hash to it in its pools, so it
+ * allocates from its own part of every pool without having to ask the
+ * others.  A request that names an address (in ciaddr or the requested
+ * address option) is answered by the worker that owns the address; any
+ * other request by the worker that the client's identifier (the client
+ * identifier option if present, otherwise the hardware address) hashes
+ * to.  Each worker writes its own lease file, named after the
+ * configured one with ".worker<N>" appended.  A worker starting without
+ * a lease file of its own picks its leases out of the configured file.
+ *
+ * The workers send each other messages over socket pairs that the
+ * supervisor sets up before starting them.  When a worker's part of a
+ * pool runs low it asks the others to lend it some free leases.  A
+ * worker only lends addresses that hash to it, so an address is lent
+ * at most once, and keeps enough free leases back that lending never
+ * leaves it short itself.  It takes the leases it lends out of its own
+ * tables and tells all the other workers that the addresses now belong
+ * to the borrower, which puts them in its pool and its lease file.
+ * A lent lease is then only in the borrower's lease file, so a worker
+ * that starts up with leases in its file for addresses that don't hash
+ * to it claims them from the other workers, and no worker answers any
+ * clients until every worker has sent its claims.  Each worker keeps
+ * the leases for the other workers' addresses aside so that it can
+ * take them over.
+ *
+ * Each worker only knows its own leases, so each one listens for OMAPI
+ * connections on its own port: the configured one plus the worker's
+ * number.  Host declarations changed through OMAPI are passed on to
+ * all the other workers, which apply them and record them in their own
+ * lease files.
+ *
+ * The server's object model (reference counts, pools, timers, the lease
+ * file) is not thread safe, so the workers are processes rather than
+ * threads.  The shards are a fixed function of the client identifier
+ * and address, so they stay the same across restarts as long as the
+ * number of workers doesn't change.
+ *
+ * With "-reuseport" (only when built to use the standard socket API)
+ * the workers' sockets are bound with SO_REUSEPORT, and the kernel
+ * hands each unicast packet (a relayed packet, or a renewal, release
+ * or inform sent straight to the server) to just one of them, chosen by
+ * the sender's address and port.  Broadcasts from directly attached
+ * clients still reach every worker and are divided up as above.  A
+ * worker tells the two apart by the packet's destination address.  If
+ * a unicast belongs to another worker, by the address it names or by
+ * the client's identifier, the worker that got it passes it on to the
+ * owner.  Otherwise all of a relay's clients would be served by the one
+ * worker the kernel picked for it, out of that worker's part of each
+ * pool.
+ */
+
+#include "dhcpd.h"
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <signal.h>
+#include <poll.h>
+
+/* How many free leases a worker asks each of the others for when its
+   part of a pool runs low (below half this many), and how many it
+   keeps back for itself when another worker asks. */
+#if !defined (WORKER_BORROW_LEASES)
+# define WORKER_BORROW_LEASES 16
+#endif
+
+/* How long to wait, in milliseconds, for another worker to make room
+   for a message about leases or hosts before giving up on it. */
+#if !defined (WORKER_SEND_TIMEOUT)
+# define WORKER_SEND_TIMEOUT 5000
+#endif
+
+int dhcpd_workers = 0;
+int dhcpd_worker_id = 0;
+const char *path_dhcpd_shared_db = NULL;
+
+/* Set while a worker reads the configured lease file to seed its own. */
+int worker_seeding = 0;
+
+static volatile sig_atomic_t worker_signal;
+
+/* The socket pairs the workers send each other messages on: worker N
+   reads worker_socks [2N], and the other workers write to
+   worker_socks [2N + 1]. */
+static int *worker_socks = NULL;
+static omapi_object_type_t *worker_inbox_type = NULL;
+static omapi_object_t *worker_inbox = NULL;
+
+/* Set while handling a packet another worker passed on to us. */
+static int worker_forwarded = 0;
+
+/* Set until all the workers have sent their claims at startup. */
+static int worker_starting = 0;
+
+/* The leases for the addresses that hash to the other workers. */
+static lease_ip_hash_t *worker_foreign_hash = NULL;
+
+/* The addresses that have been lent to a worker they don't hash to. */
+struct worker_loan {
+	struct worker_loan *next;
+	struct iaddr addr;
+	int owner;
+};
+static struct hash_table *worker_loan_hash = NULL;
+static struct worker_loan *worker_loans = NULL;
+
+/* When we last asked to borrow leases for each pool, by pool number. */
+static TIME *worker_borrow_times = NULL;
+static int worker_pool_count = 0;
+
+/* The messages the workers send each other. */
+#define WORKER_PACKET	1	/* A packet for the receiver to answer. */
+#define WORKER_BORROW	2	/* Please lend me leases from a pool. */
+#define WORKER_OWNER	3	/* These addresses now belong to a worker. */
+#define WORKER_HOST	4	/* A host was changed through OMAPI. */
+#define WORKER_READY	5	/* I've sent all my claims. */
+
+/* What goes ahead of the data in each message. */
+struct worker_msg {
+	int type;
+	int worker;			/* Who sent it. */
+
+	/* WORKER_PACKET, followed by the packet. */
+	char name [IFNAMSIZ];		/* Interface it came in on. */
+	struct iaddr from;		/* Where it came from... */
+	unsigned int from_port;		/* ...and the port, as received. */
+
+	/* WORKER_BORROW. */
+	int pool;			/* Pool number, in config order. */
+	int count;			/* How many leases we'd like. */
+
+	/* WORKER_OWNER, followed by IPv4 addresses. */
+	int owner;
+
+	/* WORKER_HOST is followed by the declarations, as they'd be
+	   written to the lease file. */
+};
+
+#define WORKER_MSG_MAX 8192
+#define WORKER_MSG_ADDRS \
+	((int)((WORKER_MSG_MAX - sizeof (struct worker_msg)) / 4))
+
+static void worker_sighandler (int sig)
+{
+	worker_signal = sig;
+}
+
+/* FNV-1a; all that matters is that it's cheap and spreads well. */
+static u_int32_t worker_hash (const unsigned char *data, unsigned len)
+{
+	u_int32_t hash = 2166136261U;
+	unsigned i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= data [i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/* Return the worker that the client that sent this packet hashes to. */
+static int worker_client_owner (struct packet *packet)
+{
+	struct option_cache *oc;
+	struct data_string ds;
+	u_int32_t hash;
+	unsigned hlen;
+
+	oc = lookup_option (&dhcp_universe, packet -> options,
+			    DHO_DHCP_CLIENT_IDENTIFIER);
+	memset (&ds, 0, sizeof ds);
+	if (oc &&
+	    evaluate_option_cache (&ds, packet, NULL, NULL,
+				   packet -> options, NULL,
+				   &global_scope, oc, MDL)) {
+		hash = worker_hash (ds.data, ds.len);
+		data_string_forget (&ds, MDL);
+	} else {
+		hlen = packet -> raw -> hlen;
+		if (hlen > sizeof packet -> raw -> chaddr)
+			hlen = sizeof packet -> raw -> chaddr;
+		hash = worker_hash (packet -> raw -> chaddr, hlen);
+	}
+
+	return hash % dhcpd_workers;
+}
+
+/* Return the worker this address hashes to, whether or not it's been
+   lent to another one since. */
+static int worker_address_shard (struct iaddr addr)
+{
+	return worker_hash (addr.iabuf, addr.len) % dhcpd_workers;
+}
+
+/* Return the worker whose part of the pools this address is in. */
+static int worker_address_owner (struct iaddr addr)
+{
+	struct worker_loan *loan = NULL;
+
+	if (worker_loan_hash &&
+	    hash_lookup ((hashed_object_t **)&loan, worker_loan_hash,
+			 addr.iabuf, addr.len, MDL))
+		return loan -> owner;
+	return worker_address_shard (addr);
+}
+
+/* Return nonzero if this address is in our part of the pools. */
+int worker_owns_address (struct iaddr addr)
+{
+	if (dhcpd_workers <= 1)
+		return 1;
+
+	return worker_address_owner (addr) == dhcpd_worker_id;
+}
+
+/* Remember that an address now belongs to the given worker. */
+static void worker_record_loan (struct iaddr addr, int owner)
+{
+	struct worker_loan *loan = NULL;
+
+	if (!worker_loan_hash &&
+	    !new_hash (&worker_loan_hash, 0, 0, 0, do_ip4_hash, MDL))
+		log_fatal ("Can't allocate worker loan hash.");
+
+	if (hash_lookup ((hashed_object_t **)&loan, worker_loan_hash,
+			 addr.iabuf, addr.len, MDL)) {
+		loan -> owner = owner;
+		return;
+	}
+
+	loan = dmalloc (sizeof *loan, MDL);
+	if (!loan)
+		log_fatal ("No memory for worker loan.");
+	loan -> addr = addr;
+	loan -> owner = owner;
+	loan -> next = worker_loans;
+	worker_loans = loan;
+	add_hash (worker_loan_hash, loan -> addr.iabuf, loan -> addr.len,
+		  (hashed_object_t *)loan, MDL);
+}
+
+/* Keep aside a lease for an address that hashes to another worker. */
+void worker_foreign_lease (struct lease *lease)
+{
+	struct lease *lt = NULL;
+
+	if (!worker_foreign_hash &&
+	    !lease_ip_new_hash (&worker_foreign_hash, LEASE_HASH_SIZE, MDL))
+		log_fatal ("Can't allocate foreign lease hash.");
+
+	/* The worker that owns it complains if it's declared twice. */
+	if (lease_ip_hash_lookup (&lt, worker_foreign_hash,
+				  lease -> ip_addr.iabuf,
+				  lease -> ip_addr.len, MDL)) {
+		lease_dereference (&lt, MDL);
+		return;
+	}
+	lease_ip_hash_add (worker_foreign_hash, lease -> ip_addr.iabuf,
+			   lease -> ip_addr.len, lease, MDL);
+}
+
+/* Find the lease we keep aside for another worker's address, and take
+   it out of the foreign hash. */
+static int worker_foreign_take (struct lease **lp, struct iaddr addr)
+{
+	if (!worker_foreign_hash ||
+	    !lease_ip_hash_lookup (lp, worker_foreign_hash,
+				   addr.iabuf, addr.len, MDL))
+		return 0;
+	lease_ip_hash_delete (worker_foreign_hash,
+			      addr.iabuf, addr.len, MDL);
+	return 1;
+}
+
+/* Called by enter_lease() for a lease in our lease file whose address
+   doesn't hash to us.   If it's in one of our pools, another worker
+   lent it to us before we last stopped, so it goes back in our tables
+   (and we claim it from the others once we've read all the leases).
+   Returns nonzero if so. */
+int worker_adopt_lease (struct iaddr addr)
+{
+	struct lease *lease = NULL;
+
+	if (dhcpd_workers <= 1 || worker_seeding)
+		return 0;
+	if (!worker_foreign_take (&lease, addr))
+		return 0;
+
+	lease_ip_hash_add (lease_ip_addr_hash, lease -> ip_addr.iabuf,
+			   lease -> ip_addr.len, lease, MDL);
+	lease_dereference (&lease, MDL);
+	worker_record_loan (addr, dhcpd_worker_id);
+	return 1;
+}
+
+/* Give up a lease that now belongs to another worker. */
+static void worker_give_up_lease (struct lease *lease)
+{
+	/* Keep it aside first, so that it isn't freed on the way. */
+	worker_foreign_lease (lease);
+
+	if (lease_dequeue (lease))
+		lease -> pool -> lease_count--;
+	if (lease -> uid)
+		uid_hash_delete (lease);
+	if (lease -> hardware_addr.hlen)
+		hw_hash_delete (lease);
+	if (lease -> billing_class)
+		unbill_class (lease);
+	lease_ip_hash_delete (lease_ip_addr_hash, lease -> ip_addr.iabuf,
+			      lease -> ip_addr.len, MDL);
+}
+
+/* Put a lease that another worker lent us in our tables and our lease
+   file.   Returns nonzero if it needs committing. */
+static int worker_take_lease (struct iaddr addr, int lender)
+{
+	struct lease *lease = NULL;
+	int result;
+
+	/* We may have claimed it ourselves at startup. */
+	if (find_lease_by_ip_addr (&lease, addr, MDL)) {
+		lease_dereference (&lease, MDL);
+		return 0;
+	}
+	if (!worker_foreign_take (&lease, addr)) {
+		log_error ("Worker %d lent us %s, which isn't in any pool.",
+			   lender, piaddr (addr));
+		return 0;
+	}
+
+	lease_ip_hash_add (lease_ip_addr_hash, lease -> ip_addr.iabuf,
+			   lease -> ip_addr.len, lease, MDL);
+	(void) lease_instantiate (lease -> ip_addr.iabuf,
+				  lease -> ip_addr.len, lease);
+	if (lease -> pool)
+		lease -> pool -> lease_count++;
+	result = write_lease (lease);
+	lease_dereference (&lease, MDL);
+	return result;
+}
+
+/* Send a message to another worker.   A packet is dropped if the other
+   worker is that far behind, since the client will try again, but for
+   anything else we wait a while for there to be room. */
+static int worker_send (int to, struct worker_msg *msg,
+			const void *data, size_t len)
+{
+	struct iovec iov [2];
+	struct pollfd pfd;
+	int fd, n;
+
+	iov [0].iov_base = (char *)msg;
+	iov [0].iov_len = sizeof *msg;
+	iov [1].iov_base = (char *)data;
+	iov [1].iov_len = len;
+
+	fd = worker_socks [2 * to + 1];
+	for (;;) {
+		if (writev (fd, iov, len ? 2 : 1) >= 0)
+			return 1;
+		if (errno == EINTR)
+			continue;
+		if ((errno != EAGAIN && errno != EWOULDBLOCK) ||
+		    msg -> type == WORKER_PACKET)
+			return 0;
+
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		pfd.revents = 0;
+		n = poll (&pfd, 1, WORKER_SEND_TIMEOUT);
+		if (n == 0) {
+			errno = ETIMEDOUT;
+			return 0;
+		}
+		if (n < 0 && errno != EINTR)
+			return 0;
+	}
+}
+
+/* Send a message to all the other workers. */
+static void worker_broadcast (struct worker_msg *msg,
+			      const void *data, size_t len)
+{
+	int i;
+
+	msg -> worker = dhcpd_worker_id;
+	for (i = 0; i < dhcpd_workers; i++) {
+		if (i == dhcpd_worker_id)
+			continue;
+		if (!worker_send (i, msg, data, len))
+			log_error ("Can't send message to worker %d: %m", i);
+	}
+}
+
+/* Tell the other workers that some addresses now belong to owner. */
+static void worker_send_owner (int owner, const unsigned char *addrs,
+			       int count)
+{
+	struct worker_msg msg;
+
+	memset (&msg, 0, sizeof msg);
+	msg.type = WORKER_OWNER;
+	msg.owner = owner;
+	msg.count = count;
+	worker_broadcast (&msg, addrs, 4 * count);
+}
+
+/* Return a pool's number, counting the pools in the order they were
+   configured, which is the same in every worker. */
+static int worker_pool_number (struct pool *pool)
+{
+	struct shared_network *share;
+	struct pool *p;
+	int n = 0;
+
+	for (share = shared_networks; share; share = share -> next)
+		for (p = share -> pools; p; p = p -> next, n++)
+			if (p == pool)
+				return n;
+	return -1;
+}
+
+static struct pool *worker_pool (int number)
+{
+	struct shared_network *share;
+	struct pool *p;
+	int n = 0;
+
+	for (share = shared_networks; share; share = share -> next)
+		for (p = share -> pools; p; p = p -> next, n++)
+			if (n == number)
+				return p;
+	return NULL;
+}
+
+/* Ask the other workers to lend us some free leases if our part of this
+   pool is running low.   This is called for every new client, so it
+   has to be cheap when the pool isn't low. */
+void worker_need_leases (struct pool *pool)
+{
+	struct worker_msg msg;
+	int n;
+
+	if (dhcpd_workers <= 1 || !worker_socks || !pool ||
+	    pool -> free_leases >= WORKER_BORROW_LEASES / 2)
+		return;
+
+	n = worker_pool_number (pool);
+	if (n < 0)
+		return;
+	if (!worker_borrow_times) {
+		worker_pool_count = 0;
+		while (worker_pool (worker_pool_count))
+			worker_pool_count++;
+		worker_borrow_times = dmalloc (worker_pool_count *
+					       sizeof *worker_borrow_times,
+					       MDL);
+		if (!worker_borrow_times)
+			log_fatal ("No memory for worker pool table.");
+	}
+	if (n >= worker_pool_count)
+		return;
+
+	/* Ask at most once a second; the others lend what they can. */
+	if (worker_borrow_times [n] == cur_time)
+		return;
+	worker_borrow_times [n] = cur_time;
+
+	memset (&msg, 0, sizeof msg);
+	msg.type = WORKER_BORROW;
+	msg.pool = n;
+	msg.count = WORKER_BORROW_LEASES;
+	worker_broadcast (&msg, NULL, 0);
+}
+
+/* Lend another worker some of the free leases in a pool. */
+static void worker_lend_leases (int borrower, int number, int count)
+{
+	unsigned char addrs [4 * WORKER_BORROW_LEASES];
+	struct lease *lease, *next;
+	struct pool *pool;
+	int lent = 0;
+
+	pool = worker_pool (number);
+	if (!pool)
+		return;
+#if defined (FAILOVER_PROTOCOL)
+	if (pool -> failover_peer)
+		return;
+#endif
+	if (count > WORKER_BORROW_LEASES)
+		count = WORKER_BORROW_LEASES;
+
+	lease = LEASE_GET_FIRST (pool -> free);
+	for (; lease && lent < count; lease = next) {
+		next = LEASE_GET_NEXT (pool -> free, lease);
+
+		/* Keep enough back for ourselves. */
+		if (pool -> free_leases <= WORKER_BORROW_LEASES)
+			break;
+
+		/* Not one we've offered, nor one we were lent ourselves. */
+		if (lease -> ends > cur_time ||
+		    (lease -> flags & STATIC_LEASE) ||
+		    worker_address_shard (lease -> ip_addr) !=
+		    dhcpd_worker_id)
+			continue;
+
+		memcpy (&addrs [4 * lent], lease -> ip_addr.iabuf, 4);
+		lent++;
+		worker_record_loan (lease -> ip_addr, borrower);
+		worker_give_up_lease (lease);
+	}
+
+	if (lent) {
+		log_info ("Lent %d leases to worker %d.", lent, borrower);
+		worker_send_owner (borrower, addrs, lent);
+	}
+}
+
+/* Some addresses now belong to the given worker: either they've been
+   lent to it, or it's claiming the ones it was lent before it last
+   stopped. */
+static void worker_owner_changed (int from, int owner,
+				  const unsigned char *addrs, int count)
+{
+	struct lease *lease;
+	struct iaddr addr;
+	int i, commit = 0;
+
+	addr.len = 4;
+	for (i = 0; i < count; i++) {
+		memcpy (addr.iabuf, &addrs [4 * i], 4);
+		worker_record_loan (addr, owner);
+
+		if (owner == dhcpd_worker_id) {
+			if (worker_take_lease (addr, from))
+				commit = 1;
+			continue;
+		}
+
+		lease = NULL;
+		if (find_lease_by_ip_addr (&lease, addr, MDL)) {
+			if (lease -> binding_state != FTS_FREE)
+				log_error ("Worker %d has claimed lease %s, "
+					   "which is %s here.", owner,
+					   piaddr (addr),
+					   binding_state_print
+						(lease -> binding_state));
+			worker_give_up_lease (lease);
+			lease_dereference (&lease, MDL);
+		}
+	}
+
+	if (commit) {
+		log_info ("Borrowed %d leases from worker %d.", count, from);
+		commit_leases ();
+	}
+}
+
+/* Pass a host declaration that was just changed through OMAPI on to the
+   other workers, so that they all treat its client the same way. */
+void worker_host_changed (struct host_decl *host)
+{
+	struct worker_msg msg;
+	char buf [WORKER_MSG_MAX];
+	FILE *file;
+	long len;
+	int deleted, result;
+
+	if (dhcpd_workers <= 1 || !worker_socks)
+		return;
+
+	file = tmpfile ();
+	if (!file) {
+		log_error ("Can't pass host %s on to the other workers: %m",
+			   host -> name);
+		return;
+	}
+
+	/* A deletion goes ahead of the declaration itself, so that a host
+	   the others already have is replaced rather than refused as a
+	   duplicate, the way enter_host() records an update in the lease
+	   file. */
+	deleted = host -> flags & HOST_DECL_DELETED;
+	host -> flags |= HOST_DECL_DELETED;
+	result = write_host_to_file (file, host);
+	if (!deleted) {
+		host -> flags &= ~HOST_DECL_DELETED;
+		if (result)
+			result = write_host_to_file (file, host);
+	}
+
+	len = ftell (file);
+	if (!result || len <= 0 ||
+	    len > (long)(sizeof buf - sizeof msg)) {
+		log_error ("Can't pass host %s on to the other workers.",
+			   host -> name);
+		fclose (file);
+		return;
+	}
+	rewind (file);
+	if (fread (buf, len, 1, file) != 1) {
+		log_error ("Can't pass host %s on to the other workers: %m",
+			   host -> name);
+		fclose (file);
+		return;
+	}
+	fclose (file);
+
+	memset (&msg, 0, sizeof msg);
+	msg.type = WORKER_HOST;
+	worker_broadcast (&msg, buf, len);
+}
+
+/* Apply the host declarations another worker was given through OMAPI,
+   and record them in our own lease file. */
+static void worker_host_update (int from, char *text, unsigned len)
+{
+	struct parse *cfile = NULL;
+	const char *val;
+	isc_result_t status;
+
+	status = new_parse (&cfile, -1, text, len, "host update", 0);
+	if (status != ISC_R_SUCCESS) {
+		log_error ("Can't parse host update from worker %d: %s",
+			   from, isc_result_totext (status));
+		return;
+	}
+	while (next_token (&val, NULL, cfile) == HOST)
+		parse_host_declaration (cfile, root_group);
+	if (cfile -> warnings_occurred)
+		log_error ("Bad host update from worker %d.", from);
+	else if (write_host_text (text, len))
+		commit_leases ();
+	end_parse (&cfile);
+}
+
+/* Return nonzero if we should answer a packet that the given worker
+   owns.   With -reuseport, only the worker the kernel picked sees a
+   unicast, so if that isn't the owner it passes the packet on. */
+static int worker_take_packet (struct packet *packet, int owner)
+{
+	struct worker_msg msg;
+
+	if (owner == dhcpd_worker_id)
+		return 1;
+	if (!dhcpv4_reuseport || !packet -> unicast)
+		return 0;
+
+	memset (&msg, 0, sizeof msg);
+	msg.type = WORKER_PACKET;
+	msg.worker = dhcpd_worker_id;
+	strncpy (msg.name, packet -> interface -> name, sizeof msg.name);
+	msg.from = packet -> client_addr;
+	msg.from_port = packet -> client_port;
+
+	/* If the owner is that far behind, the client will have to try
+	   again. */
+	if (!worker_send (owner, &msg, packet -> raw,
+			  packet -> packet_length))
+		log_error ("Can't pass packet from %s on to worker %d: %m",
+			   piaddr (packet -> client_addr), owner);
+	return 0;
+}
+
+/* Return nonzero if this worker should answer this packet. */
+int worker_owns_packet (struct packet *packet)
+{
+	struct option_cache *oc;
+	struct data_string ds;
+	struct iaddr addr;
+	int result;
+
+	if (dhcpd_workers <= 1)
+		return 1;
+
+	/* Another worker already decided this one is ours. */
+	if (worker_forwarded)
+		return 1;
+
+	/* A request about an address goes to the worker that has it. */
+	if (packet -> raw -> ciaddr.s_addr) {
+		addr.len = 4;
+		memcpy (addr.iabuf, &packet -> raw -> ciaddr, 4);
+		return worker_take_packet (packet,
+					   worker_address_owner (addr));
+	}
+	if (packet -> packet_type == DHCPREQUEST &&
+	    (oc = lookup_option (&dhcp_universe, packet -> options,
+				 DHO_DHCP_REQUESTED_ADDRESS))) {
+		memset (&ds, 0, sizeof ds);
+		if (evaluate_option_cache (&ds, packet, NULL, NULL,
+					   packet -> options, NULL,
+					   &global_scope, oc, MDL)) {
+			result = -1;
+			if (ds.len == 4) {
+				addr.len = 4;
+				memcpy (addr.iabuf, ds.data, 4);
+				result = worker_take_packet
+					(packet, worker_address_owner (addr));
+			}
+			data_string_forget (&ds, MDL);
+			if (result != -1)
+				return result;
+		}
+	}
+
+	/* Anything else goes to the worker the client hashes to; if the
+	   kernel handed a unicast to the wrong worker, it's passed on. */
+	return worker_take_packet (packet, worker_client_owner (packet));
+}
+
+/* Handle a packet that another worker passed on to us. */
+static void worker_packet (struct worker_msg *msg,
+			   struct dhcp_packet *packet, ssize_t len)
+{
+	struct hardware hfrom;
+	struct interface_info *ip;
+
+	/* Until everyone's claims are in, it might not be ours. */
+	if (worker_starting || len < DHCP_FIXED_NON_UDP)
+		return;
+
+	msg -> name [sizeof msg -> name - 1] = 0;
+	for (ip = interfaces; ip; ip = ip -> next)
+		if (!strcmp (ip -> name, msg -> name))
+			break;
+	if (!ip) {
+		log_error ("Packet passed on from another worker for "
+			   "unknown interface %s.", msg -> name);
+		return;
+	}
+
+	memset (&hfrom, 0, sizeof hfrom);
+	worker_forwarded = 1;
+	if (bootp_packet_handler)
+		(*bootp_packet_handler) (ip, packet, (unsigned)len,
+					 msg -> from_port, msg -> from,
+					 &hfrom);
+	worker_forwarded = 0;
+}
+
+/* Read and act on one message from another worker.   Returns the type
+   of message, or -1 if nothing sensible could be read. */
+static int worker_receive ()
+{
+	struct worker_msg msg;
+	struct iovec iov [2];
+	union {
+		unsigned char buf [WORKER_MSG_MAX];
+		struct dhcp_packet packet;
+	} u;
+	ssize_t len;
+
+	iov [0].iov_base = (char *)&msg;
+	iov [0].iov_len = sizeof msg;
+	iov [1].iov_base = (char *)&u;
+	iov [1].iov_len = sizeof u;
+	len = readv (worker_socks [2 * dhcpd_worker_id], iov, 2);
+	if (len < (ssize_t)sizeof msg)
+		return -1;
+	len -= sizeof msg;
+	if (msg.worker < 0 || msg.worker >= dhcpd_workers ||
+	    msg.worker == dhcpd_worker_id)
+		return -1;
+
+	switch (msg.type) {
+	      case WORKER_PACKET:
+		worker_packet (&msg, &u.packet, len);
+		break;
+
+	      case WORKER_BORROW:
+		worker_lend_leases (msg.worker, msg.pool, msg.count);
+		break;
+
+	      case WORKER_OWNER:
+		if (msg.owner < 0 || msg.owner >= dhcpd_workers ||
+		    msg.count < 0 || 4 * msg.count > len)
+			return -1;
+		worker_owner_changed (msg.worker, msg.owner,
+				      u.buf, msg.count);
+		break;
+
+	      case WORKER_HOST:
+		worker_host_update (msg.worker, (char *)u.buf, len);
+		break;
+
+	      case WORKER_READY:
+		break;
+
+	      default:
+		log_error ("Unknown message %d from worker %d.",
+			   msg.type, msg.worker);
+		return -1;
+	}
+	return msg.type;
+}
+
+static int worker_inbox_readfd (omapi_object_t *h)
+{
+	IGNORE_UNUSED (h);
+	return worker_socks [2 * dhcpd_worker_id];
+}
+
+static isc_result_t worker_inbox_handler (omapi_object_t *h)
+{
+	if (h -> type != worker_inbox_type)
+		return DHCP_R_INVALIDARG;
+
+	if (worker_receive () < 0)
+		return ISC_R_UNEXPECTED;
+	return ISC_R_SUCCESS;
+}
+
+/* Claim the leases we were lent before we last stopped, and wait until
+   all the other workers have done the same, so that no two workers
+   think they own the same address. */
+static void worker_claim_leases ()
+{
+	unsigned char addrs [4 * WORKER_MSG_ADDRS];
+	struct worker_msg msg;
+	struct worker_loan *loan;
+	struct sigaction sa, oldterm, oldint;
+	sigset_t set, oldset;
+	int count = 0, ready = 0;
+
+	/* If one of the others fails to start, the supervisor stops us
+	   while we're still waiting for it here, before the isc library's
+	   signal handling is in any position to. */
+	memset (&sa, 0, sizeof sa);
+	sa.sa_handler = SIG_DFL;
+	sigemptyset (&sa.sa_mask);
+	sigaction (SIGTERM, &sa, &oldterm);
+	sigaction (SIGINT, &sa, &oldint);
+	sigemptyset (&set);
+	sigaddset (&set, SIGTERM);
+	sigaddset (&set, SIGINT);
+	sigprocmask (SIG_UNBLOCK, &set, &oldset);
+
+	worker_starting = 1;
+	for (loan = worker_loans; loan; loan = loan -> next) {
+		if (loan -> owner != dhcpd_worker_id)
+			continue;
+		memcpy (&addrs [4 * count], loan -> addr.iabuf, 4);
+		if (++count == WORKER_MSG_ADDRS) {
+			worker_send_owner (dhcpd_worker_id, addrs, count);
+			count = 0;
+		}
+	}
+	if (count)
+		worker_send_owner (dhcpd_worker_id, addrs, count);
+
+	memset (&msg, 0, sizeof msg);
+	msg.type = WORKER_READY;
+	worker_broadcast (&msg, NULL, 0);
+
+	while (ready < dhcpd_workers - 1)
+		if (worker_receive () == WORKER_READY)
+			ready++;
+	worker_starting = 0;
+
+	sigprocmask (SIG_SETMASK, &oldset, NULL);
+	sigaction (SIGTERM, &oldterm, NULL);
+	sigaction (SIGINT, &oldint, NULL);
+}
+
+/* Start listening for messages from the other workers, once we've
+   exchanged claims with them. */
+void worker_inbox_setup ()
+{
+	isc_result_t status;
+
+	if (!worker_socks)
+		return;
+
+	worker_claim_leases ();
+
+	status = omapi_object_type_register (&worker_inbox_type,
+					     "worker-inbox",
+					     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+					     sizeof *worker_inbox,
+					     0, RC_MISC);
+	if (status != ISC_R_SUCCESS)
+		log_fatal ("Can't register worker inbox type: %s",
+			   isc_result_totext (status));
+	status = omapi_object_allocate (&worker_inbox, worker_inbox_type,
+					0, MDL);
+	if (status != ISC_R_SUCCESS)
+		log_fatal ("Can't allocate worker inbox: %s",
+			   isc_result_totext (status));
+	status = omapi_register_io_object (worker_inbox,
+					   worker_inbox_readfd, 0,
+					   worker_inbox_handler, 0, 0);
+	if (status != ISC_R_SUCCESS)
+		log_fatal ("Can't register worker inbox: %s",
+			   isc_result_totext (status));
+}
+
+/* Switch to this worker's own lease file, remembering the configured one
+   so that db_startup() can seed a new worker file from it. */
+void worker_lease_file_setup ()
+{
+	char *s;
+	size_t len;
+
+	if (dhcpd_workers <= 1)
+		return;
+
+	len = strlen (path_dhcpd_db) + sizeof ".worker" + 10;
+	s = dmalloc (len, MDL);
+	if (!s)
+		log_fatal ("no memory for worker lease db filename.");
+	snprintf (s, len, "%s.worker%d", path_dhcpd_db, dhcpd_worker_id);
+
+	path_dhcpd_shared_db = path_dhcpd_db;
+	path_dhcpd_db = s;
+
+	if (path_dhcpd_bin_db) {
+		len = strlen (path_dhcpd_bin_db) + sizeof ".worker" + 10;
+		s = dmalloc (len, MDL);
+		if (!s)
+			log_fatal ("no memory for worker lease db filename.");
+		snprintf (s, len, "%s.worker%d", path_dhcpd_bin_db,
+			  dhcpd_worker_id);
+		path_dhcpd_bin_db = s;
+	}
+}
+
+/* Fork the workers.   Returns in each worker with dhcpd_worker_id set;
+   the calling process stays behind to supervise them and never returns.
+   notify_fd, if not -1, is the pipe the daemon parent is waiting on:
+   only the first worker keeps it, so the parent hears whether that
+   worker started up.   If detach is set, the supervisor disconnects
+   from the terminal the way a daemonized worker does. */
+void start_workers (int notify_fd, int detach)
+{
+	struct sigaction sa;
+	pid_t *pids, pid;
+	int i, status, running, stopping, failed;
+
+	pids = dmalloc (dhcpd_workers * sizeof *pids, MDL);
+	if (!pids)
+		log_fatal ("No memory for worker table.");
+
+	/* Give each worker a socket pair for the others to send it
+	   messages on. */
+	worker_socks = dmalloc (2 * dhcpd_workers * sizeof *worker_socks, MDL);
+	if (!worker_socks)
+		log_fatal ("No memory for worker sockets.");
+	for (i = 0; i < dhcpd_workers; i++) {
+		if (socketpair (AF_UNIX, SOCK_DGRAM, 0,
+				&worker_socks [2 * i]) < 0)
+			log_fatal ("Can't create worker socket pair: %m");
+		if (fcntl (worker_socks [2 * i + 1], F_SETFL, O_NONBLOCK) < 0)
+			log_fatal ("Can't set worker socket non-blocking: %m");
+	}
+
+	for (i = 0; i < dhcpd_workers; i++) {
+		if ((pid = fork ()) < 0)
+			log_fatal ("Can't fork worker %d: %m", i);
+		if (pid == 0) {
+			dhcpd_worker_id = i;
+			dfree (pids, MDL);
+			if (i != 0 && notify_fd != -1)
+				(void) close (notify_fd);
+			/* Keep our own inbox and the others' outboxes. */
+			if (worker_socks) {
+				for (i = 0; i < dhcpd_workers; i++) {
+					if (i == dhcpd_worker_id)
+						(void) close
+						    (worker_socks [2 * i + 1]);
+					else
+						(void) close
+						    (worker_socks [2 * i]);
+				}
+			}
+			return;
+		}
+		pids [i] = pid;
+	}
+
+	/* From here on we're the supervisor. */
+	if (notify_fd != -1)
+		(void) close (notify_fd);
+	if (worker_socks) {
+		for (i = 0; i < 2 * dhcpd_workers; i++)
+			(void) close (worker_socks [i]);
+		dfree (worker_socks, MDL);
+		worker_socks = NULL;
+	}
+	if (detach) {
+		(void) setsid ();
+		(void) close (0);
+		(void) close (1);
+		(void) close (2);
+		(void) open ("/dev/null", O_RDWR);
+		(void) open ("/dev/null", O_RDWR);
+		(void) open ("/dev/null", O_RDWR);
+		log_perror = 0;
+		IGNORE_RET (chdir ("/"));
+	}
+
+	memset (&sa, 0, sizeof sa);
+	sa.sa_handler = worker_sighandler;
+	sigemptyset (&sa.sa_mask);
+	sigaction (SIGTERM, &sa, NULL);
+	sigaction (SIGINT, &sa, NULL);
+	signal (SIGHUP, SIG_IGN);
+
+	running = dhcpd_workers;
+	stopping = 0;
+	failed = 0;
+	while (running > 0) {
+		pid = wait (&status);
+		if (pid < 0) {
+			if (errno != EINTR)
+				break;
+			if (worker_signal) {
+				/* Pass it on; the workers' exits stop us. */
+				for (i = 0; i < dhcpd_workers; i++)
+					if (pids [i])
+						kill (pids [i], worker_signal);
+				worker_signal = 0;
+				stopping = 1;
+			}
+			continue;
+		}
+
+		for (i = 0; i < dhcpd_workers; i++)
+			if (pids [i] == pid)
+				break;
+		if (i == dhcpd_workers)
+			continue;
+		pids [i] = 0;
+		running--;
+
+		if (WIFSIGNALED (status) ? !stopping &&
+					   WTERMSIG (status) != SIGTERM
+					 : WEXITSTATUS (status) != 0) {
+			log_error ("Worker %d (pid %ld) failed.", i, (long)pid);
+			failed = 1;
+		}
+
+		/* The workers run as a group; if one goes, they all go. */
+		if (!stopping) {
+			log_info ("Worker %d exited, stopping the others.", i);
+			for (i = 0; i < dhcpd_workers; i++)
+				if (pids [i])
+					kill (pids [i], SIGTERM);
+			stopping = 1;
+		}
+	}
+
+	exit (failed ? 1 : 0);
+}